@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "omrx.h"
+#include "omrx_internal.h"
+
+#define CHECK(x) if (!(x)) { fprintf(stderr, "%s:%d: Check failed: %s\n", __FILE__, __LINE__, #x); exit(1); }
+
+// Enough elements to cover whole vectors of every width, plus leftovers
+#define MAX_COUNT 67
+
+// Byte-swap `count` elements of `width` bytes one byte at a time, to check
+// omrx_bswap_array() against
+static void reverse_elements(uint8_t *dest, const uint8_t *src, size_t width, size_t count) {
+    size_t i, j;
+
+    for (i = 0; i < count; i++) {
+        for (j = 0; j < width; j++) {
+            dest[i * width + j] = src[i * width + width - 1 - j];
+        }
+    }
+}
+
+// Check omrx_bswap_array() for elements of `width` bytes, with every count up
+// to MAX_COUNT, at every misalignment, both copying and in place.  (On
+// little-endian hosts the library itself never swaps anything, so this is
+// the only thing which exercises it there.)
+static void test_width(size_t width) {
+    uint8_t src[MAX_COUNT * 8 + 8];
+    uint8_t expected[MAX_COUNT * 8];
+    uint8_t dest[MAX_COUNT * 8 + 8];
+    size_t count, offset, i;
+
+    for (i = 0; i < sizeof(src); i++) {
+        src[i] = (uint8_t)(i * 7 + 1);
+    }
+    for (offset = 0; offset < 8; offset++) {
+        for (count = 0; count <= MAX_COUNT; count++) {
+            reverse_elements(expected, src + offset, width, count);
+            memset(dest, 0, sizeof(dest));
+            omrx_bswap_array(dest + offset, src + offset, width, count);
+            CHECK(!memcmp(dest + offset, expected, width * count));
+            // Nothing past the end is touched
+            CHECK(dest[offset + width * count] == 0);
+
+            memcpy(dest + offset, src + offset, width * count);
+            omrx_bswap_array(dest + offset, dest + offset, width, count);
+            CHECK(!memcmp(dest + offset, expected, width * count));
+        }
+    }
+}
+
+int main(void) {
+    uint8_t bytes[4] = { 1, 2, 3, 4 };
+    uint8_t out[4];
+
+    test_width(2);
+    test_width(4);
+    test_width(8);
+
+    // Single bytes are just copied
+    omrx_bswap_array(out, bytes, 1, 4);
+    CHECK(!memcmp(out, bytes, 4));
+
+    // And the scalar helpers agree with it
+    CHECK(omrx_bswap16(0x0102) == 0x0201);
+    CHECK(omrx_bswap32(0x01020304) == 0x04030201);
+    CHECK(omrx_bswap64(0x0102030405060708ULL) == 0x0807060504030201ULL);
+
+    return 0;
+}
@@ -1,10 +1,1057 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <mcheck.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/resource.h>
 
 #include "omrx.h"
 
 #define CHECK_OMRX_ERR(x) if ((x) < 0) { fprintf(stderr, "Unexpected error from libomrx.  Exiting.\n"); exit(1); }
+#define CHECK(x) if (!(x)) { fprintf(stderr, "%s:%d: Check failed: %s\n", __FILE__, __LINE__, #x); exit(1); }
+
+// Check rows of the point data written by test_write (row i is i, i+1, i+2),
+// starting at row `start`
+static void check_points(const float *data, uint16_t cols, uint32_t rows, uint32_t start) {
+    unsigned int i, j;
+
+    CHECK(cols == 3);
+    for (i = 0; i < rows; i++) {
+        for (j = 0; j < cols; j++) {
+            CHECK(data[i * cols + j] == (float)(start + i + j));
+        }
+    }
+}
+
+// Read a whole file into memory
+static char *read_file(const char *filename, size_t *size) {
+    FILE *fp;
+    char *data;
+    long len;
+
+    fp = fopen(filename, "rb");
+    CHECK(fp);
+    CHECK(!fseek(fp, 0, SEEK_END));
+    len = ftell(fp);
+    CHECK(len > 0);
+    rewind(fp);
+    data = malloc(len);
+    CHECK(data);
+    CHECK(fread(data, len, 1, fp) == 1);
+    fclose(fp);
+    *size = len;
+
+    return data;
+}
+
+static void write_file(const char *filename, const char *data, size_t size) {
+    FILE *fp;
+
+    fp = fopen(filename, "wb");
+    CHECK(fp);
+    CHECK(fwrite(data, size, 1, fp) == 1);
+    CHECK(!fclose(fp));
+}
+
+// Open the file and find the VRTx chunk under mESH "test"
+static omrx_t open_test_file(const char *filename, unsigned int flags, omrx_chunk_t *vrtx) {
+    omrx_t omrx;
+
+    CHECK_OMRX_ERR(omrx_new(NULL, &omrx));
+    CHECK_OMRX_ERR(omrx_open_ex(omrx, filename, NULL, flags));
+    CHECK(omrx_get_chunk_by_id(omrx, "test", "mESH", vrtx) == OMRX_OK);
+    CHECK(omrx_get_child(*vrtx, "VRTx", vrtx) == OMRX_OK);
+
+    return omrx;
+}
+
+// OMRX_OPEN_MMAP: data is borrowed from the mapping, and stays valid after
+// the file is closed
+static void test_mmap(const char *filename, uint32_t num_points) {
+    omrx_t omrx;
+    omrx_chunk_t chunk;
+    float *point_data;
+    uint16_t cols;
+    uint32_t rows;
+
+    omrx = open_test_file(filename, OMRX_OPEN_MMAP, &chunk);
+    CHECK_OMRX_ERR(omrx_get_attr_float32_array(chunk, OMRX_ATTR_DATA, &cols, &rows, &point_data));
+    CHECK(rows == num_points);
+    check_points(point_data, cols, rows, 0);
+    CHECK_OMRX_ERR(omrx_close(omrx));
+    check_points(point_data, cols, rows, 0);
+    CHECK_OMRX_ERR(omrx_free(omrx));
+
+    CHECK_OMRX_ERR(omrx_new(NULL, &omrx));
+    CHECK(omrx_open_ex(omrx, "/nonexistent/test.omrx", NULL, OMRX_OPEN_MMAP) == OMRX_ERR_OSERR);
+    CHECK_OMRX_ERR(omrx_free(omrx));
+}
+
+// A file cut off part way through is reported as such when it is scanned
+static void test_truncated(const char *filename) {
+    static const unsigned int flags[] = { OMRX_OPEN_NO_TOC, OMRX_OPEN_NO_TOC | OMRX_OPEN_MMAP };
+    omrx_t omrx;
+    char path[4096];
+    char *data;
+    char *id;
+    size_t size;
+    unsigned int i;
+
+    data = read_file(filename, &size);
+    snprintf(path, sizeof(path), "%s.short", filename);
+    write_file(path, data, size / 2);
+    free(data);
+
+    CHECK_OMRX_ERR(omrx_new(NULL, &omrx));
+    CHECK(omrx_open_ex(omrx, path, NULL, OMRX_OPEN_NO_TOC) == OMRX_ERR_EOF);
+    CHECK_OMRX_ERR(omrx_free(omrx));
+    remove(path);
+
+    // So is an ID whose size runs past the end (rather than allocating it)
+    data = read_file(filename, &size);
+    id = memmem(data, size, "\x04\x00\x00\x00test", 8);
+    CHECK(id);
+    memset(id, 0xff, 4);
+    snprintf(path, sizeof(path), "%s.badid", filename);
+    write_file(path, data, size);
+    free(data);
+
+    for (i = 0; i < sizeof(flags) / sizeof(flags[0]); i++) {
+        CHECK_OMRX_ERR(omrx_new(NULL, &omrx));
+        CHECK(omrx_open_ex(omrx, path, NULL, flags[i]) == OMRX_ERR_EOF);
+        CHECK(strstr(omrx_last_message(omrx), "id attribute"));
+        CHECK_OMRX_ERR(omrx_free(omrx));
+    }
+    remove(path);
+}
+
+// The chunk index is the same whether it comes from the table of contents or
+// from scanning the file
+static void test_toc(const char *filename) {
+    static const unsigned int flags[] = { OMRX_OPEN_DEFAULT, OMRX_OPEN_NO_TOC };
+    omrx_t omrx;
+    omrx_chunk_t chunk;
+    char id[16];
+    uint32_t value;
+    unsigned int i, j;
+
+    for (i = 0; i < sizeof(flags) / sizeof(flags[0]); i++) {
+        omrx = open_test_file(filename, flags[i], &chunk);
+        for (j = 0; j < 5; j++) {
+            snprintf(id, sizeof(id), "layer-%u", j);
+            CHECK(omrx_get_chunk_by_id(omrx, id, "LAYr", &chunk) == OMRX_OK);
+            CHECK_OMRX_ERR(omrx_get_attr_uint32(chunk, 0x10, &value));
+            CHECK(value == j);
+        }
+        CHECK(omrx_get_chunk_by_id(omrx, "layer-5", "LAYr", &chunk) == OMRX_STATUS_NOT_FOUND);
+        CHECK_OMRX_ERR(omrx_free(omrx));
+    }
+}
+
+// OMRX_OPEN_LAZY: children are read when first needed, which can't be done
+// once the file has been closed
+static void test_lazy(const char *filename, uint32_t num_points) {
+    omrx_t omrx;
+    omrx_chunk_t chunk;
+    float *point_data;
+    uint16_t cols;
+    uint32_t rows;
+    uint32_t value;
+
+    omrx = open_test_file(filename, OMRX_OPEN_LAZY, &chunk);
+    CHECK_OMRX_ERR(omrx_get_attr_float32_array(chunk, OMRX_ATTR_DATA, &cols, &rows, &point_data));
+    CHECK(rows == num_points);
+    check_points(point_data, cols, rows, 0);
+    free(point_data);
+    CHECK(omrx_get_chunk_by_id(omrx, "layer-4", "LAYr", &chunk) == OMRX_OK);
+    CHECK_OMRX_ERR(omrx_get_attr_uint32(chunk, 0x10, &value));
+    CHECK(value == 4);
+    CHECK_OMRX_ERR(omrx_free(omrx));
+
+    CHECK_OMRX_ERR(omrx_new(NULL, &omrx));
+    CHECK_OMRX_ERR(omrx_open_ex(omrx, filename, NULL, OMRX_OPEN_LAZY));
+    CHECK(omrx_get_chunk_by_id(omrx, "test", "mESH", &chunk) == OMRX_OK);
+    CHECK_OMRX_ERR(omrx_close(omrx));
+    CHECK(omrx_get_child(chunk, "VRTx", &chunk) == OMRX_ERR_NOT_OPEN);
+    CHECK_OMRX_ERR(omrx_free(omrx));
+}
+
+struct reader_args {
+    omrx_t omrx;
+    omrx_chunk_t chunk;
+    uint32_t num_points;
+    unsigned int index;
+};
+
+static void *reader_thread(void *arg) {
+    struct reader_args *args = arg;
+    float *point_data;
+    uint16_t cols;
+    uint32_t rows;
+    uint32_t value;
+    unsigned int i;
+
+    for (i = 0; i < 20; i++) {
+        CHECK_OMRX_ERR(omrx_get_attr_float32_array(args->chunk, OMRX_ATTR_DATA, &cols, &rows, &point_data));
+        CHECK(rows == args->num_points);
+        check_points(point_data, cols, rows, 0);
+        free(point_data);
+        // Errors in one thread don't show up in the others
+        if (args->index & 1) {
+            CHECK(omrx_get_attr_uint32(args->chunk, OMRX_ATTR_DATA, &value) == OMRX_ERR_WRONG_DTYPE);
+            CHECK(omrx_last_result(args->omrx) == OMRX_ERR_WRONG_DTYPE);
+        } else {
+            CHECK(omrx_last_result(args->omrx) == OMRX_OK);
+        }
+    }
+
+    return NULL;
+}
+
+// A new thread starts out with a clean error state, even if it gets the ID
+// of one which has exited
+static void *error_thread(void *arg) {
+    struct reader_args *args = arg;
+    uint32_t value;
+
+    CHECK(omrx_last_result(args->omrx) == OMRX_OK);
+    CHECK(omrx_get_attr_uint32(args->chunk, OMRX_ATTR_DATA, &value) == OMRX_ERR_WRONG_DTYPE);
+
+    return NULL;
+}
+
+// OMRX_OPEN_CONCURRENT: several threads reading from one instance at once
+static void test_concurrent(const char *filename, uint32_t num_points) {
+    struct reader_args args[4];
+    pthread_t threads[4];
+    omrx_t omrx;
+    omrx_chunk_t chunk;
+    unsigned int i;
+
+    omrx = open_test_file(filename, OMRX_OPEN_CONCURRENT, &chunk);
+    for (i = 0; i < 4; i++) {
+        args[i].omrx = omrx;
+        args[i].chunk = chunk;
+        args[i].num_points = num_points;
+        args[i].index = i;
+        CHECK(!pthread_create(&threads[i], NULL, reader_thread, &args[i]));
+    }
+    for (i = 0; i < 4; i++) {
+        CHECK(!pthread_join(threads[i], NULL));
+    }
+    for (i = 0; i < 4; i++) {
+        CHECK(!pthread_create(&threads[0], NULL, error_thread, &args[0]));
+        CHECK(!pthread_join(threads[0], NULL));
+    }
+    CHECK_OMRX_ERR(omrx_free(omrx));
+}
+
+// The file written by the streaming writer has the same points
+static void test_stream(const char *filename, uint32_t num_points) {
+    omrx_t omrx;
+    omrx_chunk_t chunk;
+    float *point_data;
+    uint16_t cols;
+    uint32_t rows;
+    uint32_t value;
+    char path[4096];
+
+    snprintf(path, sizeof(path), "%s.stream", filename);
+    CHECK_OMRX_ERR(omrx_new(NULL, &omrx));
+    CHECK_OMRX_ERR(omrx_open(omrx, path, NULL));
+    CHECK(omrx_get_chunk_by_id(omrx, "stream", "mESH", &chunk) == OMRX_OK);
+    CHECK(omrx_get_child(chunk, "VRTx", &chunk) == OMRX_OK);
+    CHECK_OMRX_ERR(omrx_get_attr_float32_array(chunk, OMRX_ATTR_DATA, &cols, &rows, &point_data));
+    CHECK(rows == num_points);
+    check_points(point_data, cols, rows, 0);
+    free(point_data);
+
+    // ... and the chunk appended to it afterwards
+    CHECK(omrx_get_chunk_by_id(omrx, "appended", "mESH", &chunk) == OMRX_OK);
+    CHECK_OMRX_ERR(omrx_get_attr_uint32(chunk, 0x10, &value));
+    CHECK(value == num_points);
+    CHECK(omrx_get_next_chunk(chunk, NULL, &chunk) == OMRX_STATUS_NOT_FOUND);
+    CHECK_OMRX_ERR(omrx_free(omrx));
+}
+
+// If appending to a file fails part way through, the file is left as it was
+// (including its TOC).  Writes are made to fail by limiting the file size to
+// what it already is.
+static void test_append_failure(const char *filename) {
+    omrx_t omrx;
+    struct rlimit old_limit, limit;
+    char path[4096];
+    char *data;
+    char *result;
+    uint8_t *junk;
+    size_t size, result_size;
+
+    data = read_file(filename, &size);
+    snprintf(path, sizeof(path), "%s.append", filename);
+    write_file(path, data, size);
+    junk = calloc(1, 65536);
+    CHECK(junk);
+
+    signal(SIGXFSZ, SIG_IGN);
+    CHECK(!getrlimit(RLIMIT_FSIZE, &old_limit));
+    limit = old_limit;
+    limit.rlim_cur = size;
+    CHECK(!setrlimit(RLIMIT_FSIZE, &limit));
+    CHECK_OMRX_ERR(omrx_new(NULL, &omrx));
+    CHECK_OMRX_ERR(omrx_stream_append(omrx, path));
+    CHECK_OMRX_ERR(omrx_stream_begin_chunk(omrx, "mESH"));
+    // (This may or may not fail, depending on buffering.)
+    omrx_stream_write_attr(omrx, 0x10, OMRX_DTYPE_RAW, 0, 65536, junk);
+    CHECK(omrx_stream_close(omrx) == OMRX_ERR_OSERR);
+    CHECK_OMRX_ERR(omrx_free(omrx));
+    CHECK(!setrlimit(RLIMIT_FSIZE, &old_limit));
+    signal(SIGXFSZ, SIG_DFL);
+
+    result = read_file(path, &result_size);
+    CHECK(result_size == size);
+    CHECK(!memcmp(result, data, size));
+    free(result);
+    free(junk);
+    free(data);
+    remove(path);
+}
+
+// Reading just some of the rows of an array
+static void test_rows(const char *filename, uint32_t num_points) {
+    omrx_t omrx;
+    omrx_chunk_t chunk, layer;
+    float *point_data;
+    void *data;
+    uint16_t cols;
+    uint32_t rows;
+
+    omrx = open_test_file(filename, OMRX_OPEN_DEFAULT, &chunk);
+    CHECK_OMRX_ERR(omrx_get_attr_float32_array_rows(chunk, OMRX_ATTR_DATA, 10, 5, &cols, &rows, &point_data));
+    CHECK(rows == 5);
+    check_points(point_data, cols, rows, 10);
+    free(point_data);
+
+    // A range running past the end is cut short
+    CHECK_OMRX_ERR(omrx_get_attr_array_rows(chunk, OMRX_ATTR_DATA, num_points - 2, 5, &cols, &rows, &data));
+    CHECK(rows == 2);
+    check_points(data, cols, rows, num_points - 2);
+    free(data);
+
+    CHECK_OMRX_ERR(omrx_get_attr_array_rows(chunk, OMRX_ATTR_DATA, num_points, 1, &cols, &rows, &data));
+    CHECK(rows == 0 && !data);
+    CHECK(omrx_get_attr_array_rows(chunk, OMRX_ATTR_DATA, num_points + 1, 1, &cols, &rows, &data) == OMRX_STATUS_NOT_FOUND);
+    CHECK(omrx_get_chunk_by_id(omrx, "layer-0", "LAYr", &layer) == OMRX_OK);
+    CHECK(omrx_get_attr_array_rows(layer, 0x10, 0, 1, &cols, &rows, &data) == OMRX_ERR_WRONG_DTYPE);
+    CHECK_OMRX_ERR(omrx_free(omrx));
+}
+
+// Reading into buffers supplied by the caller
+static void test_into(const char *filename, uint32_t num_points) {
+    omrx_t omrx;
+    omrx_chunk_t chunk, layer;
+    float *point_data;
+    uint16_t cols;
+    uint32_t rows;
+    char id[16];
+
+    omrx = open_test_file(filename, OMRX_OPEN_DEFAULT, &chunk);
+    point_data = malloc(sizeof(float) * 3 * num_points);
+    CHECK(point_data);
+    CHECK_OMRX_ERR(omrx_get_attr_float32_array_into(chunk, OMRX_ATTR_DATA, point_data, sizeof(float) * 3 * num_points, &cols, &rows));
+    CHECK(rows == num_points);
+    check_points(point_data, cols, rows, 0);
+    CHECK(omrx_get_attr_float32_array_into(chunk, OMRX_ATTR_DATA, point_data, sizeof(float) * 3 * num_points - 1, &cols, &rows) == OMRX_ERR_TOO_SMALL);
+
+    memset(point_data, 0, sizeof(float) * 3 * num_points);
+    CHECK_OMRX_ERR(omrx_get_attr_float32_array_rows_into(chunk, OMRX_ATTR_DATA, 20, 10, point_data, sizeof(float) * 3 * 10, &cols, &rows));
+    CHECK(rows == 10);
+    check_points(point_data, cols, rows, 20);
+    free(point_data);
+
+    CHECK(omrx_get_chunk_by_id(omrx, "layer-3", "LAYr", &layer) == OMRX_OK);
+    CHECK_OMRX_ERR(omrx_get_attr_str_into(layer, OMRX_ATTR_ID, id, sizeof(id)));
+    CHECK(!strcmp(id, "layer-3"));
+    CHECK(omrx_get_attr_str_into(layer, OMRX_ATTR_ID, id, strlen("layer-3")) == OMRX_ERR_TOO_SMALL);
+    CHECK_OMRX_ERR(omrx_free(omrx));
+}
+
+// The attribute data cache is off by default, and keeps data read from the
+// file (within its limit) once it is turned on
+static void test_cache(const char *filename, uint32_t num_points) {
+    omrx_t omrx;
+    omrx_chunk_t chunk;
+    struct omrx_cache_stats stats;
+    float *point_data;
+    uint16_t cols;
+    uint32_t rows;
+    unsigned int i;
+
+    omrx = open_test_file(filename, OMRX_OPEN_DEFAULT, &chunk);
+    for (i = 0; i < 2; i++) {
+        CHECK_OMRX_ERR(omrx_get_attr_float32_array(chunk, OMRX_ATTR_DATA, &cols, &rows, &point_data));
+        free(point_data);
+    }
+    CHECK_OMRX_ERR(omrx_get_cache_stats(omrx, &stats));
+    CHECK(stats.limit == 0 && stats.entries == 0 && stats.hits == 0);
+
+    CHECK_OMRX_ERR(omrx_set_cache_limit(omrx, 1024 * 1024));
+    for (i = 0; i < 2; i++) {
+        CHECK_OMRX_ERR(omrx_get_attr_float32_array(chunk, OMRX_ATTR_DATA, &cols, &rows, &point_data));
+        CHECK(rows == num_points);
+        check_points(point_data, cols, rows, 0);
+        free(point_data);
+    }
+    CHECK_OMRX_ERR(omrx_get_cache_stats(omrx, &stats));
+    CHECK(stats.entries == 1 && stats.size == sizeof(float) * 3 * num_points && stats.hits == 1);
+
+    CHECK_OMRX_ERR(omrx_release_attr_data(chunk, OMRX_ATTR_DATA));
+    CHECK_OMRX_ERR(omrx_get_cache_stats(omrx, &stats));
+    CHECK(stats.entries == 0 && stats.size == 0);
+    CHECK(omrx_release_attr_data(chunk, 0x1234) == OMRX_STATUS_NOT_FOUND);
+
+    // Data bigger than the limit isn't kept
+    CHECK_OMRX_ERR(omrx_set_cache_limit(omrx, 16));
+    CHECK_OMRX_ERR(omrx_get_attr_float32_array(chunk, OMRX_ATTR_DATA, &cols, &rows, &point_data));
+    free(point_data);
+    CHECK_OMRX_ERR(omrx_get_cache_stats(omrx, &stats));
+    CHECK(stats.entries == 0);
+    CHECK_OMRX_ERR(omrx_free(omrx));
+}
+
+// Shared attribute buffers: every caller gets the same buffer while it's in
+// use (even with the cache off), it outlives the instance, and the
+// attribute's own reference is dropped once nobody else has one
+static void test_buffer(const char *filename, uint32_t num_points) {
+    static const unsigned int flags[] = { OMRX_OPEN_DEFAULT, OMRX_OPEN_CONCURRENT };
+    omrx_t omrx;
+    omrx_chunk_t chunk;
+    omrx_buffer_t buf1, buf2, buf3;
+    struct omrx_cache_stats stats;
+    unsigned int i;
+
+    for (i = 0; i < sizeof(flags) / sizeof(flags[0]); i++) {
+        omrx = open_test_file(filename, flags[i], &chunk);
+        CHECK_OMRX_ERR(omrx_get_attr_buffer(chunk, OMRX_ATTR_DATA, &buf1));
+        CHECK_OMRX_ERR(omrx_get_attr_buffer(chunk, OMRX_ATTR_DATA, &buf2));
+        CHECK(buf1 == buf2);
+        omrx_buffer_release(buf2);
+        omrx_buffer_release(buf1);
+        CHECK_OMRX_ERR(omrx_get_cache_stats(omrx, &stats));
+        CHECK(stats.entries == 1);
+        CHECK_OMRX_ERR(omrx_set_cache_limit(omrx, 0));
+        CHECK_OMRX_ERR(omrx_get_cache_stats(omrx, &stats));
+        CHECK(stats.entries == 0 && stats.size == 0 && stats.evictions == 1);
+        CHECK_OMRX_ERR(omrx_free(omrx));
+    }
+
+    omrx = open_test_file(filename, OMRX_OPEN_DEFAULT, &chunk);
+    CHECK_OMRX_ERR(omrx_get_attr_buffer(chunk, OMRX_ATTR_DATA, &buf1));
+    CHECK(omrx_buffer_size(buf1) == sizeof(float) * 3 * num_points);
+    buf3 = omrx_buffer_retain(buf1);
+    CHECK(omrx_get_attr_buffer(chunk, 0x1234, &buf2) == OMRX_STATUS_NOT_FOUND);
+    CHECK(!buf2);
+    omrx_buffer_release(buf1);
+    // (Still in use, so it stays)
+    CHECK_OMRX_ERR(omrx_set_cache_limit(omrx, 0));
+    CHECK_OMRX_ERR(omrx_get_attr_buffer(chunk, OMRX_ATTR_DATA, &buf2));
+    CHECK(buf2 == buf3);
+    omrx_buffer_release(buf2);
+    CHECK_OMRX_ERR(omrx_free(omrx));
+
+    check_points(omrx_buffer_data(buf3), 3, num_points, 0);
+    omrx_buffer_release(buf3);
+}
+
+// Check the arrays of other types written by test_write (see
+// add_type_arrays() there)
+static void check_types(omrx_chunk_t chunk, uint32_t num_points) {
+    int8_t *s8_data;
+    uint16_t *u16_data;
+    int32_t *s32_data;
+    uint64_t *u64_data;
+    double *f64_data;
+    uint16_t cols;
+    uint32_t rows;
+    unsigned int k;
+
+    CHECK_OMRX_ERR(omrx_get_attr_int8_array(chunk, 0x20, &cols, &rows, &s8_data));
+    CHECK(cols == 1 && rows == num_points);
+    CHECK_OMRX_ERR(omrx_get_attr_uint16_array(chunk, 0x21, &cols, &rows, &u16_data));
+    CHECK(cols == 2 && rows == num_points);
+    CHECK_OMRX_ERR(omrx_get_attr_int32_array(chunk, 0x22, &cols, &rows, &s32_data));
+    CHECK(cols == 1 && rows == num_points);
+    CHECK_OMRX_ERR(omrx_get_attr_uint64_array(chunk, 0x23, &cols, &rows, &u64_data));
+    CHECK(cols == 1 && rows == num_points);
+    CHECK_OMRX_ERR(omrx_get_attr_float64_array(chunk, 0x24, &cols, &rows, &f64_data));
+    CHECK(cols == 1 && rows == num_points);
+    for (k = 0; k < num_points; k++) {
+        CHECK(s8_data[k] == (int8_t)(k % 256 - 128));
+        CHECK(u16_data[k * 2] == (uint16_t)(k * 7));
+        CHECK(u16_data[k * 2 + 1] == (uint16_t)(k * 7 + 1));
+        CHECK(s32_data[k] == (int32_t)k - 500);
+        CHECK(u64_data[k] == (uint64_t)k * 0x100000001ULL);
+        CHECK(f64_data[k] == k * 0.5);
+    }
+    free(s8_data);
+    free(u16_data);
+    free(s32_data);
+    free(u64_data);
+    free(f64_data);
+}
+
+// Arrays of each size of element come back in host byte order
+static void test_types(const char *filename, uint32_t num_points) {
+    omrx_t omrx;
+    omrx_chunk_t chunk;
+
+    omrx = open_test_file(filename, OMRX_OPEN_DEFAULT, &chunk);
+    CHECK(omrx_get_chunk_by_id(omrx, "types", "TYPs", &chunk) == OMRX_OK);
+    check_types(chunk, num_points);
+    CHECK_OMRX_ERR(omrx_free(omrx));
+}
+
+// Typed scalars, and arrays of any numeric type converted to float
+static void test_convert(const char *filename, uint32_t num_points) {
+    omrx_t omrx;
+    omrx_chunk_t chunk;
+    int8_t s8_value;
+    uint16_t u16_value;
+    int64_t s64_value;
+    double f64_value;
+    float *f32_data;
+    double *f64_data;
+    uint16_t *u16_data;
+    uint16_t cols;
+    uint32_t rows;
+    unsigned int k;
+
+    omrx = open_test_file(filename, OMRX_OPEN_DEFAULT, &chunk);
+    CHECK(omrx_get_chunk_by_id(omrx, "types", "TYPs", &chunk) == OMRX_OK);
+    CHECK_OMRX_ERR(omrx_get_attr_int8(chunk, 0x30, &s8_value));
+    CHECK(s8_value == -5);
+    CHECK_OMRX_ERR(omrx_get_attr_uint16(chunk, 0x31, &u16_value));
+    CHECK(u16_value == 65000);
+    CHECK_OMRX_ERR(omrx_get_attr_int64(chunk, 0x32, &s64_value));
+    CHECK(s64_value == -1234567890123LL);
+    CHECK_OMRX_ERR(omrx_get_attr_float64(chunk, 0x33, &f64_value));
+    CHECK(f64_value == 0.125);
+
+    CHECK_OMRX_ERR(omrx_get_attr_array_as_float32(chunk, 0x22, &cols, &rows, &f32_data));
+    CHECK(cols == 1 && rows == num_points);
+    for (k = 0; k < num_points; k++) {
+        CHECK(f32_data[k] == (float)((int32_t)k - 500));
+    }
+    free(f32_data);
+    CHECK_OMRX_ERR(omrx_get_attr_array_as_float64(chunk, 0x21, &cols, &rows, &f64_data));
+    CHECK(cols == 2 && rows == num_points);
+    for (k = 0; k < num_points; k++) {
+        CHECK(f64_data[k * 2] == (double)(uint16_t)(k * 7));
+    }
+    free(f64_data);
+    f64_data = malloc(sizeof(double) * num_points);
+    CHECK(f64_data);
+    CHECK_OMRX_ERR(omrx_get_attr_array_as_float64_into(chunk, 0x20, f64_data, sizeof(double) * num_points, &cols, &rows));
+    for (k = 0; k < num_points; k++) {
+        CHECK(f64_data[k] == (double)(int8_t)(k % 256 - 128));
+    }
+    free(f64_data);
+
+    CHECK(omrx_get_attr_uint16_array(chunk, 0x22, &cols, &rows, &u16_data) == OMRX_ERR_WRONG_DTYPE);
+    CHECK(omrx_get_attr_array_as_float32(chunk, OMRX_ATTR_ID, &cols, &rows, &f32_data) == OMRX_ERR_WRONG_DTYPE);
+    CHECK_OMRX_ERR(omrx_free(omrx));
+}
+
+// Encoded attributes are decoded transparently
+static void test_encoded(const char *filename, uint32_t num_points) {
+    static const unsigned int flags[] = { OMRX_OPEN_DEFAULT, OMRX_OPEN_MMAP };
+    omrx_t omrx;
+    omrx_chunk_t chunk;
+    struct omrx_attr_info info;
+    float *point_data;
+    uint16_t cols;
+    uint32_t rows;
+    unsigned int i, j;
+
+    for (i = 0; i < sizeof(flags) / sizeof(flags[0]); i++) {
+        omrx = open_test_file(filename, flags[i], &chunk);
+        CHECK(omrx_get_chunk_by_id(omrx, "encoded", "ENCd", &chunk) == OMRX_OK);
+        for (j = 0; j < 3; j++) {
+            CHECK_OMRX_ERR(omrx_get_attr_info(chunk, 0x40 + j, &info));
+            CHECK(info.exists && info.raw_type == OMRX_DTYPE_F32_ARRAY);
+            CHECK(info.cols == 3 && info.rows == num_points);
+            CHECK_OMRX_ERR(omrx_get_attr_float32_array(chunk, 0x40 + j, &cols, &rows, &point_data));
+            CHECK(rows == num_points);
+            check_points(point_data, cols, rows, 0);
+            if (!(flags[i] & OMRX_OPEN_MMAP)) {
+                free(point_data);
+            }
+        }
+        // Shuffled points compress well, so they will have been encoded
+        CHECK_OMRX_ERR(omrx_get_attr_info(chunk, 0x41, &info));
+        CHECK(OMRX_GET_ENCODING(info.encoded_type) == (OMRX_ENCODING_LZ | OMRX_ENCODING_SHUFFLE));
+        CHECK_OMRX_ERR(omrx_free(omrx));
+    }
+}
+
+// Encoded arrays split into blocks can be decoded in parallel, and ranges of
+// rows only need the blocks containing them
+static void test_blocks(const char *filename, uint32_t num_points) {
+    omrx_t omrx;
+    omrx_chunk_t chunk;
+    float *point_data;
+    uint16_t cols;
+    uint32_t rows;
+    uint32_t version;
+
+    omrx = open_test_file(filename, OMRX_OPEN_DEFAULT, &chunk);
+    CHECK_OMRX_ERR(omrx_get_version(omrx, &version));
+    CHECK(version == OMRX_VERSION);
+    CHECK_OMRX_ERR(omrx_set_threads(omrx, 4));
+    CHECK(omrx_get_chunk_by_id(omrx, "encoded", "ENCd", &chunk) == OMRX_OK);
+    CHECK_OMRX_ERR(omrx_get_attr_float32_array(chunk, 0x41, &cols, &rows, &point_data));
+    CHECK(rows == num_points);
+    check_points(point_data, cols, rows, 0);
+    free(point_data);
+    CHECK_OMRX_ERR(omrx_get_attr_float32_array_rows(chunk, 0x41, num_points / 3, num_points / 3, &cols, &rows, &point_data));
+    CHECK(rows == num_points / 3);
+    check_points(point_data, cols, rows, num_points / 3);
+    free(point_data);
+    CHECK_OMRX_ERR(omrx_free(omrx));
+}
+
+// Check that test_write produced the same file as `filename` under another
+// name (with the given extension)
+static void check_same_file(const char *filename, const char *ext) {
+    char path[4096];
+    char *data1, *data2;
+    size_t size1, size2;
+
+    snprintf(path, sizeof(path), "%s.%s", filename, ext);
+    data1 = read_file(filename, &size1);
+    data2 = read_file(path, &size2);
+    CHECK(size1 == size2 && !memcmp(data1, data2, size1));
+    free(data1);
+    free(data2);
+}
+
+// Check the encoded arrays in ENCd "encoded", all of which hold the points
+static void check_encoded_points(omrx_t omrx, uint32_t num_points) {
+    omrx_chunk_t chunk;
+    float *point_data;
+    uint16_t cols;
+    uint32_t rows;
+    unsigned int j;
+
+    CHECK(omrx_get_chunk_by_id(omrx, "encoded", "ENCd", &chunk) == OMRX_OK);
+    for (j = 0; j < 3; j++) {
+        CHECK_OMRX_ERR(omrx_get_attr_float32_array(chunk, 0x40 + j, &cols, &rows, &point_data));
+        CHECK(rows == num_points);
+        check_points(point_data, cols, rows, 0);
+        free(point_data);
+    }
+    CHECK_OMRX_ERR(omrx_get_attr_float32_array_rows(chunk, 0x41, num_points / 3, num_points / 3, &cols, &rows, &point_data));
+    CHECK(rows == num_points / 3);
+    check_points(point_data, cols, rows, num_points / 3);
+    free(point_data);
+}
+
+// Files older than OMRX_VERSION 0.2 store each encoded array as a single
+// block with no block directory.  Writing a tree out with an older version
+// re-encodes its arrays that way, they read back correctly, and writing them
+// out again as 0.2 splits them back into blocks.
+static void test_legacy_blocks(const char *filename, uint32_t num_points) {
+    omrx_t omrx;
+    omrx_chunk_t chunk, root;
+    struct omrx_attr_info info;
+    char v1_path[4096];
+    char v2_path[4096];
+    uint32_t version;
+
+    snprintf(v1_path, sizeof(v1_path), "%s.v1", filename);
+    snprintf(v2_path, sizeof(v2_path), "%s.v2", filename);
+
+    omrx = open_test_file(filename, OMRX_OPEN_DEFAULT, &chunk);
+    CHECK_OMRX_ERR(omrx_get_root_chunk(omrx, &root));
+    CHECK_OMRX_ERR(omrx_set_attr_uint32(root, OMRX_ATTR_VER, OMRX_MIN_VERSION));
+    CHECK_OMRX_ERR(omrx_write(omrx, v1_path));
+    CHECK_OMRX_ERR(omrx_free(omrx));
+
+    omrx = open_test_file(v1_path, OMRX_OPEN_DEFAULT, &chunk);
+    CHECK_OMRX_ERR(omrx_get_version(omrx, &version));
+    CHECK(version == OMRX_MIN_VERSION);
+    CHECK_OMRX_ERR(omrx_set_threads(omrx, 4));
+    check_encoded_points(omrx, num_points);
+    CHECK(omrx_get_chunk_by_id(omrx, "encoded", "ENCd", &chunk) == OMRX_OK);
+    CHECK_OMRX_ERR(omrx_get_attr_info(chunk, 0x41, &info));
+    CHECK(OMRX_GET_ENCODING(info.encoded_type) == (OMRX_ENCODING_LZ | OMRX_ENCODING_SHUFFLE));
+    CHECK_OMRX_ERR(omrx_free(omrx));
+
+    // Read it again (lazily, so nothing has been decoded yet) and write it
+    // back out as 0.2, the way test_write wrote the original
+    omrx = open_test_file(v1_path, OMRX_OPEN_MMAP, &chunk);
+    CHECK_OMRX_ERR(omrx_get_root_chunk(omrx, &root));
+    CHECK_OMRX_ERR(omrx_set_attr_uint32(root, OMRX_ATTR_VER, OMRX_VERSION));
+    CHECK_OMRX_ERR(omrx_set_block_size(omrx, 1024));
+    CHECK_OMRX_ERR(omrx_write_ex(omrx, v2_path, OMRX_WRITE_TOC));
+    CHECK_OMRX_ERR(omrx_free(omrx));
+
+    omrx = open_test_file(v2_path, OMRX_OPEN_DEFAULT, &chunk);
+    CHECK_OMRX_ERR(omrx_get_version(omrx, &version));
+    CHECK(version == OMRX_VERSION);
+    check_encoded_points(omrx, num_points);
+    CHECK_OMRX_ERR(omrx_free(omrx));
+    check_same_file(filename, "v2");
+
+    remove(v1_path);
+    remove(v2_path);
+}
+
+// Files written with checksums can be verified, and damaged attribute data is
+// caught when it is read
+static void test_checksums(const char *filename, uint32_t num_points) {
+    static const unsigned int flags[] = { OMRX_OPEN_VERIFY, OMRX_OPEN_VERIFY | OMRX_OPEN_NO_TOC, OMRX_OPEN_VERIFY | OMRX_OPEN_CONCURRENT };
+    omrx_t omrx;
+    omrx_chunk_t chunk;
+    float *point_data;
+    uint16_t cols;
+    uint32_t rows;
+    char path[4096];
+    char bad_path[sizeof(path) + 4];
+    char *data, *p;
+    uint8_t row[12];
+    float value;
+    uint32_t bits;
+    size_t size;
+    unsigned int i, j;
+
+    snprintf(path, sizeof(path), "%s.crc", filename);
+    for (i = 0; i < sizeof(flags) / sizeof(flags[0]); i++) {
+        omrx = open_test_file(path, flags[i], &chunk);
+        CHECK_OMRX_ERR(omrx_get_attr_float32_array(chunk, OMRX_ATTR_DATA, &cols, &rows, &point_data));
+        CHECK(rows == num_points);
+        check_points(point_data, cols, rows, 0);
+        free(point_data);
+        CHECK(omrx_get_chunk_by_id(omrx, "encoded", "ENCd", &chunk) == OMRX_OK);
+        for (j = 0; j < 3; j++) {
+            CHECK_OMRX_ERR(omrx_get_attr_float32_array(chunk, 0x40 + j, &cols, &rows, &point_data));
+            check_points(point_data, cols, rows, 0);
+            free(point_data);
+        }
+        CHECK_OMRX_ERR(omrx_free(omrx));
+    }
+
+    // Change a byte in row 5 of the VRTx data (the first place its bytes
+    // appear in the file)
+    for (i = 0; i < 3; i++) {
+        value = (float)(5 + i);
+        memcpy(&bits, &value, sizeof(bits));
+        for (j = 0; j < 4; j++) {
+            row[i * 4 + j] = (uint8_t)(bits >> (j * 8));
+        }
+    }
+    data = read_file(path, &size);
+    p = memmem(data, size, row, sizeof(row));
+    CHECK(p);
+    p[1] ^= 0x01;
+    snprintf(bad_path, sizeof(bad_path), "%s.bad", path);
+    write_file(bad_path, data, size);
+    free(data);
+
+    omrx = open_test_file(bad_path, OMRX_OPEN_VERIFY, &chunk);
+    CHECK(omrx_get_attr_float32_array(chunk, OMRX_ATTR_DATA, &cols, &rows, &point_data) == OMRX_ERR_CHECKSUM);
+    CHECK_OMRX_ERR(omrx_free(omrx));
+    omrx = open_test_file(bad_path, OMRX_OPEN_DEFAULT, &chunk);
+    CHECK_OMRX_ERR(omrx_get_attr_float32_array(chunk, OMRX_ATTR_DATA, &cols, &rows, &point_data));
+    CHECK(point_data[15] != 5.0f);
+    free(point_data);
+    CHECK_OMRX_ERR(omrx_free(omrx));
+    remove(bad_path);
+}
+
+static void fetch_done(omrx_fetch_t fetch, void *user_data) {
+    (void)fetch;
+    (*(int *)user_data)++;
+}
+
+// Asynchronous fetches (only available in concurrent mode)
+static void test_fetch(const char *filename, uint32_t num_points) {
+    struct omrx_fetch_request requests[3];
+    omrx_t omrx;
+    omrx_chunk_t chunk, enc;
+    omrx_fetch_t fetch;
+    float *buf1, *buf2;
+    float small[3];
+    int done = 0;
+
+    omrx = open_test_file(filename, OMRX_OPEN_DEFAULT, &chunk);
+    memset(requests, 0, sizeof(requests));
+    requests[0].chunk = chunk;
+    requests[0].id = OMRX_ATTR_DATA;
+    CHECK(omrx_fetch_submit(omrx, requests, 1, NULL, NULL, &fetch) == OMRX_ERR_BAD_STATE);
+    CHECK(!fetch);
+    CHECK_OMRX_ERR(omrx_free(omrx));
+
+    omrx = open_test_file(filename, OMRX_OPEN_CONCURRENT, &chunk);
+    CHECK(omrx_get_chunk_by_id(omrx, "encoded", "ENCd", &enc) == OMRX_OK);
+    buf1 = malloc(sizeof(float) * 3 * num_points);
+    buf2 = malloc(sizeof(float) * 3 * num_points);
+    CHECK(buf1 && buf2);
+    memset(requests, 0, sizeof(requests));
+    requests[0].chunk = chunk;
+    requests[0].id = OMRX_ATTR_DATA;
+    requests[0].buf = buf1;
+    requests[0].buf_size = sizeof(float) * 3 * num_points;
+    requests[1].chunk = enc;
+    requests[1].id = 0x42;
+    requests[1].buf = buf2;
+    requests[1].buf_size = sizeof(float) * 3 * num_points;
+    requests[2].chunk = enc;
+    requests[2].id = 0x1234;
+    CHECK_OMRX_ERR(omrx_fetch_submit(omrx, requests, 3, fetch_done, &done, &fetch));
+    CHECK(requests[2].status == OMRX_STATUS_NOT_FOUND);
+    CHECK(omrx_fetch_wait(fetch) == OMRX_OK);
+    CHECK(omrx_fetch_poll(fetch) == OMRX_OK);
+    CHECK(done == 1);
+    CHECK(requests[0].status == OMRX_OK && requests[0].size == sizeof(float) * 3 * num_points);
+    CHECK(requests[1].status == OMRX_OK && requests[1].size == sizeof(float) * 3 * num_points);
+    check_points(buf1, 3, num_points, 0);
+    check_points(buf2, 3, num_points, 0);
+    omrx_fetch_free(fetch);
+
+    // Nothing is read if any buffer is too small
+    requests[1].buf = small;
+    requests[1].buf_size = sizeof(small);
+    CHECK(omrx_fetch_submit(omrx, requests, 2, NULL, NULL, &fetch) == OMRX_ERR_TOO_SMALL);
+    CHECK(!fetch);
+    free(buf1);
+    free(buf2);
+    CHECK_OMRX_ERR(omrx_free(omrx));
+}
+
+// Access pattern advice changes how the file is read, but not what is read
+static void test_advice(const char *filename, uint32_t num_points) {
+    static const omrx_advice_t advice[] = { OMRX_ADVICE_SEQUENTIAL, OMRX_ADVICE_RANDOM, OMRX_ADVICE_WILLNEED, OMRX_ADVICE_DONTNEED };
+    static const unsigned int flags[] = { OMRX_OPEN_NO_TOC, OMRX_OPEN_MMAP | OMRX_OPEN_NO_TOC };
+    omrx_t omrx;
+    omrx_chunk_t chunk, mesh;
+    float *point_data;
+    uint16_t cols;
+    uint32_t rows;
+    unsigned int i, j;
+
+    for (i = 0; i < sizeof(advice) / sizeof(advice[0]); i++) {
+        for (j = 0; j < sizeof(flags) / sizeof(flags[0]); j++) {
+            CHECK_OMRX_ERR(omrx_new(NULL, &omrx));
+            CHECK_OMRX_ERR(omrx_advise(omrx, advice[i]));
+            CHECK_OMRX_ERR(omrx_open_ex(omrx, filename, NULL, flags[j]));
+            CHECK(omrx_get_chunk_by_id(omrx, "test", "mESH", &mesh) == OMRX_OK);
+            CHECK_OMRX_ERR(omrx_advise_chunk(mesh, OMRX_ADVICE_WILLNEED));
+            CHECK(omrx_get_child(mesh, "VRTx", &chunk) == OMRX_OK);
+            CHECK_OMRX_ERR(omrx_get_attr_float32_array(chunk, OMRX_ATTR_DATA, &cols, &rows, &point_data));
+            CHECK(rows == num_points);
+            check_points(point_data, cols, rows, 0);
+            if (!(flags[j] & OMRX_OPEN_MMAP)) {
+                free(point_data);
+            }
+            CHECK_OMRX_ERR(omrx_advise_chunk(mesh, OMRX_ADVICE_DONTNEED));
+            CHECK_OMRX_ERR(omrx_advise(omrx, OMRX_ADVICE_NORMAL));
+            CHECK_OMRX_ERR(omrx_free(omrx));
+        }
+    }
+    CHECK(omrx_advise_chunk(NULL, OMRX_ADVICE_WILLNEED) == OMRX_STATUS_NO_OBJECT);
+}
+
+struct walk_state {
+    unsigned int pre;
+    unsigned int post;
+    unsigned int max_depth;
+    omrx_walk_action_t action;
+    unsigned int action_at;
+};
+
+static omrx_walk_action_t walk_pre(omrx_chunk_t chunk, unsigned int depth, void *user_data) {
+    struct walk_state *state = user_data;
+
+    (void)chunk;
+    state->pre++;
+    if (depth > state->max_depth) {
+        state->max_depth = depth;
+    }
+
+    return state->pre == state->action_at ? state->action : OMRX_WALK_CONTINUE;
+}
+
+static omrx_walk_action_t walk_post(omrx_chunk_t chunk, unsigned int depth, void *user_data) {
+    struct walk_state *state = user_data;
+
+    (void)chunk;
+    (void)depth;
+    state->post++;
+
+    return OMRX_WALK_CONTINUE;
+}
+
+// Walking and iterating over the tree.  The file has the root chunk, mESH (with
+// VRTx, 5 LAYr and 30 PADx children), TYPs and ENCd: 40 chunks in all.
+static void test_walk(const char *filename) {
+    static const unsigned int flags[] = { OMRX_OPEN_DEFAULT, OMRX_OPEN_LAZY };
+    struct walk_state state;
+    omrx_t omrx;
+    omrx_chunk_t root, chunk;
+    unsigned int count;
+    unsigned int i;
+
+    for (i = 0; i < sizeof(flags) / sizeof(flags[0]); i++) {
+        CHECK_OMRX_ERR(omrx_new(NULL, &omrx));
+        CHECK_OMRX_ERR(omrx_open_ex(omrx, filename, NULL, flags[i]));
+        CHECK_OMRX_ERR(omrx_get_root_chunk(omrx, &root));
+
+        memset(&state, 0, sizeof(state));
+        CHECK_OMRX_ERR(omrx_walk(root, NULL, walk_pre, walk_post, &state));
+        CHECK(state.pre == 40 && state.post == 40 && state.max_depth == 2);
+
+        memset(&state, 0, sizeof(state));
+        CHECK_OMRX_ERR(omrx_walk(root, "LAYr", walk_pre, walk_post, &state));
+        CHECK(state.pre == 5 && state.post == 5 && state.max_depth == 2);
+
+        // Skipping mESH (the second chunk) leaves out its 36 children
+        memset(&state, 0, sizeof(state));
+        state.action = OMRX_WALK_SKIP;
+        state.action_at = 2;
+        CHECK_OMRX_ERR(omrx_walk(root, NULL, walk_pre, walk_post, &state));
+        CHECK(state.pre == 4 && state.post == 4);
+
+        memset(&state, 0, sizeof(state));
+        state.action = OMRX_WALK_STOP;
+        state.action_at = 3;
+        CHECK_OMRX_ERR(omrx_walk(root, NULL, walk_pre, NULL, &state));
+        CHECK(state.pre == 3);
+
+        count = 0;
+        chunk = NULL;
+        while (omrx_get_next_descendant(root, chunk, "LAYr", &chunk) == OMRX_OK) {
+            count++;
+        }
+        CHECK(count == 5 && !chunk);
+        CHECK_OMRX_ERR(omrx_free(omrx));
+    }
+}
+
+// Check that the LAYr children of `mesh` have the given IDs, in order
+static void check_layers(omrx_chunk_t mesh, const char *const *ids, unsigned int count) {
+    omrx_chunk_t chunk;
+    char *id;
+    unsigned int i = 0;
+
+    CHECK(omrx_get_child(mesh, "LAYr", &chunk) == OMRX_OK);
+    while (chunk) {
+        CHECK(i < count);
+        CHECK_OMRX_ERR(omrx_get_attr_str(chunk, OMRX_ATTR_ID, &id));
+        CHECK(!strcmp(id, ids[i]));
+        free(id);
+        i++;
+        CHECK_OMRX_ERR(omrx_get_next_chunk(chunk, "LAYr", &chunk));
+    }
+    CHECK(i == count);
+}
+
+// Finding children by tag, including after the tree has been changed
+static void test_children(const char *filename) {
+    static const unsigned int flags[] = { OMRX_OPEN_DEFAULT, OMRX_OPEN_LAZY };
+    static const char *const ids1[] = { "layer-0", "layer-1", "layer-2", "layer-3", "layer-4" };
+    static const char *const ids2[] = { "layer-0", "layer-2", "layer-3", "layer-4", "layer-5" };
+    omrx_t omrx;
+    omrx_chunk_t mesh, chunk;
+    unsigned int i;
+
+    for (i = 0; i < sizeof(flags) / sizeof(flags[0]); i++) {
+        CHECK_OMRX_ERR(omrx_new(NULL, &omrx));
+        CHECK_OMRX_ERR(omrx_open_ex(omrx, filename, NULL, flags[i]));
+        CHECK(omrx_get_chunk_by_id(omrx, "test", "mESH", &mesh) == OMRX_OK);
+        check_layers(mesh, ids1, 5);
+        CHECK(omrx_get_child(mesh, "VRTx", &chunk) == OMRX_OK);
+        CHECK(omrx_get_next_chunk(chunk, "VRTx", &chunk) == OMRX_STATUS_NOT_FOUND);
+        CHECK(omrx_get_child(mesh, "PADx", &chunk) == OMRX_OK);
+        CHECK(omrx_get_next_chunk(chunk, NULL, &chunk) == OMRX_OK);
+        CHECK(omrx_get_child(mesh, "NONE", &chunk) == OMRX_STATUS_NOT_FOUND);
+
+        CHECK(omrx_get_child_by_id(mesh, "LAYr", "layer-1", &chunk) == OMRX_OK);
+        CHECK_OMRX_ERR(omrx_del_chunk(chunk));
+        CHECK_OMRX_ERR(omrx_add_chunk(mesh, "LAYr", &chunk));
+        CHECK_OMRX_ERR(omrx_set_attr_str(chunk, OMRX_ATTR_ID, OMRX_COPY, "layer-5"));
+        check_layers(mesh, ids2, 5);
+        CHECK(omrx_get_child_by_id(mesh, "LAYr", "layer-1", &chunk) == OMRX_STATUS_NOT_FOUND);
+        CHECK(omrx_get_child_by_id(mesh, "LAYr", "layer-3", &chunk) == OMRX_OK);
+        CHECK_OMRX_ERR(omrx_free(omrx));
+    }
+}
+
+// Run a query from the root chunk and return how many chunks it selects
+static size_t run_query(omrx_t omrx, const char *path) {
+    omrx_query_t query;
+    omrx_chunk_t root;
+    omrx_chunk_t *chunks;
+    size_t count;
+    omrx_status_t status;
+
+    CHECK_OMRX_ERR(omrx_get_root_chunk(omrx, &root));
+    CHECK(omrx_query_compile(omrx, path, &query) == OMRX_OK);
+    status = omrx_query_run(query, root, &chunks, &count);
+    CHECK(status == (count ? OMRX_OK : OMRX_STATUS_NOT_FOUND));
+    CHECK(!count == !chunks);
+    free(chunks);
+    omrx_query_free(query);
+
+    return count;
+}
+
+// Chunk queries
+static void test_query(const char *filename) {
+    static const unsigned int flags[] = { OMRX_OPEN_DEFAULT, OMRX_OPEN_LAZY };
+    static const char *const bad[] = { "mESH[", "mES", "mESH[id~=x]", "mESH[id='x]", "mESH//", "mESH[name=x]" };
+    omrx_t omrx;
+    omrx_query_t query;
+    omrx_chunk_t root;
+    omrx_chunk_t *chunks;
+    size_t count;
+    char *id;
+    unsigned int i;
+
+    for (i = 0; i < sizeof(flags) / sizeof(flags[0]); i++) {
+        CHECK_OMRX_ERR(omrx_new(NULL, &omrx));
+        CHECK_OMRX_ERR(omrx_open_ex(omrx, filename, NULL, flags[i]));
+        CHECK(run_query(omrx, "*") == 3);
+        CHECK(run_query(omrx, "mESH/LAYr") == 5);
+        CHECK(run_query(omrx, "/mESH[id=test]/LAYr[id^=layer-]") == 5);
+        CHECK(run_query(omrx, "//LAYr[id$=-1]") == 1);
+        CHECK(run_query(omrx, "//*[id*='yer-3']") == 1);
+        CHECK(run_query(omrx, "mESH/VRTx") == 1);
+        CHECK(run_query(omrx, "//PADx") == 30);
+        CHECK(run_query(omrx, "TYPs//LAYr") == 0);
+        CHECK(run_query(omrx, "NONE") == 0);
+
+        // Results come back in file order
+        CHECK_OMRX_ERR(omrx_get_root_chunk(omrx, &root));
+        CHECK(omrx_query_compile(omrx, "//LAYr", &query) == OMRX_OK);
+        CHECK(omrx_query_run(query, root, &chunks, &count) == OMRX_OK);
+        CHECK(count == 5);
+        CHECK_OMRX_ERR(omrx_get_attr_str(chunks[4], OMRX_ATTR_ID, &id));
+        CHECK(!strcmp(id, "layer-4"));
+        free(id);
+        free(chunks);
+        omrx_query_free(query);
+        CHECK_OMRX_ERR(omrx_free(omrx));
+    }
+
+    CHECK_OMRX_ERR(omrx_new(NULL, &omrx));
+    for (i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        CHECK(omrx_query_compile(omrx, bad[i], &query) == OMRX_ERR_BAD_QUERY);
+        CHECK(!query);
+    }
+    CHECK_OMRX_ERR(omrx_free(omrx));
+}
 
 int main(int argc, char *argv[]) {
     omrx_t omrx;
@@ -49,9 +1096,37 @@ int main(int argc, char *argv[]) {
         printf("\n");
     }
 
+    check_points(point_data, cols, rows, 0);
     free(point_data);
 
     CHECK_OMRX_ERR(omrx_free(omrx));
 
+    test_mmap(filename, rows);
+    test_truncated(filename);
+    test_toc(filename);
+    test_lazy(filename, rows);
+    test_concurrent(filename, rows);
+    test_stream(filename, rows);
+    test_append_failure(filename);
+    test_rows(filename, rows);
+    test_into(filename, rows);
+    test_cache(filename, rows);
+    test_buffer(filename, rows);
+    test_types(filename, rows);
+    test_convert(filename, rows);
+    test_encoded(filename, rows);
+    test_blocks(filename, rows);
+    // The parallel, single-threaded and direct I/O writers all give the same
+    // output
+    check_same_file(filename, "serial");
+    check_same_file(filename, "direct");
+    test_legacy_blocks(filename, rows);
+    test_checksums(filename, rows);
+    test_fetch(filename, rows);
+    test_advice(filename, rows);
+    test_walk(filename);
+    test_children(filename);
+    test_query(filename);
+
     return 0;
 }
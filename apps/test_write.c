@@ -5,14 +5,44 @@
 #include "omrx.h"
 
 #define CHECK_OMRX_ERR(x) if ((x) < 0) { fprintf(stderr, "Unexpected error from libomrx.  Exiting.\n"); exit(1); }
+#define CHECK(x) if (!(x)) { fprintf(stderr, "%s:%d: Check failed: %s\n", __FILE__, __LINE__, #x); exit(1); }
+
+// Add arrays of various types to `chunk`, in attributes 0x20 onwards, with
+// element k of each derived from k (see check_types() in test_read)
+static void add_type_arrays(omrx_chunk_t chunk, unsigned int count) {
+    int8_t *s8_data = malloc(sizeof(int8_t) * count);
+    uint16_t *u16_data = malloc(sizeof(uint16_t) * 2 * count);
+    int32_t *s32_data = malloc(sizeof(int32_t) * count);
+    uint64_t *u64_data = malloc(sizeof(uint64_t) * count);
+    double *f64_data = malloc(sizeof(double) * count);
+    unsigned int k;
+
+    CHECK(s8_data && u16_data && s32_data && u64_data && f64_data);
+    for (k = 0; k < count; k++) {
+        s8_data[k] = (int8_t)(k % 256 - 128);
+        u16_data[k * 2] = (uint16_t)(k * 7);
+        u16_data[k * 2 + 1] = (uint16_t)(k * 7 + 1);
+        s32_data[k] = (int32_t)k - 500;
+        u64_data[k] = (uint64_t)k * 0x100000001ULL;
+        f64_data[k] = k * 0.5;
+    }
+    CHECK_OMRX_ERR(omrx_set_attr_int8_array(chunk, 0x20, OMRX_TAKE, 1, count, s8_data));
+    CHECK_OMRX_ERR(omrx_set_attr_uint16_array(chunk, 0x21, OMRX_TAKE, 2, count, u16_data));
+    CHECK_OMRX_ERR(omrx_set_attr_int32_array(chunk, 0x22, OMRX_TAKE, 1, count, s32_data));
+    CHECK_OMRX_ERR(omrx_set_attr_uint64_array(chunk, 0x23, OMRX_TAKE, 1, count, u64_data));
+    CHECK_OMRX_ERR(omrx_set_attr_float64_array(chunk, 0x24, OMRX_TAKE, 1, count, f64_data));
+}
 
 int main(int argc, char *argv[]) {
     omrx_t omrx;
-    omrx_chunk_t chunk;
+    omrx_chunk_t chunk, mesh;
     unsigned int num_points;
     float *point_data;
-    unsigned int i;
+    unsigned int i, j;
     char *filename;
+    char path[4096];
+    char id[16];
+    FILE *fp;
 
     if (argc != 3) {
         fprintf(stderr, "Usage: %s filename num_points\n", argv[0]);
@@ -46,15 +76,115 @@ int main(int argc, char *argv[]) {
     CHECK_OMRX_ERR(omrx_get_root_chunk(omrx, &chunk));
     CHECK_OMRX_ERR(omrx_add_chunk(chunk, "mESH", &chunk));
     CHECK_OMRX_ERR(omrx_set_attr_str(chunk, OMRX_ATTR_ID, OMRX_COPY, "test"));
+    mesh = chunk;
 
     // Add a VRTx chunk under mESH with some vertex data
-    CHECK_OMRX_ERR(omrx_add_chunk(chunk, "VRTx", &chunk));
-    CHECK_OMRX_ERR(omrx_set_attr_float32_array(chunk, OMRX_ATTR_DATA, OMRX_TAKE, 3, num_points, point_data));
+    CHECK_OMRX_ERR(omrx_add_chunk(mesh, "VRTx", &chunk));
+    CHECK_OMRX_ERR(omrx_set_attr_float32_array(chunk, OMRX_ATTR_DATA, OMRX_COPY, 3, num_points, point_data));
+
+    // Add some LAYr chunks under mESH with IDs "layer-0" to "layer-4", each
+    // with its number in attribute 0x10, and each followed by 6 empty PADx
+    // chunks (so that mESH has enough children to be given a tag index)
+    for (i = 0; i < 5; i++) {
+        CHECK_OMRX_ERR(omrx_add_chunk(mesh, "LAYr", &chunk));
+        snprintf(id, sizeof(id), "layer-%u", i);
+        CHECK_OMRX_ERR(omrx_set_attr_str(chunk, OMRX_ATTR_ID, OMRX_COPY, id));
+        CHECK_OMRX_ERR(omrx_set_attr_uint32(chunk, 0x10, i));
+        for (j = 0; j < 6; j++) {
+            CHECK_OMRX_ERR(omrx_add_chunk(mesh, "PADx", &chunk));
+        }
+    }
 
-    // Write it out
-    CHECK_OMRX_ERR(omrx_write(omrx, filename));
+    // Add a toplevel TYPs chunk with id="types" holding arrays of other types
+    CHECK_OMRX_ERR(omrx_get_root_chunk(omrx, &chunk));
+    CHECK_OMRX_ERR(omrx_add_chunk(chunk, "TYPs", &chunk));
+    CHECK_OMRX_ERR(omrx_set_attr_str(chunk, OMRX_ATTR_ID, OMRX_COPY, "types"));
+    add_type_arrays(chunk, num_points);
+    CHECK_OMRX_ERR(omrx_set_attr_int8(chunk, 0x30, -5));
+    CHECK_OMRX_ERR(omrx_set_attr_uint16(chunk, 0x31, 65000));
+    CHECK_OMRX_ERR(omrx_set_attr_int64(chunk, 0x32, -1234567890123LL));
+    CHECK_OMRX_ERR(omrx_set_attr_float64(chunk, 0x33, 0.125));
+
+    // Add a toplevel ENCd chunk with id="encoded" holding the points again,
+    // stored with various encodings
+    CHECK_OMRX_ERR(omrx_get_root_chunk(omrx, &chunk));
+    CHECK_OMRX_ERR(omrx_add_chunk(chunk, "ENCd", &chunk));
+    CHECK_OMRX_ERR(omrx_set_attr_str(chunk, OMRX_ATTR_ID, OMRX_COPY, "encoded"));
+    for (i = 0; i < 3; i++) {
+        CHECK_OMRX_ERR(omrx_set_attr_float32_array(chunk, 0x40 + i, OMRX_COPY, 3, num_points, point_data));
+    }
+    CHECK_OMRX_ERR(omrx_set_attr_encoding(chunk, 0x40, OMRX_ENCODING_LZ));
+    CHECK_OMRX_ERR(omrx_set_attr_encoding(chunk, 0x41, OMRX_ENCODING_LZ | OMRX_ENCODING_SHUFFLE));
+    CHECK_OMRX_ERR(omrx_set_attr_encoding(chunk, 0x42, OMRX_ENCODING_AUTO | OMRX_ENCODING_SHUFFLE));
+    CHECK(omrx_set_attr_encoding(chunk, 0x40, 0x0500) == OMRX_ERR_BAD_ENCODING);
+    CHECK(omrx_set_attr_encoding(chunk, OMRX_ATTR_ID, OMRX_ENCODING_LZ) == OMRX_ERR_WRONG_DTYPE);
+    CHECK(omrx_set_attr_encoding(chunk, 0x1234, OMRX_ENCODING_LZ) == OMRX_STATUS_NOT_FOUND);
+
+    // Write it out (with a table of contents), with small enough blocks that
+    // the encoded arrays are split into several
+    CHECK_OMRX_ERR(omrx_set_block_size(omrx, 1024));
+    CHECK_OMRX_ERR(omrx_write_ex(omrx, filename, OMRX_WRITE_TOC));
+
+    // Write it again to "<filename>.serial" from a single thread, which
+    // should produce exactly the same file
+    snprintf(path, sizeof(path), "%s.serial", filename);
+    CHECK_OMRX_ERR(omrx_set_threads(omrx, 1));
+    CHECK_OMRX_ERR(omrx_write_ex(omrx, path, OMRX_WRITE_TOC));
+    CHECK(omrx_write(omrx, "/nonexistent/test.omrx") == OMRX_ERR_OSERR);
+
+    // And to "<filename>.crc" with checksums
+    snprintf(path, sizeof(path), "%s.crc", filename);
+    CHECK_OMRX_ERR(omrx_set_threads(omrx, 0));
+    CHECK_OMRX_ERR(omrx_write_ex(omrx, path, OMRX_WRITE_TOC | OMRX_WRITE_CHECKSUMS));
+
+    // And to "<filename>.direct" with direct I/O, which again should be the
+    // same as the first file
+    snprintf(path, sizeof(path), "%s.direct", filename);
+    CHECK_OMRX_ERR(omrx_write_ex(omrx, path, OMRX_WRITE_TOC | OMRX_WRITE_DIRECT));
 
     CHECK_OMRX_ERR(omrx_free(omrx));
 
+    // Write the same points to "<filename>.stream" with the streaming writer,
+    // under mESH "stream", a piece at a time
+    snprintf(path, sizeof(path), "%s.stream", filename);
+    CHECK_OMRX_ERR(omrx_new(NULL, &omrx));
+    CHECK_OMRX_ERR(omrx_stream_open(omrx, path));
+    CHECK_OMRX_ERR(omrx_stream_begin_chunk(omrx, "mESH"));
+    CHECK_OMRX_ERR(omrx_stream_write_attr_str(omrx, OMRX_ATTR_ID, "stream"));
+    CHECK_OMRX_ERR(omrx_stream_begin_chunk(omrx, "VRTx"));
+    CHECK(omrx_stream_write_attr(omrx, OMRX_ATTR_DATA, OMRX_DTYPE_F32_ARRAY, 3, sizeof(float) * 4, point_data) == OMRX_ERR_BAD_SIZE);
+    CHECK(omrx_stream_begin_array(omrx, OMRX_ATTR_DATA, OMRX_DTYPE_F32_ARRAY | OMRX_ENCODING_LZ, 3) == OMRX_ERR_BAD_ENCODING);
+    CHECK_OMRX_ERR(omrx_stream_begin_array(omrx, OMRX_ATTR_DATA, OMRX_DTYPE_F32_ARRAY, 3));
+    for (i = 0; i < num_points; i += 100) {
+        CHECK_OMRX_ERR(omrx_stream_append_rows(omrx, num_points - i < 100 ? num_points - i : 100, point_data + i * 3));
+    }
+    CHECK(omrx_stream_end_chunk(omrx) == OMRX_ERR_BAD_STATE);
+    CHECK_OMRX_ERR(omrx_stream_end_array(omrx));
+    CHECK_OMRX_ERR(omrx_stream_end_chunk(omrx));
+    CHECK_OMRX_ERR(omrx_stream_end_chunk(omrx));
+    CHECK(omrx_stream_end_chunk(omrx) == OMRX_ERR_BAD_STATE);
+    CHECK_OMRX_ERR(omrx_stream_close(omrx));
+
+    // Then add a mESH "appended" chunk to the end of it
+    CHECK_OMRX_ERR(omrx_stream_append(omrx, path));
+    CHECK(omrx_stream_append(omrx, path) == OMRX_ERR_ALREADY_OPEN);
+    CHECK_OMRX_ERR(omrx_stream_begin_chunk(omrx, "mESH"));
+    CHECK_OMRX_ERR(omrx_stream_write_attr_str(omrx, OMRX_ATTR_ID, "appended"));
+    CHECK_OMRX_ERR(omrx_stream_write_attr_uint32(omrx, 0x10, num_points));
+    CHECK_OMRX_ERR(omrx_stream_end_chunk(omrx));
+    CHECK_OMRX_ERR(omrx_stream_close(omrx));
+
+    // Appending to something which isn't an OMRX file fails
+    snprintf(path, sizeof(path), "%s.junk", filename);
+    fp = fopen(path, "wb");
+    CHECK(fp);
+    fputs("This is not an OMRX file\n", fp);
+    fclose(fp);
+    CHECK(omrx_stream_append(omrx, path) == OMRX_ERR_BAD_MAGIC);
+    remove(path);
+    CHECK_OMRX_ERR(omrx_free(omrx));
+
+    free(point_data);
+
     return 0;
 }
@@ -10,12 +10,105 @@
 extern "C" {
 #endif
 
+/** @brief Ownership of data passed to or returned from libomrx
+  *
+  * @ingroup api
+  */
 typedef enum {
-    //TODO: Implement OMRX_REF
+    /** libomrx takes ownership of the passed buffer, and will free it (using
+      * the instance's free function) when it is no longer needed */
     OMRX_TAKE,
+    /** libomrx makes its own copy of the data, and the caller retains
+      * ownership of the passed buffer */
     OMRX_COPY,
+    /** The data is borrowed: it is not copied and is never freed by the party
+      * which did not allocate it.  The owner must keep it valid for as long
+      * as the borrower may use it (for data set by the application, until the
+      * attribute is changed or deleted, or the instance is freed; for data
+      * returned by libomrx, until the attribute is changed or deleted, or
+      * omrx_free() is called) */
+    OMRX_REF,
 } omrx_ownership_t;
 
+/** @brief Flags which can be passed to omrx_open_ex()
+  *
+  * @ingroup api
+  */
+typedef enum {
+    /** Default behavior (same as omrx_open()) */
+    OMRX_OPEN_DEFAULT    = 0x0000,
+    /** Map the file into memory, and return borrowed (::OMRX_REF) pointers
+      * into the mapping from omrx_get_attr_raw() and
+      * omrx_get_attr_float32_array() instead of allocating copies */
+    OMRX_OPEN_MMAP       = 0x0001,
+    /** Ignore any table of contents in the file and always scan the whole
+      * file to build the chunk index */
+    OMRX_OPEN_NO_TOC     = 0x0002,
+    /** Only read the toplevel chunks when opening, and read the children of
+      * each chunk from the file the first time they are accessed.  (This
+      * implies ::OMRX_OPEN_NO_TOC) */
+    OMRX_OPEN_LAZY       = 0x0004,
+    /** Allow multiple threads to read from the instance at the same time (see
+      * omrx_open_ex() for details).  (This overrides ::OMRX_OPEN_LAZY) */
+    OMRX_OPEN_CONCURRENT = 0x0008,
+    /** Check attribute data against its checksum (if the file has them, see
+      * ::OMRX_WRITE_CHECKSUMS) whenever it is read from the file, and fail
+      * with ::OMRX_ERR_CHECKSUM if it does not match */
+    OMRX_OPEN_VERIFY     = 0x0010,
+} omrx_open_flags_t;
+
+/** @brief Flags which can be passed to omrx_write_ex()
+  *
+  * @ingroup api
+  */
+typedef enum {
+    /** Default behavior (same as omrx_write()) */
+    OMRX_WRITE_DEFAULT = 0x0000,
+    /** Write a table of contents at the end of the file so it can be opened
+      * without scanning every chunk header */
+    OMRX_WRITE_TOC     = 0x0001,
+    /** Store a CRC-32C checksum of each attribute's data, so corruption can
+      * be detected when it is read back (see ::OMRX_OPEN_VERIFY) */
+    OMRX_WRITE_CHECKSUMS = 0x0002,
+    /** Bypass the operating system's page cache when writing the file, where
+      * supported (see omrx_write_ex() for details) */
+    OMRX_WRITE_DIRECT  = 0x0004,
+} omrx_write_flags_t;
+
+/** @brief Access pattern hints which can be passed to omrx_advise() and
+  * omrx_advise_chunk()
+  *
+  * @ingroup api
+  */
+typedef enum {
+    /** No particular access pattern (the default) */
+    OMRX_ADVICE_NORMAL     = 0,
+    /** Data will be read more or less in file order, so read ahead
+      * aggressively */
+    OMRX_ADVICE_SEQUENTIAL = 1,
+    /** Data will be read in no particular order, so don't read ahead */
+    OMRX_ADVICE_RANDOM     = 2,
+    /** Data will be needed soon, so start reading it in now */
+    OMRX_ADVICE_WILLNEED   = 3,
+    /** Data will not be needed again (once read), so don't keep it in the
+      * page cache */
+    OMRX_ADVICE_DONTNEED   = 4,
+} omrx_advice_t;
+
+/** @brief Values which a callback passed to omrx_walk() can return
+  *
+  * @ingroup chunkapi
+  */
+typedef enum {
+    /** Carry on walking the tree */
+    OMRX_WALK_CONTINUE = 0,
+    /** Don't go into the children of this chunk (only meaningful when
+      * returned from a `pre` callback) */
+    OMRX_WALK_SKIP     = 1,
+    /** Stop the walk here */
+    OMRX_WALK_STOP     = 2,
+} omrx_walk_action_t;
+
 /** @brief Opaque handle to an OMRX instance.
   *
   * Each OMRX instance represents a separate OMRX file.
@@ -35,6 +128,32 @@ typedef struct omrx *omrx_t;
   */
 typedef struct omrx_chunk *omrx_chunk_t;
 
+/** @brief Handle to a shared, reference-counted attribute data buffer.
+  *
+  * Returned by omrx_get_attr_buffer().  The buffer contents never change, and
+  * the buffer is freed when the last reference to it is released with
+  * omrx_buffer_release().
+  *
+  * @ingroup api
+  */
+typedef struct omrx_buffer *omrx_buffer_t;
+
+/** @brief Handle to a batch of asynchronous attribute reads.
+  *
+  * Returned by omrx_fetch_submit(), and freed with omrx_fetch_free().
+  *
+  * @ingroup api
+  */
+typedef struct omrx_fetch *omrx_fetch_t;
+
+/** @brief Handle to a compiled chunk query.
+  *
+  * Returned by omrx_query_compile(), and freed with omrx_query_free().
+  *
+  * @ingroup api
+  */
+typedef struct omrx_query *omrx_query_t;
+
 #define OMRX_WARNING        0x1000
 
 /** @brief Status codes returned by (almost) all libomrx API functions
@@ -53,6 +172,8 @@ typedef enum {
     OMRX_STATUS_DUP       = 2,
     /** NULL was passed instead of a valid parent object */
     OMRX_STATUS_NO_OBJECT = 3,
+    /** The operation has not completed yet */
+    OMRX_STATUS_PENDING   = 4,
 
     /** The opened OMRX file was written to a version of the OMRX specification newer than what this library supports.  The version is backwards-compatible, so some portions of the file may still be readable as expected, but other portions or intended functionality may not be available when using this library version. (The version of the file can be obtained with omrx_get_version()) */
     OMRX_WARN_BAD_VER     = OMRX_WARNING + 0,
@@ -98,6 +219,27 @@ typedef enum {
     
     /** Internal error (this indicates a bug somewhere inside libomrx) */
     OMRX_ERR_INTERNAL     = -12,
+
+    /** A function was called at the wrong time (for example, calls to the streaming writer functions were made out of order) */
+    OMRX_ERR_BAD_STATE    = -13,
+
+    /** The data is too large to be stored in an OMRX file (for example, an attribute larger than 4GB) */
+    OMRX_ERR_TOO_LARGE    = -14,
+
+    /** The buffer supplied by the caller is too small to hold the requested data */
+    OMRX_ERR_TOO_SMALL    = -15,
+
+    /** Attribute data uses an encoding which is not supported by this build of libomrx, or could not be decoded (corrupted data) */
+    OMRX_ERR_BAD_ENCODING = -16,
+
+    /** Attribute data read from the file does not match its checksum (the file is corrupted) */
+    OMRX_ERR_CHECKSUM     = -17,
+
+    /** A query passed to omrx_query_compile() is not valid */
+    OMRX_ERR_BAD_QUERY    = -18,
+
+    /** The size of the data supplied does not fit its datatype (for example, array data which is not a whole number of rows) */
+    OMRX_ERR_BAD_SIZE     = -19,
 } omrx_status_t;
 
 
@@ -142,11 +284,48 @@ typedef enum {
 #define OMRX_IS_SIMPLE_DTYPE(dtype) (OMRX_GET_SUBTYPE(dtype) == OMRX_TYPEF_SIMPLE)
 #define OMRX_IS_OTHER_DTYPE(dtype) (OMRX_GET_SUBTYPE(dtype) == OMRX_TYPEF_OTHER)
 
+/** @brief Encodings which can be applied to attribute data in the file
+  *
+  * An encoded attribute's datatype in the file (its "encoded type") is its
+  * normal datatype (the "raw type") with the encoding in bits 8-11.  A codec
+  * can be combined with ::OMRX_ENCODING_SHUFFLE.  Encoded data is decoded
+  * transparently when it is read, so this only affects how it is stored (see
+  * omrx_set_attr_encoding()).
+  *
+  * @ingroup api
+  */
+typedef enum {
+    /** Data is stored as-is */
+    OMRX_ENCODING_NONE    = 0x0000,
+    /** Built-in LZ77-style compression (always available) */
+    OMRX_ENCODING_LZ      = 0x0100,
+    /** zlib (deflate) compression (if libomrx was built with zlib) */
+    OMRX_ENCODING_ZLIB    = 0x0200,
+    /** Zstandard compression (if libomrx was built with libzstd) */
+    OMRX_ENCODING_ZSTD    = 0x0300,
+    /** The best compression codec available in this build (only valid when
+      * setting an encoding; it is replaced with the actual codec) */
+    OMRX_ENCODING_AUTO    = 0x0700,
+    /** Byte-shuffle the elements of array data before compressing it, which
+      * often makes numeric data much more compressible */
+    OMRX_ENCODING_SHUFFLE = 0x0800,
+} omrx_encoding_t;
+
+#define OMRX_ENCODING_MASK 0x0f00
+#define OMRX_CODEC_MASK    0x0700
+
+#define OMRX_GET_ENCODING(dtype) ((dtype) & OMRX_ENCODING_MASK)
+#define OMRX_GET_RAW_TYPE(dtype) ((dtype) & ~OMRX_ENCODING_MASK & 0xffff)
+
 #define OMRX_ATTR_VER  0x0000
 #define OMRX_ATTR_ID   0x0001
 #define OMRX_ATTR_DATA 0xffff
+/** Reserved for the checksums of a chunk's other attributes (see
+  * ::OMRX_WRITE_CHECKSUMS).  This is handled internally and never appears as
+  * an attribute of a chunk read from a file. */
+#define OMRX_ATTR_CHECKSUMS 0xfffe
 
-#define OMRX_VERSION 0x00000001
+#define OMRX_VERSION 0x00000002
 #define OMRX_MIN_VERSION 0x00000001
 
 #define OMRX_VER_MAJOR(x) ((x) >> 16)
@@ -164,6 +343,8 @@ typedef enum {
 typedef void (*omrx_log_func_t)(omrx_t omrx, omrx_status_t errcode, const char *msg);
 typedef void *(*omrx_alloc_func_t)(omrx_t omrx, size_t size);
 typedef void (*omrx_free_func_t)(omrx_t omrx, void *ptr);
+typedef void (*omrx_fetch_func_t)(omrx_fetch_t fetch, void *user_data);
+typedef omrx_walk_action_t (*omrx_walk_func_t)(omrx_chunk_t chunk, unsigned int depth, void *user_data);
 
 struct omrx_attr_info {
     bool exists;
@@ -177,6 +358,24 @@ struct omrx_attr_info {
     uint32_t rows;
 };
 
+struct omrx_cache_stats {
+    size_t limit;
+    size_t size;
+    size_t entries;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+};
+
+struct omrx_fetch_request {
+    omrx_chunk_t chunk;     // in: the chunk containing the attribute
+    uint16_t id;            // in: the attribute ID
+    void *buf;              // in: where to put the attribute's data
+    size_t buf_size;        // in: the size of buf, in bytes
+    size_t size;            // out: the size of the attribute's data
+    omrx_status_t status;   // out: the result of reading this attribute
+};
+
 void omrx_default_log_warning(omrx_t omrx, omrx_status_t errcode, const char *msg);
 void omrx_default_log_error(omrx_t omrx, omrx_status_t errcode, const char *msg);
 
@@ -186,8 +385,16 @@ omrx_status_t omrx_free(omrx_t omrx);
 void *omrx_user_data(omrx_t omrx);
 omrx_status_t omrx_status(omrx_t omrx, bool reset);
 omrx_status_t omrx_last_result(omrx_t omrx);
+const char *omrx_last_message(omrx_t omrx);
+omrx_status_t omrx_set_cache_limit(omrx_t omrx, size_t limit);
+omrx_status_t omrx_get_cache_stats(omrx_t omrx, struct omrx_cache_stats *stats);
+omrx_status_t omrx_set_threads(omrx_t omrx, unsigned int count);
+omrx_status_t omrx_set_block_size(omrx_t omrx, uint32_t size);
+omrx_status_t omrx_advise(omrx_t omrx, omrx_advice_t advice);
+omrx_status_t omrx_advise_chunk(omrx_chunk_t chunk, omrx_advice_t advice);
 omrx_status_t omrx_get_version(omrx_t omrx, uint32_t *result);
 omrx_status_t omrx_open(omrx_t omrx, const char *filename, FILE *fp);
+omrx_status_t omrx_open_ex(omrx_t omrx, const char *filename, FILE *fp, unsigned int flags);
 omrx_status_t omrx_close(omrx_t omrx);
 omrx_status_t omrx_get_root_chunk(omrx_t omrx, omrx_chunk_t *result);
 omrx_status_t omrx_get_child(omrx_chunk_t chunk, const char *tag, omrx_chunk_t *result);
@@ -195,19 +402,104 @@ omrx_status_t omrx_get_next_chunk(omrx_chunk_t chunk, const char *tag, omrx_chun
 omrx_status_t omrx_get_chunk_by_id(omrx_t omrx, const char *id, const char *tag, omrx_chunk_t *result);
 omrx_status_t omrx_get_child_by_id(omrx_chunk_t chunk, const char *tag, const char *id, omrx_chunk_t *result);
 omrx_status_t omrx_get_parent(omrx_chunk_t chunk, omrx_chunk_t *result);
+omrx_status_t omrx_get_next_descendant(omrx_chunk_t top, omrx_chunk_t chunk, const char *tag, omrx_chunk_t *result);
+omrx_status_t omrx_walk(omrx_chunk_t chunk, const char *tag, omrx_walk_func_t pre, omrx_walk_func_t post, void *user_data);
+omrx_status_t omrx_query_compile(omrx_t omrx, const char *path, omrx_query_t *result);
+omrx_status_t omrx_query_run(omrx_query_t query, omrx_chunk_t chunk, omrx_chunk_t **chunks, size_t *count);
+void omrx_query_free(omrx_query_t query);
 omrx_status_t omrx_add_chunk(omrx_chunk_t chunk, const char *tag, omrx_chunk_t *result);
 omrx_status_t omrx_del_chunk(omrx_chunk_t chunk);
 omrx_status_t omrx_get_attr_info(omrx_chunk_t chunk, uint16_t id, struct omrx_attr_info *info);
+omrx_status_t omrx_set_attr_encoding(omrx_chunk_t chunk, uint16_t id, uint16_t encoding);
 omrx_status_t omrx_get_attr_raw(omrx_chunk_t chunk, uint16_t id, size_t *size, void **data);
 omrx_status_t omrx_set_attr_str(omrx_chunk_t chunk, uint16_t id, omrx_ownership_t own, char *str);
 omrx_status_t omrx_get_attr_str(omrx_chunk_t chunk, uint16_t id, char **dest);
+omrx_status_t omrx_set_attr_uint8(omrx_chunk_t chunk, uint16_t id, uint8_t value);
+omrx_status_t omrx_get_attr_uint8(omrx_chunk_t chunk, uint16_t id, uint8_t *dest);
+omrx_status_t omrx_set_attr_int8(omrx_chunk_t chunk, uint16_t id, int8_t value);
+omrx_status_t omrx_get_attr_int8(omrx_chunk_t chunk, uint16_t id, int8_t *dest);
+omrx_status_t omrx_set_attr_uint16(omrx_chunk_t chunk, uint16_t id, uint16_t value);
+omrx_status_t omrx_get_attr_uint16(omrx_chunk_t chunk, uint16_t id, uint16_t *dest);
+omrx_status_t omrx_set_attr_int16(omrx_chunk_t chunk, uint16_t id, int16_t value);
+omrx_status_t omrx_get_attr_int16(omrx_chunk_t chunk, uint16_t id, int16_t *dest);
 omrx_status_t omrx_set_attr_uint32(omrx_chunk_t chunk, uint16_t id, uint32_t value);
 omrx_status_t omrx_get_attr_uint32(omrx_chunk_t chunk, uint16_t id, uint32_t *dest);
+omrx_status_t omrx_set_attr_int32(omrx_chunk_t chunk, uint16_t id, int32_t value);
+omrx_status_t omrx_get_attr_int32(omrx_chunk_t chunk, uint16_t id, int32_t *dest);
+omrx_status_t omrx_set_attr_float32(omrx_chunk_t chunk, uint16_t id, float value);
+omrx_status_t omrx_get_attr_float32(omrx_chunk_t chunk, uint16_t id, float *dest);
+omrx_status_t omrx_set_attr_uint64(omrx_chunk_t chunk, uint16_t id, uint64_t value);
+omrx_status_t omrx_get_attr_uint64(omrx_chunk_t chunk, uint16_t id, uint64_t *dest);
+omrx_status_t omrx_set_attr_int64(omrx_chunk_t chunk, uint16_t id, int64_t value);
+omrx_status_t omrx_get_attr_int64(omrx_chunk_t chunk, uint16_t id, int64_t *dest);
+omrx_status_t omrx_set_attr_float64(omrx_chunk_t chunk, uint16_t id, double value);
+omrx_status_t omrx_get_attr_float64(omrx_chunk_t chunk, uint16_t id, double *dest);
+omrx_status_t omrx_set_attr_uint8_array(omrx_chunk_t chunk, uint16_t id, omrx_ownership_t own, uint16_t cols, uint32_t rows, uint8_t *data);
+omrx_status_t omrx_get_attr_uint8_array(omrx_chunk_t chunk, uint16_t id, uint16_t *cols, uint32_t *rows, uint8_t **data);
+omrx_status_t omrx_get_attr_uint8_array_into(omrx_chunk_t chunk, uint16_t id, uint8_t *buf, size_t buf_size, uint16_t *cols, uint32_t *rows);
+omrx_status_t omrx_set_attr_int8_array(omrx_chunk_t chunk, uint16_t id, omrx_ownership_t own, uint16_t cols, uint32_t rows, int8_t *data);
+omrx_status_t omrx_get_attr_int8_array(omrx_chunk_t chunk, uint16_t id, uint16_t *cols, uint32_t *rows, int8_t **data);
+omrx_status_t omrx_get_attr_int8_array_into(omrx_chunk_t chunk, uint16_t id, int8_t *buf, size_t buf_size, uint16_t *cols, uint32_t *rows);
+omrx_status_t omrx_set_attr_uint16_array(omrx_chunk_t chunk, uint16_t id, omrx_ownership_t own, uint16_t cols, uint32_t rows, uint16_t *data);
+omrx_status_t omrx_get_attr_uint16_array(omrx_chunk_t chunk, uint16_t id, uint16_t *cols, uint32_t *rows, uint16_t **data);
+omrx_status_t omrx_get_attr_uint16_array_into(omrx_chunk_t chunk, uint16_t id, uint16_t *buf, size_t buf_size, uint16_t *cols, uint32_t *rows);
+omrx_status_t omrx_set_attr_int16_array(omrx_chunk_t chunk, uint16_t id, omrx_ownership_t own, uint16_t cols, uint32_t rows, int16_t *data);
+omrx_status_t omrx_get_attr_int16_array(omrx_chunk_t chunk, uint16_t id, uint16_t *cols, uint32_t *rows, int16_t **data);
+omrx_status_t omrx_get_attr_int16_array_into(omrx_chunk_t chunk, uint16_t id, int16_t *buf, size_t buf_size, uint16_t *cols, uint32_t *rows);
+omrx_status_t omrx_set_attr_uint32_array(omrx_chunk_t chunk, uint16_t id, omrx_ownership_t own, uint16_t cols, uint32_t rows, uint32_t *data);
+omrx_status_t omrx_get_attr_uint32_array(omrx_chunk_t chunk, uint16_t id, uint16_t *cols, uint32_t *rows, uint32_t **data);
+omrx_status_t omrx_get_attr_uint32_array_into(omrx_chunk_t chunk, uint16_t id, uint32_t *buf, size_t buf_size, uint16_t *cols, uint32_t *rows);
+omrx_status_t omrx_set_attr_int32_array(omrx_chunk_t chunk, uint16_t id, omrx_ownership_t own, uint16_t cols, uint32_t rows, int32_t *data);
+omrx_status_t omrx_get_attr_int32_array(omrx_chunk_t chunk, uint16_t id, uint16_t *cols, uint32_t *rows, int32_t **data);
+omrx_status_t omrx_get_attr_int32_array_into(omrx_chunk_t chunk, uint16_t id, int32_t *buf, size_t buf_size, uint16_t *cols, uint32_t *rows);
 omrx_status_t omrx_set_attr_float32_array(omrx_chunk_t chunk, uint16_t id, omrx_ownership_t own, uint16_t cols, uint32_t rows, float *data);
 omrx_status_t omrx_get_attr_float32_array(omrx_chunk_t chunk, uint16_t id, uint16_t *cols, uint32_t *rows, float **data);
+omrx_status_t omrx_get_attr_float32_array_into(omrx_chunk_t chunk, uint16_t id, float *buf, size_t buf_size, uint16_t *cols, uint32_t *rows);
+omrx_status_t omrx_set_attr_uint64_array(omrx_chunk_t chunk, uint16_t id, omrx_ownership_t own, uint16_t cols, uint32_t rows, uint64_t *data);
+omrx_status_t omrx_get_attr_uint64_array(omrx_chunk_t chunk, uint16_t id, uint16_t *cols, uint32_t *rows, uint64_t **data);
+omrx_status_t omrx_get_attr_uint64_array_into(omrx_chunk_t chunk, uint16_t id, uint64_t *buf, size_t buf_size, uint16_t *cols, uint32_t *rows);
+omrx_status_t omrx_set_attr_int64_array(omrx_chunk_t chunk, uint16_t id, omrx_ownership_t own, uint16_t cols, uint32_t rows, int64_t *data);
+omrx_status_t omrx_get_attr_int64_array(omrx_chunk_t chunk, uint16_t id, uint16_t *cols, uint32_t *rows, int64_t **data);
+omrx_status_t omrx_get_attr_int64_array_into(omrx_chunk_t chunk, uint16_t id, int64_t *buf, size_t buf_size, uint16_t *cols, uint32_t *rows);
+omrx_status_t omrx_set_attr_float64_array(omrx_chunk_t chunk, uint16_t id, omrx_ownership_t own, uint16_t cols, uint32_t rows, double *data);
+omrx_status_t omrx_get_attr_float64_array(omrx_chunk_t chunk, uint16_t id, uint16_t *cols, uint32_t *rows, double **data);
+omrx_status_t omrx_get_attr_float64_array_into(omrx_chunk_t chunk, uint16_t id, double *buf, size_t buf_size, uint16_t *cols, uint32_t *rows);
+omrx_status_t omrx_get_attr_array_as_float32(omrx_chunk_t chunk, uint16_t id, uint16_t *cols, uint32_t *rows, float **data);
+omrx_status_t omrx_get_attr_array_as_float64(omrx_chunk_t chunk, uint16_t id, uint16_t *cols, uint32_t *rows, double **data);
+omrx_status_t omrx_get_attr_array_as_float32_into(omrx_chunk_t chunk, uint16_t id, float *buf, size_t buf_size, uint16_t *cols, uint32_t *rows);
+omrx_status_t omrx_get_attr_array_as_float64_into(omrx_chunk_t chunk, uint16_t id, double *buf, size_t buf_size, uint16_t *cols, uint32_t *rows);
+omrx_status_t omrx_get_attr_array_rows(omrx_chunk_t chunk, uint16_t id, uint32_t start_row, uint32_t row_count, uint16_t *cols, uint32_t *rows, void **data);
+omrx_status_t omrx_get_attr_float32_array_rows(omrx_chunk_t chunk, uint16_t id, uint32_t start_row, uint32_t row_count, uint16_t *cols, uint32_t *rows, float **data);
+omrx_status_t omrx_get_attr_raw_into(omrx_chunk_t chunk, uint16_t id, void *buf, size_t buf_size, size_t *size);
+omrx_status_t omrx_get_attr_str_into(omrx_chunk_t chunk, uint16_t id, char *buf, size_t buf_size);
+omrx_status_t omrx_get_attr_array_rows_into(omrx_chunk_t chunk, uint16_t id, uint32_t start_row, uint32_t row_count, void *buf, size_t buf_size, uint16_t *cols, uint32_t *rows);
+omrx_status_t omrx_get_attr_float32_array_rows_into(omrx_chunk_t chunk, uint16_t id, uint32_t start_row, uint32_t row_count, float *buf, size_t buf_size, uint16_t *cols, uint32_t *rows);
 omrx_status_t omrx_release_attr_data(omrx_chunk_t chunk, uint16_t id);
+omrx_status_t omrx_get_attr_buffer(omrx_chunk_t chunk, uint16_t id, omrx_buffer_t *result);
+const void *omrx_buffer_data(omrx_buffer_t buf);
+size_t omrx_buffer_size(omrx_buffer_t buf);
+omrx_buffer_t omrx_buffer_retain(omrx_buffer_t buf);
+void omrx_buffer_release(omrx_buffer_t buf);
 omrx_status_t omrx_del_attr(omrx_chunk_t chunk, uint16_t id);
 omrx_status_t omrx_write(omrx_t omrx, const char *filename);
+omrx_status_t omrx_write_ex(omrx_t omrx, const char *filename, unsigned int flags);
+omrx_status_t omrx_stream_open(omrx_t omrx, const char *filename);
+omrx_status_t omrx_stream_append(omrx_t omrx, const char *filename);
+omrx_status_t omrx_stream_close(omrx_t omrx);
+omrx_status_t omrx_stream_begin_chunk(omrx_t omrx, const char *tag);
+omrx_status_t omrx_stream_end_chunk(omrx_t omrx);
+omrx_status_t omrx_stream_write_chunk(omrx_t omrx, omrx_chunk_t chunk);
+omrx_status_t omrx_stream_write_attr(omrx_t omrx, uint16_t id, uint16_t datatype, uint16_t cols, uint32_t size, const void *data);
+omrx_status_t omrx_stream_write_attr_str(omrx_t omrx, uint16_t id, const char *str);
+omrx_status_t omrx_stream_write_attr_uint32(omrx_t omrx, uint16_t id, uint32_t value);
+omrx_status_t omrx_stream_write_attr_float32_array(omrx_t omrx, uint16_t id, uint16_t cols, uint32_t rows, const float *data);
+omrx_status_t omrx_stream_begin_array(omrx_t omrx, uint16_t id, uint16_t datatype, uint16_t cols);
+omrx_status_t omrx_stream_append_rows(omrx_t omrx, uint32_t rows, const void *data);
+omrx_status_t omrx_stream_end_array(omrx_t omrx);
+omrx_status_t omrx_fetch_submit(omrx_t omrx, struct omrx_fetch_request *requests, size_t count, omrx_fetch_func_t callback, void *user_data, omrx_fetch_t *result);
+omrx_status_t omrx_fetch_poll(omrx_fetch_t fetch);
+omrx_status_t omrx_fetch_wait(omrx_fetch_t fetch);
+void omrx_fetch_free(omrx_fetch_t fetch);
 
 #define omrx_init() omrx_initialize(OMRX_API_VER, omrx_default_log_warning, omrx_default_log_error, NULL, NULL)
 
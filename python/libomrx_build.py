@@ -20,19 +20,29 @@ ffi.set_source("_libomrx_cffi", """
 """, libraries=['omrx'], library_dirs=['../lib'], include_dirs=['../include'])
 
 ffi.cdef("""
-    typedef enum { OMRX_TAKE, OMRX_COPY, ...} omrx_ownership_t;
+    typedef enum { OMRX_TAKE, OMRX_COPY, OMRX_REF, ...} omrx_ownership_t;
+    typedef enum { OMRX_OPEN_DEFAULT, OMRX_OPEN_MMAP, OMRX_OPEN_NO_TOC, OMRX_OPEN_LAZY, OMRX_OPEN_CONCURRENT, OMRX_OPEN_VERIFY, ...} omrx_open_flags_t;
+    typedef enum { OMRX_WRITE_DEFAULT, OMRX_WRITE_TOC, OMRX_WRITE_CHECKSUMS, OMRX_WRITE_DIRECT, ...} omrx_write_flags_t;
+    typedef enum { OMRX_ADVICE_NORMAL, OMRX_ADVICE_SEQUENTIAL, OMRX_ADVICE_RANDOM, OMRX_ADVICE_WILLNEED, OMRX_ADVICE_DONTNEED, ...} omrx_advice_t;
+    typedef enum { OMRX_WALK_CONTINUE, OMRX_WALK_SKIP, OMRX_WALK_STOP, ...} omrx_walk_action_t;
     typedef struct omrx *omrx_t;
     typedef struct omrx_chunk *omrx_chunk_t;
+    typedef struct omrx_buffer *omrx_buffer_t;
+    typedef struct omrx_fetch *omrx_fetch_t;
+    typedef struct omrx_query *omrx_query_t;
 
     #define OMRX_WARNING ...
 
-    typedef enum { OMRX_OK, OMRX_STATUS_OK, OMRX_STATUS_NOT_FOUND, OMRX_STATUS_DUP, OMRX_STATUS_NO_OBJECT, OMRX_WARN_BAD_VER, OMRX_WARN_BAD_ATTR, OMRX_WARN_OSERR, OMRX_ERR_BADAPI, OMRX_ERR_INIT_FIRST, OMRX_ERR_OSERR, OMRX_ERR_ALLOC, OMRX_ERR_EOF, OMRX_ERR_NOT_OPEN, OMRX_ERR_ALREADY_OPEN, OMRX_ERR_BAD_MAGIC, OMRX_ERR_BAD_VER, OMRX_ERR_BAD_CHUNK, OMRX_ERR_WRONG_DTYPE, OMRX_ERR_INTERNAL, ...} omrx_status_t;
+    typedef enum { OMRX_OK, OMRX_STATUS_OK, OMRX_STATUS_NOT_FOUND, OMRX_STATUS_DUP, OMRX_STATUS_NO_OBJECT, OMRX_STATUS_PENDING, OMRX_WARN_BAD_VER, OMRX_WARN_BAD_ATTR, OMRX_WARN_OSERR, OMRX_ERR_BADAPI, OMRX_ERR_INIT_FIRST, OMRX_ERR_OSERR, OMRX_ERR_ALLOC, OMRX_ERR_EOF, OMRX_ERR_NOT_OPEN, OMRX_ERR_ALREADY_OPEN, OMRX_ERR_BAD_MAGIC, OMRX_ERR_BAD_VER, OMRX_ERR_BAD_CHUNK, OMRX_ERR_WRONG_DTYPE, OMRX_ERR_INTERNAL, OMRX_ERR_BAD_STATE, OMRX_ERR_TOO_LARGE, OMRX_ERR_TOO_SMALL, OMRX_ERR_BAD_ENCODING, OMRX_ERR_CHECKSUM, OMRX_ERR_BAD_QUERY, OMRX_ERR_BAD_SIZE, ...} omrx_status_t;
 
     typedef enum { OMRX_DTYPE_U8, OMRX_DTYPE_S8, OMRX_DTYPE_U16, OMRX_DTYPE_S16, OMRX_DTYPE_U32, OMRX_DTYPE_S32, OMRX_DTYPE_F32, OMRX_DTYPE_U64, OMRX_DTYPE_S64, OMRX_DTYPE_F64, OMRX_DTYPE_U8_ARRAY, OMRX_DTYPE_S8_ARRAY, OMRX_DTYPE_U16_ARRAY, OMRX_DTYPE_S16_ARRAY, OMRX_DTYPE_U32_ARRAY, OMRX_DTYPE_S32_ARRAY, OMRX_DTYPE_F32_ARRAY, OMRX_DTYPE_U64_ARRAY, OMRX_DTYPE_S64_ARRAY, OMRX_DTYPE_F64_ARRAY, OMRX_DTYPE_UTF8, OMRX_DTYPE_RAW, ...} omrx_dtype_t;
 
+    typedef enum { OMRX_ENCODING_NONE, OMRX_ENCODING_LZ, OMRX_ENCODING_ZLIB, OMRX_ENCODING_ZSTD, OMRX_ENCODING_AUTO, OMRX_ENCODING_SHUFFLE, ...} omrx_encoding_t;
+
     #define OMRX_ATTR_VER  ...
     #define OMRX_ATTR_ID   ...
     #define OMRX_ATTR_DATA ...
+    #define OMRX_ATTR_CHECKSUMS ...
 
     #define OMRX_VERSION     ...
     #define OMRX_MIN_VERSION ...
@@ -51,6 +61,27 @@ ffi.cdef("""
         uint32_t rows;
     };
 
+    struct omrx_cache_stats {
+        size_t limit;
+        size_t size;
+        size_t entries;
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+    };
+
+    typedef void (*omrx_fetch_func_t)(omrx_fetch_t fetch, void *user_data);
+    typedef omrx_walk_action_t (*omrx_walk_func_t)(omrx_chunk_t chunk, unsigned int depth, void *user_data);
+
+    struct omrx_fetch_request {
+        omrx_chunk_t chunk;
+        uint16_t id;
+        void *buf;
+        size_t buf_size;
+        size_t size;
+        omrx_status_t status;
+    };
+
     // Callback functions into Python
     extern "Python" void _log_warning(omrx_t omrx, omrx_status_t errcode, const char *msg);
     extern "Python" void _log_error(omrx_t omrx, omrx_status_t errcode, const char *msg);
@@ -60,8 +91,16 @@ ffi.cdef("""
     void *omrx_user_data(omrx_t omrx);
     omrx_status_t omrx_status(omrx_t omrx, bool reset);
     omrx_status_t omrx_last_result(omrx_t omrx);
+    const char *omrx_last_message(omrx_t omrx);
+    omrx_status_t omrx_set_cache_limit(omrx_t omrx, size_t limit);
+    omrx_status_t omrx_get_cache_stats(omrx_t omrx, struct omrx_cache_stats *stats);
+    omrx_status_t omrx_set_threads(omrx_t omrx, unsigned int count);
+    omrx_status_t omrx_set_block_size(omrx_t omrx, uint32_t size);
+    omrx_status_t omrx_advise(omrx_t omrx, omrx_advice_t advice);
+    omrx_status_t omrx_advise_chunk(omrx_chunk_t chunk, omrx_advice_t advice);
     omrx_status_t omrx_get_version(omrx_t omrx, uint32_t *result);
     omrx_status_t omrx_open(omrx_t omrx, const char *filename, FILE *fp);
+    omrx_status_t omrx_open_ex(omrx_t omrx, const char *filename, FILE *fp, unsigned int flags);
     omrx_status_t omrx_close(omrx_t omrx);
     omrx_status_t omrx_get_root_chunk(omrx_t omrx, omrx_chunk_t *result);
     omrx_status_t omrx_get_child(omrx_chunk_t chunk, const char *tag, omrx_chunk_t *result);
@@ -69,19 +108,104 @@ ffi.cdef("""
     omrx_status_t omrx_get_chunk_by_id(omrx_t omrx, const char *id, const char *tag, omrx_chunk_t *result);
     omrx_status_t omrx_get_child_by_id(omrx_chunk_t chunk, const char *tag, const char *id, omrx_chunk_t *result);
     omrx_status_t omrx_get_parent(omrx_chunk_t chunk, omrx_chunk_t *result);
+    omrx_status_t omrx_get_next_descendant(omrx_chunk_t top, omrx_chunk_t chunk, const char *tag, omrx_chunk_t *result);
+    omrx_status_t omrx_walk(omrx_chunk_t chunk, const char *tag, omrx_walk_func_t pre, omrx_walk_func_t post, void *user_data);
+    omrx_status_t omrx_query_compile(omrx_t omrx, const char *path, omrx_query_t *result);
+    omrx_status_t omrx_query_run(omrx_query_t query, omrx_chunk_t chunk, omrx_chunk_t **chunks, size_t *count);
+    void omrx_query_free(omrx_query_t query);
     omrx_status_t omrx_add_chunk(omrx_chunk_t chunk, const char *tag, omrx_chunk_t *result);
     omrx_status_t omrx_del_chunk(omrx_chunk_t chunk);
     omrx_status_t omrx_get_attr_info(omrx_chunk_t chunk, uint16_t id, struct omrx_attr_info *info);
+    omrx_status_t omrx_set_attr_encoding(omrx_chunk_t chunk, uint16_t id, uint16_t encoding);
     omrx_status_t omrx_get_attr_raw(omrx_chunk_t chunk, uint16_t id, size_t *size, void **data);
     omrx_status_t omrx_set_attr_str(omrx_chunk_t chunk, uint16_t id, omrx_ownership_t own, char *str);
     omrx_status_t omrx_get_attr_str(omrx_chunk_t chunk, uint16_t id, char **dest);
+    omrx_status_t omrx_set_attr_uint8(omrx_chunk_t chunk, uint16_t id, uint8_t value);
+    omrx_status_t omrx_get_attr_uint8(omrx_chunk_t chunk, uint16_t id, uint8_t *dest);
+    omrx_status_t omrx_set_attr_int8(omrx_chunk_t chunk, uint16_t id, int8_t value);
+    omrx_status_t omrx_get_attr_int8(omrx_chunk_t chunk, uint16_t id, int8_t *dest);
+    omrx_status_t omrx_set_attr_uint16(omrx_chunk_t chunk, uint16_t id, uint16_t value);
+    omrx_status_t omrx_get_attr_uint16(omrx_chunk_t chunk, uint16_t id, uint16_t *dest);
+    omrx_status_t omrx_set_attr_int16(omrx_chunk_t chunk, uint16_t id, int16_t value);
+    omrx_status_t omrx_get_attr_int16(omrx_chunk_t chunk, uint16_t id, int16_t *dest);
     omrx_status_t omrx_set_attr_uint32(omrx_chunk_t chunk, uint16_t id, uint32_t value);
     omrx_status_t omrx_get_attr_uint32(omrx_chunk_t chunk, uint16_t id, uint32_t *dest);
+    omrx_status_t omrx_set_attr_int32(omrx_chunk_t chunk, uint16_t id, int32_t value);
+    omrx_status_t omrx_get_attr_int32(omrx_chunk_t chunk, uint16_t id, int32_t *dest);
+    omrx_status_t omrx_set_attr_float32(omrx_chunk_t chunk, uint16_t id, float value);
+    omrx_status_t omrx_get_attr_float32(omrx_chunk_t chunk, uint16_t id, float *dest);
+    omrx_status_t omrx_set_attr_uint64(omrx_chunk_t chunk, uint16_t id, uint64_t value);
+    omrx_status_t omrx_get_attr_uint64(omrx_chunk_t chunk, uint16_t id, uint64_t *dest);
+    omrx_status_t omrx_set_attr_int64(omrx_chunk_t chunk, uint16_t id, int64_t value);
+    omrx_status_t omrx_get_attr_int64(omrx_chunk_t chunk, uint16_t id, int64_t *dest);
+    omrx_status_t omrx_set_attr_float64(omrx_chunk_t chunk, uint16_t id, double value);
+    omrx_status_t omrx_get_attr_float64(omrx_chunk_t chunk, uint16_t id, double *dest);
+    omrx_status_t omrx_set_attr_uint8_array(omrx_chunk_t chunk, uint16_t id, omrx_ownership_t own, uint16_t cols, uint32_t rows, uint8_t *data);
+    omrx_status_t omrx_get_attr_uint8_array(omrx_chunk_t chunk, uint16_t id, uint16_t *cols, uint32_t *rows, uint8_t **data);
+    omrx_status_t omrx_get_attr_uint8_array_into(omrx_chunk_t chunk, uint16_t id, uint8_t *buf, size_t buf_size, uint16_t *cols, uint32_t *rows);
+    omrx_status_t omrx_set_attr_int8_array(omrx_chunk_t chunk, uint16_t id, omrx_ownership_t own, uint16_t cols, uint32_t rows, int8_t *data);
+    omrx_status_t omrx_get_attr_int8_array(omrx_chunk_t chunk, uint16_t id, uint16_t *cols, uint32_t *rows, int8_t **data);
+    omrx_status_t omrx_get_attr_int8_array_into(omrx_chunk_t chunk, uint16_t id, int8_t *buf, size_t buf_size, uint16_t *cols, uint32_t *rows);
+    omrx_status_t omrx_set_attr_uint16_array(omrx_chunk_t chunk, uint16_t id, omrx_ownership_t own, uint16_t cols, uint32_t rows, uint16_t *data);
+    omrx_status_t omrx_get_attr_uint16_array(omrx_chunk_t chunk, uint16_t id, uint16_t *cols, uint32_t *rows, uint16_t **data);
+    omrx_status_t omrx_get_attr_uint16_array_into(omrx_chunk_t chunk, uint16_t id, uint16_t *buf, size_t buf_size, uint16_t *cols, uint32_t *rows);
+    omrx_status_t omrx_set_attr_int16_array(omrx_chunk_t chunk, uint16_t id, omrx_ownership_t own, uint16_t cols, uint32_t rows, int16_t *data);
+    omrx_status_t omrx_get_attr_int16_array(omrx_chunk_t chunk, uint16_t id, uint16_t *cols, uint32_t *rows, int16_t **data);
+    omrx_status_t omrx_get_attr_int16_array_into(omrx_chunk_t chunk, uint16_t id, int16_t *buf, size_t buf_size, uint16_t *cols, uint32_t *rows);
+    omrx_status_t omrx_set_attr_uint32_array(omrx_chunk_t chunk, uint16_t id, omrx_ownership_t own, uint16_t cols, uint32_t rows, uint32_t *data);
+    omrx_status_t omrx_get_attr_uint32_array(omrx_chunk_t chunk, uint16_t id, uint16_t *cols, uint32_t *rows, uint32_t **data);
+    omrx_status_t omrx_get_attr_uint32_array_into(omrx_chunk_t chunk, uint16_t id, uint32_t *buf, size_t buf_size, uint16_t *cols, uint32_t *rows);
+    omrx_status_t omrx_set_attr_int32_array(omrx_chunk_t chunk, uint16_t id, omrx_ownership_t own, uint16_t cols, uint32_t rows, int32_t *data);
+    omrx_status_t omrx_get_attr_int32_array(omrx_chunk_t chunk, uint16_t id, uint16_t *cols, uint32_t *rows, int32_t **data);
+    omrx_status_t omrx_get_attr_int32_array_into(omrx_chunk_t chunk, uint16_t id, int32_t *buf, size_t buf_size, uint16_t *cols, uint32_t *rows);
     omrx_status_t omrx_set_attr_float32_array(omrx_chunk_t chunk, uint16_t id, omrx_ownership_t own, uint16_t cols, uint32_t rows, float *data);
     omrx_status_t omrx_get_attr_float32_array(omrx_chunk_t chunk, uint16_t id, uint16_t *cols, uint32_t *rows, float **data);
+    omrx_status_t omrx_get_attr_float32_array_into(omrx_chunk_t chunk, uint16_t id, float *buf, size_t buf_size, uint16_t *cols, uint32_t *rows);
+    omrx_status_t omrx_set_attr_uint64_array(omrx_chunk_t chunk, uint16_t id, omrx_ownership_t own, uint16_t cols, uint32_t rows, uint64_t *data);
+    omrx_status_t omrx_get_attr_uint64_array(omrx_chunk_t chunk, uint16_t id, uint16_t *cols, uint32_t *rows, uint64_t **data);
+    omrx_status_t omrx_get_attr_uint64_array_into(omrx_chunk_t chunk, uint16_t id, uint64_t *buf, size_t buf_size, uint16_t *cols, uint32_t *rows);
+    omrx_status_t omrx_set_attr_int64_array(omrx_chunk_t chunk, uint16_t id, omrx_ownership_t own, uint16_t cols, uint32_t rows, int64_t *data);
+    omrx_status_t omrx_get_attr_int64_array(omrx_chunk_t chunk, uint16_t id, uint16_t *cols, uint32_t *rows, int64_t **data);
+    omrx_status_t omrx_get_attr_int64_array_into(omrx_chunk_t chunk, uint16_t id, int64_t *buf, size_t buf_size, uint16_t *cols, uint32_t *rows);
+    omrx_status_t omrx_set_attr_float64_array(omrx_chunk_t chunk, uint16_t id, omrx_ownership_t own, uint16_t cols, uint32_t rows, double *data);
+    omrx_status_t omrx_get_attr_float64_array(omrx_chunk_t chunk, uint16_t id, uint16_t *cols, uint32_t *rows, double **data);
+    omrx_status_t omrx_get_attr_float64_array_into(omrx_chunk_t chunk, uint16_t id, double *buf, size_t buf_size, uint16_t *cols, uint32_t *rows);
+    omrx_status_t omrx_get_attr_array_as_float32(omrx_chunk_t chunk, uint16_t id, uint16_t *cols, uint32_t *rows, float **data);
+    omrx_status_t omrx_get_attr_array_as_float64(omrx_chunk_t chunk, uint16_t id, uint16_t *cols, uint32_t *rows, double **data);
+    omrx_status_t omrx_get_attr_array_as_float32_into(omrx_chunk_t chunk, uint16_t id, float *buf, size_t buf_size, uint16_t *cols, uint32_t *rows);
+    omrx_status_t omrx_get_attr_array_as_float64_into(omrx_chunk_t chunk, uint16_t id, double *buf, size_t buf_size, uint16_t *cols, uint32_t *rows);
+    omrx_status_t omrx_get_attr_array_rows(omrx_chunk_t chunk, uint16_t id, uint32_t start_row, uint32_t row_count, uint16_t *cols, uint32_t *rows, void **data);
+    omrx_status_t omrx_get_attr_float32_array_rows(omrx_chunk_t chunk, uint16_t id, uint32_t start_row, uint32_t row_count, uint16_t *cols, uint32_t *rows, float **data);
+    omrx_status_t omrx_get_attr_raw_into(omrx_chunk_t chunk, uint16_t id, void *buf, size_t buf_size, size_t *size);
+    omrx_status_t omrx_get_attr_str_into(omrx_chunk_t chunk, uint16_t id, char *buf, size_t buf_size);
+    omrx_status_t omrx_get_attr_array_rows_into(omrx_chunk_t chunk, uint16_t id, uint32_t start_row, uint32_t row_count, void *buf, size_t buf_size, uint16_t *cols, uint32_t *rows);
+    omrx_status_t omrx_get_attr_float32_array_rows_into(omrx_chunk_t chunk, uint16_t id, uint32_t start_row, uint32_t row_count, float *buf, size_t buf_size, uint16_t *cols, uint32_t *rows);
     omrx_status_t omrx_release_attr_data(omrx_chunk_t chunk, uint16_t id);
+    omrx_status_t omrx_get_attr_buffer(omrx_chunk_t chunk, uint16_t id, omrx_buffer_t *result);
+    const void *omrx_buffer_data(omrx_buffer_t buf);
+    size_t omrx_buffer_size(omrx_buffer_t buf);
+    omrx_buffer_t omrx_buffer_retain(omrx_buffer_t buf);
+    void omrx_buffer_release(omrx_buffer_t buf);
     omrx_status_t omrx_del_attr(omrx_chunk_t chunk, uint16_t id);
     omrx_status_t omrx_write(omrx_t omrx, const char *filename);
+    omrx_status_t omrx_write_ex(omrx_t omrx, const char *filename, unsigned int flags);
+    omrx_status_t omrx_stream_open(omrx_t omrx, const char *filename);
+    omrx_status_t omrx_stream_append(omrx_t omrx, const char *filename);
+    omrx_status_t omrx_stream_close(omrx_t omrx);
+    omrx_status_t omrx_stream_begin_chunk(omrx_t omrx, const char *tag);
+    omrx_status_t omrx_stream_end_chunk(omrx_t omrx);
+    omrx_status_t omrx_stream_write_chunk(omrx_t omrx, omrx_chunk_t chunk);
+    omrx_status_t omrx_stream_write_attr(omrx_t omrx, uint16_t id, uint16_t datatype, uint16_t cols, uint32_t size, const void *data);
+    omrx_status_t omrx_stream_write_attr_str(omrx_t omrx, uint16_t id, const char *str);
+    omrx_status_t omrx_stream_write_attr_uint32(omrx_t omrx, uint16_t id, uint32_t value);
+    omrx_status_t omrx_stream_write_attr_float32_array(omrx_t omrx, uint16_t id, uint16_t cols, uint32_t rows, const float *data);
+    omrx_status_t omrx_stream_begin_array(omrx_t omrx, uint16_t id, uint16_t datatype, uint16_t cols);
+    omrx_status_t omrx_stream_append_rows(omrx_t omrx, uint32_t rows, const void *data);
+    omrx_status_t omrx_stream_end_array(omrx_t omrx);
+    omrx_status_t omrx_fetch_submit(omrx_t omrx, struct omrx_fetch_request *requests, size_t count, omrx_fetch_func_t callback, void *user_data, omrx_fetch_t *result);
+    omrx_status_t omrx_fetch_poll(omrx_fetch_t fetch);
+    omrx_status_t omrx_fetch_wait(omrx_fetch_t fetch);
+    void omrx_fetch_free(omrx_fetch_t fetch);
 
     omrx_status_t omrx_init(void);
 """)
@@ -80,6 +80,27 @@ class WrongDtypeError (OmrxError):
 class InternalError (OmrxError):
     pass
 
+class BadStateError (OmrxError):
+    pass
+
+class TooLargeError (OmrxError):
+    pass
+
+class TooSmallError (OmrxError):
+    pass
+
+class BadEncodingError (OmrxError):
+    pass
+
+class ChecksumError (OmrxError):
+    pass
+
+class BadQueryError (OmrxError):
+    pass
+
+class BadSizeError (OmrxError):
+    pass
+
 
 _error_classes = {
     OMRX_ERR_OSERR: OmrxOSError,
@@ -92,6 +113,13 @@ _error_classes = {
     OMRX_ERR_BAD_CHUNK: BadChunkError,
     OMRX_ERR_WRONG_DTYPE: WrongDtypeError,
     OMRX_ERR_INTERNAL: InternalError,
+    OMRX_ERR_BAD_STATE: BadStateError,
+    OMRX_ERR_TOO_LARGE: TooLargeError,
+    OMRX_ERR_TOO_SMALL: TooSmallError,
+    OMRX_ERR_BAD_ENCODING: BadEncodingError,
+    OMRX_ERR_CHECKSUM: ChecksumError,
+    OMRX_ERR_BAD_QUERY: BadQueryError,
+    OMRX_ERR_BAD_SIZE: BadSizeError,
 }
 
 def omrx_exception(errcode, msg):
@@ -4,6 +4,12 @@
 #include <string.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 
 #include "omrx.h"
 #include "omrx_internal.h"
@@ -37,36 +43,345 @@ struct attr_header {
 };
 _Static_assert(sizeof(struct attr_header) == ATTRHDR_SIZE, "struct attr_header is the wrong size");
 
+#define TOC_TRAILER_SIZE 16
+
+struct toc_trailer {
+    uint64_t toc_pos;
+    uint32_t version;
+    char magic[4];
+};
+_Static_assert(sizeof(struct toc_trailer) == TOC_TRAILER_SIZE, "struct toc_trailer is the wrong size");
+
+// The layout of an attribute's encoded data (see read_block_dir()): how many
+// rows are in each block, and where each block's encoded data ends, relative
+// to the start of the first one (at data_pos within the encoded data).  Data
+// which isn't split into blocks is treated as a single block.
+struct block_dir {
+    uint32_t block_rows;
+    uint32_t count;
+    uint32_t *ends;
+    uint32_t single_end;
+    uint32_t data_pos;
+    uint64_t block_bytes;
+};
+
+// A set of blocks being decoded in parallel by decode_blocks().  src and dest
+// point to the encoded and decoded data of the first block (`first`), and tmp
+// (if shuffled) is scratch space the same size as dest.
+struct block_job {
+    omrx_attr_t attr;
+    const struct block_dir *dir;
+    uint16_t codec;
+    bool shuffle;
+    uint32_t width;
+    uint32_t first;
+    const uint8_t *src;
+    uint8_t *dest;
+    uint8_t *tmp;
+    bool failed;
+};
+
+// A set of blocks being encoded in parallel by encode_payload().  Each block
+// is compressed into its own `bound`-byte slot in work, and its encoded
+// length stored in lens.  swapped and shuffled (if needed) are scratch space
+// the same size as the source data.
+struct encode_job {
+    uint16_t dtype;
+    uint16_t cols;
+    uint16_t encoding;
+    uint16_t codec;
+    bool shuffle;
+    uint32_t width;
+    uint64_t size;
+    uint64_t block_bytes;
+    uint32_t block_rows;
+    uint32_t count;
+    uint32_t dir_len;
+    size_t bound;
+    const uint8_t *src;
+    uint8_t *swapped;
+    uint8_t *shuffled;
+    uint8_t *work;
+    uint32_t *lens;
+};
+
+// One block of an encoding job, for encoding the blocks of several attributes
+// together (see write_parallel()).
+struct encode_ref {
+    struct encode_job *job;
+    uint32_t block;
+};
+
+// A depth-first walk of a subtree (see walk_next()).  `chunk` is the chunk
+// the walk is currently at, and `leaving` says whether it has just been
+// entered (before its children) or is being left (after them).  The tree's
+// parent links are all that's needed to find the way back up, so this takes
+// constant space however deep the tree is.  When leaving a chunk, its next
+// sibling and parent are saved, so that the chunk can be freed before moving
+// on.
+struct tree_walk {
+    omrx_chunk_t top;
+    omrx_chunk_t chunk;
+    omrx_chunk_t next;
+    omrx_chunk_t parent;
+    unsigned int depth;
+    bool leaving;
+};
+
+// Where the parallel writer is up to in walking the tree (see
+// next_write_item()).
+enum {
+    WRITE_CHUNK_START,
+    WRITE_CHUNK_ATTRS,
+    WRITE_CHUNK_CHECKSUMS,
+    WRITE_CHUNK_CHILDREN,
+    WRITE_CHUNK_END,
+    WRITE_CHUNK_NEXT,
+    WRITE_DONE,
+};
+
+struct write_cursor {
+    struct tree_walk walk;
+    omrx_chunk_t chunk;
+    omrx_attr_t attr;
+    int state;
+    bool toc;
+};
+
+// One level of the stack used by run_query(): the chunk being looked at, the
+// query steps it may match (see match_query()), and whether it and its
+// siblings are being gone through using their parent's tag index.
+struct query_frame {
+    omrx_chunk_t chunk;
+    uint64_t want;
+    bool same_tag;
+};
+
+// The chunks matched by a query so far.
+struct query_results {
+    omrx_chunk_t *chunks;
+    size_t count;
+    size_t size;
+};
+
+// Something to be written by the parallel writer: a chunk header (chunk is
+// set), an attribute (attr is set), a chunk's checksums attribute (sums is
+// set), or a chunk end tag (none of them).  Each
+// consists of a header (hdr_len bytes), followed by `len` bytes of data.  If
+// width is more than 1, the data is in host order, and may need to be
+// byte-swapped as it is written.  The attribute's own data (as opposed to
+// headers and subheaders) starts data_offset bytes in.
+struct write_item {
+    omrx_chunk_t chunk;
+    omrx_attr_t attr;
+    omrx_chunk_t sums;
+    uint8_t hdr[ATTRHDR_SIZE + 6];
+    uint32_t hdr_len;
+    uint32_t data_offset;
+    const uint8_t *data;
+    size_t len;
+    uint32_t width;
+    void *own;
+    uint8_t *encoded;
+    struct encode_job job;
+    off_t pos;
+};
+
+// A run of consecutive items written together (see write_batch()).
+struct write_run {
+    struct write_item *items;
+    size_t count;
+    off_t pos;
+    size_t len;
+    bool staged;
+    uint8_t *stage;
+    int err;
+};
+
+struct write_batch {
+    struct write_run *runs;
+    int fd;
+};
+
+// The background operation for one request of an asynchronous fetch.  If the
+// attribute's data is read from the file by the operation itself, it goes
+// straight into the request's buffer, or (for encoded data) into `encoded`
+// for decoding from there.  If the data was already in memory when the fetch
+// was submitted, `data` points to it (and `shared` holds a reference to it,
+// if it's in a shared buffer), so that it can be copied even if the attribute
+// drops it in the meantime.
+struct fetch_op {
+    struct omrx_async_op async;
+    omrx_fetch_t fetch;
+    struct omrx_fetch_request *req;
+    omrx_attr_t attr;
+    bool read_file;
+    uint8_t *encoded;
+    const void *data;
+    omrx_buffer_t shared;
+};
+
 static void *omrx_default_alloc(omrx_t omrx, size_t size);
 static void omrx_default_free(omrx_t omrx, void *ptr);
 static char *omrx_strdup(omrx_t omrx, const char *s);
+static struct omrx_errstate *get_errstate(omrx_t omrx);
+static void create_errstate_key(void);
+static void free_thread_errstates(void *arg);
+static void free_errstates(omrx_t omrx);
 
 static omrx_status_t seek_to_pos(omrx_t omrx, off_t pos);
-static omrx_status_t skip_data(omrx_t omrx, off_t size);
 static omrx_status_t read_data(omrx_t omrx, off_t size, void *dest);
+static omrx_status_t read_data_at(omrx_t omrx, off_t pos, off_t size, void *dest);
+static omrx_status_t pread_data(omrx_t omrx, off_t pos, off_t size, void *dest);
+static omrx_status_t advise_range(omrx_t omrx, off_t pos, off_t size, omrx_advice_t advice);
+static void drop_behind(omrx_t omrx, off_t pos, off_t size);
+static omrx_status_t apply_file_advice(omrx_t omrx);
 static omrx_status_t write_data(omrx_t omrx, off_t size, const void *src, FILE *fp);
+static omrx_status_t patch_data(omrx_t omrx, off_t pos, off_t size, const void *src, FILE *fp);
+
+static void pool_init(omrx_pool_t pool, size_t node_size);
+static void *pool_alloc(omrx_t omrx, omrx_pool_t pool);
+static void pool_free(omrx_pool_t pool, void *node);
+static void pool_release(omrx_t omrx, omrx_pool_t pool);
+static void free_all_nodes(omrx_t omrx);
 
 static omrx_chunk_t new_chunk(omrx_t omrx, const char *tag);
 static omrx_status_t free_chunk(omrx_chunk_t chunk);
 static omrx_status_t free_all_chunks(omrx_chunk_t chunk);
+static omrx_chunk_t walk_start(struct tree_walk *walk, omrx_chunk_t top);
+static omrx_chunk_t walk_next(struct tree_walk *walk, bool descend);
+static omrx_chunk_t walk_next_entered(struct tree_walk *walk, bool descend);
 static omrx_attr_t new_attr(omrx_chunk_t chunk, uint16_t id, uint16_t datatype, uint32_t size, off_t file_pos);
 static omrx_status_t free_attr(omrx_attr_t attr);
 
 static omrx_status_t load_attr_data(omrx_attr_t attr, void **dest);
+static omrx_status_t read_attr_file(omrx_attr_t attr, uint64_t offset, size_t size, void *dest);
+static omrx_status_t load_encoded_data(omrx_attr_t attr, void **dest);
+static omrx_status_t decode_attr_range(omrx_attr_t attr, uint64_t offset, size_t size, void *dest);
+static omrx_status_t check_decodable(omrx_attr_t attr);
+static omrx_status_t verify_attr_crc(omrx_attr_t attr, const uint8_t *src);
+static omrx_status_t read_block_dir(omrx_attr_t attr, const uint8_t *src, struct block_dir *dir);
+static void free_block_dir(omrx_t omrx, struct block_dir *dir);
+static omrx_status_t read_encoded_bytes(omrx_attr_t attr, const uint8_t *src, uint32_t offset, uint32_t size, void *dest);
+static omrx_status_t decode_blocks(omrx_attr_t attr, const struct block_dir *dir, uint32_t first, uint32_t last, const uint8_t *src, uint8_t *dest);
+static void decode_block_task(void *arg, size_t index);
+static omrx_status_t decode_attr_data(omrx_attr_t attr, void *dest);
+static omrx_status_t decode_attr_buffer(omrx_attr_t attr, const uint8_t *src, void *dest);
+static omrx_status_t load_attr_range(omrx_attr_t attr, uint64_t offset, size_t size, void **dest);
+static omrx_status_t read_attr_into(omrx_attr_t attr, uint64_t offset, size_t size, void *dest);
+static omrx_status_t find_array_rows(omrx_chunk_t chunk, uint16_t id, uint16_t dtype, uint32_t start_row, uint32_t *row_count, omrx_attr_t *attr, uint64_t *offset, size_t *size);
+static omrx_status_t get_array_rows_into(omrx_chunk_t chunk, uint16_t id, uint16_t dtype, uint32_t start_row, uint32_t row_count, void *buf, size_t buf_size, uint16_t *cols, uint32_t *rows);
+static omrx_status_t peek_attr_data(omrx_attr_t attr, const void **src, void **tmp, omrx_buffer_t *shared);
+static omrx_status_t get_attr_array_converted(omrx_chunk_t chunk, uint16_t id, uint32_t dest_width, uint16_t *cols, uint32_t *rows, void *buf, size_t buf_size, void **data);
+static omrx_status_t borrow_attr_data(omrx_attr_t attr, void **dest);
+static omrx_status_t borrow_attr_data_locked(omrx_attr_t attr, void **dest);
+static void drop_attr_data(omrx_attr_t attr);
 static omrx_status_t release_attr_data(omrx_attr_t attr);
+static omrx_status_t cache_attr_data(omrx_attr_t attr);
+static void cache_insert(omrx_attr_t attr);
+static void cache_touch(omrx_attr_t attr);
+static void cache_unlink(omrx_attr_t attr);
+static void cache_evict(omrx_t omrx, size_t limit, omrx_attr_t keep);
+static omrx_status_t share_attr_data(omrx_attr_t attr, omrx_buffer_t *result);
+static omrx_buffer_t new_shared_buffer(omrx_t omrx, size_t size);
+static const void *snapshot_attr_data(omrx_attr_t attr, omrx_buffer_t *buf);
+static omrx_status_t load_shared_data(omrx_attr_t attr);
+static void put_instance(omrx_t omrx);
+static void attach_shared_buffer(omrx_attr_t attr, omrx_buffer_t buf);
 static omrx_status_t find_attr(omrx_chunk_t chunk, uint16_t id, omrx_attr_t *dest);
 static omrx_status_t chunk_add_attr(omrx_chunk_t chunk, omrx_attr_t attr);
 static omrx_status_t add_child_chunk(omrx_chunk_t parent, omrx_chunk_t child);
+static uint32_t hash_chunk_id(const char *idstr);
+static omrx_status_t resize_chunk_id_map(omrx_t omrx, size_t new_size);
 static omrx_status_t register_chunk_id(omrx_chunk_t chunk, char *idstr);
 static omrx_status_t deregister_chunk_id(omrx_chunk_t chunk);
 static omrx_status_t lookup_chunk_id(omrx_t omrx, const char *idstr, omrx_chunk_t *result);
+static struct tag_slot *find_tag_slot(struct omrx_tag_index *index, uint32_t tagint);
+static bool tag_index_add(omrx_t omrx, struct omrx_tag_index **indexp, omrx_chunk_t child);
+static void tag_index_remove(struct omrx_tag_index *index, omrx_chunk_t child, omrx_chunk_t prev);
+static struct omrx_tag_index *get_tag_index(omrx_chunk_t chunk);
+static uint64_t match_query(omrx_query_t query, omrx_chunk_t chunk, uint64_t want, bool *matched);
+static omrx_chunk_t first_query_child(omrx_query_t query, omrx_chunk_t chunk, uint64_t want, bool *same_tag);
+static omrx_status_t add_query_result(omrx_t omrx, struct query_results *results, omrx_chunk_t chunk);
+static omrx_status_t run_query(omrx_query_t query, omrx_chunk_t top, uint64_t want, struct query_results *results);
+static omrx_status_t map_file(omrx_t omrx);
+static void unmap_file(omrx_t omrx);
+static size_t scan_buffer_size(omrx_t omrx);
+static omrx_status_t scan_begin(omrx_t omrx);
+static void scan_end(omrx_t omrx);
+static omrx_status_t scan_fill(omrx_t omrx, size_t size);
+static omrx_status_t scan_read(omrx_t omrx, size_t size, void *dest);
+static void scan_skip(omrx_t omrx, off_t size);
 static omrx_status_t omrx_scan(omrx_t omrx);
+static omrx_status_t scan_all_chunks(omrx_t omrx);
+static omrx_status_t check_version(omrx_t omrx);
+static omrx_status_t check_version_number(omrx_t omrx, uint32_t ver);
 static omrx_status_t read_next_chunk(omrx_t omrx);
+static omrx_status_t read_child_chunks(omrx_chunk_t parent);
+static omrx_status_t skip_subtree(omrx_t omrx, uint32_t tagint);
+static omrx_status_t load_children(omrx_chunk_t chunk);
+static omrx_status_t load_all_children(omrx_t omrx);
+static omrx_status_t read_chunk_checksums(omrx_chunk_t chunk, uint32_t size);
 static omrx_status_t read_attr_subheader_array(omrx_attr_t attr);
+static omrx_status_t read_attr_subheader_encoded(omrx_attr_t attr);
 static omrx_status_t write_chunk(omrx_chunk_t chunk, FILE *fp);
+static omrx_status_t write_chunk_start(omrx_chunk_t chunk, FILE *fp);
+static omrx_status_t write_chunk_end(omrx_chunk_t chunk, FILE *fp);
+static uint16_t get_out_attr_count(omrx_chunk_t chunk);
+static omrx_status_t build_chunk_checksums(omrx_chunk_t chunk, uint8_t **result, uint32_t *result_len);
+static omrx_status_t write_chunk_checksums(omrx_chunk_t chunk, FILE *fp);
 static omrx_status_t write_attr_subheader_array(omrx_attr_t attr, FILE *fp);
 static omrx_status_t write_attr(omrx_attr_t attr, FILE *fp);
+static omrx_status_t write_attr_encoded(omrx_attr_t attr, FILE *fp);
+static bool same_encoded_layout(omrx_attr_t attr);
 static uint32_t get_elem_size(uint16_t dtype, uint32_t total_size);
+static uint32_t get_swap_width(uint16_t dtype);
+static void payload_ftoh(uint16_t dtype, void *data, size_t size);
+static omrx_status_t write_payload(omrx_t omrx, uint32_t width, size_t size, const void *src, FILE *fp);
+static bool uses_shuffle(uint16_t dtype, uint16_t encoding);
+static uint32_t put_encoded_subheader(uint16_t dtype, uint16_t cols, uint32_t raw_size, uint8_t *dest);
+static omrx_status_t resolve_encoding(omrx_t omrx, uint16_t id, uint16_t dtype, uint16_t *encoding);
+static omrx_status_t encode_payload(omrx_t omrx, uint16_t dtype, uint16_t encoding, uint16_t cols, uint32_t size, const void *src, uint8_t **result, uint32_t *result_len, uint16_t *result_encoding);
+static omrx_status_t encode_begin(omrx_t omrx, uint16_t dtype, uint16_t encoding, uint16_t cols, uint32_t size, const void *src, struct encode_job *job);
+static omrx_status_t encode_end(omrx_t omrx, struct encode_job *job, uint8_t **result, uint32_t *result_len, uint16_t *result_encoding);
+static void encode_cleanup(omrx_t omrx, struct encode_job *job);
+static void encode_block_task(void *arg, size_t index);
+static omrx_workers_t get_workers(omrx_t omrx);
+static omrx_async_t get_async(omrx_t omrx);
+static void fetch_op_func(struct omrx_async_op *async_op);
+static omrx_status_t finish_fetch_op(struct fetch_op *op);
+static bool fetch_finished(omrx_fetch_t fetch);
+static void free_fetch(omrx_fetch_t fetch);
+static omrx_status_t report_fetch_result(omrx_t omrx, omrx_status_t status, const char *message);
+static omrx_status_t write_parallel(omrx_t omrx, FILE *fp, bool toc);
+static omrx_status_t next_write_item(omrx_t omrx, struct write_cursor *cur, struct write_item *item);
+static omrx_status_t prepare_write_item(omrx_t omrx, struct write_item *item);
+static omrx_status_t finish_write_item(omrx_t omrx, struct write_item *item);
+static void set_plain_write_item(struct write_item *item);
+static void release_write_item(omrx_t omrx, struct write_item *item);
+static omrx_status_t checksum_write_items(omrx_t omrx, struct write_item *items, size_t count);
+static void checksum_item_task(void *arg, size_t index);
+static void encode_ref_task(void *arg, size_t index);
+static omrx_status_t write_batch(omrx_t omrx, int fd, struct write_item *items, size_t count);
+static void write_run_task(void *arg, size_t index);
+static omrx_status_t write_batch_direct(omrx_t omrx, struct write_item *items, size_t count);
+static omrx_status_t set_attr_data(omrx_chunk_t chunk, uint16_t id, uint16_t datatype, uint16_t cols, uint32_t size, void *data);
+static omrx_status_t write_toc(omrx_t omrx, FILE *fp);
+static omrx_status_t load_toc(omrx_t omrx, off_t start);
+static omrx_status_t stream_check(omrx_t omrx);
+static omrx_status_t stream_push(omrx_t omrx, const char *tag);
+static omrx_status_t stream_emit(omrx_t omrx, size_t size, const void *src);
+static omrx_status_t stream_emit_payload(omrx_t omrx, uint32_t width, size_t size, const void *src);
+static omrx_status_t stream_start_chunk(omrx_t omrx);
+static omrx_status_t stream_finish_attrs(omrx_t omrx);
+static omrx_status_t stream_add_attr(omrx_t omrx, uint16_t id, uint16_t datatype, uint16_t cols, uint32_t size, bool direct, off_t *hdr_pos);
+static omrx_status_t stream_init(omrx_t omrx, const char *filename, const char *mode);
+static void stream_cleanup(omrx_t omrx);
+static omrx_status_t stream_read_at(omrx_t omrx, off_t pos, size_t size, void *dest);
+static omrx_status_t stream_find_end(omrx_t omrx, off_t *end_pos);
+static omrx_status_t stream_save_tail(omrx_t omrx, off_t end_pos);
+static omrx_status_t stream_restore_tail(omrx_t omrx);
+static omrx_status_t build_from_toc(omrx_t omrx, off_t start, off_t toc_pos, const uint8_t *buf, size_t len);
 
 ///////////////////////////////////////////////
 
@@ -74,83 +389,98 @@ static omrx_log_func_t default_log_warning = NULL;
 static omrx_log_func_t default_log_error = NULL;
 static omrx_alloc_func_t default_alloc = omrx_default_alloc;
 static omrx_free_func_t default_free = omrx_default_free;
+static uint64_t next_serial = 0;
+
+// Per-thread error states (see get_errstate()).  Each thread's states are
+// also chained together from its thread_errstates, and errstate_key (whose
+// value is just a pointer to that) frees them when the thread exits.
+// errstate_lock protects both the instances' and the threads' lists.
+static pthread_mutex_t errstate_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t errstate_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t errstate_key;
+static bool have_errstate_key = false;
+static _Thread_local struct omrx_errstate *thread_errstates = NULL;
 
 omrx_status_t omrx_warning(omrx_t omrx, omrx_status_t errcode, const char *fmt, ...) {
+    struct omrx_errstate *err = get_errstate(omrx);
     va_list ap;
 
     va_start(ap, fmt);
-    if (vsnprintf(omrx->message, OMRX_ERRMSG_BUFSIZE, fmt, ap) < 0) {
-        strncpy(omrx->message, "(unable to format error message)", OMRX_ERRMSG_BUFSIZE);
-        omrx->message[OMRX_ERRMSG_BUFSIZE - 1] = 0;
+    if (vsnprintf(err->message, OMRX_ERRMSG_BUFSIZE, fmt, ap) < 0) {
+        strncpy(err->message, "(unable to format error message)", OMRX_ERRMSG_BUFSIZE);
+        err->message[OMRX_ERRMSG_BUFSIZE - 1] = 0;
     }
     va_end(ap);
     if (omrx->log_warning) {
-        omrx->log_warning(omrx, errcode, omrx->message);
+        omrx->log_warning(omrx, errcode, err->message);
     }
 
     // Any previous error status takes priority, but if the current status is a
     // warning or less, replace it with the most recent warning status.
-    if (omrx->status >= 0) {
-        omrx->status = errcode;
+    if (err->status >= 0) {
+        err->status = errcode;
     }
-    omrx->last_result = errcode;
+    err->last_result = errcode;
     return errcode;
 }
 
 omrx_status_t omrx_error(omrx_t omrx, omrx_status_t errcode, const char *fmt, ...) {
+    struct omrx_errstate *err = get_errstate(omrx);
     va_list ap;
 
     va_start(ap, fmt);
-    if (vsnprintf(omrx->message, OMRX_ERRMSG_BUFSIZE, fmt, ap) < 0) {
-        strncpy(omrx->message, "(unable to format error message)", OMRX_ERRMSG_BUFSIZE);
-        omrx->message[OMRX_ERRMSG_BUFSIZE - 1] = 0;
+    if (vsnprintf(err->message, OMRX_ERRMSG_BUFSIZE, fmt, ap) < 0) {
+        strncpy(err->message, "(unable to format error message)", OMRX_ERRMSG_BUFSIZE);
+        err->message[OMRX_ERRMSG_BUFSIZE - 1] = 0;
     }
     va_end(ap);
     if (omrx->log_error) {
-        omrx->log_error(omrx, errcode, omrx->message);
+        omrx->log_error(omrx, errcode, err->message);
     }
 
-    omrx->status = errcode;
-    omrx->last_result = errcode;
+    err->status = errcode;
+    err->last_result = errcode;
     return errcode;
 }
 
 omrx_status_t omrx_os_warning(omrx_t omrx, omrx_status_t errcode, const char *fmt, ...) {
+    struct omrx_errstate *err = get_errstate(omrx);
     va_list ap;
     size_t msglen;
 
     va_start(ap, fmt);
-    if (vsnprintf(omrx->message, OMRX_ERRMSG_BUFSIZE, fmt, ap) < 0) {
-        strncpy(omrx->message, "(unable to format warning message)", OMRX_ERRMSG_BUFSIZE);
-        omrx->message[OMRX_ERRMSG_BUFSIZE - 1] = 0;
+    if (vsnprintf(err->message, OMRX_ERRMSG_BUFSIZE, fmt, ap) < 0) {
+        strncpy(err->message, "(unable to format warning message)", OMRX_ERRMSG_BUFSIZE);
+        err->message[OMRX_ERRMSG_BUFSIZE - 1] = 0;
     }
     va_end(ap);
 
-    msglen = strlen(omrx->message);
+    msglen = strlen(err->message);
     // If there's space, tack on the strerror() message after our own message.
     if (msglen < OMRX_ERRMSG_BUFSIZE - 3) {
-        omrx->message[msglen] = ':';
-        omrx->message[msglen + 1] = ' ';
-        if (strerror_r(errno, omrx->message + msglen + 2, OMRX_ERRMSG_BUFSIZE - msglen - 2)) {
-            strncpy(omrx->message + msglen + 2, "(strerror failed)", OMRX_ERRMSG_BUFSIZE - msglen - 2);
-            omrx->message[OMRX_ERRMSG_BUFSIZE - 1] = 0;
+        err->message[msglen] = ':';
+        err->message[msglen + 1] = ' ';
+        if (strerror_r(errno, err->message + msglen + 2, OMRX_ERRMSG_BUFSIZE - msglen - 2)) {
+            strncpy(err->message + msglen + 2, "(strerror failed)", OMRX_ERRMSG_BUFSIZE - msglen - 2);
+            err->message[OMRX_ERRMSG_BUFSIZE - 1] = 0;
         }
     }
 
     if (omrx->log_warning) {
-        omrx->log_warning(omrx, errcode, omrx->message);
+        omrx->log_warning(omrx, errcode, err->message);
     }
 
     // Any previous error status takes priority, but if the current status is a
     // warning or less, replace it with the most recent warning status.
-    if (omrx->status >= 0) {
-        omrx->status = errcode;
+    if (err->status >= 0) {
+        err->status = errcode;
     }
-    omrx->last_result = errcode;
+    err->last_result = errcode;
     return errcode;
 }
 
 omrx_status_t omrx_os_error(omrx_t omrx, omrx_status_t errcode, const char *fmt, ...) {
+    struct omrx_errstate *err = get_errstate(omrx);
     va_list ap;
     size_t msglen;
 
@@ -161,40 +491,311 @@ omrx_status_t omrx_os_error(omrx_t omrx, omrx_status_t errcode, const char *fmt,
     }
 
     va_start(ap, fmt);
-    if (vsnprintf(omrx->message, OMRX_ERRMSG_BUFSIZE, fmt, ap) < 0) {
-        strncpy(omrx->message, "(unable to format error message)", OMRX_ERRMSG_BUFSIZE);
-        omrx->message[OMRX_ERRMSG_BUFSIZE - 1] = 0;
+    if (vsnprintf(err->message, OMRX_ERRMSG_BUFSIZE, fmt, ap) < 0) {
+        strncpy(err->message, "(unable to format error message)", OMRX_ERRMSG_BUFSIZE);
+        err->message[OMRX_ERRMSG_BUFSIZE - 1] = 0;
     }
     va_end(ap);
 
-    msglen = strlen(omrx->message);
+    msglen = strlen(err->message);
     // If there's space, tack on the strerror() message after our own message.
     if (msglen < OMRX_ERRMSG_BUFSIZE - 3) {
-        omrx->message[msglen] = ':';
-        omrx->message[msglen + 1] = ' ';
+        err->message[msglen] = ':';
+        err->message[msglen + 1] = ' ';
         if (errcode == OMRX_ERR_EOF) {
             // Since errno=0, strerror normally returns the (rather confusing
             // and not useful) "No error" message for this.  Use a better
             // message in this case.
-            strncpy(omrx->message + msglen + 2, "Unexpected end of file", OMRX_ERRMSG_BUFSIZE - msglen - 2);
-            omrx->message[OMRX_ERRMSG_BUFSIZE - 1] = 0;
+            strncpy(err->message + msglen + 2, "Unexpected end of file", OMRX_ERRMSG_BUFSIZE - msglen - 2);
+            err->message[OMRX_ERRMSG_BUFSIZE - 1] = 0;
         } else {
-            if (strerror_r(errno, omrx->message + msglen + 2, OMRX_ERRMSG_BUFSIZE - msglen - 2)) {
-                strncpy(omrx->message + msglen + 2, "(strerror failed)", OMRX_ERRMSG_BUFSIZE - msglen - 2);
-                omrx->message[OMRX_ERRMSG_BUFSIZE - 1] = 0;
+            if (strerror_r(errno, err->message + msglen + 2, OMRX_ERRMSG_BUFSIZE - msglen - 2)) {
+                strncpy(err->message + msglen + 2, "(strerror failed)", OMRX_ERRMSG_BUFSIZE - msglen - 2);
+                err->message[OMRX_ERRMSG_BUFSIZE - 1] = 0;
             }
         }
     }
 
     if (omrx->log_error) {
-        omrx->log_error(omrx, errcode, omrx->message);
+        omrx->log_error(omrx, errcode, err->message);
     }
 
-    omrx->status = errcode;
-    omrx->last_result = errcode;
+    err->status = errcode;
+    err->last_result = errcode;
     return errcode;
 }
 
+// Return the error state which error/warning results for the current call
+// should go into.  In concurrent mode, this is a separate state for each
+// calling thread, created the first time the thread needs one.  (If that
+// fails, we have little choice but to fall back to the shared one.)
+//
+// Each state is on two lists: the instance's (so that they can all be freed
+// with it) and the thread's (so that they can be freed when the thread exits,
+// rather than piling up, or being picked up by a later thread which happens
+// to get the same ID).  Only one thread-specific data key is used for the
+// whole library, since those are a limited resource (PTHREAD_KEYS_MAX).  Each
+// thread remembers the last state it used, so the lists (and their lock) are
+// only needed when a thread switches between instances.
+static struct omrx_errstate *get_errstate(omrx_t omrx) {
+    static _Thread_local struct {
+        omrx_t omrx;
+        uint64_t serial;
+        struct omrx_errstate *err;
+    } last;
+    struct omrx_errstate *err;
+
+    if (!(omrx->open_flags & OMRX_OPEN_CONCURRENT)) {
+        return &omrx->err;
+    }
+    if (last.omrx == omrx && last.serial == omrx->serial) {
+        return last.err;
+    }
+    pthread_once(&errstate_key_once, create_errstate_key);
+    pthread_mutex_lock(&errstate_lock);
+    for (err = thread_errstates; err; err = err->thread_next) {
+        if (err->omrx == omrx) {
+            break;
+        }
+    }
+    if (!err && have_errstate_key) {
+        err = omrx->alloc(omrx, sizeof(struct omrx_errstate) + OMRX_ERRMSG_BUFSIZE);
+        if (err) {
+            err->omrx = omrx;
+            err->status = OMRX_OK;
+            err->last_result = OMRX_OK;
+            err->message = (char *)(err + 1);
+            err->message[0] = 0;
+            err->prev = NULL;
+            err->next = omrx->thread_errstates;
+            if (err->next) {
+                err->next->prev = err;
+            }
+            omrx->thread_errstates = err;
+            err->thread_list = &thread_errstates;
+            err->thread_prev = NULL;
+            err->thread_next = thread_errstates;
+            if (err->thread_next) {
+                err->thread_next->thread_prev = err;
+            }
+            thread_errstates = err;
+            pthread_setspecific(errstate_key, &thread_errstates);
+        }
+    }
+    pthread_mutex_unlock(&errstate_lock);
+    if (!err) {
+        return &omrx->err;
+    }
+    last.omrx = omrx;
+    last.serial = omrx->serial;
+    last.err = err;
+
+    return err;
+}
+
+static void create_errstate_key(void) {
+    have_errstate_key = pthread_key_create(&errstate_key, free_thread_errstates) == 0;
+}
+
+// Destructor for errstate_key: free the exiting thread's error states (`arg`
+// is its thread_errstates), taking each one off its instance's list.
+static void free_thread_errstates(void *arg) {
+    struct omrx_errstate **list = arg;
+    struct omrx_errstate *err;
+
+    pthread_mutex_lock(&errstate_lock);
+    while (*list) {
+        err = *list;
+        *list = err->thread_next;
+        if (err->prev) {
+            err->prev->next = err->next;
+        } else {
+            err->omrx->thread_errstates = err->next;
+        }
+        if (err->next) {
+            err->next->prev = err->prev;
+        }
+        err->omrx->free(err->omrx, err);
+    }
+    pthread_mutex_unlock(&errstate_lock);
+}
+
+// Free all of an instance's per-thread error states, taking each one off its
+// thread's list.
+static void free_errstates(omrx_t omrx) {
+    struct omrx_errstate *err;
+
+    pthread_mutex_lock(&errstate_lock);
+    while (omrx->thread_errstates) {
+        err = omrx->thread_errstates;
+        omrx->thread_errstates = err->next;
+        if (err->thread_prev) {
+            err->thread_prev->thread_next = err->thread_next;
+        } else {
+            *err->thread_list = err->thread_next;
+        }
+        if (err->thread_next) {
+            err->thread_next->thread_prev = err->thread_prev;
+        }
+        omrx->free(omrx, err);
+    }
+    pthread_mutex_unlock(&errstate_lock);
+}
+
+// Return the worker pool for parallel work, starting it up the first time
+// it's needed.  Returns NULL if everything should just be done in the calling
+// thread (only one thread is to be used, or the pool couldn't be started).
+static omrx_workers_t get_workers(omrx_t omrx) {
+    unsigned int threads;
+
+    pthread_mutex_lock(&omrx->workers_lock);
+    if (!omrx->workers) {
+        threads = omrx->threads ? omrx->threads : omrx_default_threads();
+        if (threads > 1) {
+            omrx->workers = omrx_workers_new(omrx, threads - 1);
+        }
+    }
+    pthread_mutex_unlock(&omrx->workers_lock);
+
+    return omrx->workers;
+}
+
+// Return the background threads for asynchronous fetches, starting them up
+// the first time they're needed (NULL if that's not possible).
+static omrx_async_t get_async(omrx_t omrx) {
+    pthread_mutex_lock(&omrx->workers_lock);
+    if (!omrx->async) {
+        omrx->async = omrx_async_new(omrx, OMRX_ASYNC_THREADS);
+    }
+    pthread_mutex_unlock(&omrx->workers_lock);
+
+    return omrx->async;
+}
+
+// Called in a background thread for each request of an asynchronous fetch,
+// once its data has been read from the file (if the operation was set up to
+// do that).  The last one to finish calls the fetch's callback.  An operation
+// without an attribute is just there to complete a fetch with nothing to read.
+static void fetch_op_func(struct omrx_async_op *async_op) {
+    struct fetch_op *op = (struct fetch_op *)async_op;
+    omrx_fetch_t fetch = op->fetch;
+    omrx_t omrx = fetch->omrx;
+    omrx_status_t status = OMRX_OK;
+    bool free_now;
+
+    if (op->attr) {
+        status = finish_fetch_op(op);
+        if (op->encoded) {
+            omrx->free(omrx, op->encoded);
+            op->encoded = NULL;
+        }
+        omrx_buffer_release(op->shared);
+        op->shared = NULL;
+        op->req->status = status < 0 ? status : OMRX_OK;
+    }
+
+    pthread_mutex_lock(&omrx->fetch_lock);
+    if (status < 0 && fetch->status >= 0) {
+        // The error has been reported in this thread's error state, which
+        // the caller can't see, so keep a copy of the message for
+        // omrx_fetch_wait() to pass on.
+        fetch->status = status;
+        fetch->message = omrx_strdup(omrx, get_errstate(omrx)->message);
+    }
+    if (--fetch->pending) {
+        pthread_mutex_unlock(&omrx->fetch_lock);
+        return;
+    }
+    if (fetch->callback) {
+        fetch->in_callback = true;
+        fetch->callback_thread = pthread_self();
+        pthread_mutex_unlock(&omrx->fetch_lock);
+        fetch->callback(fetch, fetch->user_data);
+        pthread_mutex_lock(&omrx->fetch_lock);
+        fetch->in_callback = false;
+    }
+    fetch->done = true;
+    free_now = fetch->free_pending;
+    pthread_cond_broadcast(&omrx->fetch_cond);
+    pthread_mutex_unlock(&omrx->fetch_lock);
+    if (free_now) {
+        free_fetch(fetch);
+    }
+}
+
+// Get a fetch request's data into its buffer.  If the operation read the
+// data from the file, this checks and decodes/byte-swaps it; if it was in
+// memory, this copies the snapshot taken when the fetch was submitted;
+// otherwise it gets it from the mapping or the file, the same way as
+// omrx_get_attr_raw_into() would.
+static omrx_status_t finish_fetch_op(struct fetch_op *op) {
+    omrx_attr_t attr = op->attr;
+    omrx_t omrx = attr->chunk->omrx;
+
+    if (op->data) {
+        memcpy(op->req->buf, op->data, attr->size);
+        return OMRX_OK;
+    }
+    if (!op->read_file) {
+        return read_attr_file(attr, 0, attr->size, op->req->buf);
+    }
+    if (op->async.err) {
+        errno = op->async.err;
+        return omrx_os_error(omrx, OMRX_ERR_OSERR, "Read error");
+    }
+    if (op->async.done < op->async.size) {
+        return omrx_error(omrx, OMRX_ERR_EOF, "Read error: Unexpected end of file");
+    }
+    drop_behind(omrx, attr->file_pos, op->async.size);
+    if (op->encoded) {
+        CHECK_ERR(check_decodable(attr));
+        return decode_attr_buffer(attr, op->encoded, op->req->buf);
+    }
+    CHECK_ERR(verify_attr_crc(attr, op->req->buf));
+    payload_ftoh(attr->datatype, op->req->buf, attr->size);
+
+    return OMRX_OK;
+}
+
+// Has the fetch completed, as far as the calling thread is concerned?  (From
+// within the callback, it has, even though the callback hasn't returned yet.)
+// The instance's fetch_lock must be held.
+static bool fetch_finished(omrx_fetch_t fetch) {
+    return fetch->done || (fetch->in_callback && pthread_equal(fetch->callback_thread, pthread_self()));
+}
+
+static void free_fetch(omrx_fetch_t fetch) {
+    omrx_t omrx = fetch->omrx;
+    size_t i;
+
+    for (i = 0; i < fetch->count; i++) {
+        if (fetch->ops[i].encoded) {
+            omrx->free(omrx, fetch->ops[i].encoded);
+        }
+        omrx_buffer_release(fetch->ops[i].shared);
+    }
+    if (fetch->message) {
+        omrx->free(omrx, fetch->message);
+    }
+    omrx->free(omrx, fetch->ops);
+    omrx->free(omrx, fetch);
+}
+
+// Pass the result of a fetch on to the calling thread's error state.  Errors
+// were already logged when they happened in the background, so they aren't
+// logged again.
+static omrx_status_t report_fetch_result(omrx_t omrx, omrx_status_t status, const char *message) {
+    struct omrx_errstate *err = get_errstate(omrx);
+
+    if (status < 0) {
+        strncpy(err->message, message ? message : "(error message unavailable)", OMRX_ERRMSG_BUFSIZE);
+        err->message[OMRX_ERRMSG_BUFSIZE - 1] = 0;
+        err->status = status;
+    }
+    err->last_result = status;
+    return status;
+}
+
 ///////////////////////////////////
 
 static void *omrx_default_alloc(omrx_t omrx, size_t size) {
@@ -209,7 +810,7 @@ static void omrx_default_free(omrx_t omrx, void *ptr) {
 }
 
 static char *omrx_strdup(omrx_t omrx, const char *s) {
-    size_t size = strlen(s);
+    size_t size = strlen(s) + 1;
     char *dup = omrx->alloc(omrx, size);
 
     if (!dup) return dup;
@@ -219,16 +820,10 @@ static char *omrx_strdup(omrx_t omrx, const char *s) {
 
 static omrx_status_t seek_to_pos(omrx_t omrx, off_t pos) {
     LOG_IO("- seek %lu\n", pos);
-    if (fseeko(omrx->fp, pos, SEEK_SET) < 0) {
-        return omrx_os_error(omrx, OMRX_ERR_OSERR, "Seek failed");
+    if (!omrx->fp) {
+        return omrx_error(omrx, OMRX_ERR_NOT_OPEN, "Attempt to read data from a closed file");
     }
-
-    return OMRX_OK;
-}
-
-static omrx_status_t skip_data(omrx_t omrx, off_t size) {
-    LOG_IO("- skip %lu\n", size);
-    if (fseeko(omrx->fp, size, SEEK_CUR) < 0) {
+    if (fseeko(omrx->fp, pos, SEEK_SET) < 0) {
         return omrx_os_error(omrx, OMRX_ERR_OSERR, "Seek failed");
     }
 
@@ -251,7 +846,154 @@ static omrx_status_t read_data(omrx_t omrx, off_t size, void *dest) {
     return OMRX_OK;
 }
 
+static omrx_status_t read_data_at(omrx_t omrx, off_t pos, off_t size, void *dest) {
+    if (omrx->map) {
+        if ((uint64_t)pos + size > omrx->map_size) {
+            return omrx_error(omrx, OMRX_ERR_EOF, "Read error: Unexpected end of file");
+        }
+        memcpy(dest, omrx->map + pos, size);
+        return OMRX_OK;
+    }
+    if (omrx->open_flags & OMRX_OPEN_CONCURRENT) {
+        CHECK_ERR(pread_data(omrx, pos, size, dest));
+    } else {
+        CHECK_ERR(seek_to_pos(omrx, pos));
+        errno = 0;
+        CHECK_ERR(read_data(omrx, size, dest));
+    }
+    drop_behind(omrx, pos, size);
+
+    return OMRX_OK;
+}
+
+// Read data from the file using positioned reads, which (unlike seeking and
+// reading through the FILE) can safely be done by several threads at once.
+static omrx_status_t pread_data(omrx_t omrx, off_t pos, off_t size, void *dest) {
+    uint8_t *ptr = dest;
+    ssize_t count;
+    int fd;
+
+    LOG_IO("- pread %lu @ %lu\n", size, pos);
+    if (!omrx->fp) {
+        return omrx_error(omrx, OMRX_ERR_NOT_OPEN, "Attempt to read data from a closed file");
+    }
+    fd = fileno(omrx->fp);
+    while (size > 0) {
+        count = pread(fd, ptr, size, pos);
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            return omrx_os_error(omrx, OMRX_ERR_OSERR, "Read error");
+        }
+        if (count == 0) {
+            return omrx_error(omrx, OMRX_ERR_EOF, "Read error: Unexpected end of file");
+        }
+        ptr += count;
+        pos += count;
+        size -= count;
+    }
+
+    return OMRX_OK;
+}
+
+// Pass access advice for `size` bytes of the file at `pos` (or the whole
+// file, if size is 0) on to the kernel, for the file's page cache and (if it's
+// mapped) for the mapping.  Advice is only a hint, so failures are just
+// warnings.
+static omrx_status_t advise_range(omrx_t omrx, off_t pos, off_t size, omrx_advice_t advice) {
+    int err = 0;
+
+#ifdef POSIX_FADV_NORMAL
+    if (omrx->fp) {
+        int fadv;
+
+        switch (advice) {
+        case OMRX_ADVICE_SEQUENTIAL: fadv = POSIX_FADV_SEQUENTIAL; break;
+        case OMRX_ADVICE_RANDOM:     fadv = POSIX_FADV_RANDOM; break;
+        case OMRX_ADVICE_WILLNEED:   fadv = POSIX_FADV_WILLNEED; break;
+        case OMRX_ADVICE_DONTNEED:   fadv = POSIX_FADV_DONTNEED; break;
+        default:                     fadv = POSIX_FADV_NORMAL; break;
+        }
+        err = posix_fadvise(fileno(omrx->fp), pos, size, fadv);
+    }
+#endif
+    if (omrx->map && !err && (uint64_t)pos < omrx->map_size) {
+        // madvise() needs a page-aligned start address (the mapping itself
+        // starts at the beginning of the file, so is aligned).
+        off_t start = pos & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+        off_t end = (!size || (uint64_t)(pos + size) > omrx->map_size) ? (off_t)omrx->map_size : pos + size;
+        int madv;
+
+        switch (advice) {
+        case OMRX_ADVICE_SEQUENTIAL: madv = MADV_SEQUENTIAL; break;
+        case OMRX_ADVICE_RANDOM:     madv = MADV_RANDOM; break;
+        case OMRX_ADVICE_WILLNEED:   madv = MADV_WILLNEED; break;
+        case OMRX_ADVICE_DONTNEED:   madv = MADV_DONTNEED; break;
+        default:                     madv = MADV_NORMAL; break;
+        }
+        if (madvise(omrx->map + start, end - start, madv) < 0) {
+            err = errno;
+        }
+    }
+    if (err) {
+        errno = err;
+        return omrx_os_warning(omrx, OMRX_WARN_OSERR, "Cannot pass access advice to the kernel");
+    }
+
+    return OMRX_OK;
+}
+
+// Pass the instance's advice (see omrx_advise()) on to the kernel for the
+// whole file.  DONTNEED for the whole file would throw away pages which others
+// may be using, so for that, just ask for sequential read-ahead (and data is
+// then dropped as it is read, by drop_behind()).
+static omrx_status_t apply_file_advice(omrx_t omrx) {
+    omrx_advice_t advice = omrx->advice;
+
+    if (advice == OMRX_ADVICE_DONTNEED) {
+        advice = OMRX_ADVICE_SEQUENTIAL;
+    }
+
+    return advise_range(omrx, 0, 0, advice);
+}
+
+// With OMRX_ADVICE_DONTNEED, data which has been read from the file (into our
+// own memory) is dropped from the page cache straight away, so that streaming
+// through a large file doesn't push everything else out of it.  Pages which
+// the kernel was still reading ahead after the last read can't be dropped
+// then, so (except in concurrent mode, where reads happen in any order) the
+// read-ahead window after the end of the last read is dropped too, if this
+// read is further on.  Nothing else in between is touched: it was only
+// skipped over, and may well be in use by someone else.
+static void drop_behind(omrx_t omrx, off_t pos, off_t size) {
+#ifdef POSIX_FADV_DONTNEED
+    off_t start = pos;
+    off_t gap_end;
+
+    if (omrx->advice != OMRX_ADVICE_DONTNEED || !omrx->fp || omrx->map || size <= 0) {
+        return;
+    }
+    if (!(omrx->open_flags & OMRX_OPEN_CONCURRENT) && omrx->drop_pos < pos) {
+        gap_end = omrx->drop_pos + OMRX_READAHEAD_WINDOW;
+        if (gap_end >= pos) {
+            start = omrx->drop_pos;
+        } else {
+            posix_fadvise(fileno(omrx->fp), omrx->drop_pos, OMRX_READAHEAD_WINDOW, POSIX_FADV_DONTNEED);
+        }
+    }
+    if (!(omrx->open_flags & OMRX_OPEN_CONCURRENT) && omrx->drop_pos < pos + size) {
+        omrx->drop_pos = pos + size;
+    }
+    posix_fadvise(fileno(omrx->fp), start, pos + size - start, POSIX_FADV_DONTNEED);
+#else
+    (void)omrx;
+    (void)pos;
+    (void)size;
+#endif
+}
+
 static omrx_status_t write_data(omrx_t omrx, off_t size, const void *src, FILE *fp) {
+    int err;
+
     if (!size) return OMRX_OK;
 
 #if LOGIO
@@ -263,19 +1005,138 @@ static omrx_status_t write_data(omrx_t omrx, off_t size, const void *src, FILE *
     LOG_IO("\n");
 #endif
 
+    if (omrx->out.buf) {
+        // omrx_write() sends everything through its output staging instead
+        // of stdio (see omrx_output.c)
+        err = omrx_output_write(&omrx->out, src, size);
+        if (err) {
+            errno = err;
+            return omrx_os_error(omrx, OMRX_ERR_OSERR, "Write error");
+        }
+    } else if (fwrite(src, size, 1, fp) != 1) {
+        return omrx_os_error(omrx, OMRX_ERR_OSERR, "Write error");
+    }
+    omrx->write_pos += size;
+    if (omrx->write_checksums) {
+        // (see write_attr())
+        omrx->write_crc = omrx_crc32c(omrx->write_crc, src, size);
+    }
+
+    return OMRX_OK;
+}
+
+// Overwrite some already-written data at `pos`, then go back to the end of
+// the output to carry on writing.
+static omrx_status_t patch_data(omrx_t omrx, off_t pos, off_t size, const void *src, FILE *fp) {
+    LOG_IO("- patch %lu @ %lu\n", size, pos);
+    if (fseeko(fp, pos, SEEK_SET) < 0) {
+        return omrx_os_error(omrx, OMRX_ERR_OSERR, "Seek failed");
+    }
     if (fwrite(src, size, 1, fp) != 1) {
         return omrx_os_error(omrx, OMRX_ERR_OSERR, "Write error");
     }
+    if (fseeko(fp, omrx->write_pos, SEEK_SET) < 0) {
+        return omrx_os_error(omrx, OMRX_ERR_OSERR, "Seek failed");
+    }
 
     return OMRX_OK;
 }
 
 ///////////////////////////////////
 
+static void pool_init(omrx_pool_t pool, size_t node_size) {
+    // Every node needs to be able to hold the free_list link, and must keep
+    // the following node suitably aligned.
+    if (node_size < sizeof(void *)) {
+        node_size = sizeof(void *);
+    }
+    node_size = (node_size + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+    pool->node_size = node_size;
+    pool->nodes_per_slab = (OMRX_SLAB_SIZE - sizeof(struct omrx_slab)) / node_size;
+    pool->slabs = NULL;
+    pool->free_list = NULL;
+}
+
+static void *pool_alloc(omrx_t omrx, omrx_pool_t pool) {
+    struct omrx_slab *slab = pool->slabs;
+    void *node;
+
+    if (pool->free_list) {
+        node = pool->free_list;
+        pool->free_list = *(void **)node;
+        return node;
+    }
+    if (!slab || slab->used == pool->nodes_per_slab) {
+        slab = omrx->alloc(omrx, sizeof(struct omrx_slab) + pool->node_size * pool->nodes_per_slab);
+        if (!slab) return NULL;
+        slab->next = pool->slabs;
+        slab->used = 0;
+        pool->slabs = slab;
+    }
+    node = (uint8_t *)slab->data + pool->node_size * slab->used;
+    slab->used += 1;
+
+    return node;
+}
+
+static void pool_free(omrx_pool_t pool, void *node) {
+    *(void **)node = pool->free_list;
+    pool->free_list = node;
+}
+
+static void pool_release(omrx_t omrx, omrx_pool_t pool) {
+    struct omrx_slab *slab = pool->slabs;
+    struct omrx_slab *next_slab;
+
+    while (slab) {
+        next_slab = slab->next;
+        omrx->free(omrx, slab);
+        slab = next_slab;
+    }
+    pool->slabs = NULL;
+    pool->free_list = NULL;
+}
+
+// Tear down every chunk and attribute belonging to the instance in one go.
+// Rather than walking the chunk tree, this just runs linearly through the
+// slabs, releasing anything still owned by live nodes (freed nodes are marked
+// by free_chunk/free_attr), and then hands the slabs back all at once.
+static void free_all_nodes(omrx_t omrx) {
+    struct omrx_slab *slab;
+    omrx_attr_t attr;
+    omrx_chunk_t chunk;
+    size_t i;
+
+    for (slab = omrx->attr_pool.slabs; slab; slab = slab->next) {
+        for (i = 0; i < slab->used; i++) {
+            attr = (omrx_attr_t)((uint8_t *)slab->data + omrx->attr_pool.node_size * i);
+            if (attr->chunk) {
+                drop_attr_data(attr);
+            }
+        }
+    }
+    for (slab = omrx->chunk_pool.slabs; slab; slab = slab->next) {
+        for (i = 0; i < slab->used; i++) {
+            chunk = (omrx_chunk_t)((uint8_t *)slab->data + omrx->chunk_pool.node_size * i);
+            if (chunk->omrx && chunk->id) {
+                // No need to deregister, the whole ID index is going away.
+                omrx->free(omrx, chunk->id);
+            }
+            if (chunk->omrx && chunk->tag_index) {
+                omrx->free(omrx, chunk->tag_index);
+            }
+        }
+    }
+    pool_release(omrx, &omrx->attr_pool);
+    pool_release(omrx, &omrx->chunk_pool);
+    omrx->root_chunk = NULL;
+    omrx->context = NULL;
+}
+
 static omrx_chunk_t new_chunk(omrx_t omrx, const char *tag) {
     omrx_chunk_t chunk;
 
-    chunk = omrx->alloc(omrx, sizeof(struct omrx_chunk));
+    chunk = pool_alloc(omrx, &omrx->chunk_pool);
     if (!chunk) return NULL;
     memset(chunk, 0, sizeof(struct omrx_chunk));
 
@@ -310,38 +1171,102 @@ static omrx_status_t free_chunk(omrx_chunk_t chunk) {
         attr = next_attr;
     }
     if (chunk->id) {
-        omrx->free(omrx, chunk->id);
+        // Make sure we don't leave a dangling entry in the ID index.
+        deregister_chunk_id(chunk);
+    }
+    if (chunk->tag_index) {
+        omrx->free(omrx, chunk->tag_index);
     }
-    omrx->free(omrx, chunk);
+    if (chunk->unloaded) {
+        omrx->unloaded_count -= 1;
+    }
+    // Mark the node as dead for free_all_nodes()
+    chunk->omrx = NULL;
+    pool_free(&omrx->chunk_pool, chunk);
 
     return status;
 }
 
+// Free a chunk along with everything underneath it (children first).
 static omrx_status_t free_all_chunks(omrx_chunk_t chunk) {
+    struct tree_walk walk;
     omrx_status_t status = OMRX_OK;
     omrx_status_t rc;
-    omrx_chunk_t next_chunk;
 
-    // FIXME: make this non-recursive
-    while (chunk) {
-        if (chunk->first_child) {
-            rc = free_all_chunks(chunk->first_child);
+    for (chunk = walk_start(&walk, chunk); chunk; chunk = walk_next(&walk, true)) {
+        if (walk.leaving) {
+            rc = free_chunk(chunk);
             if (rc != OMRX_OK) status = rc;
         }
-        next_chunk = chunk->next;
-        rc = free_chunk(chunk);
-        if (rc != OMRX_OK) status = rc;
-        chunk = next_chunk;
     }
 
     return status;
 }
 
+// Start a depth-first walk of `top` and everything underneath it.  Returns
+// top, which the walk has just entered.
+static omrx_chunk_t walk_start(struct tree_walk *walk, omrx_chunk_t top) {
+    walk->top = top;
+    walk->chunk = top;
+    walk->next = NULL;
+    walk->parent = NULL;
+    walk->depth = 0;
+    walk->leaving = false;
+
+    return top;
+}
+
+// Take the next step of a walk: into the first child of the chunk which has
+// just been entered (if `descend` is true and it has children), otherwise on
+// to the next sibling, or back up to the parent, of the chunk being left.
+// Returns the chunk which is now being entered or left (see walk->leaving),
+// or NULL once the walk has left the top chunk.  Children are not loaded
+// here; callers should do that as they enter chunks, if needed.
+static omrx_chunk_t walk_next(struct tree_walk *walk, bool descend) {
+    omrx_chunk_t chunk = walk->chunk;
+
+    if (!walk->leaving) {
+        if (descend && chunk->first_child) {
+            chunk = chunk->first_child;
+            walk->depth++;
+        } else {
+            walk->leaving = true;
+        }
+    } else if (chunk == walk->top) {
+        chunk = NULL;
+    } else if (walk->next) {
+        chunk = walk->next;
+        walk->leaving = false;
+    } else {
+        chunk = walk->parent;
+        walk->depth--;
+    }
+    walk->chunk = chunk;
+    if (chunk && walk->leaving) {
+        walk->next = chunk->next;
+        walk->parent = chunk->parent;
+    }
+
+    return chunk;
+}
+
+// Like walk_next(), but skip over leaving chunks to the next one entered (so
+// chunks come out in file order).
+static omrx_chunk_t walk_next_entered(struct tree_walk *walk, bool descend) {
+    omrx_chunk_t chunk = walk_next(walk, descend);
+
+    while (chunk && walk->leaving) {
+        chunk = walk_next(walk, false);
+    }
+
+    return chunk;
+}
+
 static omrx_attr_t new_attr(omrx_chunk_t chunk, uint16_t id, uint16_t datatype, uint32_t size, off_t file_pos) {
     omrx_t omrx = chunk->omrx;
     omrx_attr_t attr;
 
-    attr = omrx->alloc(omrx, sizeof(struct omrx_attr));
+    attr = pool_alloc(omrx, &omrx->attr_pool);
     if (!attr) return NULL;
     memset(attr, 0, sizeof(struct omrx_attr));
 
@@ -351,7 +1276,9 @@ static omrx_attr_t new_attr(omrx_chunk_t chunk, uint16_t id, uint16_t datatype,
     attr->datatype = datatype;
     attr->size = size;
     attr->file_pos = file_pos;
+    attr->file_size = size;
     attr->data = NULL;
+    attr->own_data = false;
     attr->cols = 1;
 
     return attr;
@@ -360,36 +1287,49 @@ static omrx_attr_t new_attr(omrx_chunk_t chunk, uint16_t id, uint16_t datatype,
 static omrx_status_t free_attr(omrx_attr_t attr) {
     omrx_t omrx = attr->chunk->omrx;
 
-    if (attr->data) {
-        // FIXME: need to check if anybody's using it still
-        omrx->free(omrx, attr->data);
-    }
-    omrx->free(omrx, attr);
+    // If the data is in a shared buffer, anybody else using it still has
+    // their own reference to it.
+    drop_attr_data(attr);
+    // Mark the node as dead for free_all_nodes()
+    attr->chunk = NULL;
+    pool_free(&omrx->attr_pool, attr);
 
     return OMRX_OK;
 }
 
-// Note: it is important that this function leaves the file pointer after the
-// last byte of the read data as a couple of other things (i.e.
-// read_next_chunk) rely on that.
+// Note: If the file is mapped, the data is copied from the mapping rather
+// than read through the file pointer.  This never modifies the attribute, so
+// it is safe to call from several threads at once in concurrent mode.
 static omrx_status_t load_attr_data(omrx_attr_t attr, void **dest) {
     omrx_t omrx = attr->chunk->omrx;
+    omrx_buffer_t shared = NULL;
+    const void *data;
     omrx_status_t status;
+    size_t alloc_size;
 
-    if (attr->data) {
+    if (omrx->open_flags & OMRX_OPEN_CONCURRENT) {
+        data = snapshot_attr_data(attr, &shared);
+    } else {
+        data = attr->data;
+    }
+    if (data) {
         // Attribute is not file backed or has locally-modified value.  Just
         // copy what's in memory.
         if (attr->datatype == OMRX_DTYPE_UTF8) {
             // For strings, make sure there's a zero-byte at the end.
-            *dest = omrx->alloc(omrx, attr->size + 1);
-            CHECK_ALLOC(omrx, *dest);
-            memcpy(*dest, attr->data, attr->size);
-            ((char *)(*dest))[attr->size] = 0;
+            *dest = omrx->alloc(omrx, (size_t)attr->size + 1);
+            if (*dest) {
+                memcpy(*dest, data, attr->size);
+                ((char *)(*dest))[attr->size] = 0;
+            }
         } else {
             *dest = omrx->alloc(omrx, attr->size);
-            CHECK_ALLOC(omrx, *dest);
-            memcpy(*dest, attr->data, attr->size);
+            if (*dest) {
+                memcpy(*dest, data, attr->size);
+            }
         }
+        omrx_buffer_release(shared);
+        CHECK_ALLOC(omrx, *dest);
         return OMRX_OK;
     }
     if (attr->file_pos < 0) {
@@ -398,13 +1338,36 @@ static omrx_status_t load_attr_data(omrx_attr_t attr, void **dest) {
         // file) attribute and forgot to assign data to it.
         return omrx_error(omrx, OMRX_ERR_INTERNAL, "%s:%04x: Attempt to read from non-file-backed attribute!", attr->chunk->tag, attr->id);
     }
-    CHECK_ERR(seek_to_pos(omrx, attr->file_pos));
-    //FIXME: deal with non-raw encodings
+    if (attr->file_encoding) {
+        return load_encoded_data(attr, dest);
+    }
+    if (omrx->map) {
+        if ((uint64_t)attr->file_pos + attr->size > omrx->map_size) {
+            return omrx_error(omrx, OMRX_ERR_EOF, "%s:%04x: Attribute data extends past end of file", attr->chunk->tag, attr->id);
+        }
+        alloc_size = attr->size;
+        if (attr->datatype == OMRX_DTYPE_UTF8) {
+            // For strings, make sure there's a zero-byte at the end.
+            alloc_size += 1;
+        }
+        CHECK_ERR(verify_attr_crc(attr, omrx->map + attr->file_pos));
+        *dest = omrx->alloc(omrx, alloc_size);
+        CHECK_ALLOC(omrx, *dest);
+        memcpy(*dest, omrx->map + attr->file_pos, attr->size);
+        if (attr->datatype == OMRX_DTYPE_UTF8) {
+            ((char *)(*dest))[attr->size] = 0;
+        }
+        payload_ftoh(attr->datatype, *dest, attr->size);
+        return OMRX_OK;
+    }
     if (attr->datatype == OMRX_DTYPE_UTF8) {
         // For strings, make sure there's a zero-byte at the end.
-        *dest = omrx->alloc(omrx, attr->size + 1);
+        *dest = omrx->alloc(omrx, (size_t)attr->size + 1);
         CHECK_ALLOC(omrx, *dest);
-        status = read_data(omrx, attr->size, *dest);
+        status = read_data_at(omrx, attr->file_pos, attr->size, *dest);
+        if (status >= 0) {
+            status = verify_attr_crc(attr, *dest);
+        }
         if (status < 0) {
             omrx->free(omrx, *dest);
             *dest = NULL;
@@ -414,773 +1377,5576 @@ static omrx_status_t load_attr_data(omrx_attr_t attr, void **dest) {
     } else {
         *dest = omrx->alloc(omrx, attr->size);
         CHECK_ALLOC(omrx, *dest);
-        status = read_data(omrx, attr->size, *dest);
+        status = read_data_at(omrx, attr->file_pos, attr->size, *dest);
+        if (status >= 0) {
+            status = verify_attr_crc(attr, *dest);
+        }
         if (status < 0) {
             omrx->free(omrx, *dest);
             *dest = NULL;
             return status;
         }
+        payload_ftoh(attr->datatype, *dest, attr->size);
     }
 
     return OMRX_OK;
 }
 
-static omrx_status_t release_attr_data(omrx_attr_t attr) {
+// Like load_attr_data, but only loads `size` bytes starting at `offset` into
+// the attribute data (which the caller must have checked are within it).
+static omrx_status_t load_attr_range(omrx_attr_t attr, uint64_t offset, size_t size, void **dest) {
     omrx_t omrx = attr->chunk->omrx;
+    omrx_status_t status;
 
-    if (!attr->data) {
-        return OMRX_OK;
+    *dest = omrx->alloc(omrx, size);
+    CHECK_ALLOC(omrx, *dest);
+    status = read_attr_into(attr, offset, size, *dest);
+    if (status < 0) {
+        omrx->free(omrx, *dest);
+        *dest = NULL;
+        return status;
     }
-    if (attr->file_pos < 0) {
-        // This isn't a file-backed attribute.  Do nothing.
-        return OMRX_STATUS_NOT_FOUND;
-    }
-    omrx->free(omrx, attr->data);
 
     return OMRX_OK;
 }
 
-static omrx_status_t find_attr(omrx_chunk_t chunk, uint16_t id, omrx_attr_t *dest) {
-    omrx_attr_t attr = chunk->attrs;
+// Copy `size` bytes of the attribute data starting at `offset` (which the
+// caller must have checked are within it) into a buffer supplied by the
+// caller.
+static omrx_status_t read_attr_into(omrx_attr_t attr, uint64_t offset, size_t size, void *dest) {
+    omrx_buffer_t shared = NULL;
+    const void *data;
 
-    while (attr) {
-        if (attr->id == id) {
-            *dest = attr;
+    if (attr->chunk->omrx->open_flags & OMRX_OPEN_CONCURRENT) {
+        data = snapshot_attr_data(attr, &shared);
+    } else {
+        data = attr->data;
+    }
+    if (data) {
+        memcpy(dest, (const uint8_t *)data + offset, size);
+        omrx_buffer_release(shared);
+        return OMRX_OK;
+    }
+
+    return read_attr_file(attr, offset, size, dest);
+}
+
+// Like read_attr_into(), but always reads the data from the file (or the
+// cache), ignoring whatever is in attr->data.
+static omrx_status_t read_attr_file(omrx_attr_t attr, uint64_t offset, size_t size, void *dest) {
+    omrx_t omrx = attr->chunk->omrx;
+    omrx_status_t status;
+
+    if (attr->file_pos < 0) {
+        return omrx_error(omrx, OMRX_ERR_INTERNAL, "%s:%04x: Attempt to read from non-file-backed attribute!", attr->chunk->tag, attr->id);
+    }
+    if (attr->file_encoding) {
+        if (offset || size != attr->size) {
+            return decode_attr_range(attr, offset, size, dest);
+        }
+        status = cache_attr_data(attr);
+        if (status < 0) {
+            return status;
+        }
+        if (status == OMRX_OK) {
+            memcpy(dest, attr->data, size);
             return OMRX_OK;
         }
-        attr = attr->next;
+        return decode_attr_data(attr, dest);
+    }
+    CHECK_ERR(read_data_at(omrx, attr->file_pos + offset, size, dest));
+    if (!offset && size == attr->size) {
+        CHECK_ERR(verify_attr_crc(attr, dest));
     }
+    payload_ftoh(attr->datatype, dest, size);
 
-    *dest = NULL;
-    return OMRX_STATUS_NOT_FOUND;
+    return OMRX_OK;
 }
 
-static omrx_status_t chunk_add_attr(omrx_chunk_t chunk, omrx_attr_t attr) {
-    omrx_attr_t ptr = (omrx_attr_t)(&chunk->attrs);
+// Load and decode the data of an attribute which is encoded in the file,
+// into a newly allocated buffer.
+static omrx_status_t load_encoded_data(omrx_attr_t attr, void **dest) {
+    omrx_t omrx = attr->chunk->omrx;
+    omrx_status_t status;
 
-    while (ptr->next) {
-        if (ptr->next->id > attr->id) break;
-        ptr = ptr->next;
+    CHECK_ERR(check_decodable(attr));
+    // For strings, make sure there's a zero-byte at the end.
+    *dest = omrx->alloc(omrx, (size_t)attr->size + 1);
+    CHECK_ALLOC(omrx, *dest);
+    status = decode_attr_data(attr, *dest);
+    if (status < 0) {
+        omrx->free(omrx, *dest);
+        *dest = NULL;
+        return status;
     }
-    attr->next = ptr->next;
-    ptr->next = attr;
-    chunk->attr_count += 1;
+    ((char *)(*dest))[attr->size] = 0;
 
     return OMRX_OK;
 }
 
-static omrx_status_t add_child_chunk(omrx_chunk_t parent, omrx_chunk_t child) {
-    child->parent = parent;
-    if (!parent->first_child) {
-        parent->first_child = child;
-        parent->last_child = child;
+// Decode the attribute's (encoded) data from the file into dest, which must
+// have room for attr->size bytes.  The decoded data is in host order.
+static omrx_status_t decode_attr_data(omrx_attr_t attr, void *dest) {
+    omrx_t omrx = attr->chunk->omrx;
+    const uint8_t *src;
+    uint8_t *buf = NULL;
+    omrx_status_t status;
+
+    CHECK_ERR(check_decodable(attr));
+    if (omrx->map) {
+        src = omrx->map + attr->file_pos;
     } else {
-        parent->last_child->next = child;
-        parent->last_child = child;
+        buf = omrx->alloc(omrx, (size_t)attr->file_size + 1);
+        CHECK_ALLOC(omrx, buf);
+        status = read_data_at(omrx, attr->file_pos, attr->file_size, buf);
+        if (status < 0) {
+            omrx->free(omrx, buf);
+            return status;
+        }
+        src = buf;
+    }
+    status = decode_attr_buffer(attr, src, dest);
+    if (buf) {
+        omrx->free(omrx, buf);
     }
 
-    return OMRX_OK;
+    return status;
 }
 
-static omrx_status_t omrx_scan(omrx_t omrx) {
-    off_t file_pos;
-    uint8_t tag[4];
-    uint32_t ver;
+// Decode the attribute's encoded data, which has already been read from the
+// file into src (attr->file_size bytes), into dest.
+static omrx_status_t decode_attr_buffer(omrx_attr_t attr, const uint8_t *src, void *dest) {
+    struct block_dir dir;
 
-    file_pos = ftello(omrx->fp);
-    if (file_pos < 0) {
-        return omrx_os_error(omrx, OMRX_ERR_OSERR, "Cannot read file position");
+    CHECK_ERR(verify_attr_crc(attr, src));
+    CHECK_ERR(read_block_dir(attr, src, &dir));
+    omrx_status_t status = decode_blocks(attr, &dir, 0, dir.count, src + dir.data_pos, dest);
+    free_block_dir(attr->chunk->omrx, &dir);
+
+    return status;
+}
+
+// Decode just `size` bytes starting at `offset` of the attribute's (encoded)
+// data into dest.  If the data is split into blocks, only the blocks covering
+// the requested range are read and decoded; otherwise the whole thing has to
+// be, so it is cached if possible (the caller probably wants more of it).
+static omrx_status_t decode_attr_range(omrx_attr_t attr, uint64_t offset, size_t size, void *dest) {
+    omrx_t omrx = attr->chunk->omrx;
+    struct block_dir dir;
+    uint32_t first;
+    uint32_t last;
+    uint32_t start;
+    uint64_t out_start;
+    uint64_t out_end;
+    const uint8_t *src;
+    uint8_t *buf = NULL;
+    uint8_t *out;
+    void *tmp;
+    omrx_status_t status;
+
+    if (!size) {
+        return OMRX_OK;
     }
-    CHECK_ERR(read_data(omrx, 4, &tag));
-    if (memcmp(tag, "OMRX", 4)) {
-        return omrx_error(omrx, OMRX_ERR_BAD_MAGIC, "Bad data at beginning of file (not an OMRX file?)");
+    CHECK_ERR(check_decodable(attr));
+    CHECK_ERR(read_block_dir(attr, NULL, &dir));
+    if (dir.count == 1) {
+        free_block_dir(omrx, &dir);
+        status = cache_attr_data(attr);
+        if (status < 0) {
+            return status;
+        }
+        if (status == OMRX_OK) {
+            memcpy(dest, (uint8_t *)attr->data + offset, size);
+            return OMRX_OK;
+        }
+        CHECK_ERR(load_encoded_data(attr, &tmp));
+        memcpy(dest, (uint8_t *)tmp + offset, size);
+        omrx->free(omrx, tmp);
+        return OMRX_OK;
     }
-    //FIXME: check whether we've already been read/populated before
-    CHECK_ERR(seek_to_pos(omrx, file_pos));
-    if (omrx->root_chunk) {
-        free_all_chunks(omrx->root_chunk);
-        omrx->root_chunk = NULL;
+    first = offset / dir.block_bytes;
+    last = (offset + size + dir.block_bytes - 1) / dir.block_bytes;
+    start = first ? dir.ends[first - 1] : 0;
+    out_start = (uint64_t)first * dir.block_bytes;
+    out_end = (uint64_t)last * dir.block_bytes;
+    if (out_end > attr->size) {
+        out_end = attr->size;
     }
-    CHECK_ERR(read_next_chunk(omrx));
-    CHECK_ERR(omrx_get_version(omrx, &ver));
-    if (ver > OMRX_VERSION) {
-        if (OMRX_VER_MAJOR(ver) > OMRX_VER_MAJOR(OMRX_VERSION)) {
-            return omrx_error(omrx, OMRX_ERR_BAD_VER, "File version (%d.%d) is unsupported by this software (software version is %d.%d).", OMRX_VER_MAJOR(ver), OMRX_VER_MINOR(ver), OMRX_VER_MAJOR(OMRX_VERSION), OMRX_VER_MINOR(OMRX_VERSION));
+    out = omrx->alloc(omrx, out_end - out_start);
+    if (!out) {
+        free_block_dir(omrx, &dir);
+        return omrx_os_error(omrx, OMRX_ERR_ALLOC, "Memory allocation failed");
+    }
+    if (omrx->map) {
+        src = omrx->map + attr->file_pos + dir.data_pos + start;
+        status = OMRX_OK;
+    } else {
+        buf = omrx->alloc(omrx, dir.ends[last - 1] - start + 1);
+        if (!buf) {
+            status = omrx_os_error(omrx, OMRX_ERR_ALLOC, "Memory allocation failed");
         } else {
-            omrx_warning(omrx, OMRX_WARN_BAD_VER, "File version (%d.%d) is greater than supported version (%d.%d).  Some features may be unavailable.", OMRX_VER_MAJOR(ver), OMRX_VER_MINOR(ver), OMRX_VER_MAJOR(OMRX_VERSION), OMRX_VER_MINOR(OMRX_VERSION));
+            status = read_data_at(omrx, attr->file_pos + dir.data_pos + start, dir.ends[last - 1] - start, buf);
         }
+        src = buf;
     }
-    while (omrx->context) {
-        CHECK_ERR(read_next_chunk(omrx));
+    if (status >= 0) {
+        status = decode_blocks(attr, &dir, first, last, src, out);
+    }
+    if (status >= 0) {
+        memcpy(dest, out + (offset - out_start), size);
+    }
+    if (buf) {
+        omrx->free(omrx, buf);
     }
+    omrx->free(omrx, out);
+    free_block_dir(omrx, &dir);
 
-    return OMRX_OK;
+    return status;
 }
 
-static omrx_status_t register_chunk_id(omrx_chunk_t chunk, char *idstr) {
-    omrx_t omrx = chunk->omrx;
-    int i;
-    int next_free = -1;
-    struct idmap_st *new_id_map;
+// Make sure the attribute's encoded data can be decoded at all: that we
+// support its codec, that the decoded size given in the file is one it could
+// actually have (so we don't go allocating buffers based on nonsense), and
+// (for mapped files) that it's all within the mapping.
+static omrx_status_t check_decodable(omrx_attr_t attr) {
+    omrx_t omrx = attr->chunk->omrx;
+    uint16_t codec = attr->file_encoding & OMRX_CODEC_MASK;
+    uint64_t row_size;
 
-    if (chunk->id) {
-        deregister_chunk_id(chunk);
+    if (!omrx_codec_supported(codec)) {
+        return omrx_error(omrx, OMRX_ERR_BAD_ENCODING, "%s:%04x: Attribute encoding (%04x) is not supported by this build of libomrx", attr->chunk->tag, attr->id, attr->file_encoding);
     }
-    chunk->id = idstr;
-
-    for (i = 0; i < omrx->chunk_id_map_size; i++) {
-        if (!omrx->chunk_id_map[i].id) {
-            if (next_free == -1) {
-                next_free = i;
-            }
-        } else if (!strcmp(omrx->chunk_id_map[i].id, idstr)) {
-            // FIXME: should this be a warning?
-            return OMRX_STATUS_DUP;
-        }
+    if (attr->size > omrx_codec_max_output(codec, attr->file_size)) {
+        return omrx_error(omrx, OMRX_ERR_BAD_CHUNK, "%s:%04x: Encoded attribute has impossible decoded size (%u bytes from %u; file corrupted?)", attr->chunk->tag, attr->id, attr->size, attr->file_size);
     }
-    if (next_free == -1) {
-        // Current map is full, we need to expand it to make space.
-        next_free = omrx->chunk_id_map_size;
-        omrx->chunk_id_map_size *= 2; // FIXME: should have a max increment
-        new_id_map = realloc(omrx->chunk_id_map, sizeof(struct idmap_st) * omrx->chunk_id_map_size);
-        if (!new_id_map) {
-            return omrx_os_error(omrx, OMRX_ERR_ALLOC, "Cannot expand lookup table for new chunk ID");
+    if (OMRX_IS_ARRAY_DTYPE(attr->datatype)) {
+        row_size = (uint64_t)attr->cols * OMRX_GET_ELEMSIZE(attr->datatype);
+        if (attr->size % row_size) {
+            return omrx_error(omrx, OMRX_ERR_BAD_CHUNK, "%s:%04x: Encoded array attribute has decoded size (%u) which is not a whole number of rows (file corrupted?)", attr->chunk->tag, attr->id, attr->size);
         }
-        omrx->chunk_id_map = new_id_map;
     }
-    omrx->chunk_id_map[next_free].id = idstr;
-    omrx->chunk_id_map[next_free].chunk = chunk;
+    if (omrx->map && (uint64_t)attr->file_pos + attr->file_size > omrx->map_size) {
+        return omrx_error(omrx, OMRX_ERR_EOF, "%s:%04x: Attribute data extends past end of file", attr->chunk->tag, attr->id);
+    }
 
     return OMRX_OK;
 }
 
-static omrx_status_t deregister_chunk_id(omrx_chunk_t chunk) {
-    omrx_t omrx = chunk->omrx;
-    int i;
+// If the instance was opened with OMRX_OPEN_VERIFY and the attribute has a
+// checksum, check its data as stored in the file (src, attr->file_size bytes,
+// before any decoding or byte-swapping) against it.  The checksum also covers
+// the subheader, which is reconstructed from what was read from it.  Once an
+// attribute has passed, it isn't checked again.
+static omrx_status_t verify_attr_crc(omrx_attr_t attr, const uint8_t *src) {
+    omrx_t omrx = attr->chunk->omrx;
+    uint8_t subheader[6];
+    uint32_t sub_len = 0;
+    uint16_t cols;
+    uint32_t crc;
 
-    if (chunk->id) {
-        for (i = 0; i < omrx->chunk_id_map_size; i++) {
-            if (omrx->chunk_id_map[i].id == chunk->id) {
-                omrx->chunk_id_map[i].id = NULL;
-                break;
-            }
-        }
-        free(chunk->id);
-        chunk->id = NULL;
+    if (!(omrx->open_flags & OMRX_OPEN_VERIFY) || !attr->has_crc || __atomic_load_n(&attr->crc_ok, __ATOMIC_RELAXED)) {
+        return OMRX_OK;
+    }
+    if (attr->file_encoding) {
+        sub_len = put_encoded_subheader(attr->datatype, attr->cols, attr->size, subheader);
+    } else if (OMRX_IS_ARRAY_DTYPE(attr->datatype)) {
+        cols = UINT16_HTOF(attr->cols);
+        memcpy(subheader, &cols, 2);
+        sub_len = 2;
     }
+    crc = omrx_crc32c(0, subheader, sub_len);
+    crc = omrx_crc32c(crc, src, attr->file_size);
+    if (crc != attr->crc) {
+        return omrx_error(omrx, OMRX_ERR_CHECKSUM, "%s:%04x: Attribute data does not match its checksum (file corrupted?)", attr->chunk->tag, attr->id);
+    }
+    __atomic_store_n(&attr->crc_ok, true, __ATOMIC_RELAXED);
 
     return OMRX_OK;
 }
 
-static omrx_status_t lookup_chunk_id(omrx_t omrx, const char *idstr, omrx_chunk_t *result) {
-    int i;
+// Work out how an attribute's encoded data is laid out.  For arrays (in files
+// of version OMRX_VERSION_BLOCKS or later), the encoded data starts with the
+// number of rows in each block (0 if the data isn't split up), followed (if it
+// is) by a table giving the end offset of each block relative to the start of
+// the first one.  Anything else is always a single block.  `src` is the
+// attribute's encoded data, if it's already in memory, or NULL to read what's
+// needed from the file.  The directory must be freed with free_block_dir()
+// afterwards.
+static omrx_status_t read_block_dir(omrx_attr_t attr, const uint8_t *src, struct block_dir *dir) {
+    omrx_t omrx = attr->chunk->omrx;
+    uint32_t row_size;
+    uint64_t count;
+    uint32_t value;
+    uint32_t i;
+    omrx_status_t status;
 
-    for (i = 0; i < omrx->chunk_id_map_size; i++) {
-        if (!strcmp(omrx->chunk_id_map[i].id, idstr)) {
-            *result = omrx->chunk_id_map[i].chunk;
-            return OMRX_OK;
+    memset(dir, 0, sizeof(*dir));
+    dir->count = 1;
+    dir->ends = &dir->single_end;
+    dir->block_bytes = attr->size ? attr->size : 1;
+    dir->single_end = attr->file_size;
+    if (!OMRX_IS_ARRAY_DTYPE(attr->datatype) || omrx->file_version < OMRX_VERSION_BLOCKS) {
+        return OMRX_OK;
+    }
+    if (attr->file_size < 4) {
+        return omrx_error(omrx, OMRX_ERR_BAD_ENCODING, "%s:%04x: Encoded attribute data could not be decoded (file corrupted?)", attr->chunk->tag, attr->id);
+    }
+    CHECK_ERR(read_encoded_bytes(attr, src, 0, 4, &value));
+    dir->block_rows = UINT32_FTOH(value);
+    dir->data_pos = 4;
+    dir->single_end = attr->file_size - 4;
+    if (!dir->block_rows) {
+        return OMRX_OK;
+    }
+    row_size = attr->cols * OMRX_GET_ELEMSIZE(attr->datatype);
+    dir->block_bytes = (uint64_t)dir->block_rows * row_size;
+    count = (attr->size + dir->block_bytes - 1) / dir->block_bytes;
+    if (!count) {
+        count = 1;
+    }
+    if (count > (attr->file_size - 4) / 4) {
+        return omrx_error(omrx, OMRX_ERR_BAD_ENCODING, "%s:%04x: Encoded attribute data could not be decoded (file corrupted?)", attr->chunk->tag, attr->id);
+    }
+    dir->count = count;
+    dir->data_pos = 4 + count * 4;
+    dir->ends = omrx->alloc(omrx, count * 4);
+    CHECK_ALLOC(omrx, dir->ends);
+    status = read_encoded_bytes(attr, src, 4, count * 4, dir->ends);
+    for (i = 0; status >= 0 && i < count; i++) {
+        dir->ends[i] = UINT32_FTOH(dir->ends[i]);
+        if ((i && dir->ends[i] < dir->ends[i - 1]) || dir->ends[i] > attr->file_size - dir->data_pos) {
+            status = omrx_error(omrx, OMRX_ERR_BAD_ENCODING, "%s:%04x: Encoded attribute data could not be decoded (file corrupted?)", attr->chunk->tag, attr->id);
         }
     }
+    if (status < 0) {
+        free_block_dir(omrx, dir);
+    }
 
-    return OMRX_STATUS_NOT_FOUND;
+    return status;
 }
 
-static omrx_status_t read_next_chunk(omrx_t omrx) {
-    struct chunk_header hdr;
-    struct attr_header attr_hdr;
-    omrx_chunk_t chunk;
-    omrx_attr_t attr;
-    off_t file_pos;
-    uint32_t tagint;
-    uint_fast16_t i;
-    uint_fast16_t attr_count;
-    char *idstr;
-
-    CHECK_ERR(read_data(omrx, CHUNKHDR_SIZE, &hdr));
-    file_pos = ftello(omrx->fp);
-    if (file_pos < 0) {
-        return omrx_os_error(omrx, OMRX_ERR_OSERR, "Cannot read file position");
-    }
-    tagint = TAG_TO_TAGINT(hdr.tag);
-    hdr.count = UINT16_FTOH(hdr.count);
-    // Make sure it looks like a valid tag and we're not just reading garbage
-    // at this point (each byte should be in the range 0x40-0x7f)
-    if ((tagint & 0xc0c0c0c0) != 0x40404040) {
-        return omrx_error(omrx, OMRX_ERR_BAD_CHUNK, "Invalid chunk tag found (%08x). File likely corrupted.", tagint);
+static void free_block_dir(omrx_t omrx, struct block_dir *dir) {
+    if (dir->ends != &dir->single_end) {
+        omrx->free(omrx, dir->ends);
     }
+    dir->ends = &dir->single_end;
+}
 
-    chunk = new_chunk(omrx, hdr.tag);
-    CHECK_ALLOC(omrx, chunk);
-    chunk->file_position = file_pos;
-    attr_count = UINT16_FTOH(hdr.count);
+// Copy `size` bytes from `offset` within the attribute's encoded data into
+// dest, either from `src` (the encoded data, if it's in memory already) or
+// from the file.
+static omrx_status_t read_encoded_bytes(omrx_attr_t attr, const uint8_t *src, uint32_t offset, uint32_t size, void *dest) {
+    omrx_t omrx = attr->chunk->omrx;
 
-    for (i=0; i < attr_count; i++) {
-        CHECK_ERR(read_data(omrx, ATTRHDR_SIZE, &attr_hdr));
-        attr_hdr.id = UINT16_FTOH(attr_hdr.id);
-        attr_hdr.datatype = UINT16_FTOH(attr_hdr.datatype);
-        attr_hdr.size = UINT32_FTOH(attr_hdr.size);
-        file_pos = ftello(omrx->fp);
-        if (file_pos < 0) {
-            return omrx_os_error(omrx, OMRX_ERR_OSERR, "Cannot read file position");
-        }
-        attr = new_attr(chunk, attr_hdr.id, attr_hdr.datatype, attr_hdr.size, file_pos);
-        CHECK_ALLOC(omrx, attr);
+    if (src) {
+        memcpy(dest, src + offset, size);
+        return OMRX_OK;
+    }
+    if (omrx->map) {
+        memcpy(dest, omrx->map + attr->file_pos + offset, size);
+        return OMRX_OK;
+    }
 
-        if (OMRX_IS_ARRAY_DTYPE(attr_hdr.datatype)) {
-            CHECK_ERR(read_attr_subheader_array(attr));
-        }
+    return read_data_at(omrx, attr->file_pos + offset, size, dest);
+}
 
-        if (attr_hdr.id == OMRX_ATTR_ID) {
-            //FIXME: an error here isn't necessarily a fatal error
-            if (attr_hdr.datatype == OMRX_DTYPE_UTF8) {
-                CHECK_ERR(load_attr_data(attr, (void **)&idstr));
-                CHECK_ERR(register_chunk_id(chunk, idstr));
-            } else {
-                omrx_warning(omrx, OMRX_WARN_BAD_ATTR, "%s:id attribute has wrong type (%04x).  Ignored.", &chunk->tag, attr_hdr.datatype);
-                CHECK_ERR(skip_data(omrx, attr->size));
-            }
-        } else {
-            CHECK_ERR(skip_data(omrx, attr->size));
+// Decode blocks `first` up to (but not including) `last` of the attribute's
+// encoded data, in parallel if there's more than one.  src points to the
+// start of block `first`'s encoded data, and the decoded data goes into dest
+// (which must have room for all of it).
+static omrx_status_t decode_blocks(omrx_attr_t attr, const struct block_dir *dir, uint32_t first, uint32_t last, const uint8_t *src, uint8_t *dest) {
+    omrx_t omrx = attr->chunk->omrx;
+    struct block_job job;
+    uint64_t size;
+
+    job.attr = attr;
+    job.dir = dir;
+    job.codec = attr->file_encoding & OMRX_CODEC_MASK;
+    job.width = get_swap_width(attr->datatype);
+    job.shuffle = uses_shuffle(attr->datatype, attr->file_encoding);
+    job.first = first;
+    job.src = src;
+    job.dest = dest;
+    job.tmp = NULL;
+    job.failed = false;
+    if (job.shuffle) {
+        size = (uint64_t)(last - first) * dir->block_bytes;
+        if (size > attr->size) {
+            size = attr->size;
         }
-        CHECK_ERR(chunk_add_attr(chunk, attr));
+        job.tmp = omrx->alloc(omrx, (size_t)size + 1);
+        CHECK_ALLOC(omrx, job.tmp);
     }
-    //TODO: check for a toplevel critical tag and take appropriate action
-    if (!omrx->context) {
-        // This is the first (OMRX) chunk.  Set it up as the toplevel chunk.
-        omrx->root_chunk = chunk;
-        omrx->context = chunk;
-    } else {
-        if (tagint == (omrx->context->tagint | END_CHUNK_FLAG)) {
-            // End tag for our current context.  Pop a nesting level.
-            omrx->context = omrx->context->parent;
-            CHECK_ERR(free_chunk(chunk));
-        } else {
-            CHECK_ERR(add_child_chunk(omrx->context, chunk));
-        }
-        if (!(tagint & END_CHUNK_FLAG)) {
-            // This is a start tag.  Push a nesting level onto our context.
-            omrx->context = chunk;
-        }
+    omrx_workers_run(get_workers(omrx), last - first, decode_block_task, &job);
+    if (job.tmp) {
+        omrx->free(omrx, job.tmp);
+    }
+    if (job.failed) {
+        return omrx_error(omrx, OMRX_ERR_BAD_ENCODING, "%s:%04x: Encoded attribute data could not be decoded (file corrupted?)", attr->chunk->tag, attr->id);
     }
+
     return OMRX_OK;
 }
 
-static omrx_status_t read_attr_subheader_array(omrx_attr_t attr) {
-    omrx_t omrx = attr->chunk->omrx;
-
-    if (attr->size < 2) {
-        omrx_warning(omrx, OMRX_WARN_BAD_ATTR, "%s:%04x attribute has bad length.", attr->chunk->tag, attr->id);
-        CHECK_ERR(skip_data(omrx, attr->size));
-        attr->size = 0;
-        return OMRX_WARN_BAD_ATTR;
+// Decode one block (block job->first + index) for decode_blocks().  This runs
+// in worker threads, so it mustn't touch anything shared (not even the
+// allocator, in case it isn't thread-safe).
+static void decode_block_task(void *arg, size_t index) {
+    struct block_job *job = arg;
+    const struct block_dir *dir = job->dir;
+    omrx_attr_t attr = job->attr;
+    uint32_t block = job->first + index;
+    uint32_t base = job->first ? dir->ends[job->first - 1] : 0;
+    uint32_t start = block ? dir->ends[block - 1] : 0;
+    uint32_t len = dir->ends[block] - start;
+    uint64_t offset = (uint64_t)index * dir->block_bytes;
+    uint64_t raw_len = attr->size - (uint64_t)block * dir->block_bytes;
+    const uint8_t *src = job->src + (start - base);
+    uint8_t *dest = job->dest + offset;
+    uint8_t *tmp = job->tmp ? job->tmp + offset : NULL;
+    size_t tail;
+    bool ok = true;
+
+    if (raw_len > dir->block_bytes) {
+        raw_len = dir->block_bytes;
     }
-    CHECK_ERR(read_data(omrx, 2, &attr->cols));
-    attr->cols = UINT16_FTOH(attr->cols);
-    if (!attr->cols) {
-        attr->cols = 1;
+    tail = raw_len % job->width;
+    if (len == raw_len && job->codec) {
+        // Blocks which didn't compress are stored as-is.
+        memcpy(dest, src, len);
+    } else if (job->shuffle) {
+        ok = omrx_decompress(job->codec, tmp, raw_len, src, len);
+        if (ok) {
+            omrx_unshuffle(dest, tmp, job->width, raw_len / job->width);
+            memcpy(dest + raw_len - tail, tmp + raw_len - tail, tail);
+        }
+    } else {
+        ok = omrx_decompress(job->codec, dest, raw_len, src, len);
     }
-    attr->file_pos += 2;
-    attr->size -= 2;
-
-    return OMRX_OK;
+    if (!ok) {
+        __atomic_store_n(&job->failed, true, __ATOMIC_RELAXED);
+        return;
+    }
+    payload_ftoh(attr->datatype, dest, raw_len);
 }
 
-static omrx_status_t write_chunk(omrx_chunk_t chunk, FILE *fp) {
+// Look up an array attribute (of type `dtype`, or any array type if `dtype`
+// is 0) and work out where the given range of rows is within its data.
+// row_count is clamped to the number of rows actually available.  Returns
+// OMRX_STATUS_NOT_FOUND (via API_RESULT) if the attribute doesn't exist or
+// start_row is past the end.
+static omrx_status_t find_array_rows(omrx_chunk_t chunk, uint16_t id, uint16_t dtype, uint32_t start_row, uint32_t *row_count, omrx_attr_t *attr, uint64_t *offset, size_t *size) {
     omrx_t omrx = chunk->omrx;
-    struct chunk_header hdr;
-    omrx_attr_t attr;
-    omrx_chunk_t child;
+    uint32_t row_size;
+    uint32_t total_rows;
 
-    memcpy(hdr.tag, chunk->tag, 4);
-    hdr.count = UINT16_HTOF(chunk->attr_count);
-    CHECK_ERR(write_data(omrx, sizeof(hdr), &hdr, fp));
-    attr = chunk->attrs;
-    while (attr) {
-        CHECK_ERR(write_attr(attr, fp));
-        attr = attr->next;
+    CHECK_ERR(find_attr(chunk, id, attr));
+    if (!*attr) {
+        return API_RESULT(omrx, OMRX_STATUS_NOT_FOUND);
     }
-    if (!(chunk->tagint & END_CHUNK_FLAG)) {
-        // FIXME: make this non-recursive
-        child = chunk->first_child;
-        while (child) {
-            CHECK_ERR(write_chunk(child, fp));
-            child = child->next;
-        }
-        // Write close-tag
-        hdr.tag[3] |= CHUNK_TAG_FLAG;
-        hdr.count = 0;
-        CHECK_ERR(write_data(omrx, sizeof(hdr), &hdr, fp));
+    if (dtype ? (*attr)->datatype != dtype : !OMRX_IS_ARRAY_DTYPE((*attr)->datatype)) {
+        return omrx_error(omrx, OMRX_ERR_WRONG_DTYPE, "Attempt to get array rows of wrong type from attribute %s:%04x (type=%04x).", chunk->tag, id, (*attr)->datatype);
+    }
+    row_size = (*attr)->cols * get_elem_size((*attr)->datatype, (*attr)->size);
+    total_rows = row_size ? (*attr)->size / row_size : 0;
+    if (start_row > total_rows) {
+        return API_RESULT(omrx, OMRX_STATUS_NOT_FOUND);
     }
+    if (*row_count > total_rows - start_row) {
+        *row_count = total_rows - start_row;
+    }
+    *offset = (uint64_t)start_row * row_size;
+    *size = (size_t)*row_count * row_size;
 
     return OMRX_OK;
 }
 
-static omrx_status_t write_attr_subheader_array(omrx_attr_t attr, FILE *fp) {
-    uint16_t cols = UINT16_HTOF(attr->cols);
+static omrx_status_t get_array_rows_into(omrx_chunk_t chunk, uint16_t id, uint16_t dtype, uint32_t start_row, uint32_t row_count, void *buf, size_t buf_size, uint16_t *cols, uint32_t *rows) {
+    if (cols) {
+        *cols = 0;
+    }
+    if (rows) {
+        *rows = 0;
+    }
+    if (!chunk) return OMRX_STATUS_NO_OBJECT;
 
-    return write_data(attr->chunk->omrx, 2, &cols, fp);
-}
+    omrx_t omrx = chunk->omrx;
+    omrx_attr_t attr = NULL;
+    uint64_t offset;
+    size_t size;
 
-static omrx_status_t write_attr(omrx_attr_t attr, FILE *fp) {
+    CHECK_OK(find_array_rows(chunk, id, dtype, start_row, &row_count, &attr, &offset, &size));
+    if (cols) {
+        *cols = attr->cols;
+    }
+    if (rows) {
+        *rows = row_count;
+    }
+    if (buf_size < size) {
+        return omrx_error(omrx, OMRX_ERR_TOO_SMALL, "Buffer too small for attribute %s:%04x (%zu bytes needed).", chunk->tag, id, size);
+    }
+    if (size) {
+        CHECK_ERR(read_attr_into(attr, offset, size, buf));
+    }
+
+    return API_RESULT(omrx, OMRX_OK);
+}
+
+// Get read-only access to the attribute's data (in host order) just long
+// enough to do something with it, without handing anything out to the
+// application (so nothing needs to be pinned).  If a temporary copy had to be
+// made, *tmp is set to it and must be freed by the caller afterwards; if the
+// data is in a shared buffer (in concurrent mode), *shared is set to a
+// reference to it, which must be released.
+static omrx_status_t peek_attr_data(omrx_attr_t attr, const void **src, void **tmp, omrx_buffer_t *shared) {
     omrx_t omrx = attr->chunk->omrx;
-    struct attr_header hdr;
-    void *data;
+    uint32_t width = get_swap_width(attr->datatype);
+    uint8_t *ptr;
+
+    *tmp = NULL;
+    *shared = NULL;
+    if (omrx->open_flags & OMRX_OPEN_CONCURRENT) {
+        *src = snapshot_attr_data(attr, shared);
+        if (*src) {
+            return OMRX_OK;
+        }
+    } else {
+        CHECK_ERR(cache_attr_data(attr));
+        if (attr->data) {
+            *src = attr->data;
+            return OMRX_OK;
+        }
+    }
+    if (omrx->map && !attr->file_encoding && attr->file_pos >= 0 && (uint64_t)attr->file_pos + attr->size <= omrx->map_size) {
+        ptr = omrx->map + attr->file_pos;
+        if (!((uintptr_t)ptr % width) && !OMRX_NEEDS_SWAP(width)) {
+            CHECK_ERR(verify_attr_crc(attr, ptr));
+            *src = ptr;
+            return OMRX_OK;
+        }
+    }
+    CHECK_ERR(load_attr_data(attr, tmp));
+    *src = *tmp;
 
-    hdr.id = UINT16_HTOF(attr->id);
-    hdr.datatype = UINT16_HTOF(attr->datatype);
+    return OMRX_OK;
+}
 
-    if (OMRX_IS_ARRAY_DTYPE(attr->datatype)) {
-        hdr.size = UINT32_HTOF(attr->size + 2);
-        CHECK_ERR(write_data(omrx, sizeof(hdr), &hdr, fp));
-        CHECK_ERR(write_attr_subheader_array(attr, fp));
+// Shared implementation of omrx_get_attr_array_as_float32(), etc.
+// dest_width is 4 for float32 or 8 for float64.  If buf is NULL, a new buffer
+// is allocated and returned in *data.
+static omrx_status_t get_attr_array_converted(omrx_chunk_t chunk, uint16_t id, uint32_t dest_width, uint16_t *cols, uint32_t *rows, void *buf, size_t buf_size, void **data) {
+    if (data) {
+        *data = NULL;
+    }
+    if (cols) {
+        *cols = 0;
+    }
+    if (rows) {
+        *rows = 0;
+    }
+    if (!chunk) return OMRX_STATUS_NO_OBJECT;
+
+    omrx_t omrx = chunk->omrx;
+    omrx_attr_t attr = NULL;
+    omrx_buffer_t shared;
+    omrx_status_t status;
+    uint32_t elem_size;
+    size_t count;
+    size_t size;
+    const void *src;
+    void *tmp;
+    void *dest;
+
+    CHECK_ERR(find_attr(chunk, id, &attr));
+    if (!attr) {
+        return API_RESULT(omrx, OMRX_STATUS_NOT_FOUND);
+    }
+    if (!OMRX_IS_ARRAY_DTYPE(attr->datatype) || !omrx_convert_supported(attr->datatype)) {
+        return omrx_error(omrx, OMRX_ERR_WRONG_DTYPE, "Attempt to get float%u-array value of non-numeric-array attribute %s:%04x (type=%04x).", dest_width * 8, chunk->tag, id, attr->datatype);
+    }
+    elem_size = OMRX_GET_ELEMSIZE(attr->datatype);
+    count = attr->size / elem_size;
+    size = count * dest_width;
+    if (cols) {
+        *cols = attr->cols;
+    }
+    if (rows) {
+        *rows = count / attr->cols;
+    }
+    if (buf) {
+        if (buf_size < size) {
+            return omrx_error(omrx, OMRX_ERR_TOO_SMALL, "Buffer too small for attribute %s:%04x (%zu bytes needed).", chunk->tag, id, size);
+        }
+        dest = buf;
     } else {
-        hdr.size = UINT32_HTOF(attr->size);
-        CHECK_ERR(write_data(omrx, sizeof(hdr), &hdr, fp));
+        dest = omrx->alloc(omrx, size ? size : 1);
+        CHECK_ALLOC(omrx, dest);
+    }
+    status = peek_attr_data(attr, &src, &tmp, &shared);
+    if (status >= 0) {
+        if (dest_width == 4) {
+            omrx_convert_to_float32(dest, src, attr->datatype, count);
+        } else {
+            omrx_convert_to_float64(dest, src, attr->datatype, count);
+        }
+    }
+    omrx_buffer_release(shared);
+    if (tmp) {
+        omrx->free(omrx, tmp);
+    }
+    if (status < 0) {
+        if (!buf) {
+            omrx->free(omrx, dest);
+        }
+        return status;
+    }
+    if (data) {
+        *data = dest;
+    }
+
+    return API_RESULT(omrx, OMRX_OK);
+}
+
+// Like load_attr_data, but returns a pointer to the data without making a copy
+// for the caller.  The returned pointer is borrowed: it points either into
+// attr->data or directly into the file mapping (if the file was opened with
+// OMRX_OPEN_MMAP), and remains valid until the attribute is modified or the
+// OMRX instance is freed.  The caller must not free it.
+static omrx_status_t borrow_attr_data(omrx_attr_t attr, void **dest) {
+    omrx_t omrx = attr->chunk->omrx;
+    omrx_status_t status;
+
+    if (!(omrx->open_flags & OMRX_OPEN_CONCURRENT)) {
+        return borrow_attr_data_locked(attr, dest);
+    }
+    // This may need to fill in attr->data, and other threads may be trying
+    // to do the same thing with the same attribute.
+    pthread_mutex_lock(&omrx->attr_lock);
+    status = borrow_attr_data_locked(attr, dest);
+    pthread_mutex_unlock(&omrx->attr_lock);
+
+    return status;
+}
+
+static omrx_status_t borrow_attr_data_locked(omrx_attr_t attr, void **dest) {
+    omrx_t omrx = attr->chunk->omrx;
+    uint8_t *ptr;
+    uint32_t align;
+
+    if (attr->data) {
+        if (attr->cached) {
+            // The caller is going to hang onto this, so it can't be evicted
+            // from the cache anymore.
+            cache_touch(attr);
+            attr->pinned = true;
+        }
+        *dest = attr->data;
+        return OMRX_OK;
+    }
+    if (attr->file_pos < 0) {
+        return omrx_error(omrx, OMRX_ERR_INTERNAL, "%s:%04x: Attempt to read from non-file-backed attribute!", attr->chunk->tag, attr->id);
+    }
+    if (omrx->open_flags & OMRX_OPEN_CONCURRENT && (!omrx->map || attr->file_encoding)) {
+        CHECK_ERR(load_shared_data(attr));
+        *dest = attr->data;
+        return OMRX_OK;
+    }
+    if (!omrx->map || attr->file_encoding) {
+        // No mapping available (or the data in it needs decoding), so the
+        // best we can do is read it into memory and hang onto it.
+        omrx->cache.misses++;
+        CHECK_ERR(load_attr_data(attr, &attr->data));
+        attr->own_data = true;
+        attr->pinned = true;
+        cache_insert(attr);
+        *dest = attr->data;
+        return OMRX_OK;
+    }
+    if ((uint64_t)attr->file_pos + attr->size > omrx->map_size) {
+        return omrx_error(omrx, OMRX_ERR_EOF, "%s:%04x: Attribute data extends past end of file", attr->chunk->tag, attr->id);
+    }
+    ptr = omrx->map + attr->file_pos;
+    CHECK_ERR(verify_attr_crc(attr, ptr));
+    align = get_elem_size(attr->datatype, attr->size);
+    if ((OMRX_IS_SIMPLE_DTYPE(attr->datatype) || OMRX_IS_ARRAY_DTYPE(attr->datatype)) && ((uintptr_t)ptr % align || OMRX_NEEDS_SWAP(align))) {
+        // The data isn't suitably aligned in the file to be accessed directly
+        // as its element type (or isn't in host byte order), so we need to
+        // make a copy of it.
+        if (omrx->open_flags & OMRX_OPEN_CONCURRENT) {
+            CHECK_ERR(load_shared_data(attr));
+            *dest = attr->data;
+            return OMRX_OK;
+        }
+        attr->data = omrx->alloc(omrx, attr->size);
+        CHECK_ALLOC(omrx, attr->data);
+        memcpy(attr->data, ptr, attr->size);
+        payload_ftoh(attr->datatype, attr->data, attr->size);
+        attr->own_data = true;
+        attr->pinned = true;
+        cache_insert(attr);
+        *dest = attr->data;
+        return OMRX_OK;
+    }
+    *dest = ptr;
+
+    return OMRX_OK;
+}
+
+// Discard any in-memory data for the attribute, freeing it if we own it.
+static void drop_attr_data(omrx_attr_t attr) {
+    omrx_t omrx = attr->chunk->omrx;
+
+    cache_unlink(attr);
+    if (attr->shared) {
+        // Other readers may still have references to the buffer.
+        omrx_buffer_release(attr->shared);
+        attr->shared = NULL;
+    } else if (attr->data && attr->own_data) {
+        omrx->free(omrx, attr->data);
+    }
+    attr->data = NULL;
+    attr->own_data = false;
+}
+
+// Discard the attribute's data if it is just a (cached) copy of what's in the
+// file.  Data which has been set or modified locally is left alone, and
+// OMRX_STATUS_NOT_FOUND is returned.
+static omrx_status_t release_attr_data(omrx_attr_t attr) {
+    if (!attr->data) {
+        return OMRX_OK;
+    }
+    if (!attr->cached) {
+        return OMRX_STATUS_NOT_FOUND;
+    }
+    drop_attr_data(attr);
+
+    return OMRX_OK;
+}
+
+// Make sure the attribute's data is loaded into attr->data, keeping it in the
+// LRU cache so that later reads can be satisfied from memory.  Returns
+// OMRX_STATUS_NOT_FOUND if the data isn't (and shouldn't be) held in memory,
+// in which case the caller needs to read it from the file itself.  That is
+// the case if the file is mapped (there's no point keeping a second copy,
+// unless the data had to be decoded), if caching is off or the data is too
+// large for the cache, and in concurrent mode, where nothing gets cached
+// because other threads may be using the same attributes.  (In that mode,
+// other threads may also drop attr->data at any time, so it can only be used
+// with attr_lock held; this doesn't look at it at all.)
+static omrx_status_t cache_attr_data(omrx_attr_t attr) {
+    omrx_t omrx = attr->chunk->omrx;
+
+    if (omrx->open_flags & OMRX_OPEN_CONCURRENT) {
+        return OMRX_STATUS_NOT_FOUND;
     }
-    // FIXME: endianness of data, encoding, etc
     if (attr->data) {
-        CHECK_ERR(write_data(omrx, attr->size, attr->data, fp));
+        if (attr->cached) {
+            omrx->cache.hits++;
+            cache_touch(attr);
+        }
+        return OMRX_OK;
+    }
+    if ((omrx->map && !attr->file_encoding) || attr->file_pos < 0 || !omrx->cache.limit || attr->size > omrx->cache.limit) {
+        return OMRX_STATUS_NOT_FOUND;
+    }
+    omrx->cache.misses++;
+    CHECK_ERR(load_attr_data(attr, &attr->data));
+    attr->own_data = true;
+    cache_insert(attr);
+
+    return OMRX_OK;
+}
+
+// Return a new reference to a shared buffer containing the attribute's data.
+// If the attribute doesn't already have one, a buffer is created and (where
+// possible) the attribute switches to using it as its own data, so that
+// everyone is using the same copy.
+static omrx_status_t share_attr_data(omrx_attr_t attr, omrx_buffer_t *result) {
+    omrx_t omrx = attr->chunk->omrx;
+    omrx_buffer_t buf;
+    omrx_status_t status;
+
+    if (omrx->open_flags & OMRX_OPEN_CONCURRENT) {
+        // Other threads may attach or drop the attribute's buffer at any
+        // time, so it can only be looked at (and retained) under the lock.
+        pthread_mutex_lock(&omrx->attr_lock);
+        buf = attr->shared ? omrx_buffer_retain(attr->shared) : NULL;
+        pthread_mutex_unlock(&omrx->attr_lock);
+        if (buf) {
+            *result = buf;
+            return OMRX_OK;
+        }
+    } else if (attr->shared) {
+        if (attr->cached) {
+            omrx->cache.hits++;
+            cache_touch(attr);
+        }
+        *result = omrx_buffer_retain(attr->shared);
+        return OMRX_OK;
+    }
+    buf = new_shared_buffer(omrx, attr->size);
+    CHECK_ALLOC(omrx, buf);
+    if (omrx->open_flags & OMRX_OPEN_CONCURRENT) {
+        status = read_attr_file(attr, 0, attr->size, buf->data);
     } else {
-        // We need to load the data before we can write it out again
-        CHECK_ERR(load_attr_data(attr, &data));
-        CHECK_ERR(write_data(omrx, attr->size, data, fp));
-        omrx->free(omrx, data);
+        status = read_attr_into(attr, 0, attr->size, buf->data);
+    }
+    if (status < 0) {
+        omrx_buffer_release(buf);
+        return status;
     }
 
+    if (!(omrx->open_flags & OMRX_OPEN_CONCURRENT)) {
+        attach_shared_buffer(attr, buf);
+        *result = buf;
+        return OMRX_OK;
+    }
+    // Another thread may have got there first, in which case we just use its
+    // buffer instead.  (Other threads only ever use a buffer attached here
+    // through references of their own, taken under attr_lock, so it can be
+    // dropped again once they've all been released; see cache_evict().)
+    pthread_mutex_lock(&omrx->attr_lock);
+    if (attr->shared) {
+        *result = omrx_buffer_retain(attr->shared);
+        pthread_mutex_unlock(&omrx->attr_lock);
+        omrx_buffer_release(buf);
+        return OMRX_OK;
+    }
+    if (!attr->data) {
+        attr->data = buf->data;
+        attr->shared = omrx_buffer_retain(buf);
+        cache_insert(attr);
+    }
+    pthread_mutex_unlock(&omrx->attr_lock);
+    *result = buf;
+
     return OMRX_OK;
 }
 
-static uint32_t get_elem_size(uint16_t dtype, uint32_t total_size) {
-    if (OMRX_IS_SIMPLE_DTYPE(dtype) || OMRX_IS_ARRAY_DTYPE(dtype)) {
-        // For simple and array types, the low two bits always indicate the
-        // element width.
-        return OMRX_GET_ELEMSIZE(dtype);
+// Allocate a new shared buffer with room for `size` bytes of data (plus a
+// NUL, which keeps strings terminated), with one reference to it.  The buffer
+// also holds a reference to the instance (see struct omrx), so that it can
+// still be freed with the instance's free function if it outlives it.
+static omrx_buffer_t new_shared_buffer(omrx_t omrx, size_t size) {
+    omrx_buffer_t buf;
+
+    buf = omrx->alloc(omrx, sizeof(struct omrx_buffer) + size + 1);
+    if (!buf) {
+        return NULL;
     }
-    switch (dtype) {
-        case OMRX_DTYPE_UTF8:
-        case OMRX_DTYPE_RAW:
-            return total_size;
+    buf->refcount = 1;
+    buf->size = size;
+    buf->omrx = omrx;
+    ((uint8_t *)buf->data)[size] = 0;
+    __atomic_add_fetch(&omrx->refcount, 1, __ATOMIC_RELAXED);
+
+    return buf;
+}
+
+// Get hold of the attribute's in-memory data (if it has any) in concurrent
+// mode, where other threads may attach or drop attr->data at any time.  Data
+// from the file is only ever kept in attr->data in a shared buffer in that
+// mode (see load_shared_data()), so a reference to the buffer is returned in
+// *buf, and the data can be used without holding attr_lock until that is
+// released.  Anything else in attr->data was set by the application, and
+// stays put.  Returns NULL if the data isn't in memory.
+static const void *snapshot_attr_data(omrx_attr_t attr, omrx_buffer_t *buf) {
+    omrx_t omrx = attr->chunk->omrx;
+    const void *data;
+
+    pthread_mutex_lock(&omrx->attr_lock);
+    *buf = attr->shared ? omrx_buffer_retain(attr->shared) : NULL;
+    data = attr->data;
+    pthread_mutex_unlock(&omrx->attr_lock);
+
+    return data;
+}
+
+// Read the attribute's data from the file into a new shared buffer, and make
+// that the attribute's data.  This is how data gets loaded into attr->data in
+// concurrent mode (see snapshot_attr_data()).  attr_lock must be held.
+static omrx_status_t load_shared_data(omrx_attr_t attr) {
+    omrx_t omrx = attr->chunk->omrx;
+    omrx_buffer_t buf;
+    omrx_status_t status;
+
+    buf = new_shared_buffer(omrx, attr->size);
+    CHECK_ALLOC(omrx, buf);
+    status = read_attr_file(attr, 0, attr->size, buf->data);
+    if (status < 0) {
+        omrx_buffer_release(buf);
+        return status;
     }
+    attr->data = buf->data;
+    attr->shared = buf;
+    attr->pinned = true;
+    cache_insert(attr);
 
-    // We don't know about this type.  The only thing we can do is return 0.
-    return 0;
+    return OMRX_OK;
 }
 
-/** @endcond */
+// Drop a reference to the instance's memory, freeing it once the last one has
+// gone (see struct omrx).
+static void put_instance(omrx_t omrx) {
+    if (__atomic_sub_fetch(&omrx->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        omrx->free(omrx, omrx);
+    }
+}
 
-/////////////// External Chunk API ///////////////////
+// Make a newly created shared buffer the attribute's data, replacing any copy
+// it had before, so that later callers get the same buffer.  Data loaded from
+// the file goes into the cache, where it stays for as long as anybody else
+// has a reference to the buffer, however small the cache is, and after that
+// is discarded like anything else (see cache_evict()).  Locally set data just
+// stays with the attribute.
+static void attach_shared_buffer(omrx_attr_t attr, omrx_buffer_t buf) {
+    omrx_t omrx = attr->chunk->omrx;
+    bool from_file = !attr->data || attr->cached;
 
-/** @defgroup api The libomrx API
-  *
-  * @{
-  */
+    if (!attr->data) {
+        omrx->cache.misses++;
+    }
+    if (attr->pinned) {
+        // The application has a borrowed pointer to the existing data, so we
+        // can't replace it.
+        return;
+    }
+    drop_attr_data(attr);
+    attr->data = buf->data;
+    attr->shared = omrx_buffer_retain(buf);
+    if (from_file) {
+        cache_insert(attr);
+    }
+}
 
-/** @defgroup init Library Initialization and OMRX Instances
+// Add an attribute (whose data has just been loaded) to the head of the
+// cache, and make room for it if necessary.
+static void cache_insert(omrx_attr_t attr) {
+    struct omrx_cache *cache = &attr->chunk->omrx->cache;
+
+    attr->cached = true;
+    attr->cache_prev = NULL;
+    attr->cache_next = cache->head;
+    if (cache->head) {
+        cache->head->cache_prev = attr;
+    } else {
+        cache->tail = attr;
+    }
+    cache->head = attr;
+    cache->size += attr->size;
+    cache->entries++;
+    cache_evict(attr->chunk->omrx, cache->limit, attr);
+}
+
+// Move a cached attribute to the head of the list (most recently used).
+static void cache_touch(omrx_attr_t attr) {
+    struct omrx_cache *cache = &attr->chunk->omrx->cache;
+
+    if (cache->head == attr) {
+        return;
+    }
+    attr->cache_prev->cache_next = attr->cache_next;
+    if (attr->cache_next) {
+        attr->cache_next->cache_prev = attr->cache_prev;
+    } else {
+        cache->tail = attr->cache_prev;
+    }
+    attr->cache_prev = NULL;
+    attr->cache_next = cache->head;
+    cache->head->cache_prev = attr;
+    cache->head = attr;
+}
+
+// Remove an attribute from the cache (if it's in it), leaving its data alone.
+// This is used when the data is about to be freed, or when it's about to be
+// modified and so is no longer just a copy of what's in the file.
+static void cache_unlink(omrx_attr_t attr) {
+    struct omrx_cache *cache = &attr->chunk->omrx->cache;
+
+    if (!attr->cached) {
+        return;
+    }
+    if (attr->cache_prev) {
+        attr->cache_prev->cache_next = attr->cache_next;
+    } else {
+        cache->head = attr->cache_next;
+    }
+    if (attr->cache_next) {
+        attr->cache_next->cache_prev = attr->cache_prev;
+    } else {
+        cache->tail = attr->cache_prev;
+    }
+    attr->cache_prev = NULL;
+    attr->cache_next = NULL;
+    attr->cached = false;
+    attr->pinned = false;
+    cache->size -= attr->size;
+    cache->entries--;
+}
+
+// Discard least-recently-used data until the cache is no larger than `limit`.
+// `keep` (if not NULL) is never discarded, and nor is pinned data or a shared
+// buffer which anybody other than the attribute still has a reference to.
+static void cache_evict(omrx_t omrx, size_t limit, omrx_attr_t keep) {
+    struct omrx_cache *cache = &omrx->cache;
+    omrx_attr_t attr = cache->tail;
+    omrx_attr_t prev;
+
+    if (!omrx->fp && !omrx->map) {
+        // The file has been closed, so anything we discarded now couldn't be
+        // read back in again later.
+        return;
+    }
+    while (attr && cache->size > limit) {
+        prev = attr->cache_prev;
+        if (attr != keep && !attr->pinned && (!attr->shared || __atomic_load_n(&attr->shared->refcount, __ATOMIC_ACQUIRE) == 1)) {
+            drop_attr_data(attr);
+            cache->evictions++;
+        }
+        attr = prev;
+    }
+}
+
+static omrx_status_t find_attr(omrx_chunk_t chunk, uint16_t id, omrx_attr_t *dest) {
+    omrx_attr_t attr = chunk->attrs;
+
+    while (attr) {
+        if (attr->id == id) {
+            *dest = attr;
+            return OMRX_OK;
+        }
+        attr = attr->next;
+    }
+
+    *dest = NULL;
+    return OMRX_STATUS_NOT_FOUND;
+}
+
+static omrx_status_t chunk_add_attr(omrx_chunk_t chunk, omrx_attr_t attr) {
+    omrx_attr_t ptr = (omrx_attr_t)(&chunk->attrs);
+
+    while (ptr->next) {
+        if (ptr->next->id > attr->id) break;
+        ptr = ptr->next;
+    }
+    attr->next = ptr->next;
+    ptr->next = attr;
+    chunk->attr_count += 1;
+
+    return OMRX_OK;
+}
+
+static omrx_status_t add_child_chunk(omrx_chunk_t parent, omrx_chunk_t child) {
+    omrx_t omrx = parent->omrx;
+
+    child->parent = parent;
+    if (!parent->first_child) {
+        parent->first_child = child;
+        parent->last_child = child;
+    } else {
+        parent->last_child->next = child;
+        parent->last_child = child;
+    }
+    parent->child_count += 1;
+    if (parent->tag_index && !tag_index_add(omrx, &parent->tag_index, child)) {
+        // Just drop the index (it will be rebuilt when next needed).
+        omrx->free(omrx, parent->tag_index);
+        parent->tag_index = NULL;
+    }
+
+    return OMRX_OK;
+}
+
+static omrx_status_t map_file(omrx_t omrx) {
+    struct stat st;
+    void *map;
+
+    if (fstat(fileno(omrx->fp), &st) < 0) {
+        return omrx_os_error(omrx, OMRX_ERR_OSERR, "Cannot determine file size");
+    }
+    if (st.st_size == 0) {
+        // Can't map an empty file.  This will fail properly when we try to
+        // scan it.
+        return OMRX_OK;
+    }
+    if ((uint64_t)st.st_size > SIZE_MAX) {
+        errno = EFBIG;
+        return omrx_os_error(omrx, OMRX_ERR_OSERR, "Cannot map file");
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fileno(omrx->fp), 0);
+    if (map == MAP_FAILED) {
+        return omrx_os_error(omrx, OMRX_ERR_OSERR, "Cannot map file");
+    }
+    omrx->map = map;
+    omrx->map_size = st.st_size;
+
+    return OMRX_OK;
+}
+
+static void unmap_file(omrx_t omrx) {
+    if (omrx->map) {
+        munmap(omrx->map, omrx->map_size);
+        omrx->map = NULL;
+        omrx->map_size = 0;
+    }
+}
+
+// How much of the file the scanner reads at a time.  When reading
+// sequentially, more read-ahead means fewer (larger) reads, but when jumping
+// around, most of a large buffer would be wasted.
+static size_t scan_buffer_size(omrx_t omrx) {
+    switch (omrx->advice) {
+    case OMRX_ADVICE_SEQUENTIAL:
+    case OMRX_ADVICE_DONTNEED:
+        return OMRX_SCAN_BUFSIZE_SEQUENTIAL;
+    case OMRX_ADVICE_RANDOM:
+        return OMRX_SCAN_BUFSIZE_RANDOM;
+    default:
+        return OMRX_SCAN_BUFSIZE;
+    }
+}
+
+static omrx_status_t scan_begin(omrx_t omrx) {
+    struct omrx_scanner *scan = &omrx->scan;
+    struct stat st;
+
+    scan->pos = ftello(omrx->fp);
+    if (scan->pos < 0) {
+        return omrx_os_error(omrx, OMRX_ERR_OSERR, "Cannot read file position");
+    }
+    scan->file_size = -1;
+    if (omrx->map) {
+        scan->file_size = omrx->map_size;
+    } else if (fstat(fileno(omrx->fp), &st) == 0 && S_ISREG(st.st_mode)) {
+        scan->file_size = st.st_size;
+    }
+    if (omrx->map) {
+        scan->buf = omrx->map;
+        scan->buf_size = omrx->map_size;
+        scan->own_buf = false;
+        scan->buf_pos = 0;
+        scan->buf_len = omrx->map_size;
+    } else {
+        scan->buf_size = scan_buffer_size(omrx);
+        scan->buf = omrx->alloc(omrx, scan->buf_size);
+        CHECK_ALLOC(omrx, scan->buf);
+        scan->own_buf = true;
+        // Empty, but at the start position, so the first fill reads a whole
+        // buffer's worth.
+        scan->buf_pos = scan->pos;
+        scan->buf_len = 0;
+    }
+    scan->fill_size = scan->buf_size;
+
+    return OMRX_OK;
+}
+
+static void scan_end(omrx_t omrx) {
+    struct omrx_scanner *scan = &omrx->scan;
+
+    if (scan->own_buf) {
+        omrx->free(omrx, scan->buf);
+    }
+    scan->buf = NULL;
+    scan->buf_size = 0;
+    scan->own_buf = false;
+    scan->buf_len = 0;
+}
+
+// Make sure the next `size` bytes from the current position are in the
+// buffer, refilling it from the file if necessary.  `size` must not be larger
+// than the buffer.
+static omrx_status_t scan_fill(omrx_t omrx, size_t size) {
+    struct omrx_scanner *scan = &omrx->scan;
+    size_t want;
+    size_t count;
+
+    if (scan->pos >= scan->buf_pos && (uint64_t)(scan->pos - scan->buf_pos) + size <= scan->buf_len) {
+        return OMRX_OK;
+    }
+    if (!scan->own_buf) {
+        // The buffer is the whole file, so there's nothing more to get.
+        return omrx_error(omrx, OMRX_ERR_EOF, "Read error: Unexpected end of file");
+    }
+    // After skipping past the buffer (over attribute data, say), the next
+    // thing wanted is probably just a few headers, so only read a little to
+    // start with, and read more again as long as the reads follow on from
+    // each other.
+    if (scan->pos >= scan->buf_pos && scan->pos <= scan->buf_pos + (off_t)scan->buf_len) {
+        scan->fill_size = scan->fill_size * 2 < scan->buf_size ? scan->fill_size * 2 : scan->buf_size;
+    } else {
+        scan->fill_size = OMRX_SCAN_FILL_MIN < scan->buf_size ? OMRX_SCAN_FILL_MIN : scan->buf_size;
+    }
+    want = size > scan->fill_size ? size : scan->fill_size;
+    CHECK_ERR(seek_to_pos(omrx, scan->pos));
+    errno = 0;
+    count = fread(scan->buf, 1, want, omrx->fp);
+    LOG_IO("- fill %lu @ %lu\n", count, scan->pos);
+    drop_behind(omrx, scan->pos, count);
+    scan->buf_pos = scan->pos;
+    scan->buf_len = count;
+    if (count < size) {
+        if (ferror(omrx->fp)) {
+            return omrx_os_error(omrx, OMRX_ERR_OSERR, "Read error");
+        }
+        return omrx_error(omrx, OMRX_ERR_EOF, "Read error: Unexpected end of file");
+    }
+
+    return OMRX_OK;
+}
+
+static omrx_status_t scan_read(omrx_t omrx, size_t size, void *dest) {
+    struct omrx_scanner *scan = &omrx->scan;
+
+    if (size > scan->buf_size) {
+        // Too big to go through the buffer, just read it directly.
+        if (omrx->map) {
+            return omrx_error(omrx, OMRX_ERR_EOF, "Read error: Unexpected end of file");
+        }
+        CHECK_ERR(seek_to_pos(omrx, scan->pos));
+        errno = 0;
+        CHECK_ERR(read_data(omrx, size, dest));
+    } else {
+        CHECK_ERR(scan_fill(omrx, size));
+        memcpy(dest, scan->buf + (scan->pos - scan->buf_pos), size);
+    }
+    scan->pos += size;
+
+    return OMRX_OK;
+}
+
+static void scan_skip(omrx_t omrx, off_t size) {
+    LOG_IO("- skip %lu\n", size);
+    omrx->scan.pos += size;
+}
+
+static omrx_status_t omrx_scan(omrx_t omrx) {
+    omrx_status_t status;
+    off_t start;
+
+    if (!(omrx->open_flags & (OMRX_OPEN_NO_TOC | OMRX_OPEN_LAZY))) {
+        start = ftello(omrx->fp);
+        if (start < 0) {
+            return omrx_os_error(omrx, OMRX_ERR_OSERR, "Cannot read file position");
+        }
+        status = load_toc(omrx, start);
+        if (status != OMRX_STATUS_NOT_FOUND) {
+            return status;
+        }
+        // No usable TOC.  Go back and do it the hard way.
+        CHECK_ERR(seek_to_pos(omrx, start));
+    }
+    CHECK_ERR(scan_begin(omrx));
+    status = scan_all_chunks(omrx);
+    if (!(omrx->open_flags & OMRX_OPEN_LAZY) || status < 0) {
+        // (In lazy mode, we keep the scanner around for loading the rest of
+        // the file later.)
+        scan_end(omrx);
+    }
+
+    return status;
+}
+
+static omrx_status_t scan_all_chunks(omrx_t omrx) {
+    off_t file_pos;
+    uint8_t tag[4];
+
+    file_pos = omrx->scan.pos;
+    CHECK_ERR(scan_read(omrx, 4, &tag));
+    if (memcmp(tag, "OMRX", 4)) {
+        return omrx_error(omrx, OMRX_ERR_BAD_MAGIC, "Bad data at beginning of file (not an OMRX file?)");
+    }
+    //FIXME: check whether we've already been read/populated before
+    omrx->scan.pos = file_pos;
+    if (omrx->root_chunk) {
+        free_all_chunks(omrx->root_chunk);
+        omrx->root_chunk = NULL;
+    }
+    omrx->context = NULL;
+    CHECK_ERR(read_next_chunk(omrx));
+    CHECK_ERR(check_version(omrx));
+    if (omrx->open_flags & OMRX_OPEN_LAZY) {
+        // Only read the toplevel chunks for now.
+        omrx->root_chunk->children_pos = omrx->scan.pos;
+        omrx->root_chunk->unloaded = true;
+        omrx->unloaded_count += 1;
+        return load_children(omrx->root_chunk);
+    }
+    while (omrx->context) {
+        CHECK_ERR(read_next_chunk(omrx));
+    }
+
+    return OMRX_OK;
+}
+
+// Read all the direct children of a chunk, starting from the file position in
+// parent->children_pos and continuing up to its end tag.  Any children which
+// have children of their own are not descended into, but are just marked as
+// unloaded, to be read later by load_children().
+static omrx_status_t read_child_chunks(omrx_chunk_t parent) {
+    omrx_t omrx = parent->omrx;
+    omrx_chunk_t child;
+
+    omrx->scan.pos = parent->children_pos;
+    omrx->context = parent;
+    while (omrx->context != parent->parent) {
+        CHECK_ERR(read_next_chunk(omrx));
+        if (omrx->context != parent && omrx->context != parent->parent) {
+            // We just read the start tag of a child with its own children.
+            child = omrx->context;
+            child->children_pos = omrx->scan.pos;
+            child->unloaded = true;
+            omrx->unloaded_count += 1;
+            CHECK_ERR(skip_subtree(omrx, child->tagint));
+            omrx->context = parent;
+        }
+    }
+    omrx->context = NULL;
+
+    return OMRX_OK;
+}
+
+// Skip over the contents of a chunk (whose start tag has already been read),
+// up to and including its end tag, without creating any chunks or attributes.
+static omrx_status_t skip_subtree(omrx_t omrx, uint32_t tagint) {
+    struct chunk_header hdr;
+    struct attr_header attr_hdr;
+    uint32_t *stack;
+    uint32_t *new_stack;
+    size_t stack_size = 64;
+    size_t depth = 0;
+    uint_fast16_t i;
+    omrx_status_t status = OMRX_OK;
+
+    stack = omrx->alloc(omrx, sizeof(uint32_t) * stack_size);
+    CHECK_ALLOC(omrx, stack);
+    stack[depth++] = tagint;
+    while (depth) {
+        status = scan_read(omrx, CHUNKHDR_SIZE, &hdr);
+        if (status < 0) break;
+        tagint = TAG_TO_TAGINT(hdr.tag);
+        if ((tagint & 0xc0c0c0c0) != 0x40404040) {
+            status = omrx_error(omrx, OMRX_ERR_BAD_CHUNK, "Invalid chunk tag found (%08x). File likely corrupted.", tagint);
+            break;
+        }
+        for (i = 0; i < UINT16_FTOH(hdr.count); i++) {
+            status = scan_read(omrx, ATTRHDR_SIZE, &attr_hdr);
+            if (status < 0) break;
+            scan_skip(omrx, UINT32_FTOH(attr_hdr.size));
+        }
+        if (status < 0) break;
+        if (tagint == (stack[depth - 1] | END_CHUNK_FLAG)) {
+            depth--;
+        } else if (!(tagint & END_CHUNK_FLAG)) {
+            if (depth == stack_size) {
+                new_stack = omrx->alloc(omrx, sizeof(uint32_t) * stack_size * 2);
+                if (!new_stack) {
+                    status = omrx_error(omrx, OMRX_ERR_ALLOC, "Memory allocation failed");
+                    break;
+                }
+                memcpy(new_stack, stack, sizeof(uint32_t) * stack_size);
+                omrx->free(omrx, stack);
+                stack = new_stack;
+                stack_size *= 2;
+            }
+            stack[depth++] = tagint;
+        }
+    }
+    omrx->free(omrx, stack);
+
+    return status < 0 ? status : OMRX_OK;
+}
+
+// If the chunk's children haven't been read from the file yet (see
+// OMRX_OPEN_LAZY), read them now.  If that fails part way through, any
+// children which were read before the error are thrown away again, leaving the
+// chunk unloaded, so that a later attempt starts afresh rather than adding the
+// same children a second time.
+static omrx_status_t load_children(omrx_chunk_t chunk) {
+    omrx_t omrx = chunk->omrx;
+    omrx_chunk_t last = chunk->last_child;
+    omrx_chunk_t child;
+    omrx_chunk_t next;
+    omrx_status_t status;
+
+    if (!chunk->unloaded) {
+        return OMRX_OK;
+    }
+    if (!omrx->scan.buf) {
+        return omrx_error(omrx, OMRX_ERR_NOT_OPEN, "Attempt to read chunks from a closed file");
+    }
+    status = read_child_chunks(chunk);
+    if (status < 0) {
+        omrx->context = NULL;
+        child = last ? last->next : chunk->first_child;
+        if (last) {
+            last->next = NULL;
+        } else {
+            chunk->first_child = NULL;
+        }
+        chunk->last_child = last;
+        while (child) {
+            next = child->next;
+            chunk->child_count -= 1;
+            free_all_chunks(child);
+            child = next;
+        }
+        if (chunk->tag_index) {
+            // (It will be rebuilt when next needed.)
+            omrx->free(omrx, chunk->tag_index);
+            chunk->tag_index = NULL;
+        }
+        return status;
+    }
+    chunk->unloaded = false;
+    omrx->unloaded_count -= 1;
+
+    return OMRX_OK;
+}
+
+// Load everything still unloaded in the whole tree.
+static omrx_status_t load_all_children(omrx_t omrx) {
+    struct tree_walk walk;
+    omrx_chunk_t chunk;
+
+    for (chunk = walk_start(&walk, omrx->root_chunk); chunk; chunk = walk_next_entered(&walk, true)) {
+        CHECK_ERR(load_children(chunk));
+    }
+
+    return OMRX_OK;
+}
+
+static omrx_status_t check_version(omrx_t omrx) {
+    uint32_t ver = OMRX_MIN_VERSION;
+
+    CHECK_ERR(omrx_get_version(omrx, &ver));
+    omrx->file_version = ver;
+
+    return check_version_number(omrx, ver);
+}
+
+static omrx_status_t check_version_number(omrx_t omrx, uint32_t ver) {
+    if (ver > OMRX_VERSION) {
+        if (OMRX_VER_MAJOR(ver) > OMRX_VER_MAJOR(OMRX_VERSION)) {
+            return omrx_error(omrx, OMRX_ERR_BAD_VER, "File version (%d.%d) is unsupported by this software (software version is %d.%d).", OMRX_VER_MAJOR(ver), OMRX_VER_MINOR(ver), OMRX_VER_MAJOR(OMRX_VERSION), OMRX_VER_MINOR(OMRX_VERSION));
+        } else {
+            omrx_warning(omrx, OMRX_WARN_BAD_VER, "File version (%d.%d) is greater than supported version (%d.%d).  Some features may be unavailable.", OMRX_VER_MAJOR(ver), OMRX_VER_MINOR(ver), OMRX_VER_MAJOR(OMRX_VERSION), OMRX_VER_MINOR(OMRX_VERSION));
+        }
+    }
+
+    return OMRX_OK;
+}
+
+// FNV-1a.  Chunk IDs are generally short strings, so this is plenty good
+// enough and very cheap to compute.
+static uint32_t hash_chunk_id(const char *idstr) {
+    uint32_t hash = 2166136261u;
+
+    while (*idstr) {
+        hash ^= (uint8_t)*idstr++;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+// Rebuild the chunk ID index with a new number of slots (which must be a
+// power of two), dropping any tombstones in the process.
+static omrx_status_t resize_chunk_id_map(omrx_t omrx, size_t new_size) {
+    struct idmap_st *old_map = omrx->chunk_id_map;
+    size_t old_size = omrx->chunk_id_map_size;
+    struct idmap_st *new_map;
+    size_t mask = new_size - 1;
+    size_t i, j;
+
+    new_map = omrx->alloc(omrx, sizeof(struct idmap_st) * new_size);
+    if (!new_map) {
+        return omrx_os_error(omrx, OMRX_ERR_ALLOC, "Cannot expand lookup table for new chunk ID");
+    }
+    memset(new_map, 0, sizeof(struct idmap_st) * new_size);
+
+    for (i = 0; i < old_size; i++) {
+        if (!old_map[i].id) continue;
+        j = old_map[i].hash & mask;
+        while (new_map[j].chunk) {
+            j = (j + 1) & mask;
+        }
+        new_map[j] = old_map[i];
+    }
+    omrx->chunk_id_map = new_map;
+    omrx->chunk_id_map_size = new_size;
+    omrx->chunk_id_map_used = omrx->chunk_id_map_count;
+    if (old_map) {
+        omrx->free(omrx, old_map);
+    }
+
+    return OMRX_OK;
+}
+
+static omrx_status_t register_chunk_id(omrx_chunk_t chunk, char *idstr) {
+    omrx_t omrx = chunk->omrx;
+    uint32_t hash = hash_chunk_id(idstr);
+    size_t mask;
+    size_t i;
+    size_t next_free = SIZE_MAX;
+    size_t new_size;
+
+    if (chunk->id) {
+        deregister_chunk_id(chunk);
+    }
+    chunk->id = idstr;
+    chunk->id_hash = hash;
+
+    // Keep the table at most 3/4 full (counting tombstones), so probe
+    // sequences stay short.
+    if ((omrx->chunk_id_map_used + 1) * 4 > omrx->chunk_id_map_size * 3) {
+        new_size = omrx->chunk_id_map_size;
+        if ((omrx->chunk_id_map_count + 1) * 2 > new_size) {
+            // Mostly live entries, so we actually need more room.  (Otherwise
+            // it's mostly tombstones, and rebuilding at the same size will
+            // clear them out.)
+            new_size *= 2;
+        }
+        CHECK_ERR(resize_chunk_id_map(omrx, new_size));
+    }
+
+    mask = omrx->chunk_id_map_size - 1;
+    i = hash & mask;
+    while (omrx->chunk_id_map[i].chunk) {
+        if (!omrx->chunk_id_map[i].id) {
+            if (next_free == SIZE_MAX) {
+                next_free = i;
+            }
+        } else if (omrx->chunk_id_map[i].hash == hash && !strcmp(omrx->chunk_id_map[i].id, idstr)) {
+            // FIXME: should this be a warning?
+            return OMRX_STATUS_DUP;
+        }
+        i = (i + 1) & mask;
+    }
+    if (next_free == SIZE_MAX) {
+        next_free = i;
+        omrx->chunk_id_map_used += 1;
+    }
+    omrx->chunk_id_map[next_free].id = idstr;
+    omrx->chunk_id_map[next_free].hash = hash;
+    omrx->chunk_id_map[next_free].chunk = chunk;
+    omrx->chunk_id_map_count += 1;
+
+    return OMRX_OK;
+}
+
+static omrx_status_t deregister_chunk_id(omrx_chunk_t chunk) {
+    omrx_t omrx = chunk->omrx;
+    size_t mask = omrx->chunk_id_map_size - 1;
+    size_t i;
+
+    if (chunk->id && omrx->chunk_id_map) {
+        i = chunk->id_hash & mask;
+        while (omrx->chunk_id_map[i].chunk) {
+            // Note: we compare the chunk rather than the string, because if
+            // this chunk's ID was a duplicate, it was never actually added and
+            // we don't want to remove the other chunk with the same ID.
+            if (omrx->chunk_id_map[i].chunk == chunk && omrx->chunk_id_map[i].id) {
+                // Leave a tombstone so later probe sequences aren't broken.
+                omrx->chunk_id_map[i].id = NULL;
+                omrx->chunk_id_map_count -= 1;
+                break;
+            }
+            i = (i + 1) & mask;
+        }
+    }
+    if (chunk->id) {
+        omrx->free(omrx, chunk->id);
+        chunk->id = NULL;
+    }
+
+    return OMRX_OK;
+}
+
+static omrx_status_t lookup_chunk_id(omrx_t omrx, const char *idstr, omrx_chunk_t *result) {
+    uint32_t hash = hash_chunk_id(idstr);
+    size_t mask = omrx->chunk_id_map_size - 1;
+    size_t i = hash & mask;
+
+    while (omrx->chunk_id_map[i].chunk) {
+        if (omrx->chunk_id_map[i].id && omrx->chunk_id_map[i].hash == hash && !strcmp(omrx->chunk_id_map[i].id, idstr)) {
+            *result = omrx->chunk_id_map[i].chunk;
+            return OMRX_OK;
+        }
+        i = (i + 1) & mask;
+    }
+
+    return OMRX_STATUS_NOT_FOUND;
+}
+
+// Find the slot for a tag in a tag index: either the one in use for it, or
+// the empty one where it would go.
+static struct tag_slot *find_tag_slot(struct omrx_tag_index *index, uint32_t tagint) {
+    size_t mask = index->size - 1;
+    uint32_t hash = tagint * 0x9e3779b1u;
+    size_t i = (hash ^ (hash >> 16)) & mask;
+
+    while (index->slots[i].used && index->slots[i].tagint != tagint) {
+        i = (i + 1) & mask;
+    }
+
+    return &index->slots[i];
+}
+
+// Add a child (which must be the parent's last) to a tag index, creating the
+// index if *indexp is NULL.  Returns false if memory ran out, in which case
+// the index is left as it was.
+static bool tag_index_add(omrx_t omrx, struct omrx_tag_index **indexp, omrx_chunk_t child) {
+    struct omrx_tag_index *index = *indexp;
+    struct omrx_tag_index *new_index;
+    struct tag_slot *slot;
+    size_t new_size;
+    size_t i;
+
+    // Keep the table at most 3/4 full, so probe sequences stay short.
+    if (!index || (index->count + 1) * 4 > index->size * 3) {
+        new_size = index ? index->size * 2 : OMRX_TAG_INDEX_SIZE;
+        new_index = omrx->alloc(omrx, sizeof(struct omrx_tag_index) + sizeof(struct tag_slot) * new_size);
+        if (!new_index) {
+            return false;
+        }
+        memset(new_index, 0, sizeof(struct omrx_tag_index) + sizeof(struct tag_slot) * new_size);
+        new_index->size = new_size;
+        if (index) {
+            for (i = 0; i < index->size; i++) {
+                if (index->slots[i].used) {
+                    *find_tag_slot(new_index, index->slots[i].tagint) = index->slots[i];
+                }
+            }
+            new_index->count = index->count;
+            omrx->free(omrx, index);
+        }
+        index = new_index;
+        *indexp = index;
+    }
+
+    child->next_same_tag = NULL;
+    slot = find_tag_slot(index, child->tagint);
+    if (!slot->used) {
+        slot->used = true;
+        slot->tagint = child->tagint;
+        index->count += 1;
+    }
+    if (slot->last) {
+        slot->last->next_same_tag = child;
+    } else {
+        slot->first = child;
+    }
+    slot->last = child;
+
+    return true;
+}
+
+// Take a child out of its parent's tag index.  `prev` is the previous sibling
+// with the same tag (or NULL if there isn't one).
+static void tag_index_remove(struct omrx_tag_index *index, omrx_chunk_t child, omrx_chunk_t prev) {
+    struct tag_slot *slot = find_tag_slot(index, child->tagint);
+
+    if (prev) {
+        prev->next_same_tag = child->next_same_tag;
+    } else {
+        slot->first = child->next_same_tag;
+    }
+    if (slot->last == child) {
+        slot->last = prev;
+    }
+}
+
+// Get the tag index for a chunk's children, building it if the chunk has
+// enough children to be worth it.  Returns NULL if there is no index (either
+// because there aren't enough children or memory ran out), in which case the
+// children just have to be searched one by one.
+static struct omrx_tag_index *get_tag_index(omrx_chunk_t chunk) {
+    omrx_t omrx = chunk->omrx;
+    struct omrx_tag_index *index;
+    omrx_chunk_t child;
+
+    // (In concurrent mode, other threads may be looking for the index while
+    // this one is building it, so it's only published once it's complete.)
+    index = __atomic_load_n(&chunk->tag_index, __ATOMIC_ACQUIRE);
+    if (index || chunk->child_count < OMRX_TAG_INDEX_MIN) {
+        return index;
+    }
+    if (omrx->open_flags & OMRX_OPEN_CONCURRENT) {
+        pthread_mutex_lock(&omrx->attr_lock);
+        index = chunk->tag_index;
+    }
+    if (!index) {
+        for (child = chunk->first_child; child; child = child->next) {
+            if (!tag_index_add(omrx, &index, child)) {
+                if (index) {
+                    omrx->free(omrx, index);
+                    index = NULL;
+                }
+                break;
+            }
+        }
+        __atomic_store_n(&chunk->tag_index, index, __ATOMIC_RELEASE);
+    }
+    if (omrx->open_flags & OMRX_OPEN_CONCURRENT) {
+        pthread_mutex_unlock(&omrx->attr_lock);
+    }
+
+    return index;
+}
+
+// Check a chunk against the steps of a query which it may match (`want`, a
+// bitmask of step numbers).  Returns the steps which its children may match:
+// the next step after each one the chunk matched, plus any descendant steps
+// it was considered for (which can match further down).  *matched is set if
+// the chunk matched the last step, making it a result of the query.
+static uint64_t match_query(omrx_query_t query, omrx_chunk_t chunk, uint64_t want, bool *matched) {
+    struct query_step *step;
+    uint64_t child_want = 0;
+    size_t i;
+
+    *matched = false;
+    for (i = 0; i < query->count && (want >> i); i++) {
+        if (!((want >> i) & 1)) continue;
+        step = &query->steps[i];
+        if (step->descendant) {
+            child_want |= (uint64_t)1 << i;
+        }
+        if (omrx_query_step_matches(step, chunk->tagint, chunk->id)) {
+            if (i == query->count - 1) {
+                *matched = true;
+            } else {
+                child_want |= (uint64_t)1 << (i + 1);
+            }
+        }
+    }
+
+    return child_want;
+}
+
+// Get the first of a chunk's children which may match any of the query steps
+// in `want`.  If those are all for direct children with one particular tag,
+// and the chunk has a tag index, only the children with that tag need to be
+// looked at (so *same_tag is set, and the rest should be found by following
+// next_same_tag).
+static omrx_chunk_t first_query_child(omrx_query_t query, omrx_chunk_t chunk, uint64_t want, bool *same_tag) {
+    struct omrx_tag_index *index;
+    struct query_step *step;
+    uint32_t tagint = 0;
+    bool one_tag = false;
+    size_t i;
+
+    *same_tag = false;
+    for (i = 0; i < query->count && (want >> i); i++) {
+        if (!((want >> i) & 1)) continue;
+        step = &query->steps[i];
+        if (step->descendant || step->any_tag || (one_tag && step->tagint != tagint)) {
+            return chunk->first_child;
+        }
+        tagint = step->tagint;
+        one_tag = true;
+    }
+    index = one_tag ? get_tag_index(chunk) : NULL;
+    if (index) {
+        *same_tag = true;
+        return find_tag_slot(index, tagint)->first;
+    }
+
+    return chunk->first_child;
+}
+
+static omrx_status_t add_query_result(omrx_t omrx, struct query_results *results, omrx_chunk_t chunk) {
+    omrx_chunk_t *new_chunks;
+
+    if (results->count == results->size) {
+        results->size = results->size ? results->size * 2 : 16;
+        new_chunks = omrx->alloc(omrx, sizeof(omrx_chunk_t) * results->size);
+        CHECK_ALLOC(omrx, new_chunks);
+        if (results->chunks) {
+            memcpy(new_chunks, results->chunks, sizeof(omrx_chunk_t) * results->count);
+            omrx->free(omrx, results->chunks);
+        }
+        results->chunks = new_chunks;
+    }
+    results->chunks[results->count++] = chunk;
+
+    return OMRX_OK;
+}
+
+// Go through everything underneath `top` (whose children may match the query
+// steps in `want`) in file order, adding each chunk which matches the query to
+// `results`.  Only the parts of the tree which could still match are looked
+// at (and loaded).  Since the steps that chunks may match depend on their
+// ancestors, this keeps an explicit stack of them rather than using
+// walk_next().
+static omrx_status_t run_query(omrx_query_t query, omrx_chunk_t top, uint64_t want, struct query_results *results) {
+    omrx_t omrx = top->omrx;
+    struct query_frame *stack;
+    struct query_frame *new_stack;
+    size_t size = OMRX_QUERY_STACK_SIZE;
+    size_t depth = 0;
+    omrx_chunk_t chunk;
+    omrx_chunk_t parent = top;
+    bool matched;
+    bool same_tag;
+    omrx_status_t status = OMRX_OK;
+
+    stack = omrx->alloc(omrx, sizeof(struct query_frame) * size);
+    CHECK_ALLOC(omrx, stack);
+    for (;;) {
+        // Go down into the children of `parent` (if any might match).
+        chunk = NULL;
+        if (want) {
+            status = load_children(parent);
+            if (status < 0) break;
+            chunk = first_query_child(query, parent, want, &same_tag);
+        }
+        if (chunk) {
+            if (parent != top) {
+                depth++;
+            }
+            if (depth == size) {
+                new_stack = omrx->alloc(omrx, sizeof(struct query_frame) * size * 2);
+                if (!new_stack) {
+                    status = omrx_error(omrx, OMRX_ERR_ALLOC, "Memory allocation failed");
+                    break;
+                }
+                memcpy(new_stack, stack, sizeof(struct query_frame) * size);
+                omrx->free(omrx, stack);
+                stack = new_stack;
+                size *= 2;
+            }
+            stack[depth].chunk = chunk;
+            stack[depth].want = want;
+            stack[depth].same_tag = same_tag;
+        } else if (parent == top) {
+            break;
+        } else {
+            // Nothing below this one, so move on to the next sibling (or the
+            // parent's next sibling, etc).
+            for (;;) {
+                chunk = stack[depth].chunk;
+                chunk = stack[depth].same_tag ? chunk->next_same_tag : chunk->next;
+                stack[depth].chunk = chunk;
+                if (chunk || depth == 0) break;
+                depth--;
+            }
+            if (!chunk) break;
+        }
+        want = match_query(query, chunk, stack[depth].want, &matched);
+        if (matched) {
+            status = add_query_result(omrx, results, chunk);
+            if (status < 0) break;
+        }
+        parent = chunk;
+    }
+    omrx->free(omrx, stack);
+
+    return status;
+}
+
+static omrx_status_t read_next_chunk(omrx_t omrx) {
+    struct chunk_header hdr;
+    struct attr_header attr_hdr;
+    omrx_chunk_t chunk;
+    omrx_attr_t attr;
+    off_t file_pos;
+    uint32_t tagint;
+    uint_fast16_t i;
+    uint_fast16_t attr_count;
+    char *idstr;
+    omrx_status_t status;
+
+    CHECK_ERR(scan_read(omrx, CHUNKHDR_SIZE, &hdr));
+    file_pos = omrx->scan.pos;
+    tagint = TAG_TO_TAGINT(hdr.tag);
+    hdr.count = UINT16_FTOH(hdr.count);
+    // Make sure it looks like a valid tag and we're not just reading garbage
+    // at this point (each byte should be in the range 0x40-0x7f)
+    if ((tagint & 0xc0c0c0c0) != 0x40404040) {
+        return omrx_error(omrx, OMRX_ERR_BAD_CHUNK, "Invalid chunk tag found (%08x). File likely corrupted.", tagint);
+    }
+
+    chunk = new_chunk(omrx, hdr.tag);
+    CHECK_ALLOC(omrx, chunk);
+    chunk->file_position = file_pos;
+    attr_count = hdr.count;
+
+    for (i=0; i < attr_count; i++) {
+        CHECK_ERR(scan_read(omrx, ATTRHDR_SIZE, &attr_hdr));
+        attr_hdr.id = UINT16_FTOH(attr_hdr.id);
+        attr_hdr.datatype = UINT16_FTOH(attr_hdr.datatype);
+        attr_hdr.size = UINT32_FTOH(attr_hdr.size);
+        if (attr_hdr.id == OMRX_ATTR_CHECKSUMS && attr_hdr.datatype == OMRX_DTYPE_U32_ARRAY && i == attr_count - 1) {
+            CHECK_ERR(read_chunk_checksums(chunk, attr_hdr.size));
+            continue;
+        }
+        file_pos = omrx->scan.pos;
+        attr = new_attr(chunk, attr_hdr.id, attr_hdr.datatype, attr_hdr.size, file_pos);
+        CHECK_ALLOC(omrx, attr);
+
+        if (OMRX_GET_ENCODING(attr_hdr.datatype)) {
+            CHECK_ERR(read_attr_subheader_encoded(attr));
+        } else if (OMRX_IS_ARRAY_DTYPE(attr_hdr.datatype)) {
+            CHECK_ERR(read_attr_subheader_array(attr));
+        }
+
+        if (attr_hdr.id == OMRX_ATTR_ID) {
+            //FIXME: an error here isn't necessarily a fatal error
+            if (attr_hdr.datatype == OMRX_DTYPE_UTF8) {
+                // (Don't trust the size enough to allocate it if it's more
+                // than what's left of the file.)
+                if (omrx->scan.file_size >= 0 && (off_t)attr->size > omrx->scan.file_size - omrx->scan.pos) {
+                    return omrx_error(omrx, OMRX_ERR_EOF, "%s:id attribute runs past the end of the file (file corrupted?)", chunk->tag);
+                }
+                idstr = omrx->alloc(omrx, (size_t)attr->size + 1);
+                CHECK_ALLOC(omrx, idstr);
+                status = scan_read(omrx, attr->size, idstr);
+                if (status < 0) {
+                    omrx->free(omrx, idstr);
+                    return status;
+                }
+                idstr[attr->size] = 0;
+                CHECK_ERR(register_chunk_id(chunk, idstr));
+            } else {
+                omrx_warning(omrx, OMRX_WARN_BAD_ATTR, "%s:id attribute has wrong type (%04x).  Ignored.", &chunk->tag, attr_hdr.datatype);
+                scan_skip(omrx, attr->file_size);
+            }
+        } else {
+            scan_skip(omrx, attr->file_size);
+        }
+        CHECK_ERR(chunk_add_attr(chunk, attr));
+    }
+    //TODO: check for a toplevel critical tag and take appropriate action
+    if (!omrx->context) {
+        // This is the first (OMRX) chunk.  Set it up as the toplevel chunk.
+        omrx->root_chunk = chunk;
+        omrx->context = chunk;
+    } else {
+        if (tagint == (omrx->context->tagint | END_CHUNK_FLAG)) {
+            // End tag for our current context.  Pop a nesting level.
+            omrx->context = omrx->context->parent;
+            CHECK_ERR(free_chunk(chunk));
+        } else if (tagint == TAG_TO_TAGINT(TOC_CHUNK_TAG)) {
+            // A table of contents describes the file as it was written, and
+            // is regenerated on write if wanted, so it's not part of the tree.
+            CHECK_ERR(free_chunk(chunk));
+        } else {
+            CHECK_ERR(add_child_chunk(omrx->context, chunk));
+        }
+        if (!(tagint & END_CHUNK_FLAG)) {
+            // This is a start tag.  Push a nesting level onto our context.
+            omrx->context = chunk;
+        }
+    }
+    return OMRX_OK;
+}
+
+// Read the checksums attribute at the end of a chunk (see
+// write_chunk_checksums()), and attach each checksum to the attribute it
+// belongs to.  This isn't kept as an attribute itself, since it's only valid
+// for the data as it is in this file (it is regenerated on write if wanted).
+static omrx_status_t read_chunk_checksums(omrx_chunk_t chunk, uint32_t size) {
+    omrx_t omrx = chunk->omrx;
+    omrx_attr_t attr;
+    uint32_t *buf;
+    uint32_t id;
+    uint16_t cols;
+    uint32_t i;
+    omrx_status_t status;
+
+    if (size < 2 || (size - 2) % 8) {
+        omrx_warning(omrx, OMRX_WARN_BAD_ATTR, "%s: checksums attribute has bad length.  Ignored.", chunk->tag);
+        scan_skip(omrx, size);
+        return OMRX_WARN_BAD_ATTR;
+    }
+    CHECK_ERR(scan_read(omrx, 2, &cols));
+    size -= 2;
+    if (UINT16_FTOH(cols) != 2) {
+        omrx_warning(omrx, OMRX_WARN_BAD_ATTR, "%s: checksums attribute has bad format.  Ignored.", chunk->tag);
+        scan_skip(omrx, size);
+        return OMRX_WARN_BAD_ATTR;
+    }
+    buf = omrx->alloc(omrx, size + 1);
+    CHECK_ALLOC(omrx, buf);
+    status = scan_read(omrx, size, buf);
+    if (status >= 0) {
+        // Each row is an attribute ID and the CRC of that attribute's data.
+        for (i = 0; i < size / 4; i += 2) {
+            id = UINT32_FTOH(buf[i]);
+            if (id <= 0xffff && find_attr(chunk, id, &attr) == OMRX_OK) {
+                attr->crc = UINT32_FTOH(buf[i + 1]);
+                attr->has_crc = true;
+            }
+        }
+    }
+    omrx->free(omrx, buf);
+
+    return status;
+}
+
+static omrx_status_t read_attr_subheader_array(omrx_attr_t attr) {
+    omrx_t omrx = attr->chunk->omrx;
+
+    if (attr->size < 2) {
+        omrx_warning(omrx, OMRX_WARN_BAD_ATTR, "%s:%04x attribute has bad length.", attr->chunk->tag, attr->id);
+        scan_skip(omrx, attr->size);
+        attr->size = 0;
+        return OMRX_WARN_BAD_ATTR;
+    }
+    CHECK_ERR(scan_read(omrx, 2, &attr->cols));
+    attr->cols = UINT16_FTOH(attr->cols);
+    if (!attr->cols) {
+        attr->cols = 1;
+    }
+    attr->file_pos += 2;
+    attr->size -= 2;
+    attr->file_size = attr->size;
+
+    return OMRX_OK;
+}
+
+// Read the subheader of an encoded attribute (the column count, for arrays,
+// followed by the decoded size), and set the attribute up to describe the
+// decoded data.
+static omrx_status_t read_attr_subheader_encoded(omrx_attr_t attr) {
+    omrx_t omrx = attr->chunk->omrx;
+    uint16_t raw_type = OMRX_GET_RAW_TYPE(attr->datatype);
+    uint32_t hdr_size = OMRX_IS_ARRAY_DTYPE(raw_type) ? 6 : 4;
+    uint8_t buf[6];
+    uint16_t cols;
+    uint32_t raw_size;
+
+    if (attr->size < hdr_size) {
+        omrx_warning(omrx, OMRX_WARN_BAD_ATTR, "%s:%04x attribute has bad length.", attr->chunk->tag, attr->id);
+        scan_skip(omrx, attr->size);
+        attr->datatype = raw_type;
+        attr->size = 0;
+        attr->file_size = 0;
+        return OMRX_WARN_BAD_ATTR;
+    }
+    CHECK_ERR(scan_read(omrx, hdr_size, buf));
+    if (OMRX_IS_ARRAY_DTYPE(raw_type)) {
+        memcpy(&cols, buf, 2);
+        attr->cols = UINT16_FTOH(cols);
+        if (!attr->cols) {
+            attr->cols = 1;
+        }
+    }
+    memcpy(&raw_size, buf + hdr_size - 4, 4);
+    attr->encoding = OMRX_GET_ENCODING(attr->datatype);
+    attr->file_encoding = attr->encoding;
+    attr->datatype = raw_type;
+    attr->file_pos += hdr_size;
+    attr->file_size = attr->size - hdr_size;
+    attr->size = UINT32_FTOH(raw_size);
+
+    return OMRX_OK;
+}
+
+// Write a chunk and everything underneath it.  (Chunks with an end-style
+// tag never have children or end tags.)
+static omrx_status_t write_chunk(omrx_chunk_t chunk, FILE *fp) {
+    struct tree_walk walk;
+    bool descend = false;
+
+    for (chunk = walk_start(&walk, chunk); chunk; chunk = walk_next(&walk, descend)) {
+        descend = !(chunk->tagint & END_CHUNK_FLAG);
+        if (!walk.leaving) {
+            CHECK_ERR(write_chunk_start(chunk, fp));
+            if (descend) {
+                CHECK_ERR(load_children(chunk));
+            }
+        } else if (descend) {
+            CHECK_ERR(write_chunk_end(chunk, fp));
+        }
+    }
+
+    return OMRX_OK;
+}
+
+// Write the chunk header and all attributes (but not children)
+static omrx_status_t write_chunk_start(omrx_chunk_t chunk, FILE *fp) {
+    omrx_t omrx = chunk->omrx;
+    struct chunk_header hdr;
+    omrx_attr_t attr;
+
+    memcpy(hdr.tag, chunk->tag, 4);
+    hdr.count = UINT16_HTOF(get_out_attr_count(chunk));
+    CHECK_ERR(write_data(omrx, sizeof(hdr), &hdr, fp));
+    chunk->out_pos = omrx->write_pos;
+    attr = chunk->attrs;
+    while (attr) {
+        CHECK_ERR(write_attr(attr, fp));
+        attr = attr->next;
+    }
+    if (get_out_attr_count(chunk) != chunk->attr_count) {
+        CHECK_ERR(write_chunk_checksums(chunk, fp));
+    }
+
+    return OMRX_OK;
+}
+
+// The number of attributes a chunk will have in the file: one more than it
+// has in memory if checksums are being written (unless it has none at all,
+// or no room for another).
+static uint16_t get_out_attr_count(omrx_chunk_t chunk) {
+    if (chunk->omrx->write_checksums && chunk->attr_count && chunk->attr_count < UINT16_MAX) {
+        return chunk->attr_count + 1;
+    }
+    return chunk->attr_count;
+}
+
+// Build the checksums attribute written after a chunk's other attributes
+// (for OMRX_WRITE_CHECKSUMS), from the CRCs recorded as they were written.
+// This is a U32 array with two columns: the ID of each attribute and the
+// CRC-32C of its data as stored in the file (everything after the attribute
+// header).  The result (header and all, in file order) goes in a new buffer.
+static omrx_status_t build_chunk_checksums(omrx_chunk_t chunk, uint8_t **result, uint32_t *result_len) {
+    omrx_t omrx = chunk->omrx;
+    struct attr_header hdr;
+    omrx_attr_t attr;
+    uint32_t size = chunk->attr_count * 8;
+    uint16_t cols = UINT16_HTOF(2);
+    uint32_t value;
+    uint8_t *buf;
+    uint8_t *p;
+
+    buf = omrx->alloc(omrx, ATTRHDR_SIZE + 2 + size);
+    CHECK_ALLOC(omrx, buf);
+    hdr.id = UINT16_HTOF(OMRX_ATTR_CHECKSUMS);
+    hdr.datatype = UINT16_HTOF(OMRX_DTYPE_U32_ARRAY);
+    hdr.size = UINT32_HTOF(size + 2);
+    memcpy(buf, &hdr, ATTRHDR_SIZE);
+    memcpy(buf + ATTRHDR_SIZE, &cols, 2);
+    p = buf + ATTRHDR_SIZE + 2;
+    for (attr = chunk->attrs; attr; attr = attr->next) {
+        value = UINT32_HTOF(attr->id);
+        memcpy(p, &value, 4);
+        value = UINT32_HTOF(attr->out_crc);
+        memcpy(p + 4, &value, 4);
+        p += 8;
+    }
+    *result = buf;
+    *result_len = p - buf;
+
+    return OMRX_OK;
+}
+
+static omrx_status_t write_chunk_checksums(omrx_chunk_t chunk, FILE *fp) {
+    omrx_t omrx = chunk->omrx;
+    uint8_t *buf;
+    uint32_t len;
+    omrx_status_t status;
+
+    CHECK_ERR(build_chunk_checksums(chunk, &buf, &len));
+    status = write_data(omrx, len, buf, fp);
+    omrx->free(omrx, buf);
+
+    return status;
+}
+
+// Write the close-tag for a chunk
+static omrx_status_t write_chunk_end(omrx_chunk_t chunk, FILE *fp) {
+    struct chunk_header hdr;
+
+    memcpy(hdr.tag, chunk->tag, 4);
+    hdr.tag[3] |= CHUNK_TAG_FLAG;
+    hdr.count = 0;
+
+    return write_data(chunk->omrx, sizeof(hdr), &hdr, fp);
+}
+
+static omrx_status_t write_attr_subheader_array(omrx_attr_t attr, FILE *fp) {
+    uint16_t cols = UINT16_HTOF(attr->cols);
+
+    return write_data(attr->chunk->omrx, 2, &cols, fp);
+}
+
+static omrx_status_t write_attr(omrx_attr_t attr, FILE *fp) {
+    omrx_t omrx = attr->chunk->omrx;
+    struct attr_header hdr;
+    void *data;
+    omrx_status_t status;
+
+    attr->out_encoding = OMRX_ENCODING_NONE;
+    if (attr->encoding && attr->id != OMRX_ATTR_ID) {
+        status = write_attr_encoded(attr, fp);
+        if (status != OMRX_STATUS_NOT_FOUND) {
+            return status;
+        }
+        // Not worth encoding, so just write it as-is.
+    }
+
+    hdr.id = UINT16_HTOF(attr->id);
+    hdr.datatype = UINT16_HTOF(attr->datatype);
+
+    if (OMRX_IS_ARRAY_DTYPE(attr->datatype)) {
+        hdr.size = UINT32_HTOF(attr->size + 2);
+    } else {
+        hdr.size = UINT32_HTOF(attr->size);
+    }
+    CHECK_ERR(write_data(omrx, sizeof(hdr), &hdr, fp));
+    // The checksum (if wanted) covers everything after the header, which
+    // write_data() accumulates from here.
+    omrx->write_crc = 0;
+    if (OMRX_IS_ARRAY_DTYPE(attr->datatype)) {
+        CHECK_ERR(write_attr_subheader_array(attr, fp));
+    }
+    attr->out_pos = omrx->write_pos;
+    if (attr->data) {
+        CHECK_ERR(write_payload(omrx, get_swap_width(attr->datatype), attr->size, attr->data, fp));
+    } else {
+        // We need to load the data before we can write it out again
+        CHECK_ERR(load_attr_data(attr, &data));
+        status = write_payload(omrx, get_swap_width(attr->datatype), attr->size, data, fp);
+        omrx->free(omrx, data);
+        CHECK_ERR(status);
+    }
+    attr->out_crc = omrx->write_crc;
+
+    return OMRX_OK;
+}
+
+// Return whether an attribute's encoded data, as read from the file, is laid
+// out the same way as it would be in the file being written, so that it can be
+// copied across as-is.  (Encoded arrays only have a block directory in files
+// from OMRX_VERSION_BLOCKS on; see read_block_dir().)
+static bool same_encoded_layout(omrx_attr_t attr) {
+    omrx_t omrx = attr->chunk->omrx;
+
+    if (!OMRX_IS_ARRAY_DTYPE(attr->datatype)) {
+        return true;
+    }
+    return (omrx->file_version >= OMRX_VERSION_BLOCKS) == (omrx->out_version >= OMRX_VERSION_BLOCKS);
+}
+
+// Write an attribute with its data encoded.  Returns OMRX_STATUS_NOT_FOUND
+// (having written nothing) if encoding wouldn't make the data any smaller.
+static omrx_status_t write_attr_encoded(omrx_attr_t attr, FILE *fp) {
+    omrx_t omrx = attr->chunk->omrx;
+    struct attr_header hdr;
+    uint16_t encoding = attr->encoding;
+    uint32_t hdr_len;
+    uint32_t len;
+    uint8_t *buf;
+    void *data;
+    omrx_status_t status;
+
+    if ((!attr->data || attr->cached) && attr->file_encoding == encoding && same_encoded_layout(attr)) {
+        // The data hasn't changed since it was read, so the encoded data can
+        // be copied straight from the file.
+        hdr_len = put_encoded_subheader(attr->datatype, attr->cols, attr->size, NULL);
+        len = hdr_len + attr->file_size;
+        buf = omrx->alloc(omrx, len);
+        CHECK_ALLOC(omrx, buf);
+        put_encoded_subheader(attr->datatype, attr->cols, attr->size, buf);
+        status = read_data_at(omrx, attr->file_pos, attr->file_size, buf + hdr_len);
+        if (status >= 0) {
+            // Don't pass on corrupted data if we can tell
+            status = verify_attr_crc(attr, buf + hdr_len);
+        }
+    } else {
+        if (!omrx_codec_supported(encoding & OMRX_CODEC_MASK)) {
+            // This came from a file written with a codec we don't have, so
+            // use one we do.
+            encoding = (encoding & OMRX_ENCODING_SHUFFLE) | omrx_codec_best();
+        }
+        if (attr->data) {
+            status = encode_payload(omrx, attr->datatype, encoding, attr->cols, attr->size, attr->data, &buf, &len, &encoding);
+        } else {
+            CHECK_ERR(load_attr_data(attr, &data));
+            status = encode_payload(omrx, attr->datatype, encoding, attr->cols, attr->size, data, &buf, &len, &encoding);
+            omrx->free(omrx, data);
+        }
+        CHECK_OK(status);
+        hdr_len = put_encoded_subheader(attr->datatype, attr->cols, attr->size, NULL);
+    }
+    if (status >= 0) {
+        hdr.id = UINT16_HTOF(attr->id);
+        hdr.datatype = UINT16_HTOF(attr->datatype | encoding);
+        hdr.size = UINT32_HTOF(len);
+        status = write_data(omrx, sizeof(hdr), &hdr, fp);
+    }
+    if (status >= 0) {
+        attr->out_pos = omrx->write_pos + hdr_len;
+        attr->out_encoding = encoding;
+        attr->out_size = len - hdr_len;
+        omrx->write_crc = 0;
+        status = write_data(omrx, len, buf, fp);
+        attr->out_crc = omrx->write_crc;
+    }
+    omrx->free(omrx, buf);
+
+    return status < 0 ? status : OMRX_OK;
+}
+
+// The parallel writer.  This produces exactly the same output as
+// write_chunk(), etc, but spreads the expensive parts (encoding attribute data
+// and writing it out) across the worker pool.  The tree is written a batch at
+// a time: the next lot of chunk headers, attributes and end tags (up to
+// OMRX_WRITE_BATCH_SIZE bytes of attribute data) are collected in file order,
+// the blocks of every attribute in the batch which needs encoding are encoded
+// together, and then, since the size of everything in the batch is known,
+// each item is given its final position in the file and the workers write
+// them there with positioned writes.  Anything which might need to report an
+// error or allocate memory (loading data, setting up encoding jobs, etc)
+// happens in the calling thread.
+static omrx_status_t write_parallel(omrx_t omrx, FILE *fp, bool toc) {
+    struct write_cursor cur;
+    struct write_item *items;
+    struct encode_ref *refs;
+    size_t n;
+    size_t i;
+    size_t blocks;
+    uint64_t bytes;
+    uint32_t b;
+    bool done = false;
+    omrx_status_t status = OMRX_OK;
+
+    cur.chunk = walk_start(&cur.walk, omrx->root_chunk);
+    cur.attr = NULL;
+    cur.state = WRITE_CHUNK_START;
+    cur.toc = toc;
+    items = omrx->alloc(omrx, sizeof(struct write_item) * OMRX_WRITE_BATCH_ITEMS);
+    CHECK_ALLOC(omrx, items);
+    while (status >= 0 && !done) {
+        n = 0;
+        bytes = 0;
+        blocks = 0;
+        while (n < OMRX_WRITE_BATCH_ITEMS && bytes < OMRX_WRITE_BATCH_SIZE) {
+            memset(&items[n], 0, sizeof(struct write_item));
+            status = next_write_item(omrx, &cur, &items[n]);
+            if (status == OMRX_STATUS_NOT_FOUND) {
+                status = OMRX_OK;
+                done = true;
+                break;
+            }
+            if (status < 0) break;
+            n++;
+            if (items[n - 1].attr) {
+                status = prepare_write_item(omrx, &items[n - 1]);
+                if (status < 0) break;
+                bytes += items[n - 1].attr->size;
+                blocks += items[n - 1].job.count;
+            }
+        }
+        if (status >= 0 && blocks) {
+            refs = omrx->alloc(omrx, sizeof(struct encode_ref) * blocks);
+            if (!refs) {
+                status = omrx_os_error(omrx, OMRX_ERR_ALLOC, "Memory allocation failed");
+            } else {
+                blocks = 0;
+                for (i = 0; i < n; i++) {
+                    for (b = 0; b < items[i].job.count; b++) {
+                        refs[blocks].job = &items[i].job;
+                        refs[blocks].block = b;
+                        blocks++;
+                    }
+                }
+                omrx_workers_run(get_workers(omrx), blocks, encode_ref_task, refs);
+                omrx->free(omrx, refs);
+            }
+        }
+        for (i = 0; i < n && status >= 0; i++) {
+            if (items[i].job.count) {
+                status = finish_write_item(omrx, &items[i]);
+            }
+        }
+        if (status >= 0 && omrx->write_checksums) {
+            status = checksum_write_items(omrx, items, n);
+        }
+        if (status >= 0 && omrx->out.direct) {
+            status = write_batch_direct(omrx, items, n);
+        } else if (status >= 0) {
+            status = write_batch(omrx, fileno(fp), items, n);
+        }
+        for (i = 0; i < n; i++) {
+            release_write_item(omrx, &items[i]);
+        }
+    }
+    omrx->free(omrx, items);
+
+    return status;
+}
+
+// Get the next thing to be written (in file order) for write_parallel().
+// This walks the tree just like write_chunk() does, loading children as
+// needed.  Returns OMRX_STATUS_NOT_FOUND when everything has been written.
+// (If the TOC is being written, the root chunk's end tag is left for
+// write_toc().)
+static omrx_status_t next_write_item(omrx_t omrx, struct write_cursor *cur, struct write_item *item) {
+    struct chunk_header hdr;
+
+    for (;;) {
+        switch (cur->state) {
+            case WRITE_CHUNK_START:
+                memcpy(hdr.tag, cur->chunk->tag, 4);
+                hdr.count = UINT16_HTOF(get_out_attr_count(cur->chunk));
+                memcpy(item->hdr, &hdr, CHUNKHDR_SIZE);
+                item->hdr_len = CHUNKHDR_SIZE;
+                item->chunk = cur->chunk;
+                cur->attr = cur->chunk->attrs;
+                cur->state = WRITE_CHUNK_ATTRS;
+                return OMRX_OK;
+            case WRITE_CHUNK_ATTRS:
+                if (cur->attr) {
+                    item->attr = cur->attr;
+                    cur->attr = cur->attr->next;
+                    return OMRX_OK;
+                }
+                cur->state = WRITE_CHUNK_CHECKSUMS;
+                break;
+            case WRITE_CHUNK_CHECKSUMS:
+                cur->state = WRITE_CHUNK_CHILDREN;
+                if (get_out_attr_count(cur->chunk) != cur->chunk->attr_count) {
+                    // (This is filled in by checksum_write_items())
+                    item->sums = cur->chunk;
+                    return OMRX_OK;
+                }
+                break;
+            case WRITE_CHUNK_CHILDREN:
+                if (cur->chunk->tagint & END_CHUNK_FLAG) {
+                    // These never have children or end tags
+                    cur->chunk = walk_next(&cur->walk, false);
+                    cur->state = WRITE_CHUNK_NEXT;
+                    break;
+                }
+                CHECK_ERR(load_children(cur->chunk));
+                cur->chunk = walk_next(&cur->walk, true);
+                cur->state = cur->walk.leaving ? WRITE_CHUNK_END : WRITE_CHUNK_START;
+                break;
+            case WRITE_CHUNK_END:
+                if (cur->chunk == omrx->root_chunk && cur->toc) {
+                    cur->state = WRITE_DONE;
+                    break;
+                }
+                memcpy(hdr.tag, cur->chunk->tag, 4);
+                hdr.tag[3] |= CHUNK_TAG_FLAG;
+                hdr.count = 0;
+                memcpy(item->hdr, &hdr, CHUNKHDR_SIZE);
+                item->hdr_len = CHUNKHDR_SIZE;
+                cur->state = WRITE_CHUNK_NEXT;
+                return OMRX_OK;
+            case WRITE_CHUNK_NEXT:
+                // (The walk is leaving cur->chunk, which has been finished.)
+                cur->chunk = walk_next(&cur->walk, false);
+                if (!cur->chunk) {
+                    cur->state = WRITE_DONE;
+                } else {
+                    cur->state = cur->walk.leaving ? WRITE_CHUNK_END : WRITE_CHUNK_START;
+                }
+                break;
+            default:
+                return OMRX_STATUS_NOT_FOUND;
+        }
+    }
+}
+
+// Work out what needs to be written for an attribute (the same as
+// write_attr() would write), and get its data ready.  If it needs encoding,
+// item->job is set up for it, and finish_write_item() must be called once its
+// blocks have been encoded.
+static omrx_status_t prepare_write_item(omrx_t omrx, struct write_item *item) {
+    omrx_attr_t attr = item->attr;
+    uint16_t encoding = attr->encoding;
+    struct attr_header hdr;
+    uint32_t sub_len;
+    omrx_status_t status;
+
+    attr->out_encoding = OMRX_ENCODING_NONE;
+    if (encoding && attr->id != OMRX_ATTR_ID && (!attr->data || attr->cached) && attr->file_encoding == encoding && same_encoded_layout(attr)) {
+        // Unchanged since it was read, so copy the encoded data from the file
+        // (as in write_attr_encoded()).
+        sub_len = put_encoded_subheader(attr->datatype, attr->cols, attr->size, item->hdr + ATTRHDR_SIZE);
+        hdr.id = UINT16_HTOF(attr->id);
+        hdr.datatype = UINT16_HTOF(attr->datatype | encoding);
+        hdr.size = UINT32_HTOF(sub_len + attr->file_size);
+        memcpy(item->hdr, &hdr, ATTRHDR_SIZE);
+        item->hdr_len = ATTRHDR_SIZE + sub_len;
+        item->data_offset = item->hdr_len;
+        item->len = attr->file_size;
+        item->width = 1;
+        if (omrx->map && (uint64_t)attr->file_pos + attr->file_size <= omrx->map_size) {
+            item->data = omrx->map + attr->file_pos;
+        } else {
+            item->own = omrx->alloc(omrx, attr->file_size + 1);
+            CHECK_ALLOC(omrx, item->own);
+            CHECK_ERR(read_data_at(omrx, attr->file_pos, attr->file_size, item->own));
+            item->data = item->own;
+        }
+        CHECK_ERR(verify_attr_crc(attr, item->data));
+        attr->out_encoding = encoding;
+        attr->out_size = attr->file_size;
+        return OMRX_OK;
+    }
+    item->width = get_swap_width(attr->datatype);
+    if (attr->data) {
+        item->data = attr->data;
+    } else if (omrx->map && !attr->file_encoding && !OMRX_NEEDS_SWAP(item->width) && attr->file_pos >= 0 && (uint64_t)attr->file_pos + attr->size <= omrx->map_size) {
+        item->data = omrx->map + attr->file_pos;
+    } else {
+        CHECK_ERR(load_attr_data(attr, &item->own));
+        item->data = item->own;
+    }
+    if (encoding && attr->id != OMRX_ATTR_ID) {
+        if (!omrx_codec_supported(encoding & OMRX_CODEC_MASK)) {
+            encoding = (encoding & OMRX_ENCODING_SHUFFLE) | omrx_codec_best();
+        }
+        status = encode_begin(omrx, attr->datatype, encoding, attr->cols, attr->size, item->data, &item->job);
+        if (status == OMRX_OK) {
+            return OMRX_OK;
+        }
+        encode_cleanup(omrx, &item->job);
+        CHECK_ERR(status);
+    }
+    set_plain_write_item(item);
+
+    return OMRX_OK;
+}
+
+// Collect the result of encoding an attribute for write_parallel(), falling
+// back to writing it as-is if that's smaller.
+static omrx_status_t finish_write_item(omrx_t omrx, struct write_item *item) {
+    omrx_attr_t attr = item->attr;
+    struct attr_header hdr;
+    uint16_t encoding;
+    uint32_t len;
+    omrx_status_t status;
+
+    status = encode_end(omrx, &item->job, &item->encoded, &len, &encoding);
+    encode_cleanup(omrx, &item->job);
+    if (status == OMRX_STATUS_NOT_FOUND) {
+        set_plain_write_item(item);
+        return OMRX_OK;
+    }
+    CHECK_ERR(status);
+    hdr.id = UINT16_HTOF(attr->id);
+    hdr.datatype = UINT16_HTOF(attr->datatype | encoding);
+    hdr.size = UINT32_HTOF(len);
+    memcpy(item->hdr, &hdr, ATTRHDR_SIZE);
+    item->hdr_len = ATTRHDR_SIZE;
+    item->data = item->encoded;
+    item->len = len;
+    item->width = 1;
+    item->data_offset = ATTRHDR_SIZE + put_encoded_subheader(attr->datatype, attr->cols, attr->size, NULL);
+    attr->out_encoding = encoding;
+    attr->out_size = len - (item->data_offset - ATTRHDR_SIZE);
+
+    return OMRX_OK;
+}
+
+// Set up the header for writing an attribute's data as-is.
+static void set_plain_write_item(struct write_item *item) {
+    omrx_attr_t attr = item->attr;
+    struct attr_header hdr;
+    uint16_t cols;
+
+    hdr.id = UINT16_HTOF(attr->id);
+    hdr.datatype = UINT16_HTOF(attr->datatype);
+    if (OMRX_IS_ARRAY_DTYPE(attr->datatype)) {
+        hdr.size = UINT32_HTOF(attr->size + 2);
+        cols = UINT16_HTOF(attr->cols);
+        memcpy(item->hdr + ATTRHDR_SIZE, &cols, 2);
+        item->hdr_len = ATTRHDR_SIZE + 2;
+    } else {
+        hdr.size = UINT32_HTOF(attr->size);
+        item->hdr_len = ATTRHDR_SIZE;
+    }
+    memcpy(item->hdr, &hdr, ATTRHDR_SIZE);
+    item->data_offset = item->hdr_len;
+    item->len = attr->size;
+}
+
+static void release_write_item(omrx_t omrx, struct write_item *item) {
+    if (item->job.work) {
+        encode_cleanup(omrx, &item->job);
+    }
+    if (item->own) {
+        omrx->free(omrx, item->own);
+    }
+    if (item->encoded) {
+        omrx->free(omrx, item->encoded);
+    }
+}
+
+// Work out the checksums of all the attributes in a batch for
+// write_parallel() (in parallel), and then fill in any chunk checksums
+// attributes.  (All of a chunk's attributes come before its checksums, so
+// they'll all be done by then, even if some were in an earlier batch.)
+static omrx_status_t checksum_write_items(omrx_t omrx, struct write_item *items, size_t count) {
+    uint32_t len;
+    size_t i;
+
+    omrx_workers_run(get_workers(omrx), count, checksum_item_task, items);
+    for (i = 0; i < count; i++) {
+        if (items[i].sums) {
+            CHECK_ERR(build_chunk_checksums(items[i].sums, &items[i].encoded, &len));
+            items[i].data = items[i].encoded;
+            items[i].len = len;
+            items[i].width = 1;
+        }
+    }
+
+    return OMRX_OK;
+}
+
+// Checksum one attribute for checksum_write_items(), the same way
+// write_attr() does: everything after the attribute header, in file order.
+static void checksum_item_task(void *arg, size_t index) {
+    struct write_item *item = (struct write_item *)arg + index;
+    uint8_t buf[OMRX_SWAP_BUFSIZE];
+    const uint8_t *src = item->data;
+    size_t size = item->len;
+    size_t len;
+    uint32_t crc;
+
+    if (!item->attr) return;
+    crc = omrx_crc32c(0, item->hdr + ATTRHDR_SIZE, item->hdr_len - ATTRHDR_SIZE);
+    if (!OMRX_NEEDS_SWAP(item->width)) {
+        crc = omrx_crc32c(crc, src, size);
+    } else {
+        while (size) {
+            len = size < sizeof(buf) ? size : sizeof(buf);
+            omrx_bswap_array(buf, src, item->width, len / item->width);
+            crc = omrx_crc32c(crc, buf, len);
+            src += len;
+            size -= len;
+        }
+    }
+    item->attr->out_crc = crc;
+}
+
+static void encode_ref_task(void *arg, size_t index) {
+    struct encode_ref *ref = (struct encode_ref *)arg + index;
+
+    encode_block_task(ref->job, ref->block);
+}
+
+// Write out a batch of items for write_parallel(), starting at the current
+// write position.  Small items are gathered into runs of up to
+// OMRX_WRITE_RUN_SIZE bytes, which are copied together and written with one
+// call; anything larger is written straight from where it is.
+static omrx_status_t write_batch(omrx_t omrx, int fd, struct write_item *items, size_t count) {
+    struct write_run *runs;
+    struct write_run *run = NULL;
+    size_t nruns = 0;
+    size_t stage_size = 0;
+    size_t item_size;
+    uint8_t *stage = NULL;
+    off_t pos = omrx->write_pos;
+    size_t i;
+    int err = 0;
+
+    if (!count) {
+        return OMRX_OK;
+    }
+    runs = omrx->alloc(omrx, sizeof(struct write_run) * count);
+    CHECK_ALLOC(omrx, runs);
+    for (i = 0; i < count; i++) {
+        items[i].pos = pos;
+        if (items[i].attr) {
+            items[i].attr->out_pos = pos + items[i].data_offset;
+        } else if (items[i].chunk) {
+            items[i].chunk->out_pos = pos + CHUNKHDR_SIZE;
+        }
+        item_size = items[i].hdr_len + items[i].len;
+        if (!run || !run->staged || item_size >= OMRX_WRITE_RUN_SIZE || run->len + item_size > OMRX_WRITE_RUN_SIZE) {
+            run = &runs[nruns++];
+            memset(run, 0, sizeof(*run));
+            run->items = &items[i];
+            run->pos = pos;
+            run->staged = item_size < OMRX_WRITE_RUN_SIZE;
+        }
+        run->count++;
+        run->len += item_size;
+        if (run->staged) {
+            stage_size += item_size;
+        }
+        pos += item_size;
+    }
+    if (stage_size) {
+        stage = omrx->alloc(omrx, stage_size);
+        if (!stage) {
+            omrx->free(omrx, runs);
+            return omrx_os_error(omrx, OMRX_ERR_ALLOC, "Memory allocation failed");
+        }
+        stage_size = 0;
+        for (i = 0; i < nruns; i++) {
+            if (runs[i].staged) {
+                runs[i].stage = stage + stage_size;
+                stage_size += runs[i].len;
+            }
+        }
+    }
+    omrx_workers_run(get_workers(omrx), nruns, write_run_task, &(struct write_batch){runs, fd});
+    for (i = 0; i < nruns && !err; i++) {
+        err = runs[i].err;
+    }
+    if (stage) {
+        omrx->free(omrx, stage);
+    }
+    omrx->free(omrx, runs);
+    if (err) {
+        errno = err;
+        return omrx_os_error(omrx, OMRX_ERR_OSERR, "Write error");
+    }
+    omrx->write_pos = pos;
+    // Anything written with write_data() after this (the TOC) carries on
+    // from here
+    omrx->out.pos = pos;
+
+    return OMRX_OK;
+}
+
+// Write one run of items (see write_batch()).  Runs in worker threads.
+static void write_run_task(void *arg, size_t index) {
+    struct write_batch *batch = arg;
+    struct write_run *run = &batch->runs[index];
+    struct write_item *item;
+    struct iovec iov[2];
+    uint8_t buf[OMRX_SWAP_BUFSIZE];
+    uint8_t *p = run->stage;
+    const uint8_t *src;
+    off_t pos = run->pos;
+    size_t size;
+    size_t len;
+    size_t i;
+
+    for (i = 0; i < run->count; i++) {
+        item = &run->items[i];
+        if (p) {
+            memcpy(p, item->hdr, item->hdr_len);
+            p += item->hdr_len;
+            if (OMRX_NEEDS_SWAP(item->width)) {
+                omrx_bswap_array(p, item->data, item->width, item->len / item->width);
+            } else if (item->len) {
+                memcpy(p, item->data, item->len);
+            }
+            p += item->len;
+            continue;
+        }
+        if (!OMRX_NEEDS_SWAP(item->width)) {
+            // Write the header and data together
+            iov[0].iov_base = item->hdr;
+            iov[0].iov_len = item->hdr_len;
+            iov[1].iov_base = (void *)item->data;
+            iov[1].iov_len = item->len;
+            run->err = omrx_pwritev_all(batch->fd, iov, 2, pos);
+            pos += item->hdr_len + item->len;
+            if (run->err) return;
+            continue;
+        }
+        run->err = omrx_pwrite_all(batch->fd, item->hdr, item->hdr_len, pos);
+        pos += item->hdr_len;
+        if (run->err) return;
+        src = item->data;
+        size = item->len;
+        while (size) {
+            len = size < sizeof(buf) ? size : sizeof(buf);
+            omrx_bswap_array(buf, src, item->width, len / item->width);
+            run->err = omrx_pwrite_all(batch->fd, buf, len, pos);
+            if (run->err) return;
+            src += len;
+            pos += len;
+            size -= len;
+        }
+    }
+    if (run->stage) {
+        run->err = omrx_pwrite_all(batch->fd, run->stage, run->len, run->pos);
+    }
+}
+
+// Write out a batch of items for write_parallel() in direct mode
+// (OMRX_WRITE_DIRECT).  Everything has to be copied into the aligned output
+// buffer anyway, so this is just done in order through write_data().  (The
+// checksums were already worked out by checksum_write_items(), and don't need
+// doing again.)
+static omrx_status_t write_batch_direct(omrx_t omrx, struct write_item *items, size_t count) {
+    bool checksums = omrx->write_checksums;
+    omrx_status_t status = OMRX_OK;
+    size_t i;
+
+    omrx->write_checksums = false;
+    for (i = 0; i < count && status >= 0; i++) {
+        items[i].pos = omrx->write_pos;
+        if (items[i].attr) {
+            items[i].attr->out_pos = omrx->write_pos + items[i].data_offset;
+        } else if (items[i].chunk) {
+            items[i].chunk->out_pos = omrx->write_pos + CHUNKHDR_SIZE;
+        }
+        status = write_data(omrx, items[i].hdr_len, items[i].hdr, NULL);
+        if (status >= 0) {
+            status = write_payload(omrx, items[i].width, items[i].len, items[i].data, NULL);
+        }
+    }
+    omrx->write_checksums = checksums;
+
+    return status;
+}
+
+static uint32_t get_elem_size(uint16_t dtype, uint32_t total_size) {
+    if (OMRX_IS_SIMPLE_DTYPE(dtype) || OMRX_IS_ARRAY_DTYPE(dtype)) {
+        // For simple and array types, the low two bits always indicate the
+        // element width.
+        return OMRX_GET_ELEMSIZE(dtype);
+    }
+    switch (dtype) {
+        case OMRX_DTYPE_UTF8:
+        case OMRX_DTYPE_RAW:
+            return total_size;
+    }
+
+    // We don't know about this type.  The only thing we can do is return 0.
+    return 0;
+}
+
+// The size of the units which need to be byte-swapped between host and file
+// order for the given datatype (1 if none).
+static uint32_t get_swap_width(uint16_t dtype) {
+    if (OMRX_IS_SIMPLE_DTYPE(dtype) || OMRX_IS_ARRAY_DTYPE(dtype)) {
+        return OMRX_GET_ELEMSIZE(dtype);
+    }
+    return 1;
+}
+
+// Convert attribute data just read from the file into host order, in place.
+static void payload_ftoh(uint16_t dtype, void *data, size_t size) {
+    uint32_t width = get_swap_width(dtype);
+
+    if (OMRX_NEEDS_SWAP(width)) {
+        omrx_bswap_array(data, data, width, size / width);
+    }
+}
+
+// Write attribute data (in host order, made up of elements `width` bytes
+// wide) to the file, converting it to file order as we go.
+static omrx_status_t write_payload(omrx_t omrx, uint32_t width, size_t size, const void *src, FILE *fp) {
+    uint8_t buf[OMRX_SWAP_BUFSIZE];
+    const uint8_t *p = src;
+    size_t len;
+
+    if (!OMRX_NEEDS_SWAP(width)) {
+        return write_data(omrx, size, src, fp);
+    }
+    while (size) {
+        len = size < sizeof(buf) ? size : sizeof(buf);
+        omrx_bswap_array(buf, p, width, len / width);
+        CHECK_ERR(write_data(omrx, len, buf, fp));
+        p += len;
+        size -= len;
+    }
+
+    return OMRX_OK;
+}
+
+// Whether data of the given type is byte-shuffled by the given encoding.  (Only
+// arrays of multi-byte elements are.)
+static bool uses_shuffle(uint16_t dtype, uint16_t encoding) {
+    return (encoding & OMRX_ENCODING_SHUFFLE) && OMRX_IS_ARRAY_DTYPE(dtype) && OMRX_GET_ELEMSIZE(dtype) > 1;
+}
+
+// Fill in the subheader which precedes encoded attribute data in the file:
+// the column count (for arrays), followed by the size of the decoded data.
+// Returns its length (dest may be NULL to just get that).
+static uint32_t put_encoded_subheader(uint16_t dtype, uint16_t cols, uint32_t raw_size, uint8_t *dest) {
+    uint32_t len = 0;
+
+    if (OMRX_IS_ARRAY_DTYPE(dtype)) {
+        if (dest) {
+            cols = UINT16_HTOF(cols);
+            memcpy(dest, &cols, 2);
+        }
+        len += 2;
+    }
+    if (dest) {
+        raw_size = UINT32_HTOF(raw_size);
+        memcpy(dest + len, &raw_size, 4);
+    }
+    len += 4;
+
+    return len;
+}
+
+// Check that `encoding` is valid for an attribute with the given ID and type,
+// and replace OMRX_ENCODING_AUTO with the actual codec to use.
+static omrx_status_t resolve_encoding(omrx_t omrx, uint16_t id, uint16_t dtype, uint16_t *encoding) {
+    uint16_t codec = *encoding & OMRX_CODEC_MASK;
+
+    if (*encoding & ~OMRX_ENCODING_MASK) {
+        return omrx_error(omrx, OMRX_ERR_BAD_ENCODING, "%04x: Invalid attribute encoding (%04x)", id, *encoding);
+    }
+    if (!*encoding) {
+        return OMRX_OK;
+    }
+    if (OMRX_IS_SIMPLE_DTYPE(dtype) || OMRX_GET_ENCODING(dtype) || id == OMRX_ATTR_ID) {
+        return omrx_error(omrx, OMRX_ERR_WRONG_DTYPE, "%04x: Attributes of this type (%04x) cannot be encoded", id, dtype);
+    }
+    if (codec == OMRX_ENCODING_AUTO) {
+        codec = omrx_codec_best();
+        *encoding = (*encoding & OMRX_ENCODING_SHUFFLE) | codec;
+    }
+    if (!omrx_codec_supported(codec)) {
+        return omrx_error(omrx, OMRX_ERR_BAD_ENCODING, "%04x: Attribute encoding (%04x) is not supported by this build of libomrx", id, *encoding);
+    }
+
+    return OMRX_OK;
+}
+
+// Encode `size` bytes of attribute data (in host order) for writing to the
+// file.  On success, *result is set to a newly allocated buffer holding the
+// encoding subheader followed by the encoded data (*result_len bytes in all),
+// and *result_encoding to the encoding actually used.  Returns
+// OMRX_STATUS_NOT_FOUND if encoding wouldn't make the data any smaller.
+static omrx_status_t encode_payload(omrx_t omrx, uint16_t dtype, uint16_t encoding, uint16_t cols, uint32_t size, const void *src, uint8_t **result, uint32_t *result_len, uint16_t *result_encoding) {
+    struct encode_job job;
+    omrx_status_t status;
+
+    *result = NULL;
+    status = encode_begin(omrx, dtype, encoding, cols, size, src, &job);
+    if (status == OMRX_OK) {
+        omrx_workers_run(get_workers(omrx), job.count, encode_block_task, &job);
+        status = encode_end(omrx, &job, result, result_len, result_encoding);
+    }
+    encode_cleanup(omrx, &job);
+
+    return status;
+}
+
+// Set up `job` to encode some attribute data (see encode_payload()).  The
+// blocks then need to be encoded with encode_block_task() (job->count of
+// them), after which encode_end() collects the result.  Returns
+// OMRX_STATUS_NOT_FOUND if there's nothing to encode.  The job must be
+// cleaned up with encode_cleanup() in any case.
+//
+// Arrays larger than the instance's block size are split into blocks of
+// whole rows, which are encoded independently (in parallel), so that they
+// can also be decoded in parallel, or individually (see read_block_dir()).
+// Files older than OMRX_VERSION_BLOCKS have no block directory, so arrays
+// written to them are left as a single block.
+static omrx_status_t encode_begin(omrx_t omrx, uint16_t dtype, uint16_t encoding, uint16_t cols, uint32_t size, const void *src, struct encode_job *job) {
+    uint16_t codec = encoding & OMRX_CODEC_MASK;
+    uint32_t row_size;
+
+    memset(job, 0, sizeof(*job));
+    if (!uses_shuffle(dtype, encoding)) {
+        encoding &= ~OMRX_ENCODING_SHUFFLE;
+    }
+    if (!encoding) {
+        return OMRX_STATUS_NOT_FOUND;
+    }
+    if (!omrx_codec_supported(codec)) {
+        return omrx_error(omrx, OMRX_ERR_BAD_ENCODING, "Attribute encoding (%04x) is not supported by this build of libomrx", encoding);
+    }
+    job->dtype = dtype;
+    job->cols = cols;
+    job->encoding = encoding;
+    job->codec = codec;
+    job->width = get_swap_width(dtype);
+    job->shuffle = (encoding & OMRX_ENCODING_SHUFFLE) != 0;
+    job->size = size;
+    job->block_bytes = size ? size : 1;
+    job->count = 1;
+    job->src = src;
+    if (OMRX_IS_ARRAY_DTYPE(dtype) && omrx->out_version >= OMRX_VERSION_BLOCKS) {
+        row_size = (cols ? cols : 1) * OMRX_GET_ELEMSIZE(dtype);
+        if (omrx->block_size && size > omrx->block_size) {
+            job->block_rows = omrx->block_size / row_size;
+            if (!job->block_rows) {
+                job->block_rows = 1;
+            }
+            job->block_bytes = (uint64_t)job->block_rows * row_size;
+            job->count = (size + job->block_bytes - 1) / job->block_bytes;
+            if (job->count < 2) {
+                job->block_rows = 0;
+                job->count = 1;
+                job->block_bytes = size;
+            }
+        }
+        job->dir_len = 4 + (job->block_rows ? job->count * 4 : 0);
+    }
+    job->bound = omrx_codec_bound(codec, job->block_bytes);
+    job->work = omrx->alloc(omrx, job->bound * job->count);
+    CHECK_ALLOC(omrx, job->work);
+    job->lens = omrx->alloc(omrx, sizeof(uint32_t) * job->count);
+    CHECK_ALLOC(omrx, job->lens);
+    if (OMRX_NEEDS_SWAP(job->width)) {
+        job->swapped = omrx->alloc(omrx, size + 1);
+        CHECK_ALLOC(omrx, job->swapped);
+    }
+    if (job->shuffle) {
+        job->shuffled = omrx->alloc(omrx, size + 1);
+        CHECK_ALLOC(omrx, job->shuffled);
+    }
+
+    return OMRX_OK;
+}
+
+// Put together the output of an encoding job whose blocks have all been
+// encoded: see encode_payload() for the results.
+static omrx_status_t encode_end(omrx_t omrx, struct encode_job *job, uint8_t **result, uint32_t *result_len, uint16_t *result_encoding) {
+    uint32_t hdr_len = put_encoded_subheader(job->dtype, job->cols, job->size, NULL);
+    uint64_t total = job->dir_len;
+    uint32_t value;
+    uint32_t i;
+    uint8_t *out;
+    uint8_t *p;
+
+    *result = NULL;
+    for (i = 0; i < job->count; i++) {
+        total += job->lens[i];
+    }
+    if ((job->codec && total >= job->size) || hdr_len + total > UINT32_MAX) {
+        return OMRX_STATUS_NOT_FOUND;
+    }
+    out = omrx->alloc(omrx, hdr_len + total);
+    CHECK_ALLOC(omrx, out);
+    p = out + put_encoded_subheader(job->dtype, job->cols, job->size, out);
+    if (job->dir_len) {
+        value = UINT32_HTOF(job->block_rows);
+        memcpy(p, &value, 4);
+        p += 4;
+        if (job->block_rows) {
+            total = 0;
+            for (i = 0; i < job->count; i++) {
+                total += job->lens[i];
+                value = UINT32_HTOF(total);
+                memcpy(p, &value, 4);
+                p += 4;
+            }
+        }
+    }
+    for (i = 0; i < job->count; i++) {
+        memcpy(p, job->work + (size_t)i * job->bound, job->lens[i]);
+        p += job->lens[i];
+    }
+    *result = out;
+    *result_len = p - out;
+    *result_encoding = job->encoding;
+
+    return OMRX_OK;
+}
+
+// Free the scratch buffers of an encoding job.
+static void encode_cleanup(omrx_t omrx, struct encode_job *job) {
+    if (job->work) {
+        omrx->free(omrx, job->work);
+    }
+    if (job->lens) {
+        omrx->free(omrx, job->lens);
+    }
+    if (job->swapped) {
+        omrx->free(omrx, job->swapped);
+    }
+    if (job->shuffled) {
+        omrx->free(omrx, job->shuffled);
+    }
+    memset(job, 0, sizeof(*job));
+}
+
+// Encode one block for encode_payload() (byte-swap, shuffle, compress).  This
+// runs in worker threads, so like decode_block_task() it only touches the
+// buffers set up for it.
+static void encode_block_task(void *arg, size_t index) {
+    struct encode_job *job = arg;
+    uint64_t offset = (uint64_t)index * job->block_bytes;
+    uint64_t raw_len = job->size - offset;
+    const uint8_t *p = job->src + offset;
+    uint8_t *dest = job->work + index * job->bound;
+    size_t tail;
+    size_t len;
+
+    if (raw_len > job->block_bytes) {
+        raw_len = job->block_bytes;
+    }
+    tail = raw_len % job->width;
+    if (job->swapped) {
+        omrx_bswap_array(job->swapped + offset, p, job->width, raw_len / job->width);
+        memcpy(job->swapped + offset + raw_len - tail, p + raw_len - tail, tail);
+        p = job->swapped + offset;
+    }
+    if (job->shuffle) {
+        omrx_shuffle(job->shuffled + offset, p, job->width, raw_len / job->width);
+        memcpy(job->shuffled + offset + raw_len - tail, p + raw_len - tail, tail);
+        len = omrx_compress(job->codec, dest, job->bound, job->shuffled + offset, raw_len);
+    } else {
+        len = omrx_compress(job->codec, dest, job->bound, p, raw_len);
+    }
+    if (job->codec && (!len || len >= raw_len)) {
+        // Not compressible, so just store it (unshuffled).
+        memcpy(dest, p, raw_len);
+        len = raw_len;
+    }
+    job->lens[index] = len;
+}
+
+// Add a new attribute to a chunk, taking ownership of the supplied data.
+static omrx_status_t set_attr_data(omrx_chunk_t chunk, uint16_t id, uint16_t datatype, uint16_t cols, uint32_t size, void *data) {
+    omrx_t omrx = chunk->omrx;
+    omrx_attr_t attr;
+
+    attr = new_attr(chunk, id, datatype, size, -1);
+    CHECK_ALLOC(omrx, attr);
+    attr->cols = cols;
+    attr->data = data;
+    attr->own_data = true;
+
+    return chunk_add_attr(chunk, attr);
+}
+
+// Write a TOC chunk describing everything written so far (which must be the
+// entire contents of the root chunk), followed by the OMRX end tag and the
+// trailer pointing to the TOC.
+static omrx_status_t write_toc(omrx_t omrx, FILE *fp) {
+    struct tree_walk walk;
+    omrx_chunk_t chunk;
+    omrx_chunk_t toc;
+    omrx_attr_t attr;
+    struct toc_trailer trailer;
+    off_t toc_pos;
+    size_t chunk_count = 0;
+    size_t attr_count = 0;
+    size_t encoded_count = 0;
+    size_t ids_size = 0;
+    size_t i = 0;
+    size_t j = 0;
+    size_t k = 0;
+    uint8_t *tags;
+    uint32_t *parents;
+    uint64_t *chunk_pos;
+    uint16_t *nattrs;
+    uint16_t *types;
+    uint32_t *sizes;
+    uint64_t *attr_pos;
+    uint32_t *raw_sizes = NULL;
+    uint32_t *crcs = NULL;
+    uint8_t *ids;
+    omrx_status_t status;
+
+    // (Children of chunks with an end-style tag are never written.)
+    for (chunk = walk_start(&walk, omrx->root_chunk); chunk; chunk = walk_next_entered(&walk, !(chunk->tagint & END_CHUNK_FLAG))) {
+        chunk->toc_index = chunk_count++;
+        attr_count += chunk->attr_count;
+        if (find_attr(chunk, OMRX_ATTR_ID, &attr) == OMRX_OK && attr->datatype == OMRX_DTYPE_UTF8) {
+            ids_size += attr->size + 1;
+        }
+        for (attr = chunk->attrs; attr; attr = attr->next) {
+            if (attr->out_encoding) {
+                encoded_count++;
+            }
+        }
+    }
+
+    toc = new_chunk(omrx, TOC_CHUNK_TAG);
+    CHECK_ALLOC(omrx, toc);
+
+    // Note: set_attr_data takes ownership of each array as soon as it's
+    // allocated, so free_chunk(toc) will clean everything up on failure.
+    tags = omrx->alloc(omrx, chunk_count * 4);
+    status = tags ? set_attr_data(toc, TOC_ATTR_CHUNK_TAGS, OMRX_DTYPE_U8_ARRAY, 4, chunk_count * 4, tags) : OMRX_ERR_ALLOC;
+    if (status >= 0) {
+        parents = omrx->alloc(omrx, chunk_count * 4);
+        status = parents ? set_attr_data(toc, TOC_ATTR_CHUNK_PARENTS, OMRX_DTYPE_U32_ARRAY, 1, chunk_count * 4, parents) : OMRX_ERR_ALLOC;
+    }
+    if (status >= 0) {
+        chunk_pos = omrx->alloc(omrx, chunk_count * 8);
+        status = chunk_pos ? set_attr_data(toc, TOC_ATTR_CHUNK_POS, OMRX_DTYPE_U64_ARRAY, 1, chunk_count * 8, chunk_pos) : OMRX_ERR_ALLOC;
+    }
+    if (status >= 0) {
+        nattrs = omrx->alloc(omrx, chunk_count * 2);
+        status = nattrs ? set_attr_data(toc, TOC_ATTR_CHUNK_NATTRS, OMRX_DTYPE_U16_ARRAY, 1, chunk_count * 2, nattrs) : OMRX_ERR_ALLOC;
+    }
+    if (status >= 0) {
+        types = omrx->alloc(omrx, attr_count * 6 + 1);
+        status = types ? set_attr_data(toc, TOC_ATTR_ATTR_TYPES, OMRX_DTYPE_U16_ARRAY, 3, attr_count * 6, types) : OMRX_ERR_ALLOC;
+    }
+    if (status >= 0) {
+        sizes = omrx->alloc(omrx, attr_count * 4 + 1);
+        status = sizes ? set_attr_data(toc, TOC_ATTR_ATTR_SIZES, OMRX_DTYPE_U32_ARRAY, 1, attr_count * 4, sizes) : OMRX_ERR_ALLOC;
+    }
+    if (status >= 0) {
+        attr_pos = omrx->alloc(omrx, attr_count * 8 + 1);
+        status = attr_pos ? set_attr_data(toc, TOC_ATTR_ATTR_POS, OMRX_DTYPE_U64_ARRAY, 1, attr_count * 8, attr_pos) : OMRX_ERR_ALLOC;
+    }
+    if (status >= 0 && encoded_count) {
+        // Encoded attributes have both an encoded size (in the sizes array)
+        // and a decoded size.  (Readers which don't know about encodings
+        // can ignore this.)
+        raw_sizes = omrx->alloc(omrx, attr_count * 4 + 1);
+        status = raw_sizes ? set_attr_data(toc, TOC_ATTR_ATTR_RAWSIZES, OMRX_DTYPE_U32_ARRAY, 1, attr_count * 4, raw_sizes) : OMRX_ERR_ALLOC;
+    }
+    if (status >= 0 && omrx->write_checksums) {
+        // The attribute checksums are also in each chunk, but opening a file
+        // from its TOC doesn't read those.
+        crcs = omrx->alloc(omrx, attr_count * 4 + 1);
+        status = crcs ? set_attr_data(toc, TOC_ATTR_ATTR_CRCS, OMRX_DTYPE_U32_ARRAY, 1, attr_count * 4, crcs) : OMRX_ERR_ALLOC;
+    }
+    if (status >= 0) {
+        ids = omrx->alloc(omrx, ids_size + 1);
+        status = ids ? set_attr_data(toc, TOC_ATTR_IDS, OMRX_DTYPE_RAW, 1, ids_size, ids) : OMRX_ERR_ALLOC;
+    }
+    if (status < 0) {
+        free_chunk(toc);
+        if (status == OMRX_ERR_ALLOC) {
+            return omrx_error(omrx, OMRX_ERR_ALLOC, "Memory allocation failed");
+        }
+        return status;
+    }
+
+    for (chunk = walk_start(&walk, omrx->root_chunk); chunk; chunk = walk_next_entered(&walk, !(chunk->tagint & END_CHUNK_FLAG))) {
+        memcpy(tags + i * 4, chunk->tag, 4);
+        // (These are attribute data, so they're in host order until
+        // write_attr() converts them.)
+        parents[i] = chunk->parent ? chunk->parent->toc_index : TOC_NO_PARENT;
+        chunk_pos[i] = chunk->out_pos;
+        nattrs[i] = chunk->attr_count;
+        for (attr = chunk->attrs; attr; attr = attr->next) {
+            types[j * 3] = attr->id;
+            types[j * 3 + 1] = attr->datatype | attr->out_encoding;
+            types[j * 3 + 2] = attr->cols;
+            sizes[j] = attr->out_encoding ? attr->out_size : attr->size;
+            attr_pos[j] = attr->out_pos;
+            if (raw_sizes) {
+                raw_sizes[j] = attr->size;
+            }
+            if (crcs) {
+                crcs[j] = attr->out_crc;
+            }
+            if (attr->id == OMRX_ATTR_ID && attr->datatype == OMRX_DTYPE_UTF8) {
+                status = read_attr_into(attr, 0, attr->size, ids + k);
+                if (status < 0) {
+                    free_chunk(toc);
+                    return status;
+                }
+                ids[k + attr->size] = 0;
+                k += attr->size + 1;
+            }
+            j++;
+        }
+        i++;
+    }
+
+    toc_pos = omrx->write_pos;
+    status = write_chunk(toc, fp);
+    free_chunk(toc);
+    CHECK_ERR(status);
+    CHECK_ERR(write_chunk_end(omrx->root_chunk, fp));
+
+    trailer.toc_pos = UINT64_HTOF(toc_pos);
+    trailer.version = UINT32_HTOF(TOC_TRAILER_VERSION);
+    memcpy(trailer.magic, TOC_TRAILER_MAGIC, 4);
+
+    return write_data(omrx, sizeof(trailer), &trailer, fp);
+}
+
+// Attempt to build the chunk tree from the TOC at the end of the file instead
+// of scanning the whole thing.  Returns OMRX_STATUS_NOT_FOUND if there is no
+// TOC, or it doesn't appear to match the file, in which case the caller
+// should fall back to omrx_scan().
+static omrx_status_t load_toc(omrx_t omrx, off_t start) {
+    struct chunk_header end_hdr;
+    struct toc_trailer trailer;
+    uint8_t magic[4];
+    uint8_t *buf;
+    off_t file_size;
+    off_t end_pos;
+    off_t toc_pos;
+    size_t toc_len;
+    omrx_status_t status;
+
+    if (omrx->map) {
+        file_size = omrx->map_size;
+    } else {
+        if (fseeko(omrx->fp, 0, SEEK_END) < 0) {
+            // Can't seek to the end (a pipe or something?)
+            return OMRX_STATUS_NOT_FOUND;
+        }
+        file_size = ftello(omrx->fp);
+        if (file_size < 0) {
+            return OMRX_STATUS_NOT_FOUND;
+        }
+    }
+    end_pos = file_size - TOC_TRAILER_SIZE - CHUNKHDR_SIZE;
+    if (end_pos < start + 2 * CHUNKHDR_SIZE) {
+        return OMRX_STATUS_NOT_FOUND;
+    }
+    CHECK_ERR(read_data_at(omrx, start, 4, magic));
+    CHECK_ERR(read_data_at(omrx, end_pos, CHUNKHDR_SIZE, &end_hdr));
+    CHECK_ERR(read_data_at(omrx, end_pos + CHUNKHDR_SIZE, TOC_TRAILER_SIZE, &trailer));
+    toc_pos = UINT64_FTOH(trailer.toc_pos);
+    if (memcmp(magic, "OMRX", 4) || memcmp(end_hdr.tag, "OMRx", 4) || end_hdr.count != 0) {
+        return OMRX_STATUS_NOT_FOUND;
+    }
+    if (memcmp(trailer.magic, TOC_TRAILER_MAGIC, 4) || UINT32_FTOH(trailer.version) != TOC_TRAILER_VERSION) {
+        return OMRX_STATUS_NOT_FOUND;
+    }
+    if (toc_pos < start + CHUNKHDR_SIZE || toc_pos > end_pos - CHUNKHDR_SIZE) {
+        return OMRX_STATUS_NOT_FOUND;
+    }
+
+    // Read the whole TOC in one go.
+    toc_len = end_pos - toc_pos;
+    if (omrx->map) {
+        buf = omrx->map + toc_pos;
+    } else {
+        buf = omrx->alloc(omrx, toc_len);
+        CHECK_ALLOC(omrx, buf);
+        status = read_data_at(omrx, toc_pos, toc_len, buf);
+        if (status < 0) {
+            omrx->free(omrx, buf);
+            return status;
+        }
+    }
+
+    if (omrx->root_chunk) {
+        free_all_chunks(omrx->root_chunk);
+        omrx->root_chunk = NULL;
+    }
+    omrx->context = NULL;
+    status = build_from_toc(omrx, start, toc_pos, buf, toc_len);
+    if (!omrx->map) {
+        omrx->free(omrx, buf);
+    }
+    CHECK_OK(status);
+
+    return check_version(omrx);
+}
+
+// Parse the TOC chunk in buf and reconstruct the chunk tree from it.
+static omrx_status_t build_from_toc(omrx_t omrx, off_t start, off_t toc_pos, const uint8_t *buf, size_t len) {
+    struct chunk_header hdr;
+    struct attr_header attr_hdr;
+    const uint8_t *tags = NULL;
+    const uint8_t *parents = NULL;
+    const uint8_t *chunk_pos = NULL;
+    const uint8_t *nattrs = NULL;
+    const uint8_t *types = NULL;
+    const uint8_t *sizes = NULL;
+    const uint8_t *attr_pos = NULL;
+    const uint8_t *raw_sizes = NULL;
+    const uint8_t *crcs = NULL;
+    const uint8_t *ids = NULL;
+    size_t tags_size = 0, parents_size = 0, chunk_pos_size = 0, nattrs_size = 0;
+    size_t types_size = 0, sizes_size = 0, attr_pos_size = 0, raw_sizes_size = 0, crcs_size = 0, ids_size = 0;
+    const uint8_t *p = buf;
+    const uint8_t *end = buf + len;
+    const uint8_t *id_end;
+    omrx_chunk_t *chunks = NULL;
+    omrx_chunk_t chunk;
+    omrx_attr_t attr;
+    size_t chunk_count, attr_count;
+    size_t i, j, a;
+    uint32_t parent;
+    uint16_t n, id, datatype, cols;
+    uint32_t size, raw_size, crc;
+    uint64_t pos;
+    char *idstr;
+    omrx_status_t status = OMRX_STATUS_NOT_FOUND;
+
+    if (len < CHUNKHDR_SIZE) return OMRX_STATUS_NOT_FOUND;
+    memcpy(&hdr, p, CHUNKHDR_SIZE);
+    p += CHUNKHDR_SIZE;
+    if (memcmp(hdr.tag, TOC_CHUNK_TAG, 4)) return OMRX_STATUS_NOT_FOUND;
+    for (i = 0; i < UINT16_FTOH(hdr.count); i++) {
+        if (end - p < ATTRHDR_SIZE) return OMRX_STATUS_NOT_FOUND;
+        memcpy(&attr_hdr, p, ATTRHDR_SIZE);
+        p += ATTRHDR_SIZE;
+        size = UINT32_FTOH(attr_hdr.size);
+        if ((size_t)(end - p) < size) return OMRX_STATUS_NOT_FOUND;
+        if (OMRX_IS_ARRAY_DTYPE(UINT16_FTOH(attr_hdr.datatype))) {
+            // Skip the array sub-header (the column counts are implied)
+            if (size < 2) return OMRX_STATUS_NOT_FOUND;
+            p += 2;
+            size -= 2;
+        }
+        switch (UINT16_FTOH(attr_hdr.id)) {
+            case TOC_ATTR_CHUNK_TAGS: tags = p; tags_size = size; break;
+            case TOC_ATTR_CHUNK_PARENTS: parents = p; parents_size = size; break;
+            case TOC_ATTR_CHUNK_POS: chunk_pos = p; chunk_pos_size = size; break;
+            case TOC_ATTR_CHUNK_NATTRS: nattrs = p; nattrs_size = size; break;
+            case TOC_ATTR_ATTR_TYPES: types = p; types_size = size; break;
+            case TOC_ATTR_ATTR_SIZES: sizes = p; sizes_size = size; break;
+            case TOC_ATTR_ATTR_POS: attr_pos = p; attr_pos_size = size; break;
+            case TOC_ATTR_ATTR_RAWSIZES: raw_sizes = p; raw_sizes_size = size; break;
+            case TOC_ATTR_ATTR_CRCS: crcs = p; crcs_size = size; break;
+            case TOC_ATTR_IDS: ids = p; ids_size = size; break;
+        }
+        p += size;
+    }
+    if (!tags || !parents || !chunk_pos || !nattrs || !types || !sizes || !attr_pos || !ids) {
+        return OMRX_STATUS_NOT_FOUND;
+    }
+    chunk_count = parents_size / 4;
+    attr_count = sizes_size / 4;
+    if (!chunk_count || tags_size != chunk_count * 4 || parents_size != chunk_count * 4 || chunk_pos_size != chunk_count * 8 || nattrs_size != chunk_count * 2) {
+        return OMRX_STATUS_NOT_FOUND;
+    }
+    if (types_size != attr_count * 6 || sizes_size != attr_count * 4 || attr_pos_size != attr_count * 8) {
+        return OMRX_STATUS_NOT_FOUND;
+    }
+    if ((raw_sizes && raw_sizes_size != attr_count * 4) || (crcs && crcs_size != attr_count * 4)) {
+        return OMRX_STATUS_NOT_FOUND;
+    }
+
+    chunks = omrx->alloc(omrx, sizeof(omrx_chunk_t) * chunk_count);
+    CHECK_ALLOC(omrx, chunks);
+
+    a = 0;
+    for (i = 0; i < chunk_count; i++) {
+        memcpy(&parent, parents + i * 4, 4);
+        parent = UINT32_FTOH(parent);
+        memcpy(&pos, chunk_pos + i * 8, 8);
+        pos = UINT64_FTOH(pos);
+        memcpy(&n, nattrs + i * 2, 2);
+        n = UINT16_FTOH(n);
+        if ((TAG_TO_TAGINT(tags + i * 4) & 0xc0c0c0c0) != 0x40404040) goto fail;
+        if (i == 0) {
+            if (parent != TOC_NO_PARENT || memcmp(tags, "OMRX", 4)) goto fail;
+        } else if (parent >= i || (chunks[parent]->tagint & END_CHUNK_FLAG)) {
+            goto fail;
+        }
+        if (pos < (uint64_t)start || pos > (uint64_t)toc_pos || a + n > attr_count) goto fail;
+
+        chunk = new_chunk(omrx, (const char *)(tags + i * 4));
+        if (!chunk) {
+            status = omrx_error(omrx, OMRX_ERR_ALLOC, "Memory allocation failed");
+            goto fail;
+        }
+        chunk->file_position = pos;
+        chunks[i] = chunk;
+        if (i == 0) {
+            omrx->root_chunk = chunk;
+        } else {
+            add_child_chunk(chunks[parent], chunk);
+        }
+
+        for (j = 0; j < n; j++, a++) {
+            memcpy(&id, types + a * 6, 2);
+            memcpy(&datatype, types + a * 6 + 2, 2);
+            memcpy(&cols, types + a * 6 + 4, 2);
+            memcpy(&size, sizes + a * 4, 4);
+            memcpy(&pos, attr_pos + a * 8, 8);
+            id = UINT16_FTOH(id);
+            datatype = UINT16_FTOH(datatype);
+            cols = UINT16_FTOH(cols);
+            size = UINT32_FTOH(size);
+            pos = UINT64_FTOH(pos);
+            if (pos < (uint64_t)start || pos + size > (uint64_t)toc_pos) goto fail;
+            if (OMRX_GET_ENCODING(datatype) && !raw_sizes) goto fail;
+
+            attr = new_attr(chunk, id, datatype, size, pos);
+            if (!attr) {
+                status = omrx_error(omrx, OMRX_ERR_ALLOC, "Memory allocation failed");
+                goto fail;
+            }
+            attr->cols = cols ? cols : 1;
+            if (OMRX_GET_ENCODING(datatype)) {
+                // The TOC records the encoded size; the decoded size is
+                // kept separately.
+                memcpy(&raw_size, raw_sizes + a * 4, 4);
+                attr->encoding = OMRX_GET_ENCODING(datatype);
+                attr->file_encoding = attr->encoding;
+                attr->datatype = OMRX_GET_RAW_TYPE(datatype);
+                attr->size = UINT32_FTOH(raw_size);
+            }
+            if (crcs) {
+                memcpy(&crc, crcs + a * 4, 4);
+                attr->crc = UINT32_FTOH(crc);
+                attr->has_crc = true;
+            }
+            chunk_add_attr(chunk, attr);
+
+            if (id == OMRX_ATTR_ID && datatype == OMRX_DTYPE_UTF8) {
+                id_end = ids_size ? memchr(ids, 0, ids_size) : NULL;
+                if (!id_end || (size_t)(id_end - ids) != size) goto fail;
+                idstr = omrx_strdup(omrx, (const char *)ids);
+                if (!idstr) {
+                    status = omrx_error(omrx, OMRX_ERR_ALLOC, "Memory allocation failed");
+                    goto fail;
+                }
+                ids_size -= size + 1;
+                ids += size + 1;
+                status = register_chunk_id(chunk, idstr);
+                if (status < 0) goto fail;
+            }
+        }
+    }
+    if (a != attr_count) goto fail;
+
+    omrx->free(omrx, chunks);
+    return OMRX_OK;
+
+fail:
+    omrx->free(omrx, chunks);
+    if (omrx->root_chunk) {
+        free_all_chunks(omrx->root_chunk);
+        omrx->root_chunk = NULL;
+    }
+    return status;
+}
+
+// Make sure the streaming writer is in a state where a new attribute or
+// chunk can be started.
+static omrx_status_t stream_check(omrx_t omrx) {
+    if (!omrx->stream.fp) {
+        return omrx_error(omrx, OMRX_ERR_NOT_OPEN, "Streaming writer function called without omrx_stream_open()");
+    }
+    if (omrx->stream.in_array) {
+        return omrx_error(omrx, OMRX_ERR_BAD_STATE, "omrx_stream_end_array() must be called before writing anything else");
+    }
+
+    return OMRX_OK;
+}
+
+// Open a new chunk in the streaming writer (nothing is written yet)
+static omrx_status_t stream_push(omrx_t omrx, const char *tag) {
+    struct omrx_stream *stream = &omrx->stream;
+    struct omrx_stream_level *level;
+    struct omrx_stream_level *new_levels;
+
+    if (stream->depth == stream->max_depth) {
+        new_levels = omrx->alloc(omrx, sizeof(struct omrx_stream_level) * stream->max_depth * 2);
+        CHECK_ALLOC(omrx, new_levels);
+        memcpy(new_levels, stream->levels, sizeof(struct omrx_stream_level) * stream->depth);
+        omrx->free(omrx, stream->levels);
+        stream->levels = new_levels;
+        stream->max_depth *= 2;
+    }
+    level = &stream->levels[stream->depth++];
+    memcpy(level->tag, tag, 4);
+    level->tagint = TAG_TO_TAGINT(tag);
+    level->started = false;
+    level->has_children = false;
+    level->hdr_pos = -1;
+    level->attr_count = 0;
+    level->written_count = 0;
+
+    return OMRX_OK;
+}
+
+// Output data for the current chunk: either into the pending buffer, if the
+// chunk header hasn't been written yet, or straight to the file.
+static omrx_status_t stream_emit(omrx_t omrx, size_t size, const void *src) {
+    struct omrx_stream *stream = &omrx->stream;
+
+    if (stream->levels[stream->depth - 1].started) {
+        return write_data(omrx, size, src, stream->fp);
+    }
+    memcpy(stream->pending + stream->pending_len, src, size);
+    stream->pending_len += size;
+
+    return OMRX_OK;
+}
+
+// Like write_payload(), but for the streaming writer.
+static omrx_status_t stream_emit_payload(omrx_t omrx, uint32_t width, size_t size, const void *src) {
+    uint8_t buf[OMRX_SWAP_BUFSIZE];
+    const uint8_t *p = src;
+    size_t len;
+
+    if (!OMRX_NEEDS_SWAP(width)) {
+        return stream_emit(omrx, size, src);
+    }
+    while (size) {
+        len = size < sizeof(buf) ? size : sizeof(buf);
+        omrx_bswap_array(buf, p, width, len / width);
+        CHECK_ERR(stream_emit(omrx, len, buf));
+        p += len;
+        size -= len;
+    }
+
+    return OMRX_OK;
+}
+
+// Write the header for the current chunk, followed by whatever attributes
+// have been collected for it so far.
+static omrx_status_t stream_start_chunk(omrx_t omrx) {
+    struct omrx_stream *stream = &omrx->stream;
+    struct omrx_stream_level *level = &stream->levels[stream->depth - 1];
+    struct chunk_header hdr;
+
+    memcpy(hdr.tag, level->tag, 4);
+    hdr.count = UINT16_HTOF(level->attr_count);
+    level->hdr_pos = omrx->write_pos;
+    CHECK_ERR(write_data(omrx, sizeof(hdr), &hdr, stream->fp));
+    CHECK_ERR(write_data(omrx, stream->pending_len, stream->pending, stream->fp));
+    stream->pending_len = 0;
+    level->started = true;
+    level->written_count = level->attr_count;
+
+    return OMRX_OK;
+}
+
+// Called when no more attributes can be added to the current chunk.  Makes
+// sure its header has been written, and has the right attribute count.
+static omrx_status_t stream_finish_attrs(omrx_t omrx) {
+    struct omrx_stream *stream = &omrx->stream;
+    struct omrx_stream_level *level = &stream->levels[stream->depth - 1];
+    uint16_t count;
+
+    if (!level->started) {
+        return stream_start_chunk(omrx);
+    }
+    if (level->written_count != level->attr_count) {
+        count = UINT16_HTOF(level->attr_count);
+        CHECK_ERR(patch_data(omrx, level->hdr_pos + 4, 2, &count, stream->fp));
+        level->written_count = level->attr_count;
+    }
+
+    return OMRX_OK;
+}
+
+// Write the header (and array subheader) for a new attribute on the current
+// chunk.  `size` is the size of the data which will follow, which the caller
+// must then emit.  If `direct` is set (or the attribute is too big to fit in
+// the pending buffer), the chunk header is written out first, so that the
+// attribute data can go straight to the file.  The position of the attribute
+// header in the file is returned in `hdr_pos` (if the chunk has been started).
+static omrx_status_t stream_add_attr(omrx_t omrx, uint16_t id, uint16_t datatype, uint16_t cols, uint32_t size, bool direct, off_t *hdr_pos) {
+    struct omrx_stream *stream = &omrx->stream;
+    struct omrx_stream_level *level = &stream->levels[stream->depth - 1];
+    struct attr_header hdr;
+    uint16_t subhdr;
+    uint64_t total = ATTRHDR_SIZE + (uint64_t)size;
+
+    if (level->has_children) {
+        return omrx_error(omrx, OMRX_ERR_BAD_STATE, "%.4s:%04x: Attributes must be written before any child chunks", level->tag, id);
+    }
+    if (level->attr_count == UINT16_MAX) {
+        return omrx_error(omrx, OMRX_ERR_TOO_LARGE, "%.4s:%04x: Too many attributes for one chunk", level->tag, id);
+    }
+    if (OMRX_IS_ARRAY_DTYPE(datatype)) {
+        if (!cols) {
+            return omrx_error(omrx, OMRX_ERR_WRONG_DTYPE, "%.4s:%04x: Array attributes must have at least one column", level->tag, id);
+        }
+        if (size > UINT32_MAX - 2) {
+            return omrx_error(omrx, OMRX_ERR_TOO_LARGE, "%.4s:%04x: Attribute data is too large", level->tag, id);
+        }
+        total += 2;
+    }
+    level->attr_count++;
+    if (!level->started && (direct || stream->pending_len + total > OMRX_STREAM_BUFSIZE)) {
+        CHECK_ERR(stream_start_chunk(omrx));
+    }
+    if (hdr_pos) {
+        *hdr_pos = omrx->write_pos;
+    }
+    hdr.id = UINT16_HTOF(id);
+    hdr.datatype = UINT16_HTOF(datatype);
+    if (OMRX_IS_ARRAY_DTYPE(datatype)) {
+        hdr.size = UINT32_HTOF(size + 2);
+        subhdr = UINT16_HTOF(cols);
+        CHECK_ERR(stream_emit(omrx, sizeof(hdr), &hdr));
+        CHECK_ERR(stream_emit(omrx, 2, &subhdr));
+    } else {
+        hdr.size = UINT32_HTOF(size);
+        CHECK_ERR(stream_emit(omrx, sizeof(hdr), &hdr));
+    }
+
+    return OMRX_OK;
+}
+
+// Set up the streaming writer state and open the output file.
+static omrx_status_t stream_init(omrx_t omrx, const char *filename, const char *mode) {
+    struct omrx_stream *stream = &omrx->stream;
+
+    if (stream->fp) {
+        return omrx_error(omrx, OMRX_ERR_ALREADY_OPEN, "Streaming writer is already open");
+    }
+    stream->max_depth = 16;
+    stream->levels = omrx->alloc(omrx, sizeof(struct omrx_stream_level) * stream->max_depth);
+    stream->pending = omrx->alloc(omrx, OMRX_STREAM_BUFSIZE);
+    if (!stream->levels || !stream->pending) {
+        stream_cleanup(omrx);
+        return omrx_os_error(omrx, OMRX_ERR_ALLOC, "Memory allocation failed");
+    }
+    stream->fp = fopen(filename, mode);
+    if (!stream->fp) {
+        stream_cleanup(omrx);
+        return omrx_os_error(omrx, OMRX_ERR_OSERR, "Cannot open '%s' for writing", filename);
+    }
+
+    return OMRX_OK;
+}
+
+static void stream_cleanup(omrx_t omrx) {
+    struct omrx_stream *stream = &omrx->stream;
+
+    if (stream->levels) {
+        omrx->free(omrx, stream->levels);
+    }
+    if (stream->pending) {
+        omrx->free(omrx, stream->pending);
+    }
+    if (stream->tail) {
+        omrx->free(omrx, stream->tail);
+    }
+    memset(stream, 0, sizeof(struct omrx_stream));
+}
+
+static omrx_status_t stream_read_at(omrx_t omrx, off_t pos, size_t size, void *dest) {
+    FILE *fp = omrx->stream.fp;
+
+    if (fseeko(fp, pos, SEEK_SET) < 0) {
+        return omrx_os_error(omrx, OMRX_ERR_OSERR, "Seek failed");
+    }
+    errno = 0;
+    if (fread(dest, size, 1, fp) != 1) {
+        if (feof(fp)) {
+            return omrx_error(omrx, OMRX_ERR_EOF, "Read error: Unexpected end of file");
+        }
+        return omrx_os_error(omrx, OMRX_ERR_OSERR, "Read error");
+    }
+
+    return OMRX_OK;
+}
+
+// Check that the file opened for appending is an OMRX file we can add to,
+// and find where new chunks should go.  That's normally the position of the
+// OMRX end tag at the very end of the file, but if the file has a TOC (which
+// will no longer be accurate once we've added to the file), we start writing
+// over the top of the TOC chunk instead.
+static omrx_status_t stream_find_end(omrx_t omrx, off_t *end_pos) {
+    FILE *fp = omrx->stream.fp;
+    struct chunk_header hdr;
+    struct attr_header attr_hdr;
+    struct toc_trailer trailer;
+    uint_fast16_t i;
+    uint32_t ver;
+    off_t pos;
+    off_t file_size;
+    off_t toc_pos;
+
+    if (fseeko(fp, 0, SEEK_END) < 0) {
+        return omrx_os_error(omrx, OMRX_ERR_OSERR, "Seek failed");
+    }
+    file_size = ftello(fp);
+    if (file_size < 0) {
+        return omrx_os_error(omrx, OMRX_ERR_OSERR, "Cannot read file position");
+    }
+    if (file_size < 2 * CHUNKHDR_SIZE) {
+        return omrx_error(omrx, OMRX_ERR_BAD_MAGIC, "Bad data at beginning of file (not an OMRX file?)");
+    }
+
+    // Check the OMRX chunk header and make sure it's a version we can write
+    CHECK_ERR(stream_read_at(omrx, 0, CHUNKHDR_SIZE, &hdr));
+    if (memcmp(hdr.tag, "OMRX", 4)) {
+        return omrx_error(omrx, OMRX_ERR_BAD_MAGIC, "Bad data at beginning of file (not an OMRX file?)");
+    }
+    pos = CHUNKHDR_SIZE;
+    // Anything added has to be laid out to suit the file's version.
+    omrx->out_version = OMRX_MIN_VERSION;
+    for (i = 0; i < UINT16_FTOH(hdr.count); i++) {
+        CHECK_ERR(stream_read_at(omrx, pos, ATTRHDR_SIZE, &attr_hdr));
+        pos += ATTRHDR_SIZE;
+        if (UINT16_FTOH(attr_hdr.id) == OMRX_ATTR_VER && UINT16_FTOH(attr_hdr.datatype) == OMRX_DTYPE_U32 && UINT32_FTOH(attr_hdr.size) == 4) {
+            CHECK_ERR(stream_read_at(omrx, pos, 4, &ver));
+            CHECK_ERR(check_version_number(omrx, UINT32_FTOH(ver)));
+            omrx->out_version = UINT32_FTOH(ver);
+        }
+        pos += UINT32_FTOH(attr_hdr.size);
+    }
+
+    // Now find the end
+    CHECK_ERR(stream_read_at(omrx, file_size - CHUNKHDR_SIZE, CHUNKHDR_SIZE, &hdr));
+    if (!memcmp(hdr.tag, "OMRx", 4) && hdr.count == 0) {
+        *end_pos = file_size - CHUNKHDR_SIZE;
+        return OMRX_OK;
+    }
+    pos = file_size - TOC_TRAILER_SIZE - CHUNKHDR_SIZE;
+    if (pos >= CHUNKHDR_SIZE) {
+        CHECK_ERR(stream_read_at(omrx, pos, CHUNKHDR_SIZE, &hdr));
+        CHECK_ERR(stream_read_at(omrx, pos + CHUNKHDR_SIZE, TOC_TRAILER_SIZE, &trailer));
+        if (!memcmp(hdr.tag, "OMRx", 4) && hdr.count == 0 && !memcmp(trailer.magic, TOC_TRAILER_MAGIC, 4)) {
+            *end_pos = pos;
+            toc_pos = UINT64_FTOH(trailer.toc_pos);
+            if (UINT32_FTOH(trailer.version) == TOC_TRAILER_VERSION && toc_pos >= CHUNKHDR_SIZE && toc_pos < pos) {
+                CHECK_ERR(stream_read_at(omrx, toc_pos, CHUNKHDR_SIZE, &hdr));
+                if (!memcmp(hdr.tag, TOC_CHUNK_TAG, 4)) {
+                    *end_pos = toc_pos;
+                }
+            }
+            return OMRX_OK;
+        }
+    }
+
+    return omrx_error(omrx, OMRX_ERR_BAD_CHUNK, "Cannot find the end of the OMRX chunk (file truncated or corrupted?)");
+}
+
+// Keep a copy of everything from end_pos to the end of the file being
+// appended to (the old end tag, and TOC if any), for stream_restore_tail().
+static omrx_status_t stream_save_tail(omrx_t omrx, off_t end_pos) {
+    struct omrx_stream *stream = &omrx->stream;
+    off_t file_size;
+
+    if (fseeko(stream->fp, 0, SEEK_END) < 0) {
+        return omrx_os_error(omrx, OMRX_ERR_OSERR, "Seek failed");
+    }
+    file_size = ftello(stream->fp);
+    if (file_size < 0) {
+        return omrx_os_error(omrx, OMRX_ERR_OSERR, "Cannot read file position");
+    }
+    stream->tail_pos = end_pos;
+    stream->tail_len = file_size - end_pos;
+    stream->tail = omrx->alloc(omrx, stream->tail_len);
+    CHECK_ALLOC(omrx, stream->tail);
+    CHECK_ERR(stream_read_at(omrx, end_pos, stream->tail_len, stream->tail));
+
+    return OMRX_OK;
+}
+
+// Put back the end of a file which was being appended to, and cut off
+// anything written after it, leaving the file as it was before
+// omrx_stream_append().
+static omrx_status_t stream_restore_tail(omrx_t omrx) {
+    struct omrx_stream *stream = &omrx->stream;
+
+    clearerr(stream->fp);
+    if (fseeko(stream->fp, stream->tail_pos, SEEK_SET) < 0 || fwrite(stream->tail, stream->tail_len, 1, stream->fp) != 1 || fflush(stream->fp) || ftruncate(fileno(stream->fp), stream->tail_pos + stream->tail_len) < 0) {
+        return omrx_os_error(omrx, OMRX_ERR_OSERR, "Cannot restore the end of the file after a failed append (file may be corrupted)");
+    }
+
+    return OMRX_OK;
+}
+
+/** @endcond */
+
+/////////////// External Chunk API ///////////////////
+
+/** @defgroup api The libomrx API
+  *
+  * @{
+  */
+
+/** @defgroup init Library Initialization and OMRX Instances
+  *
+  * @brief Setting up, obtaining OMRX handles, error logging, etc.
+  *
+  * @{
+  */
+
+/** @def omrx_init
+  * @brief Convenience wrapper for omrx_initialize()
+  *
+  * The first call into libomrx from any application must be either omrx_init()
+  * or omrx_initialize().  You can use omrx_initialize() if you wish to
+  * override some of the default parameters, such as the default log handling
+  * functions (see omrx_initialize() for details).  However, if default values
+  * for these parameters are acceptable (as is often the case), omrx_init() can
+  * be used as a simpler alternative.
+  *
+  * Using omrx_init() is equivalent to the following:
+  * @code
+  * omrx_initialize(OMRX_API_VER, omrx_default_log_warning, omrx_default_log_error, NULL, NULL)
+  * @endcode
+  *
+  * omrx_init() takes no parameters.  Return values are the same as for omrx_initialize().
+  *
+  * @note Unlike other libomrx functions, if omrx_init() returns an error
+  * result, no error message is logged.  It is up to the application to print
+  * a descriptive error if appropriate, should initialization fail.
+  */
+
+/** @brief Initialize the libomrx library
+  *
+  * omrx_initialize() must be invoked before any other libomrx functions/macros
+  * are used.  It performs initial setup of the library and allows specifying
+  * functions to use for logging errors/warnings and allocating and freeing
+  * memory.
+  *
+  * Alternately, if you want to use default values for these parameters, the
+  * omrx_init() macro provides a simpler interface which can be used instead of
+  * calling omrx_initialize() directly.
+  *
+  * @param[in] api_ver    A constant indicating the version of the API expected
+  *                       by the application.  This must always be
+  *                       ::OMRX_API_VER.
+  * @param[in] warn_func  The function to be called when a warning message
+  *                       needs to be issued.  Can be `NULL`, in which case no
+  *                       logging of warnings will be attempted.
+  * @param[in] err_func   The function to be called when an error message needs
+  *                       to be issued.  Can be `NULL`, in which case no
+  *                       logging of errors will be attempted.
+  * @param[in] alloc_func Function to use when allocating memory.  Can be
+  *                       `NULL`, in which case a default implementation will
+  *                       be used which uses the standard C `malloc()`.
+  * @param[in] free_func  Function to use when freeing memory.  Can be `NULL`,
+  *                       in which case a default implementation will be used
+  *                       which uses the standard C `free()`.
+  *
+  * @retval ::OMRX_OK         Library initialization successful
+  * @retval ::OMRX_ERR_BADAPI Initialization failed: The passed API version does
+  *                           not match the version the library was compiled
+  *                           with.  (This generally indicates the application
+  *                           was compiled with a different version of the
+  *                           headers than the library)
+  *
+  * @note Unlike other libomrx functions, if omrx_initialize() returns an error
+  * result, no error message is logged.  It is up to the application to print
+  * a descriptive error if appropriate, should initialization fail.
+  */
+omrx_status_t omrx_initialize(int api_ver, omrx_log_func_t warn_func, omrx_log_func_t err_func, omrx_alloc_func_t alloc_func, omrx_free_func_t free_func) {
+    if (api_ver != OMRX_API_VER) {
+        return OMRX_ERR_BADAPI;
+    }
+
+    if (!alloc_func) {
+        alloc_func = omrx_default_alloc;
+    }
+    if (!free_func) {
+        free_func = omrx_default_free;
+    }
+    default_log_warning = warn_func;
+    default_log_error = err_func;
+    default_alloc = alloc_func;
+    default_free = free_func;
+
+    return OMRX_OK;
+}
+
+/** @brief Create a new (empty) OMRX instance and return its handle.
+  *
+  * Optionally, a pointer (to anything) can be provided via the `user_data`
+  * parameter which will be associated with the new OMRX instance.  This
+  * pointer is not used in any way by libomrx, but can be used to store
+  * application-specific data which should be associated with the instance, and
+  * can be retrieved later with omrx_user_data().
+  *
+  * @param[in] user_data  Optional pointer to arbitrary application data
+  * @param[out] result    A handle to the OMRX instance created
+  *
+  * @retval ::OMRX_OK        Instance created successfully
+  * @retval ::OMRX_ERR_ALLOC Creation failed due to lack of memory
+  */
+omrx_status_t omrx_new(void *user_data, omrx_t *result) {
+    omrx_t omrx;
+
+    if (!default_alloc) {
+        // FIXME: call default log functions
+        *result = NULL;
+        return OMRX_ERR_INIT_FIRST;
+    }
+
+    omrx = default_alloc(NULL, sizeof(struct omrx));
+
+    if (!omrx) {
+        // FIXME: call default log functions
+        *result = NULL;
+        return OMRX_ERR_ALLOC;
+    }
+    memset(omrx, 0, sizeof(struct omrx));
+
+    omrx->refcount = 1;
+    omrx->serial = __atomic_add_fetch(&next_serial, 1, __ATOMIC_RELAXED);
+    omrx->user_data = user_data;
+    omrx->alloc = default_alloc;
+    omrx->free = default_free;
+    omrx->err.message = omrx->alloc(omrx, OMRX_ERRMSG_BUFSIZE);
+    if (omrx->err.message) {
+        omrx->err.message[0] = 0;
+    }
+    pthread_mutex_init(&omrx->attr_lock, NULL);
+    pthread_mutex_init(&omrx->workers_lock, NULL);
+    pthread_mutex_init(&omrx->fetch_lock, NULL);
+    pthread_cond_init(&omrx->fetch_cond, NULL);
+    omrx->log_error = default_log_error;
+    omrx->log_warning = default_log_warning;
+    pool_init(&omrx->chunk_pool, sizeof(struct omrx_chunk));
+    pool_init(&omrx->attr_pool, sizeof(struct omrx_attr));
+    omrx->cache.limit = OMRX_CACHE_DEFAULT_LIMIT;
+    omrx->block_size = OMRX_BLOCK_DEFAULT_SIZE;
+    omrx->file_version = OMRX_VERSION;
+    omrx->out_version = OMRX_VERSION;
+    omrx->root_chunk = new_chunk(omrx, "OMRX");
+    omrx->chunk_id_map_size = 32;
+    omrx->chunk_id_map = omrx->alloc(omrx, sizeof(struct idmap_st) * omrx->chunk_id_map_size);
+    if (omrx->chunk_id_map) {
+        memset(omrx->chunk_id_map, 0, sizeof(struct idmap_st) * omrx->chunk_id_map_size);
+    }
+    omrx->err.status = OMRX_OK;
+    omrx->err.last_result = OMRX_OK;
+
+    if (!omrx->err.message || !omrx->root_chunk || !omrx->chunk_id_map) {
+        // FIXME: print an error message
+        omrx_free(omrx);
+        *result = NULL;
+        return OMRX_ERR_ALLOC;
+    }
+
+    if (omrx_set_attr_uint32(omrx->root_chunk, OMRX_ATTR_VER, OMRX_VERSION) < 0) {
+        omrx_free(omrx);
+        *result = NULL;
+        return OMRX_ERR_ALLOC;
+    }
+
+    *result = omrx;
+    return OMRX_OK;
+}
+
+/** @brief Release all resources associated with an OMRX handle
+  *
+  * After calling this function, all underlying resources associated with the
+  * given OMRX instance are closed and all memory is freed (including the
+  * instance itself).  The provided handle should not be used for any future
+  * calls.
+  *
+  * @note If a `user_data` pointer was provided when calling omrx_new(), the
+  * user data is *not* freed by this function.  It is up to the application to
+  * clean up any related application data if required.
+  *
+  * Any asynchronous fetches (see omrx_fetch_submit()) must be freed with
+  * omrx_fetch_free() before the instance is freed.
+  *
+  * @param[in] omrx The OMRX instance to release.
+  *
+  * @retval ::OMRX_OK  Instance freed successfully
+  */
+omrx_status_t omrx_free(omrx_t omrx) {
+    omrx_status_t status = OMRX_OK;
+    omrx_status_t rc;
+
+    // Note: we don't exit immediately on errors in here, because we want to
+    // continue on and clean up as much as possible anyway.  We save any error
+    // status and return it at the end of things.
+    if (omrx->fp) {
+        rc = omrx_close(omrx);
+        if (rc != OMRX_OK) status = rc;
+    }
+    if (omrx->stream.fp) {
+        rc = omrx_stream_close(omrx);
+        if (rc != OMRX_OK) status = rc;
+    }
+    if (omrx->async) {
+        omrx_async_free(omrx->async);
+    }
+    scan_end(omrx);
+    unmap_file(omrx);
+    if (omrx->filename) {
+        omrx->free(omrx, omrx->filename);
+    }
+    if (omrx->err.message) {
+        omrx->free(omrx, omrx->err.message);
+    }
+    free_errstates(omrx);
+    pthread_mutex_destroy(&omrx->attr_lock);
+    if (omrx->workers) {
+        omrx_workers_free(omrx->workers);
+    }
+    pthread_mutex_destroy(&omrx->workers_lock);
+    pthread_mutex_destroy(&omrx->fetch_lock);
+    pthread_cond_destroy(&omrx->fetch_cond);
+    free_all_nodes(omrx);
+    if (omrx->chunk_id_map) {
+        omrx->free(omrx, omrx->chunk_id_map);
+    }
+    put_instance(omrx);
+
+    return status;
+}
+
+/** @brief Retrieve the user_data pointer provided when calling omrx_new()
+  *
+  * @param[in] omrx  The OMRX instance
+  *
+  * @returns The value provided as the `user_data` parameter when omrx_new()
+  * was called.
+  */
+void *omrx_user_data(omrx_t omrx) {
+    return omrx->user_data;
+}
+
+/** @brief Return the status code from the last libomrx call
+  *
+  * This function returns whatever status code was returned by the most recent
+  * call to any libomrx function (except omrx_status()).  This is a convenience
+  * so that a function's return value can be tested directly (i.e. in an `if`
+  * statement) for error conditions, but then can also be retrieved again later
+  * if the application wants more information about a non-error result.  For
+  * example:
+  *
+  * @code
+  *     #define CHECK_ERR(x) if ((x) < 0) exit(1);
+  *
+  *     CHECK_ERR(omrx_get_chunk_by_id(omrx, "test", NULL, &chunk));
+  *
+  *     if (omrx_last_result(omrx) == OMRX_STATUS_NOT_FOUND) {
+  *         printf("Didn't find 'test' id\n");
+  *     }
+  * @endcode
+  *
+  * Note that this differs from omrx_status() in that omrx_last_result() only
+  * returns the result of the last call, and will not report any errors or
+  * warnings which might have happened previously.
+  *
+  * @param[in] omrx The OMRX instance to query
+  *
+  * @note If the instance was opened with ::OMRX_OPEN_CONCURRENT, this returns
+  * the result of the last call made by the calling thread.
+  *
+  * @returns The same status code as was returned by the previous libomrx call
+  */
+omrx_status_t omrx_last_result(omrx_t omrx) {
+    return get_errstate(omrx)->last_result;
+}
+
+/** @brief Return the current (accumulated) error/warning status
+  *
+  * libomrx maintains a record of the last error or warning status produced by
+  * any API call.  omrx_status() can be called to find out whether any calls
+  * have produced any errors or warnings up to this point (even if the most
+  * recent call was successful).  Optionally, the status can be reset before
+  * making a series of calls, so that it can be checked (for example) at the
+  * end to ensure no undetected problems were encountered.
+  *
+  * If you only want to get the returned status code from the most recent
+  * libomrx call (regardless of any previous errors), see omrx_last_result()
+  * instead.
+  *
+  * @param[in] omrx The OMRX instance to query
+  * @param[in] reset Reset the status to OMRX_OK after reading
+  *
+  * @note If the instance was opened with ::OMRX_OPEN_CONCURRENT, each thread
+  * has its own status, which only reflects calls made by that thread.
+  *
+  * @returns The last error/warning result from any previous libomrx call, or OMRX_OK if no errors or warnings have occurred since the last reset.
+  */
+omrx_status_t omrx_status(omrx_t omrx, bool reset) {
+    struct omrx_errstate *err = get_errstate(omrx);
+    omrx_status_t status = err->status;
+
+    if (reset) {
+        err->status = OMRX_OK;
+    }
+    return status;
+}
+
+/** @brief Return the message for the most recent error or warning
+  *
+  * This returns the text of the last error or warning message produced by any
+  * libomrx call (the same message passed to the error/warning log functions),
+  * or an empty string if there have not been any.  The returned string is
+  * owned by libomrx, and is only valid until the next libomrx call on the
+  * same instance (or, in concurrent mode, by the same thread).
+  *
+  * @note If the instance was opened with ::OMRX_OPEN_CONCURRENT, each thread
+  * has its own status (see omrx_status()) and message, and this only returns
+  * messages produced by calls made by the calling thread.
+  *
+  * @param[in] omrx The OMRX instance to query
+  *
+  * @returns The last error/warning message
+  */
+const char *omrx_last_message(omrx_t omrx) {
+    return get_errstate(omrx)->message;
+}
+
+/** @brief Set the maximum amount of memory used for caching attribute data
+  *
+  * With a non-zero limit, attribute data read from the file is kept in
+  * memory, so that later requests for the same attribute do not need to read
+  * it from the file again.  To keep memory use bounded, the total size of the
+  * cached data is limited to `limit` bytes.  When the limit is exceeded, the
+  * least-recently-used data is discarded.  Setting a smaller limit than
+  * before discards data immediately to fit within it; a limit of 0 disables
+  * caching altogether.
+  *
+  * Caching is off by default (the limit is 0), since a cached read keeps an
+  * extra copy of the data in memory besides the one handed to the caller.
+  * Applications which read the same attributes repeatedly can turn it on with
+  * this function.
+  *
+  * Data which has been handed out to the application as a borrowed pointer
+  * (for files opened with ::OMRX_OPEN_MMAP) counts towards the limit, but is
+  * never discarded automatically (see omrx_release_attr_data()).  Likewise,
+  * shared buffers (see omrx_get_attr_buffer()) count towards the limit, but
+  * are only discarded once the application has released all its references
+  * to them.  Data set by the application is not part of the cache and is not
+  * counted.
+  *
+  * @note Nothing is cached for files opened with ::OMRX_OPEN_MMAP (other than
+  * borrowed copies of misaligned data, and decoded copies of encoded data) or
+  * ::OMRX_OPEN_CONCURRENT, since in those cases data can be read directly
+  * from the file without going through shared state.
+  *
+  * @param[in] omrx   The OMRX instance
+  * @param[in] limit  The maximum size of cached data, in bytes
+  *
+  * @retval ::OMRX_OK  Limit set successfully
+  */
+omrx_status_t omrx_set_cache_limit(omrx_t omrx, size_t limit) {
+    if (omrx->open_flags & OMRX_OPEN_CONCURRENT) {
+        pthread_mutex_lock(&omrx->attr_lock);
+        omrx->cache.limit = limit;
+        cache_evict(omrx, limit, NULL);
+        pthread_mutex_unlock(&omrx->attr_lock);
+    } else {
+        omrx->cache.limit = limit;
+        cache_evict(omrx, limit, NULL);
+    }
+
+    return API_RESULT(omrx, OMRX_OK);
+}
+
+/** @brief Retrieve statistics about the attribute data cache
+  *
+  * Fills in `stats` with the current size and limit of the attribute data
+  * cache, along with counters of how many reads were satisfied from the
+  * cache (`hits`), how many had to load the data from the file (`misses`), and
+  * how many times data was discarded to make room for other data
+  * (`evictions`).
+  *
+  * @param[in] omrx    The OMRX instance
+  * @param[out] stats  The cache statistics
+  *
+  * @retval ::OMRX_OK  Statistics returned successfully
+  */
+omrx_status_t omrx_get_cache_stats(omrx_t omrx, struct omrx_cache_stats *stats) {
+    stats->limit = omrx->cache.limit;
+    stats->size = omrx->cache.size;
+    stats->entries = omrx->cache.entries;
+    stats->hits = omrx->cache.hits;
+    stats->misses = omrx->cache.misses;
+    stats->evictions = omrx->cache.evictions;
+
+    return API_RESULT(omrx, OMRX_OK);
+}
+
+/** @brief Set the number of threads used for parallel work
+  *
+  * Some operations (such as encoding and decoding attribute data which is
+  * split into blocks, see omrx_set_block_size(), and writing files with
+  * omrx_write()) can be spread across several threads.  By default, one
+  * thread per CPU is used, so on a machine with more than one CPU these are
+  * done in parallel unless this is called.  `count` sets a different number
+  * (including the calling thread).  A count of 1 does everything in the
+  * calling thread, and 0 restores the default.
+  *
+  * Worker threads (one fewer than the thread count) are only started once
+  * they are first needed, and then stay around until the instance is freed
+  * or the count is changed.  This must not be called while other threads are
+  * using the instance.
+  *
+  * @param[in] omrx   The OMRX instance
+  * @param[in] count  The number of threads to use
+  *
+  * @retval ::OMRX_OK  Thread count set successfully
+  */
+omrx_status_t omrx_set_threads(omrx_t omrx, unsigned int count) {
+    if (count > OMRX_MAX_THREADS) {
+        count = OMRX_MAX_THREADS;
+    }
+    pthread_mutex_lock(&omrx->workers_lock);
+    if (omrx->workers && count != omrx->threads) {
+        // The pool gets started again with the new size when it's next
+        // needed.
+        omrx_workers_free(omrx->workers);
+        omrx->workers = NULL;
+    }
+    omrx->threads = count;
+    pthread_mutex_unlock(&omrx->workers_lock);
+
+    return API_RESULT(omrx, OMRX_OK);
+}
+
+/** @brief Set the block size used for large encoded array attributes
+  *
+  * When an encoded array attribute (see omrx_set_attr_encoding()) is larger
+  * than `size` bytes, it is split into blocks of about `size` bytes (a whole
+  * number of rows each), which are encoded independently.  Blocks can then be
+  * decoded in parallel (see omrx_set_threads()), and reading a range of rows
+  * only needs to decode the blocks which contain them.  The default is 1MB;
+  * a size of 0 stores each attribute as a single block.
+  *
+  * This only affects how data is written; files with any block size (or none)
+  * can be read.  Blocks were introduced in version 0.2 of the file format, so
+  * when a tree read from an older file is written out again (keeping its
+  * version), its encoded arrays are always stored as a single block.
+  *
+  * @param[in] omrx  The OMRX instance
+  * @param[in] size  The (decoded) size of each block, in bytes
+  *
+  * @retval ::OMRX_OK  Block size set successfully
+  */
+omrx_status_t omrx_set_block_size(omrx_t omrx, uint32_t size) {
+    omrx->block_size = size;
+
+    return API_RESULT(omrx, OMRX_OK);
+}
+
+/** @brief Say how the file is going to be read
+  *
+  * The advice is passed on to the operating system (with posix_fadvise(), and
+  * madvise() for files opened with ::OMRX_OPEN_MMAP) so it can manage
+  * read-ahead and the page cache to suit, and also controls how much of the
+  * file libomrx itself reads at a time when scanning chunk headers.  It can be
+  * given before opening a file (so that it applies to the initial scan, which
+  * is where the read-ahead size makes the most difference), or while the file
+  * is open, and stays in effect for later files opened with the same instance.
+  *
+  * - ::OMRX_ADVICE_SEQUENTIAL: The file will be read from front to back (for
+  *   example, by omrx_open_ex() with ::OMRX_OPEN_NO_TOC and then reading
+  *   every attribute in order).  Larger reads are used, and the kernel reads
+  *   further ahead.
+  * - ::OMRX_ADVICE_RANDOM: Attributes will be read in no particular order,
+  *   so reading ahead would mostly be wasted.
+  * - ::OMRX_ADVICE_WILLNEED: The whole file will be needed, so start reading
+  *   it into the page cache now.
+  * - ::OMRX_ADVICE_DONTNEED: The file is being streamed through once (by a
+  *   batch job, for example).  It is read sequentially, and data is dropped
+  *   from the page cache as soon as it has been read, so that other users of
+  *   the page cache are not pushed out of it.  (This does not apply to files
+  *   opened with ::OMRX_OPEN_MMAP, where data is read straight from the page
+  *   cache.)
+  * - ::OMRX_ADVICE_NORMAL: Go back to the default behavior.
+  *
+  * See omrx_advise_chunk() to give advice for particular parts of the file.
+  *
+  * This must not be called while other threads are using the instance.
+  *
+  * @param[in] omrx    The OMRX instance
+  * @param[in] advice  How the file will be accessed
+  *
+  * @retval ::OMRX_OK          Advice set successfully
+  * @retval ::OMRX_WARN_OSERR  The operating system did not accept the advice
+  *                            (it is still used by libomrx itself)
+  */
+omrx_status_t omrx_advise(omrx_t omrx, omrx_advice_t advice) {
+    omrx->advice = advice;
+    if (omrx->fp) {
+        return API_RESULT(omrx, apply_file_advice(omrx));
+    }
+
+    return API_RESULT(omrx, OMRX_OK);
+}
+
+/** @brief Say how the data of a chunk (and its descendants) is going to be read
+  *
+  * Like omrx_advise(), but only for the attribute data of `chunk` and all of
+  * the chunks below it (which have been read from the file so far).  This is
+  * mostly useful for:
+  *
+  * - ::OMRX_ADVICE_WILLNEED: Start reading the attribute data into the page
+  *   cache in the background, so that it is (hopefully) already there by the
+  *   time it is asked for.
+  * - ::OMRX_ADVICE_DONTNEED: Drop the attribute data from the page cache,
+  *   once it is no longer needed.
+  *
+  * ::OMRX_ADVICE_SEQUENTIAL, ::OMRX_ADVICE_RANDOM and ::OMRX_ADVICE_NORMAL are
+  * passed on too, but some systems apply them to the whole file rather than
+  * just the parts of it given.  None of them change the instance's own advice.
+  *
+  * This may be used from any thread (in concurrent mode).
+  *
+  * @param[in] chunk   The chunk
+  * @param[in] advice  How the chunk's data will be accessed
+  *
+  * @retval ::OMRX_OK          Advice passed on successfully
+  * @retval ::OMRX_WARN_OSERR  The operating system did not accept the advice
+  */
+omrx_status_t omrx_advise_chunk(omrx_chunk_t chunk, omrx_advice_t advice) {
+    if (!chunk) return OMRX_STATUS_NO_OBJECT;
+
+    omrx_t omrx = chunk->omrx;
+    struct tree_walk walk;
+    omrx_attr_t attr;
+    omrx_status_t status = OMRX_OK;
+    omrx_status_t rc;
+    off_t start = 0;
+    off_t end = -1;
+    off_t pos;
+    off_t size;
+
+    if (!omrx->fp && !omrx->map) {
+        return API_RESULT(omrx, OMRX_OK);
+    }
+    // Go through the subtree in file order, collecting the attribute data
+    // into as few ranges as possible.
+    for (chunk = walk_start(&walk, chunk); chunk; chunk = walk_next_entered(&walk, !chunk->unloaded)) {
+        for (attr = chunk->attrs; attr; attr = attr->next) {
+            if (attr->file_pos < 0) {
+                continue;
+            }
+            pos = attr->file_pos;
+            size = attr->file_encoding ? attr->file_size : attr->size;
+            if (end >= 0 && pos >= start && pos <= end + OMRX_ADVISE_MERGE_GAP) {
+                if (pos + size > end) {
+                    end = pos + size;
+                }
+                continue;
+            }
+            if (end > start) {
+                rc = advise_range(omrx, start, end - start, advice);
+                if (rc != OMRX_OK) status = rc;
+            }
+            start = pos;
+            end = pos + size;
+        }
+    }
+    if (end > start) {
+        rc = advise_range(omrx, start, end - start, advice);
+        if (rc != OMRX_OK) status = rc;
+    }
+
+    return API_RESULT(omrx, status);
+}
+
+/** @brief Default logging function for warning messages
+  *
+  * This is the warning log function passed to omrx_initialize() if the
+  * omrx_init() convenience wrapper is used.  It will send all warning messages
+  * to stderr, prefixed with "libomrx warning: ".
+  */
+void omrx_default_log_warning(omrx_t omrx, omrx_status_t errcode, const char *msg) {
+    if (omrx && omrx->filename) {
+        fprintf(stderr, "libomrx warning: %s: %s\n", omrx->filename, msg);
+    } else {
+        fprintf(stderr, "libomrx warning: %s\n", msg);
+    }
+    fflush(stderr);
+}
+
+/** @brief Default logging function for error messages
+  *
+  * This is the error log function passed to omrx_initialize() if the
+  * omrx_init() convenience wrapper is used.  It will send all error messages
+  * to stderr, prefixed with "libomrx error: ".
+  */
+void omrx_default_log_error(omrx_t omrx, omrx_status_t errcode, const char *msg) {
+    if (omrx && omrx->filename) {
+        fprintf(stderr, "libomrx error: %s: %s\n", omrx->filename, msg);
+    } else {
+        fprintf(stderr, "libomrx error: %s\n", msg);
+    }
+    fflush(stderr);
+}
+
+/** @} */
+
+/** @defgroup fileio File Operations
+  *
+  * @brief Opening, reading, and writing OMRX files
+  *
+  * @{
+  */
+
+/** @brief Open an existing OMRX file for reading
+  *
+  * This function will open an existing file (or use a supplied `FILE` handle)
+  * for reading, and perform an intial scan of its contents.  The file must be
+  * seekable.
+  *
+  * The `omrx` handle supplied should be a fresh handle created with
+  * omrx_new().  If it has been previously used, any previous contents will be
+  * overwritten.  The file will be scanned for consistency and structure, and
+  * an index will be created in memory, but the actual file data is not read
+  * until it is actually needed.  It is therefore important not to call
+  * omrx_close() until you are sure you have retrieved all the data you need.
+  *
+  * If the `fp` parameter is `NULL`, then the file specified by `filename` is
+  * opened and read.  If `fp` is not `NULL`, then it should be an open `FILE`
+  * pointer (opened for reading in binary mode) which will be used instead.  In
+  * this case `filename` can still be provided, and will be used in
+  * error/warning messages, etc, as the name of the open file.
+  *
+  * @param[in] omrx     The OMRX instance to use
+  * @param[in] filename The name of the file to open
+  * @param[in] fp       An open `FILE` pointer to use for file IO, or `NULL`
+  *
+  * @retval ::OMRX_OK             File opened successfully
+  * @retval ::OMRX_ERR_EOF        Unexpected end-of-file encountered
+  * @retval ::OMRX_ERR_BAD_MAGIC  Bad data at beginning of file
+  * @retval ::OMRX_ERR_BAD_CHUNK  Invalid chunk tag encountered
+  * @retval ::OMRX_ERR_BAD_VER    File version is incompatible with library version
+  */
+omrx_status_t omrx_open(omrx_t omrx, const char *filename, FILE *fp) {
+    return omrx_open_ex(omrx, filename, fp, OMRX_OPEN_DEFAULT);
+}
+
+/** @brief Open an existing OMRX file for reading, with options
+  *
+  * This works the same as omrx_open(), but allows specifying additional flags
+  * (from ::omrx_open_flags_t, OR'd together) which control how the file is
+  * accessed.
+  *
+  * If ::OMRX_OPEN_MMAP is specified, the whole file is mapped into memory
+  * (the file must therefore be a regular file, not a pipe, etc).  In this mode
+  * omrx_get_attr_raw() and omrx_get_attr_float32_array() do not allocate a
+  * copy of the data for the caller, but instead return a borrowed pointer
+  * (see ::OMRX_REF) which points directly into the mapped file wherever
+  * possible.  Borrowed data must not be freed or modified by the caller, and
+  * remains valid until the attribute is changed or deleted, or the OMRX
+  * instance is freed with omrx_free() (it remains available after
+  * omrx_close()).
+  *
+  * If the file contains a table of contents (see omrx_write_ex()), it is used
+  * to build the chunk index instead of scanning the file, unless
+  * ::OMRX_OPEN_NO_TOC is specified.  If the TOC is missing or does not match
+  * the file, the file is scanned as usual.
+  *
+  * If ::OMRX_OPEN_LAZY is specified, only the toplevel chunks (and their
+  * attributes) are indexed when the file is opened.  The children of a chunk
+  * are read from the file the first time they are needed (by
+  * omrx_get_child(), omrx_add_chunk(), omrx_write(), etc), so memory use
+  * depends on how much of the file is actually accessed.  Note that in this
+  * mode omrx_get_chunk_by_id() can only see IDs in the parts of the file read
+  * so far, so if an ID is not found, the rest of the file will be read before
+  * giving up.  Also, unless ::OMRX_OPEN_MMAP is used too, chunks which have
+  * not been read yet become inaccessible after omrx_close().
+  *
+  * If ::OMRX_OPEN_CONCURRENT is specified, the file is opened for concurrent
+  * reading from multiple threads.  The whole file is indexed when it is opened
+  * (::OMRX_OPEN_LAZY is ignored), and after omrx_open_ex() returns, any number
+  * of threads may call the functions which look up chunks or read attributes
+  * (omrx_get_child(), omrx_get_chunk_by_id(), omrx_get_attr_info(),
+  * omrx_get_attr_raw(), omrx_get_attr_float32_array(), etc) on the instance at
+  * the same time.  Attribute data is read using positioned reads (`pread()`)
+  * on the underlying file descriptor (or copied from the mapping, with
+  * ::OMRX_OPEN_MMAP), rather than by seeking the shared `FILE`.  The results
+  * reported by omrx_status(), omrx_last_result() and omrx_last_message() are
+  * kept separately for each thread.  In this mode:
+  *  - The tree must be treated as read-only: no thread may add, delete or
+  *    modify chunks or attributes (or call omrx_close(), omrx_write() or
+  *    omrx_free()) while other threads are using the instance.
+  *  - Any alloc/free functions passed to omrx_initialize(), and any log
+  *    functions, must be thread-safe.
+  *  - Data returned by omrx_get_attr_raw(), etc, is still owned by the caller
+  *    (or borrowed, with ::OMRX_OPEN_MMAP) exactly as in normal mode.
+  *
+  * If ::OMRX_OPEN_VERIFY is specified and the file was written with
+  * checksums (see ::OMRX_WRITE_CHECKSUMS), each attribute's data is checked
+  * against its checksum the first time all of it is read from the file, and
+  * the read fails with ::OMRX_ERR_CHECKSUM if it does not match.  (Reading
+  * just part of an attribute, with omrx_get_attr_float32_array_rows(), etc,
+  * only checks it if the whole attribute has to be read anyway.)  Attributes
+  * with no checksum are read as usual.
+  *
+  * @param[in] omrx     The OMRX instance to use
+  * @param[in] filename The name of the file to open
+  * @param[in] fp       An open `FILE` pointer to use for file IO, or `NULL`
+  * @param[in] flags    Zero or more ::omrx_open_flags_t values OR'd together
+  *
+  * @retval ::OMRX_OK             File opened successfully
+  * @retval ::OMRX_ERR_OSERR      File could not be opened or mapped
+  * @retval ::OMRX_ERR_EOF        Unexpected end-of-file encountered
+  * @retval ::OMRX_ERR_BAD_MAGIC  Bad data at beginning of file
+  * @retval ::OMRX_ERR_BAD_CHUNK  Invalid chunk tag encountered
+  * @retval ::OMRX_ERR_BAD_VER    File version is incompatible with library version
+  */
+omrx_status_t omrx_open_ex(omrx_t omrx, const char *filename, FILE *fp, unsigned int flags) {
+    if (omrx->fp) {
+        return omrx_error(omrx, OMRX_ERR_ALREADY_OPEN, "omrx_open() called on already open OMRX handle");
+    }
+    if (fp) {
+        omrx->fp = fp;
+        omrx->close_file = false;
+    } else {
+        omrx->fp = fopen(filename, "rb");
+        omrx->close_file = true;
+        if (!omrx->fp) {
+            return omrx_os_error(omrx, OMRX_ERR_OSERR, "Cannot open '%s' for reading", filename);
+        }
+    }
+    if (omrx->filename) {
+        omrx->free(omrx, omrx->filename);
+    }
+    omrx->filename = omrx_strdup(omrx, filename);
+    if (flags & OMRX_OPEN_CONCURRENT) {
+        // Everything needs to be read up front, since the tree can't change
+        // once other threads start using it.
+        flags &= ~OMRX_OPEN_LAZY;
+    }
+    omrx->open_flags = flags;
+    omrx->drop_pos = 0;
+    if (omrx->map) {
+        // Chunks from a previously mapped file may hold borrowed pointers into
+        // the old mapping, so they need to go before the mapping does.
+        free_all_chunks(omrx->root_chunk);
+        omrx->root_chunk = NULL;
+        unmap_file(omrx);
+    }
+    if (flags & OMRX_OPEN_MMAP) {
+        CHECK_ERR(map_file(omrx));
+    }
+    if (omrx->advice != OMRX_ADVICE_NORMAL) {
+        apply_file_advice(omrx);
+    }
+
+    return omrx_scan(omrx);
+}
+
+/** @brief Get the version of the OMRX file currently open for reading
+  *
+  * Returns a binary constant indicating the version of the OMRX standard that
+  * the open file was written to.  The upper 16 bits contain the major version,
+  * and the lower 16 bits contain the minor version.
+  *
+  * @param[in] omrx     The OMRX instance to query
+  * @param[out] result  Where to store the version information
+  *
+  * @retval OMRX_OK  Value read successfully and stored in `result`
+  */
+omrx_status_t omrx_get_version(omrx_t omrx, uint32_t *result) {
+    return omrx_get_attr_uint32(omrx->root_chunk, OMRX_ATTR_VER, result);
+}
+
+/** @brief Close an OMRX instance opened using omrx_open()
+  *
+  * Once a file is closed, data which was previously read will still be
+  * available, but attempts to access attributes not previously read will fail.
+  * It is therefore important if you wish to continue accessing the OMRX
+  * instance after closing it that you make sure you have loaded all data you
+  * wish to access before calling omrx_close().
+  *
+  * If any asynchronous fetches (see omrx_fetch_submit()) are still in
+  * progress, this waits for them to finish before closing the file.
+  *
+  * @param[in] omrx  The OMRX instance to close
+  *
+  * @retval OMRX_OK          Closed successfully
+  * @retval OMRX_WARN_OSERR  Could not close underlying file object
+  */
+omrx_status_t omrx_close(omrx_t omrx) {
+    if (!omrx->fp) {
+        return omrx_error(omrx, OMRX_ERR_NOT_OPEN, "omrx_close() called on non-open OMRX handle");
+    }
+    if (omrx->async) {
+        // Any fetches still reading from the file have to finish first.
+        omrx_async_drain(omrx->async);
+    }
+    if (omrx->scan.own_buf) {
+        // Without the file, the scanner is no use anymore.  (If the file is
+        // mapped, though, it can still keep working from the mapping.)
+        scan_end(omrx);
+    }
+    if (omrx->close_file) {
+        if (fclose(omrx->fp)) {
+            omrx->fp = NULL;
+            return omrx_os_warning(omrx, OMRX_WARN_OSERR, "Close failed");
+        }
+    }
+    omrx->fp = NULL;
+
+    return API_RESULT(omrx, OMRX_OK);
+}
+
+/** @brief Write the contents of an OMRX instance out to a file
+  *
+  * This is equivalent to calling omrx_write_ex() with ::OMRX_WRITE_DEFAULT.
+  *
+  * @param[in] omrx     The OMRX instance to write
+  * @param[in] filename The name of the file to create
+  *
+  * @retval ::OMRX_OK         File written successfully
+  * @retval ::OMRX_ERR_OSERR  File could not be created or written
+  */
+omrx_status_t omrx_write(omrx_t omrx, const char *filename) {
+    return omrx_write_ex(omrx, filename, OMRX_WRITE_DEFAULT);
+}
+
+/** @brief Write the contents of an OMRX instance out to a file, with options
+  *
+  * This works the same as omrx_write(), but allows specifying additional flags
+  * (from ::omrx_write_flags_t, OR'd together) which control what is written.
+  *
+  * If ::OMRX_WRITE_TOC is specified, an ancillary table-of-contents chunk is
+  * written at the end of the OMRX chunk, describing the position of every
+  * chunk and attribute in the file, along with a small trailer after the end
+  * of the OMRX data which points to it.  When such a file is later opened with
+  * omrx_open(), the chunk index is loaded from the TOC with a single read
+  * instead of scanning every header in the file.  (Readers which do not
+  * understand the TOC simply ignore it.)
+  *
+  * If ::OMRX_WRITE_CHECKSUMS is specified, a CRC-32C checksum of each
+  * attribute's data (as stored in the file) is also written, in an extra
+  * attribute (::OMRX_ATTR_CHECKSUMS) at the end of each chunk, and in the TOC
+  * if there is one.  When the file is opened with ::OMRX_OPEN_VERIFY,
+  * attribute data is checked against these as it is read.
+  *
+  * Encoding attribute data and writing it to the file are done in parallel,
+  * using one thread per CPU by default, unless the instance is limited to a
+  * single thread (see omrx_set_threads()) or there is only one CPU.  The file
+  * produced is exactly the same either way.
+  *
+  * If ::OMRX_WRITE_DIRECT is specified, the file is written with direct I/O
+  * (`O_DIRECT`), bypassing the operating system's page cache, so that writing
+  * a very large file doesn't evict other (more useful) data from the cache.
+  * All output then goes through a large aligned buffer and is written from a
+  * single thread, though encoding is still done in parallel.  This is usually
+  * slower for small files, and if the platform or file system does not
+  * support direct I/O, the file is simply written normally.
+  *
+  * @param[in] omrx     The OMRX instance to write
+  * @param[in] filename The name of the file to create
+  * @param[in] flags    Zero or more ::omrx_write_flags_t values OR'd together
+  *
+  * @retval ::OMRX_OK         File written successfully
+  * @retval ::OMRX_ERR_OSERR  File could not be created or written
+  */
+omrx_status_t omrx_write_ex(omrx_t omrx, const char *filename, unsigned int flags) {
+    FILE *fp;
+    omrx_chunk_t child;
+    omrx_status_t status;
+    int err;
+
+    if (omrx->stream.fp) {
+        return omrx_error(omrx, OMRX_ERR_BAD_STATE, "omrx_write() cannot be used while the streaming writer is open");
+    }
+    fp = fopen(filename, "wb");
+    if (!fp) {
+        return omrx_os_error(omrx, OMRX_ERR_OSERR, "Cannot open '%s' for writing", filename);
+    }
+    // Everything is written through the output staging (and positioned
+    // writes) rather than stdio; `fp` just holds the file open.
+    err = omrx_output_init(omrx, &omrx->out, fileno(fp), flags & OMRX_WRITE_DIRECT);
+    if (err) {
+        fclose(fp);
+        return omrx_os_error(omrx, OMRX_ERR_ALLOC, "Memory allocation failed");
+    }
+    omrx->write_pos = 0;
+    omrx->write_checksums = (flags & OMRX_WRITE_CHECKSUMS) != 0;
+    // The file gets the tree's version, and its encoded data is laid out to
+    // match.
+    if (omrx_get_version(omrx, &omrx->out_version) != OMRX_OK) {
+        omrx->out_version = OMRX_MIN_VERSION;
+    }
+    if (get_workers(omrx)) {
+        status = write_parallel(omrx, fp, flags & OMRX_WRITE_TOC);
+        if (status >= 0 && (flags & OMRX_WRITE_TOC)) {
+            status = write_toc(omrx, fp);
+        }
+    } else if (flags & OMRX_WRITE_TOC) {
+        status = write_chunk_start(omrx->root_chunk, fp);
+        if (status >= 0) {
+            status = load_children(omrx->root_chunk);
+        }
+        child = omrx->root_chunk->first_child;
+        while (child && status >= 0) {
+            status = write_chunk(child, fp);
+            child = child->next;
+        }
+        if (status >= 0) {
+            // This also writes the root chunk's end tag
+            status = write_toc(omrx, fp);
+        }
+    } else {
+        status = write_chunk(omrx->root_chunk, fp);
+    }
+    if (status >= 0) {
+        err = omrx_output_flush(&omrx->out);
+        if (err) {
+            errno = err;
+            status = omrx_os_error(omrx, OMRX_ERR_OSERR, "Write error");
+        }
+    }
+    omrx_output_free(&omrx->out);
+    omrx->write_checksums = false;
+    if (status < 0) {
+        fclose(fp);
+        return status;
+    }
+
+    if (fclose(fp)) {
+        return omrx_os_warning(omrx, OMRX_WARN_OSERR, "Close failed");
+    }
+
+    return API_RESULT(omrx, OMRX_OK);
+}
+
+/** @} */
+
+/** @defgroup stream Streaming Writer
+  *
+  * @brief Writing OMRX files incrementally, without building them in memory
   *
-  * @brief Setting up, obtaining OMRX handles, error logging, etc.
+  * The streaming writer writes a file front-to-back as chunks and attributes
+  * are supplied, rather than from the in-memory tree of an OMRX instance (the
+  * tree is not used or modified).  Only a small, fixed amount of memory is
+  * used regardless of how much data is written, and the data for large array
+  * attributes can be supplied a slice at a time.  For example:
+  *
+  * @code
+  *     omrx_stream_open(omrx, "points.omrx");
+  *     omrx_stream_begin_chunk(omrx, "mESH");
+  *     omrx_stream_write_attr_str(omrx, OMRX_ATTR_ID, "scan1");
+  *     omrx_stream_begin_chunk(omrx, "VRTx");
+  *     omrx_stream_begin_array(omrx, OMRX_ATTR_DATA, OMRX_DTYPE_F32_ARRAY, 3);
+  *     while (get_more_points(&points, &count)) {
+  *         omrx_stream_append_rows(omrx, count, points);
+  *     }
+  *     omrx_stream_end_array(omrx);
+  *     omrx_stream_end_chunk(omrx);   // VRTx
+  *     omrx_stream_end_chunk(omrx);   // mESH
+  *     omrx_stream_close(omrx);
+  * @endcode
+  *
+  * All of a chunk's attributes must be written before any of its children.
+  * The output file must be seekable, since some headers are filled in after
+  * the data that follows them has been written.
   *
   * @{
   */
 
-/** @def omrx_init
-  * @brief Convenience wrapper for omrx_initialize()
+/** @brief Start writing a new OMRX file with the streaming writer
   *
-  * The first call into libomrx from any application must be either omrx_init()
-  * or omrx_initialize().  You can use omrx_initialize() if you wish to
-  * override some of the default parameters, such as the default log handling
-  * functions (see omrx_initialize() for details).  However, if default values
-  * for these parameters are acceptable (as is often the case), omrx_init() can
-  * be used as a simpler alternative.
+  * Creates the file and writes the start of the toplevel OMRX chunk
+  * (including its version attribute).  Further attributes can then be added to
+  * the OMRX chunk, and child chunks written, using the other omrx_stream_*()
+  * functions.
   *
-  * Using omrx_init() is equivalent to the following:
-  * @code
-  * omrx_initialize(OMRX_API_VER, omrx_default_log_warning, omrx_default_log_error, NULL, NULL)
-  * @endcode
+  * Only one file can be written by the streaming writer at a time for each
+  * OMRX instance, and omrx_write() cannot be used while it is open.
   *
-  * omrx_init() takes no parameters.  Return values are the same as for omrx_initialize().
+  * @param[in] omrx     The OMRX instance to use
+  * @param[in] filename The name of the file to create
   *
-  * @note Unlike other libomrx functions, if omrx_init() returns an error
-  * result, no error message is logged.  It is up to the application to print
-  * a descriptive error if appropriate, should initialization fail.
+  * @retval ::OMRX_OK               File created successfully
+  * @retval ::OMRX_ERR_ALREADY_OPEN The streaming writer is already open
+  * @retval ::OMRX_ERR_OSERR        File could not be created or written
   */
+omrx_status_t omrx_stream_open(omrx_t omrx, const char *filename) {
+    struct omrx_stream *stream = &omrx->stream;
+    omrx_status_t status;
 
-/** @brief Initialize the libomrx library
+    CHECK_ERR(stream_init(omrx, filename, "wb"));
+    omrx->write_pos = 0;
+    omrx->out_version = OMRX_VERSION;
+    status = stream_push(omrx, "OMRX");
+    if (status >= 0) {
+        status = omrx_stream_write_attr_uint32(omrx, OMRX_ATTR_VER, OMRX_VERSION);
+    }
+    if (status < 0) {
+        fclose(stream->fp);
+        stream_cleanup(omrx);
+        return status;
+    }
+
+    return API_RESULT(omrx, OMRX_OK);
+}
+
+/** @brief Add new chunks to the end of an existing OMRX file
   *
-  * omrx_initialize() must be invoked before any other libomrx functions/macros
-  * are used.  It performs initial setup of the library and allows specifying
-  * functions to use for logging errors/warnings and allocating and freeing
-  * memory.
+  * This opens an existing OMRX file with the streaming writer, positioned so
+  * that any chunks written (with omrx_stream_begin_chunk(), etc, or
+  * omrx_stream_write_chunk()) are added as new toplevel chunks after the
+  * existing ones.  The file is modified in place: none of the existing
+  * contents are read or rewritten, apart from the OMRX end tag (and the
+  * table of contents, if there is one), which are overwritten and replaced by
+  * a new end tag when omrx_stream_close() is called.
   *
-  * Alternately, if you want to use default values for these parameters, the
-  * omrx_init() macro provides a simpler interface which can be used instead of
-  * calling omrx_initialize() directly.
+  * If writing fails, omrx_stream_close() puts the original end tag (and
+  * table of contents) back and removes anything which was added, so the file
+  * is left as it was before this call, and the error is returned.
   *
-  * @param[in] api_ver    A constant indicating the version of the API expected
-  *                       by the application.  This must always be
-  *                       ::OMRX_API_VER.
-  * @param[in] warn_func  The function to be called when a warning message
-  *                       needs to be issued.  Can be `NULL`, in which case no
-  *                       logging of warnings will be attempted.
-  * @param[in] err_func   The function to be called when an error message needs
-  *                       to be issued.  Can be `NULL`, in which case no
-  *                       logging of errors will be attempted.
-  * @param[in] alloc_func Function to use when allocating memory.  Can be
-  *                       `NULL`, in which case a default implementation will
-  *                       be used which uses the standard C `malloc()`.
-  * @param[in] free_func  Function to use when freeing memory.  Can be `NULL`,
-  *                       in which case a default implementation will be used
-  *                       which uses the standard C `free()`.
+  * Attributes cannot be added to the OMRX chunk itself in this mode.
   *
-  * @retval ::OMRX_OK         Library initialization successful
-  * @retval ::OMRX_ERR_BADAPI Initialization failed: The passed API version does
-  *                           not match the version the library was compiled
-  *                           with.  (This generally indicates the application
-  *                           was compiled with a different version of the
-  *                           headers than the library)
+  * @note Since the table of contents (see ::OMRX_WRITE_TOC) would no longer
+  * describe the whole file, it is removed.  The file can still be opened as
+  * usual (by scanning it), or can be rewritten with omrx_write_ex() to
+  * regain the TOC.
   *
-  * @note Unlike other libomrx functions, if omrx_initialize() returns an error
-  * result, no error message is logged.  It is up to the application to print
-  * a descriptive error if appropriate, should initialization fail.
+  * @note If the file is currently open for reading by an OMRX instance, that
+  * instance will not see the new chunks.  (It is safe to keep reading the
+  * existing chunks, though, since they are not moved.)
+  *
+  * @param[in] omrx     The OMRX instance to use
+  * @param[in] filename The name of the file to append to
+  *
+  * @retval ::OMRX_OK               File opened successfully
+  * @retval ::OMRX_ERR_ALREADY_OPEN The streaming writer is already open
+  * @retval ::OMRX_ERR_OSERR        File could not be opened
+  * @retval ::OMRX_ERR_BAD_MAGIC    The file is not an OMRX file
+  * @retval ::OMRX_ERR_BAD_CHUNK    The end of the OMRX chunk could not be found
+  * @retval ::OMRX_ERR_BAD_VER      File version is incompatible with library version
   */
-omrx_status_t omrx_initialize(int api_ver, omrx_log_func_t warn_func, omrx_log_func_t err_func, omrx_alloc_func_t alloc_func, omrx_free_func_t free_func) {
-    if (api_ver != OMRX_API_VER) {
-        return OMRX_ERR_BADAPI;
-    }
+omrx_status_t omrx_stream_append(omrx_t omrx, const char *filename) {
+    struct omrx_stream *stream = &omrx->stream;
+    struct omrx_stream_level *level;
+    off_t end_pos = 0;
+    omrx_status_t status;
 
-    if (!alloc_func) {
-        alloc_func = omrx_default_alloc;
+    CHECK_ERR(stream_init(omrx, filename, "r+b"));
+    status = stream_find_end(omrx, &end_pos);
+    if (status >= 0) {
+        status = stream_save_tail(omrx, end_pos);
     }
-    if (!free_func) {
-        free_func = omrx_default_free;
+    if (status >= 0 && fseeko(stream->fp, end_pos, SEEK_SET) < 0) {
+        status = omrx_os_error(omrx, OMRX_ERR_OSERR, "Seek failed");
     }
-    default_log_warning = warn_func;
-    default_log_error = err_func;
-    default_alloc = alloc_func;
-    default_free = free_func;
+    if (status >= 0) {
+        status = stream_push(omrx, "OMRX");
+    }
+    if (status < 0) {
+        fclose(stream->fp);
+        stream_cleanup(omrx);
+        return status;
+    }
+    omrx->write_pos = end_pos;
+    stream->appending = true;
+    // The OMRX chunk header and attributes are already there, and we're
+    // only adding children.
+    level = &stream->levels[0];
+    level->started = true;
+    level->has_children = true;
+    level->hdr_pos = 0;
 
-    return OMRX_OK;
+    return API_RESULT(omrx, OMRX_OK);
 }
 
-/** @brief Create a new (empty) OMRX instance and return its handle.
+/** @brief Finish writing a file with the streaming writer
   *
-  * Optionally, a pointer (to anything) can be provided via the `user_data`
-  * parameter which will be associated with the new OMRX instance.  This
-  * pointer is not used in any way by libomrx, but can be used to store
-  * application-specific data which should be associated with the instance, and
-  * can be retrieved later with omrx_user_data().
+  * Any chunks (and array attributes) still open are ended, the end of the
+  * toplevel OMRX chunk is written, and the file is closed.
   *
-  * @param[in] user_data  Optional pointer to arbitrary application data
-  * @param[out] result    A handle to the OMRX instance created
+  * If the file was opened with omrx_stream_append() and anything could not
+  * be written (here or earlier), the file is put back the way it was.
   *
-  * @retval ::OMRX_OK        Instance created successfully
-  * @retval ::OMRX_ERR_ALLOC Creation failed due to lack of memory
+  * @param[in] omrx  The OMRX instance to use
+  *
+  * @retval ::OMRX_OK          File written successfully
+  * @retval ::OMRX_ERR_NOT_OPEN The streaming writer is not open
+  * @retval ::OMRX_ERR_OSERR   File could not be written
+  * @retval ::OMRX_WARN_OSERR  Could not close the file
   */
-omrx_status_t omrx_new(void *user_data, omrx_t *result) {
-    omrx_t omrx;
+omrx_status_t omrx_stream_close(omrx_t omrx) {
+    struct omrx_stream *stream = &omrx->stream;
+    struct chunk_header hdr;
+    omrx_status_t status = OMRX_OK;
 
-    if (!default_alloc) {
-        // FIXME: call default log functions
-        *result = NULL;
-        return OMRX_ERR_INIT_FIRST;
+    if (!stream->fp) {
+        return omrx_error(omrx, OMRX_ERR_NOT_OPEN, "omrx_stream_close() called when streaming writer is not open");
     }
-
-    omrx = default_alloc(NULL, sizeof(struct omrx));
-
-    if (!omrx) {
-        // FIXME: call default log functions
-        *result = NULL;
-        return OMRX_ERR_ALLOC;
+    if (stream->in_array) {
+        status = omrx_stream_end_array(omrx);
     }
-    memset(omrx, 0, sizeof(struct omrx));
-
-    omrx->user_data = user_data;
-    omrx->alloc = default_alloc;
-    omrx->free = default_free;
-    omrx->message = omrx->alloc(omrx, OMRX_ERRMSG_BUFSIZE);
-    omrx->log_error = default_log_error;
-    omrx->log_warning = default_log_warning;
-    omrx->root_chunk = new_chunk(omrx, "OMRX");
-    omrx->chunk_id_map_size = 32;
-    omrx->chunk_id_map = omrx->alloc(omrx, sizeof(struct idmap_st) * omrx->chunk_id_map_size);
-    if (omrx->chunk_id_map) {
-        memset(omrx->chunk_id_map, 0, sizeof(struct idmap_st) * omrx->chunk_id_map_size);
+    while (status >= 0 && stream->depth > 1) {
+        status = omrx_stream_end_chunk(omrx);
     }
-    omrx->status = OMRX_OK;
-    omrx->last_result = OMRX_OK;
-
-    if (!omrx->message || !omrx->root_chunk || !omrx->chunk_id_map) {
-        // FIXME: print an error message
-        omrx_free(omrx);
-        *result = NULL;
-        return OMRX_ERR_ALLOC;
+    if (status >= 0) {
+        status = stream_finish_attrs(omrx);
     }
-
-    if (omrx_set_attr_uint32(omrx->root_chunk, OMRX_ATTR_VER, OMRX_MIN_VERSION) < 0) {
-        omrx_free(omrx);
-        *result = NULL;
-        return OMRX_ERR_ALLOC;
+    if (status >= 0) {
+        memcpy(hdr.tag, "OMRx", 4);
+        hdr.count = 0;
+        status = write_data(omrx, sizeof(hdr), &hdr, stream->fp);
+    }
+    if (status >= 0 && stream->appending) {
+        // Get rid of anything which was after the old end tag
+        if (fflush(stream->fp) || ftruncate(fileno(stream->fp), omrx->write_pos) < 0) {
+            status = omrx_os_error(omrx, OMRX_ERR_OSERR, "Cannot truncate file");
+        }
+    }
+    if (stream->appending && (status < 0 || ferror(stream->fp))) {
+        // (ferror() catches write errors which the application ignored.)
+        if (status >= 0) {
+            status = omrx_error(omrx, OMRX_ERR_OSERR, "Write error");
+        }
+        if (stream_restore_tail(omrx) < 0) {
+            status = OMRX_ERR_OSERR;
+        }
+    }
+    if (fclose(stream->fp) && status >= 0) {
+        status = omrx_os_warning(omrx, OMRX_WARN_OSERR, "Close failed");
+    }
+    stream_cleanup(omrx);
+    if (status != OMRX_OK) {
+        return status;
     }
 
-    *result = omrx;
-    return OMRX_OK;
+    return API_RESULT(omrx, OMRX_OK);
 }
 
-/** @brief Release all resources associated with an OMRX handle
-  *
-  * After calling this function, all underlying resources associated with the
-  * given OMRX instance are closed and all memory is freed (including the
-  * instance itself).  The provided handle should not be used for any future
-  * calls.
+/** @brief Start a new chunk in the streaming writer
   *
-  * @note If a `user_data` pointer was provided when calling omrx_new(), the
-  * user data is *not* freed by this function.  It is up to the application to
-  * clean up any related application data if required.
+  * The new chunk becomes a child of the chunk most recently begun (and not yet
+  * ended), or of the toplevel OMRX chunk.  Attributes written after this call
+  * belong to the new chunk, until one of its children is begun or it is ended
+  * with omrx_stream_end_chunk().
   *
-  * @param[in] omrx The OMRX instance to release.
+  * @param[in] omrx  The OMRX instance to use
+  * @param[in] tag   The four-character tag of the new chunk
   *
-  * @retval ::OMRX_OK  Instance freed successfully
+  * @retval ::OMRX_OK            Chunk started successfully
+  * @retval ::OMRX_ERR_BAD_STATE The current chunk cannot have children, or an
+  *                              array attribute is still being written
+  * @retval ::OMRX_ERR_BAD_CHUNK The tag is not a valid chunk tag
   */
-omrx_status_t omrx_free(omrx_t omrx) {
-    omrx_status_t status = OMRX_OK;
-    omrx_status_t rc;
+omrx_status_t omrx_stream_begin_chunk(omrx_t omrx, const char *tag) {
+    struct omrx_stream *stream = &omrx->stream;
+    struct omrx_stream_level *parent;
 
-    // Note: we don't exit immediately on errors in here, because we want to
-    // continue on and clean up as much as possible anyway.  We save any error
-    // status and return it at the end of things.
-    if (omrx->fp) {
-        rc = omrx_close(omrx);
-        if (rc != OMRX_OK) status = rc;
+    CHECK_ERR(stream_check(omrx));
+    if (strlen(tag) != 4 || (TAG_TO_TAGINT(tag) & 0xc0c0c0c0) != 0x40404040) {
+        return omrx_error(omrx, OMRX_ERR_BAD_CHUNK, "Invalid chunk tag '%s'", tag);
     }
-    if (omrx->filename) {
-        omrx->free(omrx, omrx->filename);
+    parent = &stream->levels[stream->depth - 1];
+    if (parent->tagint & END_CHUNK_FLAG) {
+        return omrx_error(omrx, OMRX_ERR_BAD_STATE, "%.4s chunks cannot contain other chunks", parent->tag);
     }
-    if (omrx->message) {
-        omrx->free(omrx, omrx->message);
-    }
-    if (omrx->root_chunk) {
-        rc = free_all_chunks(omrx->root_chunk);
-        if (rc != OMRX_OK) status = rc;
+    CHECK_ERR(stream_finish_attrs(omrx));
+    parent->has_children = true;
+    CHECK_ERR(stream_push(omrx, tag));
+
+    return API_RESULT(omrx, OMRX_OK);
+}
+
+/** @brief End the current chunk in the streaming writer
+  *
+  * The chunk most recently begun with omrx_stream_begin_chunk() (and not yet
+  * ended) is finished, and subsequent attributes and chunks go to its parent.
+  *
+  * @param[in] omrx  The OMRX instance to use
+  *
+  * @retval ::OMRX_OK            Chunk ended successfully
+  * @retval ::OMRX_ERR_BAD_STATE There is no open chunk to end (the OMRX chunk
+  *                              itself is ended by omrx_stream_close()), or
+  *                              an array attribute is still being written
+  * @retval ::OMRX_ERR_OSERR     File could not be written
+  */
+omrx_status_t omrx_stream_end_chunk(omrx_t omrx) {
+    struct omrx_stream *stream = &omrx->stream;
+    struct omrx_stream_level *level;
+    struct chunk_header hdr;
+
+    CHECK_ERR(stream_check(omrx));
+    if (stream->depth <= 1) {
+        return omrx_error(omrx, OMRX_ERR_BAD_STATE, "omrx_stream_end_chunk() called with no open chunk");
     }
-    if (omrx->chunk_id_map) {
-        omrx->free(omrx, omrx->chunk_id_map);
+    CHECK_ERR(stream_finish_attrs(omrx));
+    level = &stream->levels[stream->depth - 1];
+    if (!(level->tagint & END_CHUNK_FLAG)) {
+        memcpy(hdr.tag, level->tag, 4);
+        hdr.tag[3] |= CHUNK_TAG_FLAG;
+        hdr.count = 0;
+        CHECK_ERR(write_data(omrx, sizeof(hdr), &hdr, stream->fp));
     }
-    omrx->free(omrx, omrx);
+    stream->depth--;
 
-    return status;
+    return API_RESULT(omrx, OMRX_OK);
 }
 
-/** @brief Retrieve the user_data pointer provided when calling omrx_new()
+/** @brief Write an existing chunk with the streaming writer
   *
-  * @param[in] omrx  The OMRX instance
+  * Writes out `chunk` (which must belong to the same OMRX instance),
+  * including all of its attributes and children, as a child of the current
+  * chunk.  This allows chunks built in memory with the normal chunk API (see
+  * omrx_add_chunk(), etc) to be mixed with streamed ones, or added to an
+  * existing file with omrx_stream_append().
   *
-  * @returns The value provided as the `user_data` parameter when omrx_new()
-  * was called.
+  * @param[in] omrx   The OMRX instance to use
+  * @param[in] chunk  The chunk to write
+  *
+  * @retval ::OMRX_OK            Chunk written successfully
+  * @retval ::OMRX_ERR_BAD_STATE The current chunk cannot have children, or an
+  *                              array attribute is still being written
+  * @retval ::OMRX_ERR_OSERR     File could not be written
   */
-void *omrx_user_data(omrx_t omrx) {
-    return omrx->user_data;
+omrx_status_t omrx_stream_write_chunk(omrx_t omrx, omrx_chunk_t chunk) {
+    struct omrx_stream *stream = &omrx->stream;
+    struct omrx_stream_level *parent;
+
+    if (!chunk) return OMRX_STATUS_NO_OBJECT;
+
+    CHECK_ERR(stream_check(omrx));
+    if (chunk->omrx != omrx) {
+        return omrx_error(omrx, OMRX_ERR_BAD_STATE, "omrx_stream_write_chunk() called with a chunk from a different OMRX instance");
+    }
+    parent = &stream->levels[stream->depth - 1];
+    if (parent->tagint & END_CHUNK_FLAG) {
+        return omrx_error(omrx, OMRX_ERR_BAD_STATE, "%.4s chunks cannot contain other chunks", parent->tag);
+    }
+    CHECK_ERR(stream_finish_attrs(omrx));
+    parent->has_children = true;
+    CHECK_ERR(write_chunk(chunk, stream->fp));
+
+    return API_RESULT(omrx, OMRX_OK);
 }
 
-/** @brief Return the status code from the last libomrx call
+/** @brief Write an attribute with the streaming writer
   *
-  * This function returns whatever status code was returned by the most recent
-  * call to any libomrx function (except omrx_status()).  This is a convenience
-  * so that a function's return value can be tested directly (i.e. in an `if`
-  * statement) for error conditions, but then can also be retrieved again later
-  * if the application wants more information about a non-error result.  For
-  * example:
+  * Adds an attribute with the given data to the current chunk.  For array
+  * datatypes, `cols` gives the number of columns, and `size` must be a
+  * multiple of the row size; for other types it is ignored.  The data is
+  * copied (or written out) before this returns.
   *
-  * @code
-  *     #define CHECK_ERR(x) if ((x) < 0) exit(1);
+  * To store the data encoded, combine the datatype with an encoding (see
+  * ::omrx_encoding_t), for example `OMRX_DTYPE_F32_ARRAY |
+  * OMRX_ENCODING_AUTO | OMRX_ENCODING_SHUFFLE`.  The data passed in is still
+  * the raw (unencoded) data.
   *
-  *     CHECK_ERR(omrx_get_chunk_by_id(omrx, "test", NULL, &chunk));
+  * Each attribute ID should only be written once for any given chunk.
   *
-  *     if (omrx_last_result(omrx) == OMRX_STATUS_NOT_FOUND) {
-  *         printf("Didn't find 'test' id\n");
-  *     }
-  * @endcode
+  * @param[in] omrx      The OMRX instance to use
+  * @param[in] id        The attribute ID
+  * @param[in] datatype  The datatype of the attribute
+  * @param[in] cols      Number of columns (for array datatypes)
+  * @param[in] size      Size of the data, in bytes
+  * @param[in] data      The attribute data
   *
-  * Note that this differs from omrx_status() in that omrx_last_result() only
-  * returns the result of the last call, and will not report any errors or
-  * warnings which might have happened previously.
+  * @retval ::OMRX_OK               Attribute written successfully
+  * @retval ::OMRX_ERR_BAD_STATE    The current chunk already has children, or
+  *                                 an array attribute is still being written
+  * @retval ::OMRX_ERR_WRONG_DTYPE  An array datatype was given with no columns
+  * @retval ::OMRX_ERR_BAD_SIZE     Array data is not a whole number of rows
+  * @retval ::OMRX_ERR_TOO_LARGE    The data (or number of attributes) is too
+  *                                 large for the file format
+  * @retval ::OMRX_ERR_BAD_ENCODING The requested encoding is not available
+  * @retval ::OMRX_ERR_OSERR        File could not be written
+  */
+omrx_status_t omrx_stream_write_attr(omrx_t omrx, uint16_t id, uint16_t datatype, uint16_t cols, uint32_t size, const void *data) {
+    uint16_t encoding = OMRX_GET_ENCODING(datatype);
+    uint16_t raw_type = OMRX_GET_RAW_TYPE(datatype);
+    uint8_t *buf;
+    uint32_t len;
+    omrx_status_t status;
+
+    CHECK_ERR(stream_check(omrx));
+    if (OMRX_IS_ARRAY_DTYPE(raw_type)) {
+        if (!cols) {
+            return omrx_error(omrx, OMRX_ERR_WRONG_DTYPE, "%04x: Array attributes must have at least one column", id);
+        }
+        if (size % ((uint32_t)cols * OMRX_GET_ELEMSIZE(raw_type))) {
+            return omrx_error(omrx, OMRX_ERR_BAD_SIZE, "%04x: Array data size (%u) is not a whole number of rows", id, size);
+        }
+    }
+    if (encoding) {
+        datatype = raw_type;
+        CHECK_ERR(resolve_encoding(omrx, id, datatype, &encoding));
+        status = encode_payload(omrx, datatype, encoding, cols, size, data, &buf, &len, &encoding);
+        CHECK_ERR(status);
+        if (status == OMRX_OK) {
+            // (The encoded datatype isn't an array type, so this doesn't add
+            // another array subheader.)
+            status = stream_add_attr(omrx, id, datatype | encoding, 0, len, false, NULL);
+            if (status >= 0) {
+                status = stream_emit(omrx, len, buf);
+            }
+            omrx->free(omrx, buf);
+            CHECK_ERR(status);
+            return API_RESULT(omrx, OMRX_OK);
+        }
+        // Not worth encoding, so just write it as-is.
+    }
+    CHECK_ERR(stream_add_attr(omrx, id, datatype, cols, size, false, NULL));
+    CHECK_ERR(stream_emit_payload(omrx, get_swap_width(datatype), size, data));
+
+    return API_RESULT(omrx, OMRX_OK);
+}
+
+/** @brief Write a string attribute with the streaming writer
   *
-  * @param[in] omrx The OMRX instance to query
+  * @see omrx_stream_write_attr()
+  */
+omrx_status_t omrx_stream_write_attr_str(omrx_t omrx, uint16_t id, const char *str) {
+    size_t size = strlen(str);
+
+    if (size > UINT32_MAX) {
+        return omrx_error(omrx, OMRX_ERR_TOO_LARGE, "%04x: Attribute data is too large", id);
+    }
+
+    return omrx_stream_write_attr(omrx, id, OMRX_DTYPE_UTF8, 0, size, str);
+}
+
+/** @brief Write a uint32 attribute with the streaming writer
   *
-  * @returns The same status code as was returned by the previous libomrx call
+  * @see omrx_stream_write_attr()
   */
-omrx_status_t omrx_last_result(omrx_t omrx) {
-    return omrx->last_result;
+omrx_status_t omrx_stream_write_attr_uint32(omrx_t omrx, uint16_t id, uint32_t value) {
+    return omrx_stream_write_attr(omrx, id, OMRX_DTYPE_U32, 0, 4, &value);
 }
 
-/** @brief Return the current (accumulated) error/warning status
+/** @brief Write a complete float32 array attribute with the streaming writer
   *
-  * libomrx maintains a record of the last error or warning status produced by
-  * any API call.  omrx_status() can be called to find out whether any calls
-  * have produced any errors or warnings up to this point (even if the most
-  * recent call was successful).  Optionally, the status can be reset before
-  * making a series of calls, so that it can be checked (for example) at the
-  * end to ensure no undetected problems were encountered.
+  * To write an array a piece at a time instead, see omrx_stream_begin_array().
   *
-  * If you only want to get the returned status code from the most recent
-  * libomrx call (regardless of any previous errors), see omrx_last_result()
-  * instead.
+  * @see omrx_stream_write_attr()
+  */
+omrx_status_t omrx_stream_write_attr_float32_array(omrx_t omrx, uint16_t id, uint16_t cols, uint32_t rows, const float *data) {
+    uint64_t size = (uint64_t)4 * rows * cols;
+
+    if (size > UINT32_MAX - 2) {
+        return omrx_error(omrx, OMRX_ERR_TOO_LARGE, "%04x: Attribute data is too large", id);
+    }
+
+    return omrx_stream_write_attr(omrx, id, OMRX_DTYPE_F32_ARRAY, cols, size, data);
+}
+
+/** @brief Start writing an array attribute a piece at a time
   *
-  * @param[in] omrx The OMRX instance to query
-  * @param[in] reset Reset the status to OMRX_OK after reading
+  * Adds an array attribute to the current chunk, whose data is then supplied
+  * by one or more calls to omrx_stream_append_rows(), followed by
+  * omrx_stream_end_array() (nothing else can be written in between).  The
+  * data goes straight to the file as it is appended, and the attribute's size
+  * is filled in when the array is ended.
   *
-  * @returns The last error/warning result from any previous libomrx call, or OMRX_OK if no errors or warnings have occurred since the last reset.
+  * Arrays written this way are always stored unencoded: an encoded attribute
+  * starts with its block directory, which can't be known until all of the
+  * data has been seen.  To store an array encoded, pass the whole array to
+  * omrx_stream_write_attr() with an encoded datatype instead.
+  *
+  * @param[in] omrx      The OMRX instance to use
+  * @param[in] id        The attribute ID
+  * @param[in] datatype  The datatype of the attribute (must be an array type,
+  *                      with no encoding)
+  * @param[in] cols      Number of columns
+  *
+  * @retval ::OMRX_OK              Array attribute started successfully
+  * @retval ::OMRX_ERR_WRONG_DTYPE  `datatype` is not an array type, or `cols`
+  *                                 is zero
+  * @retval ::OMRX_ERR_BAD_ENCODING `datatype` includes an encoding
+  * @retval ::OMRX_ERR_BAD_STATE    The current chunk already has children, or
+  *                                 another array is still being written
+  * @retval ::OMRX_ERR_OSERR        File could not be written
   */
-omrx_status_t omrx_status(omrx_t omrx, bool reset) {
-    omrx_status_t status = omrx->status;
+omrx_status_t omrx_stream_begin_array(omrx_t omrx, uint16_t id, uint16_t datatype, uint16_t cols) {
+    struct omrx_stream *stream = &omrx->stream;
 
-    if (reset) {
-        omrx->status = OMRX_OK;
+    CHECK_ERR(stream_check(omrx));
+    if (OMRX_GET_ENCODING(datatype)) {
+        return omrx_error(omrx, OMRX_ERR_BAD_ENCODING, "omrx_stream_begin_array() can't write encoded arrays (datatype %04x); use omrx_stream_write_attr()", datatype);
     }
-    return status;
+    if (!OMRX_IS_ARRAY_DTYPE(datatype)) {
+        return omrx_error(omrx, OMRX_ERR_WRONG_DTYPE, "omrx_stream_begin_array() called with non-array datatype %04x", datatype);
+    }
+    CHECK_ERR(stream_add_attr(omrx, id, datatype, cols, 0, true, &stream->array_hdr_pos));
+    stream->in_array = true;
+    stream->array_cols = cols;
+    stream->array_elem_size = get_elem_size(datatype, 0);
+    stream->array_size = 0;
+
+    return API_RESULT(omrx, OMRX_OK);
 }
 
-/** @brief Default logging function for warning messages
+/** @brief Append rows to the array attribute being written
   *
-  * This is the warning log function passed to omrx_initialize() if the
-  * omrx_init() convenience wrapper is used.  It will send all warning messages
-  * to stderr, prefixed with "libomrx warning: ".
+  * @param[in] omrx  The OMRX instance to use
+  * @param[in] rows  The number of rows in `data`
+  * @param[in] data  The rows to append (each row being `cols` elements of the
+  *                  array's element type)
+  *
+  * @retval ::OMRX_OK            Data written successfully
+  * @retval ::OMRX_ERR_BAD_STATE omrx_stream_begin_array() has not been called
+  * @retval ::OMRX_ERR_TOO_LARGE The attribute would become too large for the
+  *                              file format (4GB)
+  * @retval ::OMRX_ERR_OSERR     File could not be written
   */
-void omrx_default_log_warning(omrx_t omrx, omrx_status_t errcode, const char *msg) {
-    if (omrx && omrx->filename) {
-        fprintf(stderr, "libomrx warning: %s: %s\n", omrx->filename, msg);
-    } else {
-        fprintf(stderr, "libomrx warning: %s\n", msg);
+omrx_status_t omrx_stream_append_rows(omrx_t omrx, uint32_t rows, const void *data) {
+    struct omrx_stream *stream = &omrx->stream;
+    uint64_t size;
+
+    if (!stream->in_array) {
+        return omrx_error(omrx, OMRX_ERR_BAD_STATE, "omrx_stream_append_rows() called without omrx_stream_begin_array()");
     }
-    fflush(stderr);
+    size = (uint64_t)rows * stream->array_cols * stream->array_elem_size;
+    if (stream->array_size + size > UINT32_MAX - 2) {
+        return omrx_error(omrx, OMRX_ERR_TOO_LARGE, "Array attribute data is too large");
+    }
+    CHECK_ERR(write_payload(omrx, stream->array_elem_size, size, data, stream->fp));
+    stream->array_size += size;
+
+    return API_RESULT(omrx, OMRX_OK);
 }
 
-/** @brief Default logging function for error messages
+/** @brief Finish writing an array attribute
   *
-  * This is the error log function passed to omrx_initialize() if the
-  * omrx_init() convenience wrapper is used.  It will send all error messages
-  * to stderr, prefixed with "libomrx error: ".
+  * @param[in] omrx  The OMRX instance to use
+  *
+  * @retval ::OMRX_OK            Array attribute finished successfully
+  * @retval ::OMRX_ERR_BAD_STATE omrx_stream_begin_array() has not been called
+  * @retval ::OMRX_ERR_OSERR     File could not be written
   */
-void omrx_default_log_error(omrx_t omrx, omrx_status_t errcode, const char *msg) {
-    if (omrx && omrx->filename) {
-        fprintf(stderr, "libomrx error: %s: %s\n", omrx->filename, msg);
-    } else {
-        fprintf(stderr, "libomrx error: %s\n", msg);
+omrx_status_t omrx_stream_end_array(omrx_t omrx) {
+    struct omrx_stream *stream = &omrx->stream;
+    uint32_t size;
+
+    if (!stream->in_array) {
+        return omrx_error(omrx, OMRX_ERR_BAD_STATE, "omrx_stream_end_array() called without omrx_stream_begin_array()");
     }
-    fflush(stderr);
+    if (stream->array_size) {
+        size = UINT32_HTOF(stream->array_size + 2);
+        CHECK_ERR(patch_data(omrx, stream->array_hdr_pos + 4, 4, &size, stream->fp));
+    }
+    stream->in_array = false;
+
+    return API_RESULT(omrx, OMRX_OK);
 }
 
 /** @} */
 
-/** @defgroup fileio File Operations
+/** @defgroup fetch Asynchronous Fetches
   *
-  * @brief Opening, reading, and writing OMRX files
+  * @brief Reading attribute data in the background
+  *
+  * Instead of reading attributes one at a time and waiting for each read to
+  * complete, a batch of attribute reads can be submitted all at once with
+  * omrx_fetch_submit().  They are carried out in the background while the
+  * caller gets on with something else, and can be overlapped with each other
+  * as much as the system allows: on Linux, the reads are queued to the kernel
+  * through an io_uring where available, and otherwise are spread over a small
+  * pool of background threads.  For example:
+  *
+  * @code
+  *     struct omrx_fetch_request reqs[2] = {
+  *         {.chunk = vrtx, .id = OMRX_ATTR_DATA, .buf = verts, .buf_size = sizeof(verts)},
+  *         {.chunk = face, .id = OMRX_ATTR_DATA, .buf = faces, .buf_size = sizeof(faces)},
+  *     };
+  *     omrx_fetch_t fetch;
+  *
+  *     omrx_fetch_submit(omrx, reqs, 2, NULL, NULL, &fetch);
+  *     do_something_else();
+  *     if (omrx_fetch_wait(fetch) == OMRX_OK) {
+  *         // verts and faces now contain the data
+  *     }
+  *     omrx_fetch_free(fetch);
+  * @endcode
+  *
+  * Asynchronous fetches are only available for instances opened with
+  * ::OMRX_OPEN_CONCURRENT.  Each request reads the raw data of an attribute
+  * into a buffer supplied by the caller, in the same way as
+  * omrx_get_attr_raw_into().
   *
   * @{
   */
 
-/** @brief Open an existing OMRX file for reading
+/** @brief Start reading a batch of attributes in the background
   *
-  * This function will open an existing file (or use a supplied `FILE` handle)
-  * for reading, and perform an intial scan of its contents.  The file must be
-  * seekable.
+  * For each request in `requests`, the data of attribute `id` of `chunk` is
+  * read into `buf` (in host byte order, and decoded if it is encoded in the
+  * file).  This function returns as soon as the reads have been started; use
+  * omrx_fetch_poll() or omrx_fetch_wait() to find out when they are done, or
+  * supply a `callback` to be called when they are.
   *
-  * The `omrx` handle supplied should be a fresh handle created with
-  * omrx_new().  If it has been previously used, any previous contents will be
-  * overwritten.  The file will be scanned for consistency and structure, and
-  * an index will be created in memory, but the actual file data is not read
-  * until it is actually needed.  It is therefore important not to call
-  * omrx_close() until you are sure you have retrieved all the data you need.
+  * Before this returns, each request's `size` is set to the size of the
+  * attribute's data (or 0 if it doesn't exist).  The `status` of each request
+  * is set to ::OMRX_STATUS_PENDING, or ::OMRX_STATUS_NOT_FOUND /
+  * ::OMRX_STATUS_NO_OBJECT if the attribute or chunk doesn't exist (in which
+  * case nothing is read for that request).  Once the fetch has completed, it
+  * is ::OMRX_OK, or the error status for that request's read.
   *
-  * If the `fp` parameter is `NULL`, then the file specified by `filename` is
-  * opened and read.  If `fp` is not `NULL`, then it should be an open `FILE`
-  * pointer (opened for reading in binary mode) which will be used instead.  In
-  * this case `filename` can still be provided, and will be used in
-  * error/warning messages, etc, as the name of the open file.
+  * If any request's buffer is too small for its attribute data, nothing is
+  * read at all and ::OMRX_ERR_TOO_SMALL is returned.
   *
-  * @param[in] omrx     The OMRX instance to use
-  * @param[in] filename The name of the file to open
-  * @param[in] fp       An open `FILE` pointer to use for file IO, or `NULL`
+  * The `requests` array and all of the buffers must stay valid (and must not
+  * be touched) until the fetch has completed.  The callback, if any, is called
+  * from a background thread once all of the requests have completed.  It may
+  * call omrx_fetch_poll(), omrx_fetch_wait() or omrx_fetch_free() on the
+  * fetch, and read attributes (as any other thread can in concurrent mode), but
+  * must not call omrx_close() or omrx_free().
   *
-  * @retval ::OMRX_OK             File opened successfully
-  * @retval ::OMRX_ERR_EOF        Unexpected end-of-file encountered
-  * @retval ::OMRX_ERR_BAD_MAGIC  Bad data at beginning of file
-  * @retval ::OMRX_ERR_BAD_CHUNK  Invalid chunk tag encountered
-  * @retval ::OMRX_ERR_BAD_VER    File version is incompatible with library version
+  * Every fetch must be freed with omrx_fetch_free() (which waits for it to
+  * complete, if necessary) before the instance is freed.
+  *
+  * @param[in] omrx       The OMRX instance
+  * @param[in,out] requests  The attributes to read
+  * @param[in] count      The number of entries in `requests`
+  * @param[in] callback   Function to call when all reads have completed (may
+  *                       be `NULL`)
+  * @param[in] user_data  Passed to `callback`
+  * @param[out] result    The handle for the new fetch
+  *
+  * @retval ::OMRX_OK             The reads have been started
+  * @retval ::OMRX_ERR_BAD_STATE  The instance was not opened with
+  *                               ::OMRX_OPEN_CONCURRENT
+  * @retval ::OMRX_ERR_TOO_SMALL  A request's buffer is too small (nothing was
+  *                               started)
   */
-omrx_status_t omrx_open(omrx_t omrx, const char *filename, FILE *fp) {
-    if (omrx->fp) {
-        return omrx_error(omrx, OMRX_ERR_ALREADY_OPEN, "omrx_open() called on already open OMRX handle");
+omrx_status_t omrx_fetch_submit(omrx_t omrx, struct omrx_fetch_request *requests, size_t count, omrx_fetch_func_t callback, void *user_data, omrx_fetch_t *result) {
+    struct omrx_fetch_request *req;
+    struct fetch_op *op;
+    omrx_fetch_t fetch;
+    omrx_async_t async;
+    omrx_attr_t attr;
+    omrx_status_t status;
+    size_t last = 0;
+    size_t i;
+
+    *result = NULL;
+    if (!(omrx->open_flags & OMRX_OPEN_CONCURRENT)) {
+        return omrx_error(omrx, OMRX_ERR_BAD_STATE, "Asynchronous fetches require an instance opened with OMRX_OPEN_CONCURRENT");
     }
-    if (fp) {
-        omrx->fp = fp;
-        omrx->close_file = false;
-    } else {
-        omrx->fp = fopen(filename, "rb");
-        omrx->close_file = true;
-        if (!omrx->fp) {
-            return omrx_os_error(omrx, OMRX_ERR_OSERR, "Cannot open '%s' for reading", filename);
+    async = get_async(omrx);
+    if (!async) {
+        return omrx_error(omrx, OMRX_ERR_OSERR, "Unable to start background threads for asynchronous fetches");
+    }
+
+    fetch = omrx->alloc(omrx, sizeof(struct omrx_fetch));
+    CHECK_ALLOC(omrx, fetch);
+    memset(fetch, 0, sizeof(struct omrx_fetch));
+    // (Always at least one op, for completing a fetch with nothing to read.)
+    fetch->ops = omrx->alloc(omrx, (count ? count : 1) * sizeof(struct fetch_op));
+    if (!fetch->ops) {
+        omrx->free(omrx, fetch);
+        return omrx_os_error(omrx, OMRX_ERR_ALLOC, "Memory allocation failed");
+    }
+    memset(fetch->ops, 0, (count ? count : 1) * sizeof(struct fetch_op));
+    fetch->omrx = omrx;
+    fetch->requests = requests;
+    fetch->count = count;
+    fetch->callback = callback;
+    fetch->user_data = user_data;
+    fetch->status = OMRX_OK;
+
+    // Check everything (and allocate what's needed) before starting anything,
+    // so that there's nothing to cancel if something's wrong.
+    for (i = 0; i < count; i++) {
+        req = &requests[i];
+        op = &fetch->ops[i];
+        op->fetch = fetch;
+        op->req = req;
+        op->async.func = fetch_op_func;
+        req->size = 0;
+        if (!req->chunk) {
+            req->status = OMRX_STATUS_NO_OBJECT;
+            continue;
+        }
+        attr = NULL;
+        status = find_attr(req->chunk, req->id, &attr);
+        if (status < 0) {
+            free_fetch(fetch);
+            return status;
+        }
+        if (!attr) {
+            req->status = OMRX_STATUS_NOT_FOUND;
+            continue;
+        }
+        req->size = attr->size;
+        req->status = OMRX_STATUS_PENDING;
+        if (req->buf_size < attr->size) {
+            free_fetch(fetch);
+            return omrx_error(omrx, OMRX_ERR_TOO_SMALL, "Buffer too small for attribute %s:%04x (%zu bytes needed).", req->chunk->tag, req->id, (size_t)attr->size);
+        }
+        op->attr = attr;
+        // Data which is already in memory (or mapped) is just copied by the
+        // background thread.  Otherwise the operation reads it from the file.
+        // (Other threads may drop the in-memory data at any time, so the
+        // operation gets its own reference to it now.)
+        op->data = snapshot_attr_data(attr, &op->shared);
+        if (!op->data && !omrx->map && omrx->fp && attr->file_pos >= 0 && (attr->file_encoding ? attr->file_size : attr->size)) {
+            op->read_file = true;
+            if (attr->file_encoding) {
+                status = check_decodable(attr);
+                if (status < 0) {
+                    free_fetch(fetch);
+                    return status;
+                }
+                op->encoded = omrx->alloc(omrx, (size_t)attr->file_size + 1);
+                if (!op->encoded) {
+                    free_fetch(fetch);
+                    return omrx_os_error(omrx, OMRX_ERR_ALLOC, "Memory allocation failed");
+                }
+            }
         }
+        fetch->pending++;
+        last = i;
     }
-    omrx->filename = omrx_strdup(omrx, filename);
 
-    return omrx_scan(omrx);
+    *result = fetch;
+    if (!fetch->pending) {
+        fetch->pending = 1;
+        fetch->ops[0].fetch = fetch;
+        fetch->ops[0].req = NULL;
+        fetch->ops[0].attr = NULL;
+        fetch->ops[0].async.func = fetch_op_func;
+        omrx_async_run(async, &fetch->ops[0].async);
+        return API_RESULT(omrx, OMRX_OK);
+    }
+    // Once the last operation has been started, the whole fetch may complete
+    // (and be freed by the callback) at any time, so stop there.
+    for (i = 0; i <= last; i++) {
+        op = &fetch->ops[i];
+        attr = op->attr;
+        if (!attr) {
+            continue;
+        }
+        if (!op->read_file) {
+            omrx_async_run(async, &op->async);
+        } else if (op->encoded) {
+            omrx_async_read(async, &op->async, fileno(omrx->fp), op->encoded, attr->file_size, attr->file_pos);
+        } else {
+            omrx_async_read(async, &op->async, fileno(omrx->fp), op->req->buf, attr->size, attr->file_pos);
+        }
+    }
+    omrx_async_submit(async);
+
+    return API_RESULT(omrx, OMRX_OK);
 }
 
-/** @brief Get the version of the OMRX file currently open for reading
-  *
-  * Returns a binary constant indicating the version of the OMRX standard that
-  * the open file was written to.  The upper 16 bits contain the major version,
-  * and the lower 16 bits contain the minor version.
+/** @brief Check whether an asynchronous fetch has completed
   *
-  * @param[in] omrx     The OMRX instance to query
-  * @param[out] result  Where to store the version information
+  * @param[in] fetch  The fetch
   *
-  * @retval OMRX_OK  Value read successfully and stored in `result`
+  * @retval ::OMRX_STATUS_PENDING  The fetch is still in progress
+  * @retval ::OMRX_OK              All requests completed successfully
+  * @retval <0                     The error status of the first request which
+  *                                failed (see the requests' `status` fields
+  *                                for the others)
   */
-omrx_status_t omrx_get_version(omrx_t omrx, uint32_t *result) {
-    return omrx_get_attr_uint32(omrx->root_chunk, OMRX_ATTR_VER, result);
+omrx_status_t omrx_fetch_poll(omrx_fetch_t fetch) {
+    omrx_t omrx = fetch->omrx;
+    omrx_status_t status;
+    bool finished;
+
+    pthread_mutex_lock(&omrx->fetch_lock);
+    finished = fetch_finished(fetch);
+    status = fetch->status;
+    pthread_mutex_unlock(&omrx->fetch_lock);
+    if (!finished) {
+        return API_RESULT(omrx, OMRX_STATUS_PENDING);
+    }
+
+    return report_fetch_result(omrx, status, fetch->message);
 }
 
-/** @brief Close an OMRX instance opened using omrx_open()
+/** @brief Wait for an asynchronous fetch to complete
   *
-  * Once a file is closed, data which was previously read will still be
-  * available, but attempts to access attributes not previously read will fail.
-  * It is therefore important if you wish to continue accessing the OMRX
-  * instance after closing it that you make sure you have loaded all data you
-  * wish to access before calling omrx_close().
+  * If the fetch has a callback, this also waits for the callback to return
+  * (unless called from the callback itself).
   *
-  * @param[in] omrx  The OMRX instance to close
+  * @param[in] fetch  The fetch
   *
-  * @retval OMRX_OK          Closed successfully
-  * @retval OMRX_WARN_OSERR  Could not close underlying file object
+  * @retval ::OMRX_OK  All requests completed successfully
+  * @retval <0         The error status of the first request which failed (see
+  *                    the requests' `status` fields for the others)
   */
-omrx_status_t omrx_close(omrx_t omrx) {
-    if (!omrx->fp) {
-        return omrx_error(omrx, OMRX_ERR_NOT_OPEN, "omrx_close() called on non-open OMRX handle");
-    }
-    if (omrx->close_file) {
-        if (fclose(omrx->fp)) {
-            omrx->fp = NULL;
-            return omrx_os_warning(omrx, OMRX_WARN_OSERR, "Close failed");
-        }
+omrx_status_t omrx_fetch_wait(omrx_fetch_t fetch) {
+    omrx_t omrx = fetch->omrx;
+    omrx_status_t status;
+
+    pthread_mutex_lock(&omrx->fetch_lock);
+    while (!fetch_finished(fetch)) {
+        pthread_cond_wait(&omrx->fetch_cond, &omrx->fetch_lock);
     }
-    omrx->fp = NULL;
+    status = fetch->status;
+    pthread_mutex_unlock(&omrx->fetch_lock);
 
-    return API_RESULT(omrx, OMRX_OK);
+    return report_fetch_result(omrx, status, fetch->message);
 }
 
-omrx_status_t omrx_write(omrx_t omrx, const char *filename) {
-    FILE *fp = fopen(filename, "wb");
-
-    if (!fp) {
-        return omrx_os_error(omrx, OMRX_ERR_OSERR, "Cannot open '%s' for writing", filename);
+/** @brief Free an asynchronous fetch
+  *
+  * If the fetch is still in progress, this waits for it to complete first.
+  * When called from the fetch's callback, the fetch is freed once the callback
+  * returns.
+  *
+  * @param[in] fetch  The fetch (may be `NULL`, in which case nothing is done)
+  */
+void omrx_fetch_free(omrx_fetch_t fetch) {
+    if (!fetch) {
+        return;
     }
-    CHECK_ERR(write_chunk(omrx->root_chunk, fp));
 
-    if (fclose(fp)) {
-        return omrx_os_warning(omrx, OMRX_WARN_OSERR, "Close failed");
-    }
+    omrx_t omrx = fetch->omrx;
 
-    return API_RESULT(omrx, OMRX_OK);
+    pthread_mutex_lock(&omrx->fetch_lock);
+    if (fetch->in_callback && pthread_equal(fetch->callback_thread, pthread_self())) {
+        fetch->free_pending = true;
+        pthread_mutex_unlock(&omrx->fetch_lock);
+        return;
+    }
+    while (!fetch->done) {
+        pthread_cond_wait(&omrx->fetch_cond, &omrx->fetch_lock);
+    }
+    pthread_mutex_unlock(&omrx->fetch_lock);
+    free_fetch(fetch);
 }
 
 /** @} */
@@ -1200,6 +6966,11 @@ omrx_status_t omrx_get_root_chunk(omrx_t omrx, omrx_chunk_t *result) {
 omrx_status_t omrx_get_chunk_by_id(omrx_t omrx, const char *id, const char *tag, omrx_chunk_t *result) {
     omrx_status_t rc = lookup_chunk_id(omrx, id, result);
 
+    if (rc == OMRX_STATUS_NOT_FOUND && omrx->unloaded_count) {
+        // It may be in a part of the file we haven't read yet.
+        CHECK_ERR(load_all_children(omrx));
+        rc = lookup_chunk_id(omrx, id, result);
+    }
     if (rc != OMRX_OK) {
         *result = NULL;
         return API_RESULT(omrx, rc);
@@ -1219,10 +6990,16 @@ omrx_status_t omrx_get_child(omrx_chunk_t chunk, const char *tag, omrx_chunk_t *
     if (!chunk) return OMRX_STATUS_NO_OBJECT;
 
     omrx_t omrx = chunk->omrx;
-   
+
+    CHECK_ERR(load_children(chunk));
     if (tag) {
         uint32_t tagint = TAG_TO_TAGINT(tag);
+        struct omrx_tag_index *index = get_tag_index(chunk);
 
+        if (index) {
+            *result = find_tag_slot(index, tagint)->first;
+            return API_RESULT(omrx, *result ? OMRX_OK : OMRX_STATUS_NOT_FOUND);
+        }
         chunk = chunk->first_child;
         while (chunk) {
             if (chunk->tagint == tagint) {
@@ -1247,6 +7024,10 @@ omrx_status_t omrx_get_next_chunk(omrx_chunk_t chunk, const char *tag, omrx_chun
     if (tag) {
         uint32_t tagint = chunk->tagint;
 
+        if (chunk->parent && get_tag_index(chunk->parent)) {
+            *result = chunk->next_same_tag;
+            return API_RESULT(omrx, *result ? OMRX_OK : OMRX_STATUS_NOT_FOUND);
+        }
         while (chunk->next) {
             chunk = chunk->next;
             if (chunk->tagint == tagint) {
@@ -1268,47 +7049,308 @@ omrx_status_t omrx_get_child_by_id(omrx_chunk_t chunk, const char *tag, const ch
     if (!chunk) return OMRX_STATUS_NO_OBJECT;
 
     omrx_t omrx = chunk->omrx;
+    struct omrx_tag_index *index = NULL;
     uint32_t tagint;
    
     if (tag) {
         tagint = TAG_TO_TAGINT(tag);
     } else {
-        tagint = 0;
+        tagint = 0;
+    }
+
+    CHECK_ERR(load_children(chunk));
+    if (tagint) {
+        index = get_tag_index(chunk);
+    }
+    if (index) {
+        // Only look at the children with the right tag.
+        chunk = find_tag_slot(index, tagint)->first;
+    } else {
+        chunk = chunk->first_child;
+    }
+    while (chunk) {
+        if (!tagint || (tagint == chunk->tagint)) {
+            if (chunk->id && !strcmp(chunk->id, id)) {
+                *result = chunk;
+                return API_RESULT(omrx, OMRX_OK);
+            }
+        }
+        chunk = index ? chunk->next_same_tag : chunk->next;
+    }
+    *result = NULL;
+    return API_RESULT(omrx, OMRX_STATUS_NOT_FOUND);
+}
+
+omrx_status_t omrx_get_parent(omrx_chunk_t chunk, omrx_chunk_t *result) {
+    if (!chunk) return OMRX_STATUS_NO_OBJECT;
+
+    omrx_t omrx = chunk->omrx;
+   
+    if (chunk->parent) {
+        *result = chunk->parent;
+        return API_RESULT(omrx, OMRX_OK);
+    }
+    *result = NULL;
+    return API_RESULT(omrx, OMRX_STATUS_NOT_FOUND);
+}
+
+/** @brief Iterate over all the chunks underneath a chunk
+  *
+  * Returns the chunk after `chunk` in depth-first (file) order, without
+  * leaving the subtree under `top`.  Start with `chunk` set to `NULL` (to get
+  * the first descendant of `top`), and pass each result back in to get the
+  * next one.  Children are loaded as needed.  This keeps no state of its own,
+  * so the tree can be modified between calls, as long as `chunk` is not
+  * deleted.
+  *
+  * @param[in]  top     The chunk whose descendants to go through
+  * @param[in]  chunk   The last chunk returned, or `NULL` to start
+  * @param[in]  tag     If not `NULL`, only return chunks with this tag
+  * @param[out] result  The next chunk, or `NULL` if there are no more
+  *
+  * @retval ::OMRX_OK                Next chunk found
+  * @retval ::OMRX_STATUS_NOT_FOUND  No more (matching) chunks
+  */
+omrx_status_t omrx_get_next_descendant(omrx_chunk_t top, omrx_chunk_t chunk, const char *tag, omrx_chunk_t *result) {
+    if (!top) return OMRX_STATUS_NO_OBJECT;
+
+    omrx_t omrx = top->omrx;
+    struct tree_walk walk;
+    uint32_t tagint = tag ? TAG_TO_TAGINT(tag) : 0;
+
+    // Pick up the walk as if it had just entered `chunk`.
+    walk_start(&walk, top);
+    if (chunk) {
+        walk.chunk = chunk;
+    }
+    for (;;) {
+        CHECK_ERR(load_children(walk.chunk));
+        chunk = walk_next_entered(&walk, true);
+        if (!chunk || !tag || chunk->tagint == tagint) {
+            break;
+        }
+    }
+    *result = chunk;
+
+    return API_RESULT(omrx, chunk ? OMRX_OK : OMRX_STATUS_NOT_FOUND);
+}
+
+/** @brief Walk the tree underneath a chunk, calling functions for each chunk
+  *
+  * Goes through `chunk` and everything underneath it in depth-first (file)
+  * order, loading children as needed.  `pre` is called for each chunk before
+  * any of its children, and `post` after all of them.  Either may be `NULL`.
+  * If `tag` is given, they are only called for chunks with that tag, but the
+  * walk still goes through the children of other chunks.  Each is passed the
+  * chunk, its depth below the starting chunk (which is at depth 0) and
+  * `user_data`, and returns an ::omrx_walk_action_t:
+  *
+  * - ::OMRX_WALK_CONTINUE: Carry on.
+  * - ::OMRX_WALK_SKIP: (From `pre`) Skip the chunk's children (`post` is
+  *   still called for the chunk itself).
+  * - ::OMRX_WALK_STOP: Return from omrx_walk() straight away.
+  *
+  * This does not recurse, so trees of any depth can be walked.  The callbacks
+  * may add chunks, but the only chunk which may be deleted (with
+  * omrx_del_chunk()) is the one just passed to `post`.
+  *
+  * @param[in] chunk      The chunk to start from
+  * @param[in] tag        If not `NULL`, only call the callbacks for chunks
+  *                       with this tag
+  * @param[in] pre        Function to call when entering each chunk
+  * @param[in] post       Function to call when leaving each chunk
+  * @param[in] user_data  Passed to the callbacks
+  *
+  * @retval ::OMRX_OK  Walk complete (or stopped by a callback)
+  */
+omrx_status_t omrx_walk(omrx_chunk_t chunk, const char *tag, omrx_walk_func_t pre, omrx_walk_func_t post, void *user_data) {
+    if (!chunk) return OMRX_STATUS_NO_OBJECT;
+
+    omrx_t omrx = chunk->omrx;
+    struct tree_walk walk;
+    uint32_t tagint = tag ? TAG_TO_TAGINT(tag) : 0;
+    omrx_walk_action_t action = OMRX_WALK_CONTINUE;
+    bool match;
+
+    for (chunk = walk_start(&walk, chunk); chunk; chunk = walk_next(&walk, action == OMRX_WALK_CONTINUE)) {
+        match = !tag || chunk->tagint == tagint;
+        action = OMRX_WALK_CONTINUE;
+        if (!walk.leaving) {
+            if (pre && match) {
+                action = pre(chunk, walk.depth, user_data);
+            }
+            if (action == OMRX_WALK_CONTINUE) {
+                CHECK_ERR(load_children(chunk));
+            }
+        } else if (post && match) {
+            action = post(chunk, walk.depth, user_data);
+        }
+        if (action == OMRX_WALK_STOP) {
+            break;
+        }
+    }
+
+    return API_RESULT(omrx, OMRX_OK);
+}
+
+/** @brief Compile a query for selecting chunks
+  *
+  * A query is a path of steps, each selecting chunks by tag and (optionally)
+  * ID, separated by `/` (the next step selects children of the chunks
+  * selected so far) or `//` (any of their descendants).  Each step is a
+  * four-character tag, or `*` for any tag, which may be followed by one of
+  * these predicates on the chunk's ID:
+  *
+  * - `[id=VALUE]`: The ID is VALUE
+  * - `[id^=VALUE]`: The ID starts with VALUE
+  * - `[id$=VALUE]`: The ID ends with VALUE
+  * - `[id*=VALUE]`: The ID contains VALUE
+  *
+  * VALUE may be enclosed in double or single quotes (and must be if it
+  * contains `]`).  Queries are run with omrx_query_run(), relative to a
+  * starting chunk: the first step selects its children, or any of its
+  * descendants if the query starts with `//`.  (A leading single `/` makes no
+  * difference.)  For example:
+  *
+  * - `mESH[id=test]/VRTx`: The `VRTx` children of the `mESH` chunk with the
+  *   ID `test`
+  * - `//NRMx`: All `NRMx` chunks, anywhere in the tree
+  * - `*[id^=scan_]/VRTx`: The `VRTx` children of every chunk with an ID
+  *   starting with `scan_`
+  *
+  * A compiled query can be run any number of times, on chunks from any
+  * instance (and, in concurrent mode, from several threads at once), but must
+  * be freed with omrx_query_free() before the instance it was compiled with is
+  * freed.
+  *
+  * @param[in]  omrx    The OMRX instance
+  * @param[in]  path    The query
+  * @param[out] result  The compiled query (`NULL` on failure)
+  *
+  * @retval ::OMRX_OK             Query compiled successfully
+  * @retval ::OMRX_ERR_BAD_QUERY  The query is not valid (the error message
+  *                               says why)
+  */
+omrx_status_t omrx_query_compile(omrx_t omrx, const char *path, omrx_query_t *result) {
+    const char *msg = NULL;
+    size_t pos = 0;
+    int err;
+
+    *result = NULL;
+    err = omrx_query_parse(omrx, path, result, &pos, &msg);
+    if (err == EINVAL) {
+        return omrx_error(omrx, OMRX_ERR_BAD_QUERY, "Invalid query '%s': %s at position %zu", path, msg, pos);
+    } else if (err) {
+        return omrx_error(omrx, OMRX_ERR_ALLOC, "Memory allocation failed");
+    }
+
+    return API_RESULT(omrx, OMRX_OK);
+}
+
+/** @brief Find all the chunks selected by a query
+  *
+  * Runs a query compiled with omrx_query_compile(), starting from `chunk`,
+  * and returns every chunk it selects, in file order (each chunk only once).
+  * The tree is gone through in a single pass, and only the parts of it which
+  * could contain matches are looked at (and loaded, for files opened with
+  * ::OMRX_OPEN_LAZY).  If the first step is for a particular ID (`[id=...]`),
+  * that chunk is found using the instance's ID index instead of searching for
+  * it, and where a step is for children with a particular tag, only those are
+  * looked at.  (Like omrx_get_chunk_by_id(), this assumes IDs are unique.)
+  *
+  * The returned array must be freed by the caller.
+  *
+  * @param[in]  query   The compiled query
+  * @param[in]  chunk   The chunk to start from
+  * @param[out] chunks  The selected chunks (`NULL` if there are none)
+  * @param[out] count   The number of chunks selected
+  *
+  * @retval ::OMRX_OK                At least one chunk selected
+  * @retval ::OMRX_STATUS_NOT_FOUND  Nothing matched the query
+  */
+omrx_status_t omrx_query_run(omrx_query_t query, omrx_chunk_t chunk, omrx_chunk_t **chunks, size_t *count) {
+    if (!chunk) return OMRX_STATUS_NO_OBJECT;
+
+    omrx_t omrx = chunk->omrx;
+    struct query_step *first = &query->steps[0];
+    struct query_results results;
+    omrx_chunk_t start = NULL;
+    omrx_chunk_t ancestor;
+    uint64_t want;
+    bool matched;
+    omrx_status_t status;
+
+    *chunks = NULL;
+    *count = 0;
+    results.chunks = NULL;
+    results.count = 0;
+    results.size = 0;
+    if (first->id_op == QUERY_ID_EQ) {
+        status = lookup_chunk_id(omrx, first->id, &start);
+        if (status == OMRX_STATUS_NOT_FOUND && omrx->unloaded_count) {
+            // It may be in a part of the file we haven't read yet.
+            CHECK_ERR(load_all_children(omrx));
+            status = lookup_chunk_id(omrx, first->id, &start);
+        }
+        if (status == OMRX_OK) {
+            // Make sure it's in the right place to be selected.
+            ancestor = start->parent;
+            while (first->descendant && ancestor && ancestor != chunk) {
+                ancestor = ancestor->parent;
+            }
+            if (ancestor != chunk || !omrx_query_step_matches(first, start->tagint, start->id)) {
+                start = NULL;
+            }
+        }
+        status = OMRX_OK;
+        if (start) {
+            want = match_query(query, start, 1, &matched);
+            if (matched) {
+                status = add_query_result(omrx, &results, start);
+            }
+            if (status >= 0 && want) {
+                status = run_query(query, start, want, &results);
+            }
+        }
+    } else {
+        status = run_query(query, chunk, 1, &results);
     }
-
-    chunk = chunk->first_child;
-    while (chunk) {
-        if (!tagint || (tagint == chunk->tagint)) {
-            if (chunk->id && !strcmp(chunk->id, id)) {
-                *result = chunk;
-                return API_RESULT(omrx, OMRX_OK);
-            }
+    if (status < 0) {
+        if (results.chunks) {
+            omrx->free(omrx, results.chunks);
         }
-        chunk = chunk->next;
+        return status;
     }
-    *result = NULL;
-    return API_RESULT(omrx, OMRX_STATUS_NOT_FOUND);
-}
+    *chunks = results.chunks;
+    *count = results.count;
 
-omrx_status_t omrx_get_parent(omrx_chunk_t chunk, omrx_chunk_t *result) {
-    if (!chunk) return OMRX_STATUS_NO_OBJECT;
+    return API_RESULT(omrx, results.count ? OMRX_OK : OMRX_STATUS_NOT_FOUND);
+}
 
-    omrx_t omrx = chunk->omrx;
-   
-    if (chunk->parent) {
-        *result = chunk->parent;
-        return API_RESULT(omrx, OMRX_OK);
+/** @brief Free a compiled query
+  *
+  * @param[in] query  The query (may be `NULL`, in which case nothing is done)
+  */
+void omrx_query_free(omrx_query_t query) {
+    if (!query) {
+        return;
     }
-    *result = NULL;
-    return API_RESULT(omrx, OMRX_STATUS_NOT_FOUND);
+
+    omrx_t omrx = query->omrx;
+
+    omrx->free(omrx, query->text);
+    omrx->free(omrx, query);
 }
 
 omrx_status_t omrx_add_chunk(omrx_chunk_t chunk, const char *tag, omrx_chunk_t *result) {
     if (!chunk) return OMRX_STATUS_NO_OBJECT;
 
     omrx_t omrx = chunk->omrx;
-    omrx_chunk_t child = new_chunk(omrx, tag);
+    omrx_chunk_t child;
 
+    // Make sure anything already in the file comes before the new chunk.
+    CHECK_ERR(load_children(chunk));
+    child = new_chunk(omrx, tag);
     CHECK_ALLOC(omrx, child);
     CHECK_ERR(add_child_chunk(chunk, child));
     if (result) {
@@ -1322,19 +7364,32 @@ omrx_status_t omrx_del_chunk(omrx_chunk_t chunk) {
     if (!chunk) return OMRX_STATUS_NO_OBJECT;
 
     omrx_t omrx = chunk->omrx;
+    omrx_chunk_t head;
     omrx_chunk_t sibling;
+    omrx_chunk_t prev_same = NULL;
 
-    sibling = (omrx_chunk_t)(&chunk->parent->first_child);
-    while (sibling) {
+    head = (omrx_chunk_t)(&chunk->parent->first_child);
+    sibling = head;
+    while (sibling->next) {
         if (sibling->next == chunk) {
             sibling->next = chunk->next;
             if (chunk == chunk->parent->last_child) {
-                chunk->parent->last_child = sibling;
+                chunk->parent->last_child = (sibling == head) ? NULL : sibling;
+            }
+            chunk->parent->child_count -= 1;
+            if (chunk->parent->tag_index) {
+                tag_index_remove(chunk->parent->tag_index, chunk, prev_same);
             }
             break;
         }
+        sibling = sibling->next;
+        if (sibling->tagint == chunk->tagint) {
+            prev_same = sibling;
+        }
     }
-    CHECK_ERR(free_chunk(chunk));
+    // Free the chunk along with everything underneath it.
+    chunk->next = NULL;
+    CHECK_ERR(free_all_chunks(chunk));
 
     return API_RESULT(omrx, OMRX_OK);
 }
@@ -1356,16 +7411,15 @@ omrx_status_t omrx_set_attr_str(omrx_chunk_t chunk, uint16_t id, omrx_ownership_
     if (attr->datatype != OMRX_DTYPE_UTF8) {
         return omrx_error(omrx, OMRX_ERR_WRONG_DTYPE, "Attempt to set string value for non-string attribute %s:%04x (type=%04x).", chunk->tag, id, attr->datatype);
     }
-    if (attr->data) {
-        // FIXME: do we need to worry about people with refs to this?
-        omrx->free(omrx, attr->data);
-    }
+    // FIXME: do we need to worry about people with refs to this?
+    drop_attr_data(attr);
     if (own == OMRX_COPY) {
         attr->data = omrx_strdup(omrx, str);
         CHECK_ALLOC(omrx, attr->data);
     } else {
         attr->data = str;
     }
+    attr->own_data = (own != OMRX_REF);
     attr->size = strlen(attr->data);
 
     return API_RESULT(omrx, OMRX_OK);
@@ -1386,7 +7440,7 @@ omrx_status_t omrx_get_attr_info(omrx_chunk_t chunk, uint16_t id, struct omrx_at
         return API_RESULT(omrx, OMRX_STATUS_NOT_FOUND);
     }
     info->exists = true;
-    info->encoded_type = attr->datatype;
+    info->encoded_type = attr->datatype | attr->file_encoding;
     info->raw_type = attr->datatype;
     info->size = attr->size;
     info->elem_size = get_elem_size(attr->datatype, attr->size);
@@ -1402,7 +7456,7 @@ omrx_status_t omrx_get_attr_info(omrx_chunk_t chunk, uint16_t id, struct omrx_at
             info->rows = 0;
         }
     } else {
-        info->elem_type = info->encoded_type;
+        info->elem_type = info->raw_type;
         info->is_array = false;
         info->cols = 1;
         info->rows = 1;
@@ -1416,6 +7470,45 @@ omrx_status_t omrx_get_attr_info(omrx_chunk_t chunk, uint16_t id, struct omrx_at
     return API_RESULT(omrx, OMRX_OK);
 }
 
+/** @brief Set the encoding used to store an attribute's data
+  *
+  * Selects how the attribute's data will be encoded (compressed) when the
+  * file is written (see ::omrx_encoding_t).  Reading is not affected: encoded
+  * data is always decoded transparently.  Attributes read from a file keep
+  * the encoding they had there unless it is changed with this function.
+  *
+  * If encoding the data would not make it any smaller, it is written
+  * unencoded instead.  Simple (non-array) numeric attributes and the chunk ID
+  * cannot be encoded.  Large arrays are split into separately encoded blocks
+  * of rows (see omrx_set_block_size()).
+  *
+  * @param[in] chunk     The chunk containing the attribute
+  * @param[in] id        The attribute ID
+  * @param[in] encoding  An ::omrx_encoding_t codec, optionally combined with
+  *                      ::OMRX_ENCODING_SHUFFLE (or ::OMRX_ENCODING_NONE)
+  *
+  * @retval ::OMRX_OK               Encoding set successfully
+  * @retval ::OMRX_STATUS_NOT_FOUND The attribute does not exist
+  * @retval ::OMRX_ERR_WRONG_DTYPE  Attributes of this type can't be encoded
+  * @retval ::OMRX_ERR_BAD_ENCODING The encoding is invalid, or its codec is
+  *                                 not available in this build of libomrx
+  */
+omrx_status_t omrx_set_attr_encoding(omrx_chunk_t chunk, uint16_t id, uint16_t encoding) {
+    if (!chunk) return OMRX_STATUS_NO_OBJECT;
+
+    omrx_t omrx = chunk->omrx;
+    omrx_attr_t attr = NULL;
+
+    CHECK_ERR(find_attr(chunk, id, &attr));
+    if (!attr) {
+        return API_RESULT(omrx, OMRX_STATUS_NOT_FOUND);
+    }
+    CHECK_ERR(resolve_encoding(omrx, id, attr->datatype, &encoding));
+    attr->encoding = encoding;
+
+    return API_RESULT(omrx, OMRX_OK);
+}
+
 omrx_status_t omrx_get_attr_raw(omrx_chunk_t chunk, uint16_t id, size_t *size, void **data) {
     *data = NULL;
     if (size) {
@@ -1430,7 +7523,12 @@ omrx_status_t omrx_get_attr_raw(omrx_chunk_t chunk, uint16_t id, size_t *size, v
     if (!attr) {
         return API_RESULT(omrx, OMRX_STATUS_NOT_FOUND);
     }
-    CHECK_ERR(load_attr_data(attr, data));
+    if (omrx->open_flags & OMRX_OPEN_MMAP) {
+        CHECK_ERR(borrow_attr_data(attr, data));
+    } else {
+        CHECK_ERR(cache_attr_data(attr));
+        CHECK_ERR(load_attr_data(attr, data));
+    }
     if (size) {
         *size = attr->size;
     }
@@ -1452,76 +7550,104 @@ omrx_status_t omrx_get_attr_str(omrx_chunk_t chunk, uint16_t id, char **dest) {
     if (attr->datatype != OMRX_DTYPE_UTF8) {
         return omrx_error(omrx, OMRX_ERR_WRONG_DTYPE, "Attempt to get string value of non-string attribute %s:%04x (type=%04x).", chunk->tag, id, attr->datatype);
     }
+    CHECK_ERR(cache_attr_data(attr));
     CHECK_ERR(load_attr_data(attr, (void **)dest));
 
     return API_RESULT(omrx, OMRX_OK);
 }
 
-omrx_status_t omrx_set_attr_uint32(omrx_chunk_t chunk, uint16_t id, uint32_t value) {
+// Typed accessors.  Every scalar and array datatype gets the same family of
+// functions, generated by the macros below:
+//
+//   omrx_set_attr_<type>(chunk, id, value)
+//   omrx_get_attr_<type>(chunk, id, &value)
+//   omrx_set_attr_<type>_array(chunk, id, own, cols, rows, data)
+//   omrx_get_attr_<type>_array(chunk, id, &cols, &rows, &data)
+//   omrx_get_attr_<type>_array_into(chunk, id, buf, buf_size, &cols, &rows)
+//
+// where <type> is one of uint8, int8, uint16, int16, uint32, int32, float32,
+// uint64, int64 or float64.  The getters fail with OMRX_ERR_WRONG_DTYPE if the
+// attribute is not of exactly the requested type (see
+// omrx_get_attr_array_as_float32() and friends for converting getters).
+//
+// As with omrx_get_attr_raw(), the data returned by the array getters must be
+// freed by the caller, unless the file was opened with OMRX_OPEN_MMAP, in
+// which case it is borrowed (see omrx_release_attr_data()).  The _into
+// variants copy the data into a buffer supplied by the caller instead (see
+// omrx_get_attr_raw_into()).
+
+static omrx_status_t set_attr_scalar(omrx_chunk_t chunk, uint16_t id, uint16_t dtype, const char *type_name, const void *value) {
     if (!chunk) return OMRX_STATUS_NO_OBJECT;
 
     omrx_t omrx = chunk->omrx;
     omrx_attr_t attr = NULL;
+    uint32_t size = OMRX_GET_ELEMSIZE(dtype);
 
     CHECK_ERR(find_attr(chunk, id, &attr));
     if (!attr) {
-        attr = new_attr(chunk, id, OMRX_DTYPE_U32, 4, -1);
+        attr = new_attr(chunk, id, dtype, size, -1);
         CHECK_ALLOC(omrx, attr);
         CHECK_ERR(chunk_add_attr(chunk, attr));
     }
-    if (attr->datatype != OMRX_DTYPE_U32) {
-        return omrx_error(omrx, OMRX_ERR_WRONG_DTYPE, "Attempt to set uint32 value for non-uint32 attribute %s:%04x (type=%04x).", chunk->tag, id, attr->datatype);
+    if (attr->datatype != dtype) {
+        return omrx_error(omrx, OMRX_ERR_WRONG_DTYPE, "Attempt to set %s value for non-%s attribute %s:%04x (type=%04x).", type_name, type_name, chunk->tag, id, attr->datatype);
     }
-    if (!attr->data) {
-        attr->data = omrx->alloc(omrx, 4);
+    // If we've got a cached copy of the old value, we can reuse it, but it's
+    // no longer just a copy of the file data.
+    cache_unlink(attr);
+    if (!attr->data || !attr->own_data) {
+        drop_attr_data(attr);
+        attr->data = omrx->alloc(omrx, size);
         CHECK_ALLOC(omrx, attr->data);
+        attr->own_data = true;
     }
-    *((uint32_t *)attr->data) = value;
+    memcpy(attr->data, value, size);
 
     return API_RESULT(omrx, OMRX_OK);
 }
 
-omrx_status_t omrx_get_attr_uint32(omrx_chunk_t chunk, uint16_t id, uint32_t *dest) {
+static omrx_status_t get_attr_scalar(omrx_chunk_t chunk, uint16_t id, uint16_t dtype, const char *type_name, void *dest) {
     if (!chunk) return OMRX_STATUS_NO_OBJECT;
 
     omrx_t omrx = chunk->omrx;
     omrx_attr_t attr = NULL;
+    uint32_t size = OMRX_GET_ELEMSIZE(dtype);
 
     CHECK_ERR(find_attr(chunk, id, &attr));
     if (!attr) {
-        *dest = 0;
+        memset(dest, 0, size);
         return API_RESULT(omrx, OMRX_STATUS_NOT_FOUND);
     }
-    if (attr->datatype != OMRX_DTYPE_U32) {
-        return omrx_error(omrx, OMRX_ERR_WRONG_DTYPE, "Attempt to get uint32 value of non-uint32 attribute %s:%04x (type=%04x).", chunk->tag, id, attr->datatype);
-    }
-    if (!attr->data) {
-        CHECK_ERR(load_attr_data(attr, &attr->data));
+    if (attr->datatype != dtype) {
+        return omrx_error(omrx, OMRX_ERR_WRONG_DTYPE, "Attempt to get %s value of non-%s attribute %s:%04x (type=%04x).", type_name, type_name, chunk->tag, id, attr->datatype);
     }
-    *dest = *((uint32_t *)attr->data);
+    CHECK_ERR(cache_attr_data(attr));
+    CHECK_ERR(read_attr_into(attr, 0, size, dest));
 
     return API_RESULT(omrx, OMRX_OK);
 }
 
-omrx_status_t omrx_set_attr_float32_array(omrx_chunk_t chunk, uint16_t id, omrx_ownership_t own, uint16_t cols, uint32_t rows, float *data) {
+static omrx_status_t set_attr_array(omrx_chunk_t chunk, uint16_t id, uint16_t dtype, const char *type_name, omrx_ownership_t own, uint16_t cols, uint32_t rows, void *data) {
     if (!chunk) return OMRX_STATUS_NO_OBJECT;
 
     omrx_t omrx = chunk->omrx;
     omrx_attr_t attr = NULL;
+    uint64_t size = (uint64_t)OMRX_GET_ELEMSIZE(dtype) * rows * cols;
 
+    if (size > UINT32_MAX - 2) {
+        return omrx_error(omrx, OMRX_ERR_TOO_LARGE, "%04x: Attribute data is too large", id);
+    }
     CHECK_ERR(find_attr(chunk, id, &attr));
     if (!attr) {
-        attr = new_attr(chunk, id, OMRX_DTYPE_F32_ARRAY, 0, -1);
+        attr = new_attr(chunk, id, dtype, 0, -1);
         CHECK_ALLOC(omrx, attr);
         CHECK_ERR(chunk_add_attr(chunk, attr));
     }
-    if (attr->datatype != OMRX_DTYPE_F32_ARRAY) {
-        return omrx_error(omrx, OMRX_ERR_WRONG_DTYPE, "Attempt to set float-array value for non-float-array attribute %s:%04x (type=%04x).", chunk->tag, id, attr->datatype);
-    }
-    if (attr->data) {
-        omrx->free(omrx, attr->data);
+    if (attr->datatype != dtype) {
+        return omrx_error(omrx, OMRX_ERR_WRONG_DTYPE, "Attempt to set %s-array value for non-%s-array attribute %s:%04x (type=%04x).", type_name, type_name, chunk->tag, id, attr->datatype);
     }
-    attr->size = 4 * rows * cols;
+    drop_attr_data(attr);
+    attr->size = size;
     attr->cols = cols;
     if (own == OMRX_COPY) {
         attr->data = omrx->alloc(omrx, attr->size);
@@ -1530,11 +7656,12 @@ omrx_status_t omrx_set_attr_float32_array(omrx_chunk_t chunk, uint16_t id, omrx_
     } else {
         attr->data = data;
     }
+    attr->own_data = (own != OMRX_REF);
 
     return API_RESULT(omrx, OMRX_OK);
 }
 
-omrx_status_t omrx_get_attr_float32_array(omrx_chunk_t chunk, uint16_t id, uint16_t *cols, uint32_t *rows, float **data) {
+static omrx_status_t get_attr_array(omrx_chunk_t chunk, uint16_t id, uint16_t dtype, const char *type_name, uint16_t *cols, uint32_t *rows, void **data) {
     *data = NULL;
     if (cols) {
         *cols = 0;
@@ -1551,28 +7678,498 @@ omrx_status_t omrx_get_attr_float32_array(omrx_chunk_t chunk, uint16_t id, uint1
     if (!attr) {
         return API_RESULT(omrx, OMRX_STATUS_NOT_FOUND);
     }
-    if (attr->datatype != OMRX_DTYPE_F32_ARRAY) {
-        return omrx_error(omrx, OMRX_ERR_WRONG_DTYPE, "Attempt to get float32-array value of non-float32-array attribute %s:%04x (type=%04x).", chunk->tag, id, attr->datatype);
+    if (attr->datatype != dtype) {
+        return omrx_error(omrx, OMRX_ERR_WRONG_DTYPE, "Attempt to get %s-array value of non-%s-array attribute %s:%04x (type=%04x).", type_name, type_name, chunk->tag, id, attr->datatype);
+    }
+    if (omrx->open_flags & OMRX_OPEN_MMAP) {
+        CHECK_ERR(borrow_attr_data(attr, data));
+    } else {
+        CHECK_ERR(cache_attr_data(attr));
+        CHECK_ERR(load_attr_data(attr, data));
     }
-    CHECK_ERR(load_attr_data(attr, (void **)data));
     if (cols) {
         *cols = attr->cols;
     }
     if (rows) {
-        *rows = (attr->size / attr->cols) / 4;
+        *rows = (attr->size / attr->cols) / OMRX_GET_ELEMSIZE(dtype);
+    }
+
+    return API_RESULT(omrx, OMRX_OK);
+}
+
+#define DEFINE_SCALAR_ACCESSORS(name, ctype, dtype) \
+    omrx_status_t omrx_set_attr_##name(omrx_chunk_t chunk, uint16_t id, ctype value) { \
+        return set_attr_scalar(chunk, id, dtype, #name, &value); \
+    } \
+    omrx_status_t omrx_get_attr_##name(omrx_chunk_t chunk, uint16_t id, ctype *dest) { \
+        return get_attr_scalar(chunk, id, dtype, #name, dest); \
+    }
+
+#define DEFINE_ARRAY_ACCESSORS(name, ctype, dtype) \
+    omrx_status_t omrx_set_attr_##name##_array(omrx_chunk_t chunk, uint16_t id, omrx_ownership_t own, uint16_t cols, uint32_t rows, ctype *data) { \
+        return set_attr_array(chunk, id, dtype, #name, own, cols, rows, data); \
+    } \
+    omrx_status_t omrx_get_attr_##name##_array(omrx_chunk_t chunk, uint16_t id, uint16_t *cols, uint32_t *rows, ctype **data) { \
+        return get_attr_array(chunk, id, dtype, #name, cols, rows, (void **)data); \
+    } \
+    omrx_status_t omrx_get_attr_##name##_array_into(omrx_chunk_t chunk, uint16_t id, ctype *buf, size_t buf_size, uint16_t *cols, uint32_t *rows) { \
+        return get_array_rows_into(chunk, id, dtype, 0, UINT32_MAX, buf, buf_size, cols, rows); \
+    }
+
+#define DEFINE_TYPED_ACCESSORS(name, ctype, dtype) \
+    DEFINE_SCALAR_ACCESSORS(name, ctype, dtype) \
+    DEFINE_ARRAY_ACCESSORS(name, ctype, dtype ## _ARRAY)
+
+/** @fn omrx_status_t omrx_get_attr_float32_array_into(omrx_chunk_t chunk, uint16_t id, float *buf, size_t buf_size, uint16_t *cols, uint32_t *rows)
+  * @brief Read a float32 array attribute into a caller-supplied buffer
+  *
+  * Like omrx_get_attr_float32_array(), but the data is copied into `buf`
+  * instead of a newly allocated (or borrowed) buffer.  The
+  * omrx_get_attr_<type>_array_into() functions for the other array types work
+  * the same way.
+  *
+  * @param[in] chunk     The chunk containing the attribute
+  * @param[in] id        The attribute ID
+  * @param[out] buf      The buffer to read the data into
+  * @param[in] buf_size  The size of `buf`, in bytes
+  * @param[out] cols     The number of columns (may be `NULL`)
+  * @param[out] rows     The number of rows (may be `NULL`).  `cols` and `rows`
+  *                      are set even if `buf` is too small.
+  *
+  * @retval ::OMRX_OK               Data read successfully
+  * @retval ::OMRX_STATUS_NOT_FOUND The attribute does not exist
+  * @retval ::OMRX_ERR_WRONG_DTYPE  The attribute is not a float32 array
+  * @retval ::OMRX_ERR_TOO_SMALL    `buf` is too small (nothing was read)
+  */
+
+DEFINE_TYPED_ACCESSORS(uint8,   uint8_t,  OMRX_DTYPE_U8)
+DEFINE_TYPED_ACCESSORS(int8,    int8_t,   OMRX_DTYPE_S8)
+DEFINE_TYPED_ACCESSORS(uint16,  uint16_t, OMRX_DTYPE_U16)
+DEFINE_TYPED_ACCESSORS(int16,   int16_t,  OMRX_DTYPE_S16)
+DEFINE_TYPED_ACCESSORS(uint32,  uint32_t, OMRX_DTYPE_U32)
+DEFINE_TYPED_ACCESSORS(int32,   int32_t,  OMRX_DTYPE_S32)
+DEFINE_TYPED_ACCESSORS(float32, float,    OMRX_DTYPE_F32)
+DEFINE_TYPED_ACCESSORS(uint64,  uint64_t, OMRX_DTYPE_U64)
+DEFINE_TYPED_ACCESSORS(int64,   int64_t,  OMRX_DTYPE_S64)
+DEFINE_TYPED_ACCESSORS(float64, double,   OMRX_DTYPE_F64)
+
+/** @brief Get any numeric array attribute, converted to float32
+  *
+  * Works like omrx_get_attr_float32_array(), but accepts an array attribute
+  * of any numeric element type (8/16/32/64-bit integers, float32 or float64),
+  * converting each element to float32.  Conversions from types which can't
+  * be represented exactly (large integers, float64) round to the nearest
+  * float32 value.
+  *
+  * The returned data is always a new buffer, which must be freed by the
+  * caller.
+  *
+  * @param[in] chunk  The chunk containing the attribute
+  * @param[in] id     The attribute ID
+  * @param[out] cols  The number of columns (may be `NULL`)
+  * @param[out] rows  The number of rows (may be `NULL`)
+  * @param[out] data  The converted data
+  *
+  * @retval ::OMRX_OK               Data returned successfully
+  * @retval ::OMRX_STATUS_NOT_FOUND The attribute does not exist
+  * @retval ::OMRX_ERR_WRONG_DTYPE  The attribute is not an array of one of
+  *                                 the numeric types listed above
+  */
+omrx_status_t omrx_get_attr_array_as_float32(omrx_chunk_t chunk, uint16_t id, uint16_t *cols, uint32_t *rows, float **data) {
+    return get_attr_array_converted(chunk, id, 4, cols, rows, NULL, 0, (void **)data);
+}
+
+/** @brief Get any numeric array attribute, converted to float64
+  *
+  * The same as omrx_get_attr_array_as_float32(), but converts to float64.
+  */
+omrx_status_t omrx_get_attr_array_as_float64(omrx_chunk_t chunk, uint16_t id, uint16_t *cols, uint32_t *rows, double **data) {
+    return get_attr_array_converted(chunk, id, 8, cols, rows, NULL, 0, (void **)data);
+}
+
+/** @brief Read any numeric array attribute into a caller-supplied float32 buffer
+  *
+  * Like omrx_get_attr_array_as_float32(), but the converted data is written
+  * into `buf` (which must be at least `cols * rows * 4` bytes) instead of a
+  * newly allocated buffer.
+  *
+  * @retval ::OMRX_OK               Data read successfully
+  * @retval ::OMRX_STATUS_NOT_FOUND The attribute does not exist
+  * @retval ::OMRX_ERR_WRONG_DTYPE  The attribute is not a numeric array
+  * @retval ::OMRX_ERR_TOO_SMALL    `buf` is too small (nothing was read)
+  */
+omrx_status_t omrx_get_attr_array_as_float32_into(omrx_chunk_t chunk, uint16_t id, float *buf, size_t buf_size, uint16_t *cols, uint32_t *rows) {
+    return get_attr_array_converted(chunk, id, 4, cols, rows, buf, buf_size, NULL);
+}
+
+/** @brief Read any numeric array attribute into a caller-supplied float64 buffer
+  *
+  * The same as omrx_get_attr_array_as_float32_into(), but converts to
+  * float64.
+  */
+omrx_status_t omrx_get_attr_array_as_float64_into(omrx_chunk_t chunk, uint16_t id, double *buf, size_t buf_size, uint16_t *cols, uint32_t *rows) {
+    return get_attr_array_converted(chunk, id, 8, cols, rows, buf, buf_size, NULL);
+}
+
+/** @brief Get a range of rows from an array attribute
+  *
+  * Works like omrx_get_attr_float32_array(), but only retrieves up to
+  * `row_count` rows, starting at row `start_row`, and works with any array
+  * datatype (the data is returned in its raw form, as `cols` elements per row
+  * of the attribute's element type).  Only the requested part of the
+  * attribute is read from the file.
+  *
+  * If the requested range extends past the end of the array, only the rows
+  * up to the end are returned (and `rows` is set accordingly).
+  *
+  * As with omrx_get_attr_float32_array(), the returned data must be freed by
+  * the caller, unless the file was opened with ::OMRX_OPEN_MMAP, in which case
+  * it is a borrowed pointer into the attribute data (see ::OMRX_REF).  If no
+  * rows are returned, `data` is set to `NULL`.
+  *
+  * @param[in] chunk      The chunk containing the attribute
+  * @param[in] id         The attribute ID
+  * @param[in] start_row  The first row to return
+  * @param[in] row_count  The (maximum) number of rows to return
+  * @param[out] cols      The number of columns in each row (may be `NULL`)
+  * @param[out] rows      The number of rows returned (may be `NULL`)
+  * @param[out] data      The returned data
+  *
+  * @retval ::OMRX_OK               Data returned successfully
+  * @retval ::OMRX_STATUS_NOT_FOUND The attribute does not exist, or
+  *                                 `start_row` is past the end of the array
+  * @retval ::OMRX_ERR_WRONG_DTYPE  The attribute is not an array
+  */
+omrx_status_t omrx_get_attr_array_rows(omrx_chunk_t chunk, uint16_t id, uint32_t start_row, uint32_t row_count, uint16_t *cols, uint32_t *rows, void **data) {
+    *data = NULL;
+    if (cols) {
+        *cols = 0;
+    }
+    if (rows) {
+        *rows = 0;
+    }
+    if (!chunk) return OMRX_STATUS_NO_OBJECT;
+
+    omrx_t omrx = chunk->omrx;
+    omrx_attr_t attr = NULL;
+    uint64_t offset;
+    size_t size;
+    void *ptr;
+
+    CHECK_OK(find_array_rows(chunk, id, 0, start_row, &row_count, &attr, &offset, &size));
+    if (cols) {
+        *cols = attr->cols;
+    }
+    if (!row_count) {
+        return API_RESULT(omrx, OMRX_OK);
+    }
+    if (omrx->open_flags & OMRX_OPEN_MMAP) {
+        CHECK_ERR(borrow_attr_data(attr, &ptr));
+        *data = (uint8_t *)ptr + offset;
+    } else {
+        CHECK_ERR(load_attr_range(attr, offset, size, data));
+    }
+    if (rows) {
+        *rows = row_count;
+    }
+
+    return API_RESULT(omrx, OMRX_OK);
+}
+
+/** @brief Get a range of rows from a float32 array attribute
+  *
+  * This is the same as omrx_get_attr_array_rows(), but checks that the
+  * attribute is a float32 array.
+  *
+  * @see omrx_get_attr_array_rows()
+  */
+omrx_status_t omrx_get_attr_float32_array_rows(omrx_chunk_t chunk, uint16_t id, uint32_t start_row, uint32_t row_count, uint16_t *cols, uint32_t *rows, float **data) {
+    *data = NULL;
+    if (!chunk) return OMRX_STATUS_NO_OBJECT;
+
+    omrx_t omrx = chunk->omrx;
+    omrx_attr_t attr = NULL;
+
+    CHECK_ERR(find_attr(chunk, id, &attr));
+    if (attr && attr->datatype != OMRX_DTYPE_F32_ARRAY) {
+        return omrx_error(omrx, OMRX_ERR_WRONG_DTYPE, "Attempt to get float32-array value of non-float32-array attribute %s:%04x (type=%04x).", chunk->tag, id, attr->datatype);
+    }
+
+    return omrx_get_attr_array_rows(chunk, id, start_row, row_count, cols, rows, (void **)data);
+}
+
+/** @brief Read an attribute's raw data into a caller-supplied buffer
+  *
+  * Like omrx_get_attr_raw(), but instead of allocating a new buffer, the data
+  * is copied into `buf`, which must be at least as large as the attribute
+  * data.  (The same applies to all the other `_into` functions: they never
+  * allocate memory for the data, so a buffer can be reused for many reads.)
+  *
+  * @param[in] chunk     The chunk containing the attribute
+  * @param[in] id        The attribute ID
+  * @param[out] buf      The buffer to read the data into
+  * @param[in] buf_size  The size of `buf`, in bytes
+  * @param[out] size     The size of the attribute data (may be `NULL`).  This
+  *                      is set even if `buf` is too small, so the caller can
+  *                      find out how big a buffer is needed.
+  *
+  * @retval ::OMRX_OK               Data read successfully
+  * @retval ::OMRX_STATUS_NOT_FOUND The attribute does not exist
+  * @retval ::OMRX_ERR_TOO_SMALL    `buf` is too small (nothing was read)
+  */
+omrx_status_t omrx_get_attr_raw_into(omrx_chunk_t chunk, uint16_t id, void *buf, size_t buf_size, size_t *size) {
+    if (size) {
+        *size = 0;
+    }
+    if (!chunk) return OMRX_STATUS_NO_OBJECT;
+
+    omrx_t omrx = chunk->omrx;
+    omrx_attr_t attr = NULL;
+
+    CHECK_ERR(find_attr(chunk, id, &attr));
+    if (!attr) {
+        return API_RESULT(omrx, OMRX_STATUS_NOT_FOUND);
     }
+    if (size) {
+        *size = attr->size;
+    }
+    if (buf_size < attr->size) {
+        return omrx_error(omrx, OMRX_ERR_TOO_SMALL, "Buffer too small for attribute %s:%04x (%zu bytes needed).", chunk->tag, id, (size_t)attr->size);
+    }
+    CHECK_ERR(read_attr_into(attr, 0, attr->size, buf));
+
+    return API_RESULT(omrx, OMRX_OK);
+}
+
+/** @brief Read a string attribute into a caller-supplied buffer
+  *
+  * Like omrx_get_attr_str(), but the string (including its terminating NUL
+  * byte) is copied into `buf` instead of a newly allocated buffer.
+  *
+  * @param[in] chunk     The chunk containing the attribute
+  * @param[in] id        The attribute ID
+  * @param[out] buf      The buffer to read the string into
+  * @param[in] buf_size  The size of `buf`, in bytes
+  *
+  * @retval ::OMRX_OK               String read successfully
+  * @retval ::OMRX_STATUS_NOT_FOUND The attribute does not exist
+  * @retval ::OMRX_ERR_WRONG_DTYPE  The attribute is not a string
+  * @retval ::OMRX_ERR_TOO_SMALL    `buf` is too small (nothing was read)
+  */
+omrx_status_t omrx_get_attr_str_into(omrx_chunk_t chunk, uint16_t id, char *buf, size_t buf_size) {
+    if (!chunk) return OMRX_STATUS_NO_OBJECT;
+
+    omrx_t omrx = chunk->omrx;
+    omrx_attr_t attr = NULL;
+
+    CHECK_ERR(find_attr(chunk, id, &attr));
+    if (!attr) {
+        return API_RESULT(omrx, OMRX_STATUS_NOT_FOUND);
+    }
+    if (attr->datatype != OMRX_DTYPE_UTF8) {
+        return omrx_error(omrx, OMRX_ERR_WRONG_DTYPE, "Attempt to get string value of non-string attribute %s:%04x (type=%04x).", chunk->tag, id, attr->datatype);
+    }
+    if (buf_size < (size_t)attr->size + 1) {
+        return omrx_error(omrx, OMRX_ERR_TOO_SMALL, "Buffer too small for attribute %s:%04x (%zu bytes needed).", chunk->tag, id, (size_t)attr->size + 1);
+    }
+    CHECK_ERR(read_attr_into(attr, 0, attr->size, buf));
+    buf[attr->size] = 0;
 
     return API_RESULT(omrx, OMRX_OK);
 }
 
+/** @brief Read a range of rows from an array attribute into a caller-supplied buffer
+  *
+  * Like omrx_get_attr_array_rows(), but the data is copied into `buf` instead
+  * of a newly allocated (or borrowed) buffer.  `buf` only needs to be large
+  * enough for the rows which are actually returned.
+  *
+  * @param[in] chunk      The chunk containing the attribute
+  * @param[in] id         The attribute ID
+  * @param[in] start_row  The first row to return
+  * @param[in] row_count  The (maximum) number of rows to return
+  * @param[out] buf       The buffer to read the data into
+  * @param[in] buf_size   The size of `buf`, in bytes
+  * @param[out] cols      The number of columns in each row (may be `NULL`)
+  * @param[out] rows      The number of rows returned (may be `NULL`).  `cols`
+  *                       and `rows` are set even if `buf` is too small.
+  *
+  * @retval ::OMRX_OK               Data read successfully
+  * @retval ::OMRX_STATUS_NOT_FOUND The attribute does not exist, or
+  *                                 `start_row` is past the end of the array
+  * @retval ::OMRX_ERR_WRONG_DTYPE  The attribute is not an array
+  * @retval ::OMRX_ERR_TOO_SMALL    `buf` is too small (nothing was read)
+  */
+omrx_status_t omrx_get_attr_array_rows_into(omrx_chunk_t chunk, uint16_t id, uint32_t start_row, uint32_t row_count, void *buf, size_t buf_size, uint16_t *cols, uint32_t *rows) {
+    return get_array_rows_into(chunk, id, 0, start_row, row_count, buf, buf_size, cols, rows);
+}
+
+/** @brief Read a range of rows from a float32 array attribute into a caller-supplied buffer
+  *
+  * This is the same as omrx_get_attr_array_rows_into(), but checks that the
+  * attribute is a float32 array.
+  *
+  * @see omrx_get_attr_array_rows_into()
+  */
+omrx_status_t omrx_get_attr_float32_array_rows_into(omrx_chunk_t chunk, uint16_t id, uint32_t start_row, uint32_t row_count, float *buf, size_t buf_size, uint16_t *cols, uint32_t *rows) {
+    return get_array_rows_into(chunk, id, OMRX_DTYPE_F32_ARRAY, start_row, row_count, buf, buf_size, cols, rows);
+}
+
+/** @brief Release any in-memory copy of an attribute's data
+  *
+  * Attribute data read from the file may be kept in the instance's attribute
+  * cache (see omrx_set_cache_limit()), so that it can be returned again
+  * quickly.  This explicitly discards the cached copy for the given attribute
+  * (it will be read from the file again if it is needed later).
+  *
+  * This also releases data which has been handed out as a borrowed pointer
+  * (for example by omrx_get_attr_float32_array() when the file was opened
+  * with ::OMRX_OPEN_MMAP).  Such data is never evicted from the cache
+  * automatically, so the application should call this function once it has
+  * finished with the pointer.  Any borrowed pointers to the attribute data
+  * are invalid after this call.
+  *
+  * Data which has been set or modified by the application (and not yet
+  * written out) is never discarded.
+  *
+  * @param[in] chunk  The chunk containing the attribute
+  * @param[in] id     The attribute ID
+  *
+  * @retval ::OMRX_OK               Data released (or was not in memory)
+  * @retval ::OMRX_STATUS_NOT_FOUND The attribute does not exist, or its data
+  *                                 has been set locally and cannot be
+  *                                 released
+  */
 omrx_status_t omrx_release_attr_data(omrx_chunk_t chunk, uint16_t id) {
     if (!chunk) return OMRX_STATUS_NO_OBJECT;
 
     omrx_t omrx = chunk->omrx;
-    //FIXME: implement this
+    omrx_attr_t attr = NULL;
+    omrx_status_t status;
+
+    CHECK_ERR(find_attr(chunk, id, &attr));
+    if (!attr) {
+        return API_RESULT(omrx, OMRX_STATUS_NOT_FOUND);
+    }
+    if (omrx->open_flags & OMRX_OPEN_CONCURRENT) {
+        pthread_mutex_lock(&omrx->attr_lock);
+        status = release_attr_data(attr);
+        pthread_mutex_unlock(&omrx->attr_lock);
+    } else {
+        status = release_attr_data(attr);
+    }
+
+    return API_RESULT(omrx, status);
+}
+
+/** @brief Get a shared reference to an attribute's data
+  *
+  * Unlike the other attribute getters, which each return a separate copy of
+  * the data, this returns a handle to a reference-counted buffer which is
+  * shared between all callers asking for the same attribute.  The data is only
+  * read (or copied) once for all the callers using it at the same time, and
+  * stays valid for as long as the caller holds its reference, even if the
+  * attribute is later modified, deleted, evicted from the attribute cache, or
+  * the OMRX instance is freed.  The buffer contents must not be modified.
+  *
+  * @note The attribute keeps its own reference to the buffer in the attribute
+  * cache, which is held for as long as any caller still has one, whatever the
+  * cache limit.  Once they have all been released, the buffer is discarded
+  * like any other cached data (see omrx_set_cache_limit()), which with the
+  * cache off (the default) happens the next time the cache is trimmed, so a
+  * later call may read the data again.
+  *
+  * Use omrx_buffer_data() and omrx_buffer_size() to access the data (which is
+  * in the same form as returned by omrx_get_attr_raw(); string data is always
+  * followed by a NUL byte), and omrx_buffer_release() to release the
+  * reference when done.  Additional references can be taken with
+  * omrx_buffer_retain(), for example to hand the data to several threads.
+  *
+  * @param[in] chunk    The chunk containing the attribute
+  * @param[in] id       The attribute ID
+  * @param[out] result  A new reference to the shared buffer (`NULL` if the
+  *                     attribute does not exist)
+  *
+  * @retval ::OMRX_OK               Buffer returned successfully
+  * @retval ::OMRX_STATUS_NOT_FOUND The attribute does not exist
+  * @retval ::OMRX_ERR_ALLOC        The buffer could not be allocated
+  */
+omrx_status_t omrx_get_attr_buffer(omrx_chunk_t chunk, uint16_t id, omrx_buffer_t *result) {
+    *result = NULL;
+    if (!chunk) return OMRX_STATUS_NO_OBJECT;
+
+    omrx_t omrx = chunk->omrx;
+    omrx_attr_t attr = NULL;
+
+    CHECK_ERR(find_attr(chunk, id, &attr));
+    if (!attr) {
+        return API_RESULT(omrx, OMRX_STATUS_NOT_FOUND);
+    }
+    CHECK_ERR(share_attr_data(attr, result));
+
     return API_RESULT(omrx, OMRX_OK);
 }
 
+/** @brief Return a pointer to the data in a shared attribute buffer
+  *
+  * The pointer remains valid until the caller's reference to the buffer is
+  * released.
+  *
+  * @param[in] buf  The buffer (from omrx_get_attr_buffer())
+  *
+  * @returns A read-only pointer to the attribute data
+  */
+const void *omrx_buffer_data(omrx_buffer_t buf) {
+    return buf->data;
+}
+
+/** @brief Return the size (in bytes) of the data in a shared attribute buffer
+  *
+  * @param[in] buf  The buffer (from omrx_get_attr_buffer())
+  *
+  * @returns The size of the attribute data
+  */
+size_t omrx_buffer_size(omrx_buffer_t buf) {
+    return buf->size;
+}
+
+/** @brief Take an additional reference to a shared attribute buffer
+  *
+  * Each call to this function must be balanced by a call to
+  * omrx_buffer_release().  This (and omrx_buffer_release()) may be called from
+  * any thread, at any time.
+  *
+  * @param[in] buf  The buffer
+  *
+  * @returns `buf` (for convenience)
+  */
+omrx_buffer_t omrx_buffer_retain(omrx_buffer_t buf) {
+    __atomic_add_fetch(&buf->refcount, 1, __ATOMIC_RELAXED);
+    return buf;
+}
+
+/** @brief Release a reference to a shared attribute buffer
+  *
+  * When the last reference is released, the buffer is freed.  This uses the
+  * free function of the instance the buffer came from, even if the instance
+  * has been freed in the meantime (in which case the free function is still
+  * passed the instance handle, but only omrx_user_data() may be used with
+  * it).
+  *
+  * @param[in] buf  The buffer (may be `NULL`, in which case nothing is done)
+  */
+void omrx_buffer_release(omrx_buffer_t buf) {
+    if (!buf) {
+        return;
+    }
+    omrx_t omrx = buf->omrx;
+
+    if (__atomic_sub_fetch(&buf->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        omrx->free(omrx, buf);
+        put_instance(omrx);
+    }
+}
+
 omrx_status_t omrx_del_attr(omrx_chunk_t chunk, uint16_t id) {
     if (!chunk) return OMRX_STATUS_NO_OBJECT;
 
@@ -0,0 +1,479 @@
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#ifdef OMRX_HAVE_IO_URING
+  #include <linux/io_uring.h>
+  #ifdef IORING_FEAT_RW_CUR_POS
+    // (IORING_OP_READ arrived at the same time as this)
+    #define OMRX_ASYNC_URING 1
+    #include <sys/mman.h>
+    #include <sys/syscall.h>
+  #endif
+#endif
+
+#include "omrx.h"
+#include "omrx_internal.h"
+
+/** @cond internal
+  */
+
+// Background execution of asynchronous operations (used by
+// omrx_fetch_submit()).  Unlike the worker pool (omrx_workers.c), nothing
+// here waits for the operations it's given: they are queued, and each one's
+// function is called in one of a small set of background threads once it's
+// ready to run, while the submitting thread carries on with something else.
+//
+// An operation can also ask for some data to be read from a file first (with
+// omrx_async_read()).  On Linux, where possible, those reads are handed to the
+// kernel through an io_uring, so any number of them can be outstanding at
+// once without tying up a thread each; one extra thread waits for them to
+// complete and passes the operations on to the others.  Otherwise (or if the
+// ring is full), the background thread which picks up the operation just does
+// the read itself with pread() before calling its function.
+
+struct omrx_async {
+    omrx_t omrx;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t idle_cond;
+    struct omrx_async_op *head;
+    struct omrx_async_op *tail;
+    size_t active;
+    bool shutdown;
+    pthread_t *threads;
+    unsigned int nthreads;
+#ifdef OMRX_ASYNC_URING
+    bool have_ring;
+    int ring_fd;
+    void *ring_map;
+    size_t ring_map_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned int entries;
+    unsigned int inflight;
+    unsigned int queued;
+    pthread_t reaper;
+#endif
+};
+
+static void *async_main(void *arg);
+static void queue_op(omrx_async_t async, struct omrx_async_op *op);
+static void read_op(struct omrx_async_op *op);
+
+#ifdef OMRX_ASYNC_URING
+static bool ring_init(omrx_async_t async);
+static void ring_free(omrx_async_t async);
+static bool ring_queue(omrx_async_t async, struct omrx_async_op *op);
+static bool ring_flush(omrx_async_t async);
+static void *ring_main(void *arg);
+#endif
+
+// Create the background threads (and io_uring, if possible).  Returns NULL if
+// they couldn't be set up.
+omrx_async_t omrx_async_new(omrx_t omrx, unsigned int nthreads) {
+    omrx_async_t async;
+    unsigned int i;
+
+    async = omrx->alloc(omrx, sizeof(struct omrx_async));
+    if (!async) return NULL;
+    memset(async, 0, sizeof(struct omrx_async));
+    async->omrx = omrx;
+    async->threads = omrx->alloc(omrx, nthreads * sizeof(pthread_t));
+    if (!async->threads) {
+        omrx->free(omrx, async);
+        return NULL;
+    }
+    pthread_mutex_init(&async->lock, NULL);
+    pthread_cond_init(&async->work_cond, NULL);
+    pthread_cond_init(&async->idle_cond, NULL);
+    for (i = 0; i < nthreads; i++) {
+        if (pthread_create(&async->threads[i], NULL, async_main, async)) {
+            break;
+        }
+    }
+    async->nthreads = i;
+    if (!i) {
+        omrx_async_free(async);
+        return NULL;
+    }
+#ifdef OMRX_ASYNC_URING
+    async->have_ring = ring_init(async);
+#endif
+
+    return async;
+}
+
+// Wait for everything which has been queued to finish, then shut down the
+// background threads and free everything.
+void omrx_async_free(omrx_async_t async) {
+    omrx_t omrx = async->omrx;
+    unsigned int i;
+
+    omrx_async_drain(async);
+#ifdef OMRX_ASYNC_URING
+    if (async->have_ring) {
+        ring_free(async);
+    }
+#endif
+    pthread_mutex_lock(&async->lock);
+    async->shutdown = true;
+    pthread_cond_broadcast(&async->work_cond);
+    pthread_mutex_unlock(&async->lock);
+    for (i = 0; i < async->nthreads; i++) {
+        pthread_join(async->threads[i], NULL);
+    }
+    pthread_mutex_destroy(&async->lock);
+    pthread_cond_destroy(&async->work_cond);
+    pthread_cond_destroy(&async->idle_cond);
+    omrx->free(omrx, async->threads);
+    omrx->free(omrx, async);
+}
+
+// Wait until every operation which has been queued has finished (its
+// function has returned).  Any reads not yet submitted are started first.
+void omrx_async_drain(omrx_async_t async) {
+    pthread_mutex_lock(&async->lock);
+#ifdef OMRX_ASYNC_URING
+    if (async->have_ring) {
+        ring_flush(async);
+    }
+#endif
+    while (async->active) {
+        pthread_cond_wait(&async->idle_cond, &async->lock);
+    }
+    pthread_mutex_unlock(&async->lock);
+}
+
+// Call op->func(op) in a background thread.
+void omrx_async_run(omrx_async_t async, struct omrx_async_op *op) {
+    op->size = 0;
+    op->done = 0;
+    op->err = 0;
+    pthread_mutex_lock(&async->lock);
+    async->active++;
+    queue_op(async, op);
+    pthread_mutex_unlock(&async->lock);
+}
+
+// Read `size` bytes at `pos` in the file `fd` into `buf`, and then call
+// op->func(op) in a background thread.  On return from the read, op->err is 0
+// or an errno value, and op->done is the number of bytes read (less than
+// `size` if the end of the file was reached).  Reads which go through the
+// io_uring aren't handed to the kernel until omrx_async_submit() is called,
+// so that a whole batch of them only needs one system call.
+void omrx_async_read(omrx_async_t async, struct omrx_async_op *op, int fd, void *buf, size_t size, off_t pos) {
+    op->fd = fd;
+    op->buf = buf;
+    op->size = size;
+    op->pos = pos;
+    op->done = 0;
+    op->err = 0;
+    pthread_mutex_lock(&async->lock);
+    async->active++;
+#ifdef OMRX_ASYNC_URING
+    if (async->have_ring && ring_queue(async, op)) {
+        pthread_mutex_unlock(&async->lock);
+        return;
+    }
+#endif
+    queue_op(async, op);
+    pthread_mutex_unlock(&async->lock);
+}
+
+// Start all the reads queued by omrx_async_read() since the last call.
+void omrx_async_submit(omrx_async_t async) {
+#ifdef OMRX_ASYNC_URING
+    pthread_mutex_lock(&async->lock);
+    if (async->have_ring) {
+        ring_flush(async);
+    }
+    pthread_mutex_unlock(&async->lock);
+#else
+    (void)async;
+#endif
+}
+
+// Add an operation to the queue for the background threads (which must be
+// locked).
+static void queue_op(omrx_async_t async, struct omrx_async_op *op) {
+    op->next = NULL;
+    if (async->tail) {
+        async->tail->next = op;
+    } else {
+        async->head = op;
+    }
+    async->tail = op;
+    pthread_cond_signal(&async->work_cond);
+}
+
+static void *async_main(void *arg) {
+    omrx_async_t async = arg;
+    struct omrx_async_op *op;
+
+    pthread_mutex_lock(&async->lock);
+    for (;;) {
+        while (!async->shutdown && !async->head) {
+            pthread_cond_wait(&async->work_cond, &async->lock);
+        }
+        if (!async->head) break;
+        op = async->head;
+        async->head = op->next;
+        if (!async->head) {
+            async->tail = NULL;
+        }
+        pthread_mutex_unlock(&async->lock);
+        if (op->done < op->size && !op->err) {
+            read_op(op);
+        }
+        // (The function may free the op, so it can't be touched after this.)
+        op->func(op);
+        pthread_mutex_lock(&async->lock);
+        if (--async->active == 0) {
+            pthread_cond_broadcast(&async->idle_cond);
+        }
+    }
+    pthread_mutex_unlock(&async->lock);
+
+    return NULL;
+}
+
+// Do (the rest of) an operation's read the ordinary way
+static void read_op(struct omrx_async_op *op) {
+    ssize_t count;
+
+    while (op->done < op->size) {
+        count = pread(op->fd, op->buf + op->done, op->size - op->done, op->pos + op->done);
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            op->err = errno;
+            return;
+        }
+        if (count == 0) return;
+        op->done += count;
+    }
+}
+
+#ifdef OMRX_ASYNC_URING
+
+static int uring_setup(unsigned int entries, struct io_uring_params *params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+// Set up the io_uring and the thread which collects its completions.
+// Returns false if that's not possible (not supported by the kernel, not
+// permitted, etc), in which case reads are just done by the background
+// threads.
+static bool ring_init(omrx_async_t async) {
+    struct io_uring_params params;
+    size_t sq_size;
+    size_t cq_size;
+    uint8_t *map;
+    unsigned int needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_RW_CUR_POS;
+
+    memset(&params, 0, sizeof(params));
+    async->ring_fd = uring_setup(OMRX_ASYNC_RING_ENTRIES, &params);
+    if (async->ring_fd < 0) {
+        return false;
+    }
+    if ((params.features & needed) != needed) {
+        close(async->ring_fd);
+        return false;
+    }
+    sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    async->ring_map_size = sq_size > cq_size ? sq_size : cq_size;
+    async->ring_map = mmap(NULL, async->ring_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, async->ring_fd, IORING_OFF_SQ_RING);
+    if (async->ring_map == MAP_FAILED) {
+        close(async->ring_fd);
+        return false;
+    }
+    async->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    async->sqes = mmap(NULL, async->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, async->ring_fd, IORING_OFF_SQES);
+    if (async->sqes == MAP_FAILED) {
+        munmap(async->ring_map, async->ring_map_size);
+        close(async->ring_fd);
+        return false;
+    }
+    map = async->ring_map;
+    async->sq_tail = (unsigned int *)(map + params.sq_off.tail);
+    async->sq_mask = (unsigned int *)(map + params.sq_off.ring_mask);
+    async->sq_array = (unsigned int *)(map + params.sq_off.array);
+    async->cq_head = (unsigned int *)(map + params.cq_off.head);
+    async->cq_tail = (unsigned int *)(map + params.cq_off.tail);
+    async->cq_mask = (unsigned int *)(map + params.cq_off.ring_mask);
+    async->cqes = (struct io_uring_cqe *)(map + params.cq_off.cqes);
+    // The completion queue is at least as big as this, so it can never
+    // overflow.
+    async->entries = params.sq_entries;
+    if (pthread_create(&async->reaper, NULL, ring_main, async)) {
+        munmap(async->sqes, async->sqes_size);
+        munmap(async->ring_map, async->ring_map_size);
+        close(async->ring_fd);
+        return false;
+    }
+
+    return true;
+}
+
+// Stop the completion thread and free the ring.  Nothing may be in flight.
+static void ring_free(omrx_async_t async) {
+    pthread_mutex_lock(&async->lock);
+    // A no-op with no operation attached tells the completion thread to stop.
+    if (!ring_queue(async, NULL) || !ring_flush(async)) {
+        // (This shouldn't be possible, but if so, just leave it running.)
+        pthread_mutex_unlock(&async->lock);
+        return;
+    }
+    pthread_mutex_unlock(&async->lock);
+    pthread_join(async->reaper, NULL);
+    munmap(async->sqes, async->sqes_size);
+    munmap(async->ring_map, async->ring_map_size);
+    close(async->ring_fd);
+    async->have_ring = false;
+}
+
+// Add a read of the rest of the operation's data (or a no-op, if op is NULL)
+// to the ring's submission queue, to be handed to the kernel by ring_flush().
+// The async state must be locked.  Returns false if the ring is full, in
+// which case the caller has to deal with the operation some other way.
+static bool ring_queue(omrx_async_t async, struct omrx_async_op *op) {
+    struct io_uring_sqe *sqe;
+    unsigned int tail;
+    unsigned int index;
+
+    if (async->inflight + async->queued >= async->entries) {
+        return false;
+    }
+    // We're the only ones adding entries (and the kernel only looks at them
+    // when we call io_uring_enter()), so the tail can't move underneath us.
+    tail = *async->sq_tail;
+    index = tail & *async->sq_mask;
+    sqe = &async->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    if (op) {
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = op->fd;
+        sqe->addr = (uintptr_t)(op->buf + op->done);
+        sqe->len = op->size - op->done > UINT32_MAX / 2 ? UINT32_MAX / 2 : op->size - op->done;
+        sqe->off = op->pos + op->done;
+    } else {
+        sqe->opcode = IORING_OP_NOP;
+    }
+    sqe->user_data = (uintptr_t)op;
+    async->sq_array[index] = index;
+    __atomic_store_n(async->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    async->queued++;
+
+    return true;
+}
+
+// Hand everything added by ring_queue() to the kernel, with a single
+// io_uring_enter().  The async state must be locked.  Anything the kernel
+// didn't take is removed from the ring again and passed to the background
+// threads instead (which do the reads themselves), and false is returned.
+static bool ring_flush(omrx_async_t async) {
+    struct io_uring_sqe *sqe;
+    struct omrx_async_op *op;
+    unsigned int tail;
+    unsigned int i;
+    int rc;
+
+    if (!async->queued) {
+        return true;
+    }
+    do {
+        rc = uring_enter(async->ring_fd, async->queued, 0, 0);
+    } while (rc < 0 && errno == EINTR);
+    if (rc < 0) {
+        rc = 0;
+    }
+    async->inflight += rc;
+    if ((unsigned int)rc == async->queued) {
+        async->queued = 0;
+        return true;
+    }
+    // Entries are consumed in order, so the ones left over are the last ones
+    // added, and can just be taken back.
+    tail = *async->sq_tail - async->queued;
+    for (i = rc; i < async->queued; i++) {
+        sqe = &async->sqes[(tail + i) & *async->sq_mask];
+        op = (struct omrx_async_op *)(uintptr_t)sqe->user_data;
+        if (op) {
+            queue_op(async, op);
+        }
+    }
+    __atomic_store_n(async->sq_tail, tail + rc, __ATOMIC_RELEASE);
+    async->queued = 0;
+
+    return false;
+}
+
+// The completion thread.  This waits for reads submitted to the ring to
+// complete, and then passes their operations on to the background threads
+// (or resubmits them, if they only got part of the data).
+static void *ring_main(void *arg) {
+    omrx_async_t async = arg;
+    struct io_uring_cqe *cqe;
+    struct omrx_async_op *op;
+    unsigned int head;
+    unsigned int tail;
+    bool stop = false;
+
+    while (!stop) {
+        if (uring_enter(async->ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+            // Shouldn't happen, but don't spin.
+            usleep(1000);
+        }
+        head = *async->cq_head;
+        tail = __atomic_load_n(async->cq_tail, __ATOMIC_ACQUIRE);
+        pthread_mutex_lock(&async->lock);
+        for (; head != tail; head++) {
+            cqe = &async->cqes[head & *async->cq_mask];
+            op = (struct omrx_async_op *)(uintptr_t)cqe->user_data;
+            async->inflight--;
+            if (!op) {
+                stop = true;
+                continue;
+            }
+            if (cqe->res < 0) {
+                op->err = -cqe->res;
+            } else if (cqe->res > 0) {
+                op->done += cqe->res;
+                if (op->done < op->size && ring_queue(async, op)) {
+                    continue;
+                }
+            }
+            // Done (or failed, or hit the end of the file).  If there's
+            // still some to read because it couldn't be resubmitted, the
+            // background thread will do the rest (or find the end of the
+            // file again).
+            queue_op(async, op);
+        }
+        __atomic_store_n(async->cq_head, head, __ATOMIC_RELEASE);
+        ring_flush(async);
+        pthread_mutex_unlock(&async->lock);
+    }
+
+    return NULL;
+}
+
+#endif
+
+/** @endcond */
@@ -0,0 +1,404 @@
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+#ifdef OMRX_HAVE_ZLIB
+  #include <zlib.h>
+#endif
+#ifdef OMRX_HAVE_ZSTD
+  #include <zstd.h>
+#endif
+
+#include "omrx.h"
+#include "omrx_internal.h"
+
+/** @cond internal
+  */
+
+// Attribute data codecs.  Everything here works on plain byte buffers (the
+// attribute data in file order); libomrx.c deals with the encoding
+// subheaders, byte order and error reporting.
+
+#define ZLIB_LEVEL 1
+#define ZSTD_LEVEL 3
+
+// The built-in LZ codec.  This is a simple byte-oriented LZ77 variant, which
+// is always available (so files written with it can be read anywhere).  The
+// compressed data is a series of sequences, each of which is:
+//
+//   token         1 byte: high nibble = literal count, low = match length - 4
+//   [lit count]   if the literal nibble is 15: further bytes, added to it,
+//                 until one is less than 255
+//   literals      (literal count) bytes copied straight to the output
+//   offset        2 bytes (LE): distance back to the start of the match
+//   [match len]   if the match nibble is 15: further bytes, as for literals
+//
+// The last sequence has literals only, and ends the data.  Matches are at
+// least 4 bytes long, and the last 5 bytes of the input are always literals.
+
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_LAST_LITERALS 5
+#define LZ_MIN_INPUT 12
+
+static inline uint32_t lz_load32(const uint8_t *p) {
+    uint32_t v;
+
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline uint64_t lz_load64(const uint8_t *p) {
+    uint64_t v;
+
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline uint32_t lz_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Write the extra bytes for a literal count or match length of `len` (which
+// has already had 15 subtracted from it).
+static inline uint8_t *lz_put_len(uint8_t *op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+static size_t lz_compress(uint8_t *dest, size_t dest_size, const uint8_t *src, size_t size) {
+    uint32_t table[1 << LZ_HASH_BITS];
+    const uint8_t *ip = src;
+    const uint8_t *anchor = src;
+    const uint8_t *end = src + size;
+    const uint8_t *match_limit = end - LZ_LAST_LITERALS;
+    const uint8_t *input_limit = end - LZ_MIN_INPUT;
+    const uint8_t *ref;
+    const uint8_t *mp;
+    const uint8_t *rp;
+    uint8_t *op = dest;
+    uint8_t *oend = dest + dest_size;
+    uint8_t *token;
+    uint32_t seq;
+    uint32_t h;
+    size_t lit;
+    size_t mlen;
+    size_t offset;
+    size_t step;
+
+    memset(table, 0, sizeof(table));
+    if (size >= LZ_MIN_INPUT) {
+        while (ip <= input_limit) {
+            seq = lz_load32(ip);
+            h = lz_hash(seq);
+            ref = src + table[h];
+            table[h] = ip - src;
+            if (ref >= ip || ip - ref > LZ_MAX_OFFSET || lz_load32(ref) != seq) {
+                // No match.  Skip ahead faster the longer it's been since the
+                // last one, so incompressible data doesn't take forever.
+                step = 1 + ((ip - anchor) >> 6);
+                if ((size_t)(input_limit - ip) < step) break;
+                ip += step;
+                continue;
+            }
+            mp = ip + LZ_MIN_MATCH;
+            rp = ref + LZ_MIN_MATCH;
+            while (mp + 8 <= match_limit && lz_load64(mp) == lz_load64(rp)) {
+                mp += 8;
+                rp += 8;
+            }
+            while (mp < match_limit && *mp == *rp) {
+                mp++;
+                rp++;
+            }
+            lit = ip - anchor;
+            mlen = mp - ip - LZ_MIN_MATCH;
+            offset = ip - ref;
+            if ((size_t)(oend - op) < 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1) {
+                return 0;
+            }
+            token = op++;
+            *token = (lit >= 15 ? 15 : lit) << 4 | (mlen >= 15 ? 15 : mlen);
+            if (lit >= 15) {
+                op = lz_put_len(op, lit - 15);
+            }
+            memcpy(op, anchor, lit);
+            op += lit;
+            *op++ = offset & 0xff;
+            *op++ = offset >> 8;
+            if (mlen >= 15) {
+                op = lz_put_len(op, mlen - 15);
+            }
+            ip = anchor = mp;
+        }
+    }
+    lit = end - anchor;
+    if ((size_t)(oend - op) < 1 + lit / 255 + 1 + lit) {
+        return 0;
+    }
+    *op++ = (lit >= 15 ? 15 : lit) << 4;
+    if (lit >= 15) {
+        op = lz_put_len(op, lit - 15);
+    }
+    memcpy(op, anchor, lit);
+    op += lit;
+
+    return op - dest;
+}
+
+static bool lz_decompress(uint8_t *dest, size_t size, const uint8_t *src, size_t src_size) {
+    const uint8_t *ip = src;
+    const uint8_t *iend = src + src_size;
+    uint8_t *op = dest;
+    uint8_t *oend = dest + size;
+    const uint8_t *ref;
+    uint8_t token;
+    uint8_t b;
+    size_t lit;
+    size_t mlen;
+    size_t offset;
+
+    while (ip < iend) {
+        token = *ip++;
+        lit = token >> 4;
+        if (lit == 15) {
+            do {
+                if (ip >= iend) return false;
+                b = *ip++;
+                lit += b;
+            } while (b == 255);
+        }
+        if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op)) return false;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == iend) break;
+
+        if (iend - ip < 2) return false;
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (!offset || offset > (size_t)(op - dest)) return false;
+        mlen = token & 15;
+        if (mlen == 15) {
+            do {
+                if (ip >= iend) return false;
+                b = *ip++;
+                mlen += b;
+            } while (b == 255);
+        }
+        mlen += LZ_MIN_MATCH;
+        if (mlen > (size_t)(oend - op)) return false;
+        ref = op - offset;
+        if (offset >= mlen) {
+            memcpy(op, ref, mlen);
+            op += mlen;
+        } else {
+            // Overlapping match (a repeating pattern)
+            while (mlen--) {
+                *op++ = *ref++;
+            }
+        }
+    }
+
+    return op == oend;
+}
+
+// Returns true if the given codec (OMRX_ENCODING_* & OMRX_CODEC_MASK) is
+// available in this build.
+bool omrx_codec_supported(uint16_t codec) {
+    switch (codec) {
+        case OMRX_ENCODING_NONE:
+        case OMRX_ENCODING_LZ:
+            return true;
+#ifdef OMRX_HAVE_ZLIB
+        case OMRX_ENCODING_ZLIB:
+            return true;
+#endif
+#ifdef OMRX_HAVE_ZSTD
+        case OMRX_ENCODING_ZSTD:
+            return true;
+#endif
+    }
+    return false;
+}
+
+// The best compression codec available in this build
+uint16_t omrx_codec_best(void) {
+#if defined(OMRX_HAVE_ZSTD)
+    return OMRX_ENCODING_ZSTD;
+#elif defined(OMRX_HAVE_ZLIB)
+    return OMRX_ENCODING_ZLIB;
+#else
+    return OMRX_ENCODING_LZ;
+#endif
+}
+
+// The largest size that compressing `size` bytes with the given codec can
+// produce.
+size_t omrx_codec_bound(uint16_t codec, size_t size) {
+    switch (codec) {
+        case OMRX_ENCODING_LZ:
+            return size + size / 255 + 16;
+#ifdef OMRX_HAVE_ZLIB
+        case OMRX_ENCODING_ZLIB:
+            return compressBound(size);
+#endif
+#ifdef OMRX_HAVE_ZSTD
+        case OMRX_ENCODING_ZSTD:
+            return ZSTD_compressBound(size);
+#endif
+    }
+    return size;
+}
+
+// The largest size that `size` bytes compressed with the given codec could
+// decompress to.  (These are the worst-case ratios of each format: LZ can
+// produce at most 255 bytes per input byte, deflate 1032, and zstd 32768,
+// from a 4-byte RLE block.)
+uint64_t omrx_codec_max_output(uint16_t codec, uint64_t size) {
+    switch (codec) {
+        case OMRX_ENCODING_LZ:
+            return size * 256;
+        case OMRX_ENCODING_ZLIB:
+            return size * 1032;
+        case OMRX_ENCODING_ZSTD:
+            return size * 32768;
+    }
+    return size;
+}
+
+// Compress `size` bytes from src into dest.  Returns the compressed size, or
+// 0 if it didn't fit in dest_size bytes (or the codec failed).
+size_t omrx_compress(uint16_t codec, void *dest, size_t dest_size, const void *src, size_t size) {
+#ifdef OMRX_HAVE_ZLIB
+    uLongf len;
+#endif
+#ifdef OMRX_HAVE_ZSTD
+    size_t rc;
+#endif
+
+    switch (codec) {
+        case OMRX_ENCODING_NONE:
+            if (dest_size < size) return 0;
+            memcpy(dest, src, size);
+            return size;
+        case OMRX_ENCODING_LZ:
+            return lz_compress(dest, dest_size, src, size);
+#ifdef OMRX_HAVE_ZLIB
+        case OMRX_ENCODING_ZLIB:
+            len = dest_size;
+            if (compress2(dest, &len, src, size, ZLIB_LEVEL) != Z_OK) return 0;
+            return len;
+#endif
+#ifdef OMRX_HAVE_ZSTD
+        case OMRX_ENCODING_ZSTD:
+            rc = ZSTD_compress(dest, dest_size, src, size, ZSTD_LEVEL);
+            if (ZSTD_isError(rc)) return 0;
+            return rc;
+#endif
+    }
+    return 0;
+}
+
+// Decompress src_size bytes from src into dest, which must decode to exactly
+// `size` bytes.  Returns false if the data is corrupt (or the codec isn't
+// supported).
+bool omrx_decompress(uint16_t codec, void *dest, size_t size, const void *src, size_t src_size) {
+#ifdef OMRX_HAVE_ZLIB
+    uLongf len;
+#endif
+
+    switch (codec) {
+        case OMRX_ENCODING_NONE:
+            if (src_size != size) return false;
+            memcpy(dest, src, size);
+            return true;
+        case OMRX_ENCODING_LZ:
+            return lz_decompress(dest, size, src, src_size);
+#ifdef OMRX_HAVE_ZLIB
+        case OMRX_ENCODING_ZLIB:
+            len = size;
+            if (uncompress(dest, &len, src, src_size) != Z_OK) return false;
+            return len == size;
+#endif
+#ifdef OMRX_HAVE_ZSTD
+        case OMRX_ENCODING_ZSTD:
+            return ZSTD_decompress(dest, size, src, src_size) == size;
+#endif
+    }
+    return false;
+}
+
+// Byte-shuffle `count` elements of `width` bytes each: all of the first bytes
+// of each element, then all of the second bytes, and so on.  For numeric
+// arrays this groups the (often similar) high-order bytes together, which
+// compresses much better.  dest and src must not overlap.
+void omrx_shuffle(void *dest, const void *src, size_t width, size_t count) {
+    uint8_t *d = dest;
+    const uint8_t *s = src;
+    size_t i, j;
+
+    switch (width) {
+        case 2:
+            for (i = 0; i < count; i++) {
+                d[i] = s[i * 2];
+                d[count + i] = s[i * 2 + 1];
+            }
+            break;
+        case 4:
+            for (i = 0; i < count; i++) {
+                d[i] = s[i * 4];
+                d[count + i] = s[i * 4 + 1];
+                d[count * 2 + i] = s[i * 4 + 2];
+                d[count * 3 + i] = s[i * 4 + 3];
+            }
+            break;
+        default:
+            for (j = 0; j < width; j++) {
+                for (i = 0; i < count; i++) {
+                    d[count * j + i] = s[i * width + j];
+                }
+            }
+            break;
+    }
+}
+
+// The reverse of omrx_shuffle()
+void omrx_unshuffle(void *dest, const void *src, size_t width, size_t count) {
+    uint8_t *d = dest;
+    const uint8_t *s = src;
+    size_t i, j;
+
+    switch (width) {
+        case 2:
+            for (i = 0; i < count; i++) {
+                d[i * 2] = s[i];
+                d[i * 2 + 1] = s[count + i];
+            }
+            break;
+        case 4:
+            for (i = 0; i < count; i++) {
+                d[i * 4] = s[i];
+                d[i * 4 + 1] = s[count + i];
+                d[i * 4 + 2] = s[count * 2 + i];
+                d[i * 4 + 3] = s[count * 3 + i];
+            }
+            break;
+        default:
+            for (j = 0; j < width; j++) {
+                for (i = 0; i < count; i++) {
+                    d[i * width + j] = s[count * j + i];
+                }
+            }
+            break;
+    }
+}
+
+/** @endcond */
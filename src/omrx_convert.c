@@ -0,0 +1,278 @@
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "omrx.h"
+#include "omrx_internal.h"
+
+/** @cond internal
+  */
+
+// Conversion of array data from any numeric element type to float32 or
+// float64 (used by omrx_get_attr_array_as_float32(), etc).  As with the
+// byte-swapping kernels, the vector kernels convert as many whole vectors as
+// they can and return how many elements they did, and the scalar loops mop up
+// the rest (or do everything, for types with no vector kernel).  Source data
+// is always in host order, but need not be aligned.
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  #define OMRX_CONVERT_X86 1
+  #include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+  #define OMRX_CONVERT_NEON 1
+  #include <arm_neon.h>
+#endif
+
+// Convert elements `start` up to `count` one at a time (the compiler is
+// usually able to vectorize these itself, too).
+#define SCALAR_CONVERT_LOOP(dest, src, type, start, count) \
+    do { \
+        size_t _i; \
+        switch (type) { \
+            case OMRX_DTYPE_U8:  for (_i = (start); _i < (count); _i++) { uint8_t _v;  memcpy(&_v, (src) + _i,     1); (dest)[_i] = _v; } break; \
+            case OMRX_DTYPE_S8:  for (_i = (start); _i < (count); _i++) { int8_t _v;   memcpy(&_v, (src) + _i,     1); (dest)[_i] = _v; } break; \
+            case OMRX_DTYPE_U16: for (_i = (start); _i < (count); _i++) { uint16_t _v; memcpy(&_v, (src) + _i * 2, 2); (dest)[_i] = _v; } break; \
+            case OMRX_DTYPE_S16: for (_i = (start); _i < (count); _i++) { int16_t _v;  memcpy(&_v, (src) + _i * 2, 2); (dest)[_i] = _v; } break; \
+            case OMRX_DTYPE_U32: for (_i = (start); _i < (count); _i++) { uint32_t _v; memcpy(&_v, (src) + _i * 4, 4); (dest)[_i] = _v; } break; \
+            case OMRX_DTYPE_S32: for (_i = (start); _i < (count); _i++) { int32_t _v;  memcpy(&_v, (src) + _i * 4, 4); (dest)[_i] = _v; } break; \
+            case OMRX_DTYPE_F32: for (_i = (start); _i < (count); _i++) { float _v;    memcpy(&_v, (src) + _i * 4, 4); (dest)[_i] = _v; } break; \
+            case OMRX_DTYPE_U64: for (_i = (start); _i < (count); _i++) { uint64_t _v; memcpy(&_v, (src) + _i * 8, 8); (dest)[_i] = _v; } break; \
+            case OMRX_DTYPE_S64: for (_i = (start); _i < (count); _i++) { int64_t _v;  memcpy(&_v, (src) + _i * 8, 8); (dest)[_i] = _v; } break; \
+            case OMRX_DTYPE_F64: for (_i = (start); _i < (count); _i++) { double _v;   memcpy(&_v, (src) + _i * 8, 8); (dest)[_i] = _v; } break; \
+        } \
+    } while (0)
+
+#ifdef OMRX_CONVERT_X86
+
+__attribute__((target("avx2")))
+static size_t to_float32_avx2(float *dest, const uint8_t *src, uint16_t type, size_t count) {
+    size_t i = 0;
+
+    switch (type) {
+        case OMRX_DTYPE_U8:
+            for (; i + 8 <= count; i += 8) {
+                __m256i v = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(src + i)));
+                _mm256_storeu_ps(dest + i, _mm256_cvtepi32_ps(v));
+            }
+            break;
+        case OMRX_DTYPE_S8:
+            for (; i + 8 <= count; i += 8) {
+                __m256i v = _mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i *)(src + i)));
+                _mm256_storeu_ps(dest + i, _mm256_cvtepi32_ps(v));
+            }
+            break;
+        case OMRX_DTYPE_U16:
+            for (; i + 8 <= count; i += 8) {
+                __m256i v = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(src + i * 2)));
+                _mm256_storeu_ps(dest + i, _mm256_cvtepi32_ps(v));
+            }
+            break;
+        case OMRX_DTYPE_S16:
+            for (; i + 8 <= count; i += 8) {
+                __m256i v = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(src + i * 2)));
+                _mm256_storeu_ps(dest + i, _mm256_cvtepi32_ps(v));
+            }
+            break;
+        case OMRX_DTYPE_S32:
+            for (; i + 8 <= count; i += 8) {
+                __m256i v = _mm256_loadu_si256((const __m256i *)(src + i * 4));
+                _mm256_storeu_ps(dest + i, _mm256_cvtepi32_ps(v));
+            }
+            break;
+        case OMRX_DTYPE_F64:
+            for (; i + 8 <= count; i += 8) {
+                __m128 lo = _mm256_cvtpd_ps(_mm256_loadu_pd((const double *)(src + i * 8)));
+                __m128 hi = _mm256_cvtpd_ps(_mm256_loadu_pd((const double *)(src + i * 8 + 32)));
+                _mm256_storeu_ps(dest + i, _mm256_set_m128(hi, lo));
+            }
+            break;
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t to_float64_avx2(double *dest, const uint8_t *src, uint16_t type, size_t count) {
+    size_t i = 0;
+
+    switch (type) {
+        case OMRX_DTYPE_U8:
+            for (; i + 4 <= count; i += 4) {
+                int32_t bytes;
+                memcpy(&bytes, src + i, 4);
+                __m128i v = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(bytes));
+                _mm256_storeu_pd(dest + i, _mm256_cvtepi32_pd(v));
+            }
+            break;
+        case OMRX_DTYPE_S8:
+            for (; i + 4 <= count; i += 4) {
+                int32_t bytes;
+                memcpy(&bytes, src + i, 4);
+                __m128i v = _mm_cvtepi8_epi32(_mm_cvtsi32_si128(bytes));
+                _mm256_storeu_pd(dest + i, _mm256_cvtepi32_pd(v));
+            }
+            break;
+        case OMRX_DTYPE_U16:
+            for (; i + 4 <= count; i += 4) {
+                __m128i v = _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i *)(src + i * 2)));
+                _mm256_storeu_pd(dest + i, _mm256_cvtepi32_pd(v));
+            }
+            break;
+        case OMRX_DTYPE_S16:
+            for (; i + 4 <= count; i += 4) {
+                __m128i v = _mm_cvtepi16_epi32(_mm_loadl_epi64((const __m128i *)(src + i * 2)));
+                _mm256_storeu_pd(dest + i, _mm256_cvtepi32_pd(v));
+            }
+            break;
+        case OMRX_DTYPE_S32:
+            for (; i + 4 <= count; i += 4) {
+                __m128i v = _mm_loadu_si128((const __m128i *)(src + i * 4));
+                _mm256_storeu_pd(dest + i, _mm256_cvtepi32_pd(v));
+            }
+            break;
+        case OMRX_DTYPE_F32:
+            for (; i + 4 <= count; i += 4) {
+                __m128 v = _mm_loadu_ps((const float *)(src + i * 4));
+                _mm256_storeu_pd(dest + i, _mm256_cvtps_pd(v));
+            }
+            break;
+    }
+    return i;
+}
+
+static size_t to_float32_vector(float *dest, const uint8_t *src, uint16_t type, size_t count) {
+    if (__builtin_cpu_supports("avx2")) {
+        return to_float32_avx2(dest, src, type, count);
+    }
+    return 0;
+}
+
+static size_t to_float64_vector(double *dest, const uint8_t *src, uint16_t type, size_t count) {
+    if (__builtin_cpu_supports("avx2")) {
+        return to_float64_avx2(dest, src, type, count);
+    }
+    return 0;
+}
+
+#elif defined(OMRX_CONVERT_NEON)
+
+static size_t to_float32_vector(float *dest, const uint8_t *src, uint16_t type, size_t count) {
+    size_t i = 0;
+
+    switch (type) {
+        case OMRX_DTYPE_U16:
+            for (; i + 4 <= count; i += 4) {
+                uint32x4_t v = vmovl_u16(vld1_u16((const uint16_t *)(src + i * 2)));
+                vst1q_f32(dest + i, vcvtq_f32_u32(v));
+            }
+            break;
+        case OMRX_DTYPE_S16:
+            for (; i + 4 <= count; i += 4) {
+                int32x4_t v = vmovl_s16(vld1_s16((const int16_t *)(src + i * 2)));
+                vst1q_f32(dest + i, vcvtq_f32_s32(v));
+            }
+            break;
+        case OMRX_DTYPE_U32:
+            for (; i + 4 <= count; i += 4) {
+                vst1q_f32(dest + i, vcvtq_f32_u32(vld1q_u32((const uint32_t *)(src + i * 4))));
+            }
+            break;
+        case OMRX_DTYPE_S32:
+            for (; i + 4 <= count; i += 4) {
+                vst1q_f32(dest + i, vcvtq_f32_s32(vld1q_s32((const int32_t *)(src + i * 4))));
+            }
+            break;
+        case OMRX_DTYPE_F64:
+            for (; i + 4 <= count; i += 4) {
+                float32x2_t lo = vcvt_f32_f64(vld1q_f64((const double *)(src + i * 8)));
+                float32x2_t hi = vcvt_f32_f64(vld1q_f64((const double *)(src + i * 8 + 16)));
+                vst1q_f32(dest + i, vcombine_f32(lo, hi));
+            }
+            break;
+    }
+    return i;
+}
+
+static size_t to_float64_vector(double *dest, const uint8_t *src, uint16_t type, size_t count) {
+    size_t i = 0;
+
+    switch (type) {
+        case OMRX_DTYPE_S32:
+            for (; i + 2 <= count; i += 2) {
+                vst1q_f64(dest + i, vcvtq_f64_s64(vmovl_s32(vld1_s32((const int32_t *)(src + i * 4)))));
+            }
+            break;
+        case OMRX_DTYPE_F32:
+            for (; i + 2 <= count; i += 2) {
+                vst1q_f64(dest + i, vcvt_f64_f32(vld1_f32((const float *)(src + i * 4))));
+            }
+            break;
+    }
+    return i;
+}
+
+#else
+
+static size_t to_float32_vector(float *dest, const uint8_t *src, uint16_t type, size_t count) {
+    // No vector kernels for this platform; the scalar loops do everything.
+    return 0;
+}
+
+static size_t to_float64_vector(double *dest, const uint8_t *src, uint16_t type, size_t count) {
+    return 0;
+}
+
+#endif
+
+// Returns true if the given type (a simple numeric dtype, or an array of one)
+// can be converted by the functions below.  Anything else is left alone by
+// them, so callers must check this first.
+bool omrx_convert_supported(uint16_t type) {
+    switch (OMRX_GET_ELEMTYPE(type)) {
+        case OMRX_DTYPE_U8:
+        case OMRX_DTYPE_S8:
+        case OMRX_DTYPE_U16:
+        case OMRX_DTYPE_S16:
+        case OMRX_DTYPE_U32:
+        case OMRX_DTYPE_S32:
+        case OMRX_DTYPE_F32:
+        case OMRX_DTYPE_U64:
+        case OMRX_DTYPE_S64:
+        case OMRX_DTYPE_F64:
+            return true;
+    }
+    return false;
+}
+
+// Convert `count` elements of the given type (a simple numeric dtype, or the
+// element type of an array dtype) to float32.  Conversions from wider types
+// are rounded to the nearest representable value.
+void omrx_convert_to_float32(float *dest, const void *src, uint16_t type, size_t count) {
+    const uint8_t *s = src;
+    size_t done;
+
+    type = OMRX_GET_ELEMTYPE(type);
+    if (type == OMRX_DTYPE_F32) {
+        memcpy(dest, src, count * 4);
+        return;
+    }
+    done = to_float32_vector(dest, s, type, count);
+    SCALAR_CONVERT_LOOP(dest, s, type, done, count);
+}
+
+// Convert `count` elements of the given type to float64.
+void omrx_convert_to_float64(double *dest, const void *src, uint16_t type, size_t count) {
+    const uint8_t *s = src;
+    size_t done;
+
+    type = OMRX_GET_ELEMTYPE(type);
+    if (type == OMRX_DTYPE_F64) {
+        memcpy(dest, src, count * 8);
+        return;
+    }
+    done = to_float64_vector(dest, s, type, count);
+    SCALAR_CONVERT_LOOP(dest, s, type, done, count);
+}
+
+/** @endcond */
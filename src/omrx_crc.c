@@ -0,0 +1,139 @@
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "omrx.h"
+#include "omrx_internal.h"
+
+/** @cond internal
+  */
+
+// CRC-32C (Castagnoli), used to checksum attribute data (see
+// OMRX_WRITE_CHECKSUMS).  This is the same CRC as used by iSCSI, ext4, etc,
+// which most current CPUs can compute directly (SSE4.2 on x86, the CRC
+// extension on ARMv8).  Elsewhere, a slice-by-8 table lookup is used.
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  #define OMRX_CRC_X86 1
+  #include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+  #define OMRX_CRC_ARM 1
+  #include <arm_acle.h>
+#endif
+
+#define CRC32C_POLY 0x82f63b78 // (reflected)
+
+static uint32_t crc_table[8][256];
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+static void init_crc_table(void) {
+    uint32_t crc;
+    int i, j;
+
+    for (i = 0; i < 256; i++) {
+        crc = i;
+        for (j = 0; j < 8; j++) {
+            crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+        }
+        crc_table[0][i] = crc;
+    }
+    for (i = 0; i < 256; i++) {
+        crc = crc_table[0][i];
+        for (j = 1; j < 8; j++) {
+            crc = (crc >> 8) ^ crc_table[0][crc & 0xff];
+            crc_table[j][i] = crc;
+        }
+    }
+}
+
+static uint32_t crc32c_table(uint32_t crc, const uint8_t *p, size_t size) {
+    uint32_t lo, hi;
+
+    pthread_once(&crc_table_once, init_crc_table);
+    for (; size >= 8; size -= 8, p += 8) {
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        if (OMRX_HOST_BIG_ENDIAN) {
+            lo = omrx_bswap32(lo);
+            hi = omrx_bswap32(hi);
+        }
+        lo ^= crc;
+        crc = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff] ^
+              crc_table[5][(lo >> 16) & 0xff] ^ crc_table[4][lo >> 24] ^
+              crc_table[3][hi & 0xff] ^ crc_table[2][(hi >> 8) & 0xff] ^
+              crc_table[1][(hi >> 16) & 0xff] ^ crc_table[0][hi >> 24];
+    }
+    while (size--) {
+        crc = (crc >> 8) ^ crc_table[0][(crc ^ *p++) & 0xff];
+    }
+    return crc;
+}
+
+#ifdef OMRX_CRC_X86
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *p, size_t size) {
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+    uint64_t v;
+
+    for (; size >= 8; size -= 8, p += 8) {
+        memcpy(&v, p, 8);
+        crc64 = _mm_crc32_u64(crc64, v);
+    }
+    crc = crc64;
+#else
+    uint32_t v;
+
+    for (; size >= 4; size -= 4, p += 4) {
+        memcpy(&v, p, 4);
+        crc = _mm_crc32_u32(crc, v);
+    }
+#endif
+    while (size--) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+}
+
+static uint32_t crc32c_update(uint32_t crc, const uint8_t *p, size_t size) {
+    if (__builtin_cpu_supports("sse4.2")) {
+        return crc32c_sse42(crc, p, size);
+    }
+    return crc32c_table(crc, p, size);
+}
+
+#elif defined(OMRX_CRC_ARM)
+
+static uint32_t crc32c_update(uint32_t crc, const uint8_t *p, size_t size) {
+    uint64_t v;
+
+    for (; size >= 8; size -= 8, p += 8) {
+        memcpy(&v, p, 8);
+        crc = __crc32cd(crc, v);
+    }
+    while (size--) {
+        crc = __crc32cb(crc, *p++);
+    }
+    return crc;
+}
+
+#else
+
+static uint32_t crc32c_update(uint32_t crc, const uint8_t *p, size_t size) {
+    return crc32c_table(crc, p, size);
+}
+
+#endif
+
+// Compute the CRC-32C of `size` bytes at `data`.  `crc` is the result of a
+// previous call, to continue a checksum over several buffers, or 0 to start a
+// new one.
+uint32_t omrx_crc32c(uint32_t crc, const void *data, size_t size) {
+    return ~crc32c_update(~crc, data, size);
+}
+
+/** @endcond */
@@ -0,0 +1,157 @@
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "omrx.h"
+#include "omrx_internal.h"
+
+/** @cond internal
+  */
+
+// Bulk byte-order conversion of array data.  OMRX files are always stored
+// little-endian, so on big-endian hosts every multi-byte element needs to be
+// byte-swapped on the way in and out.  (On little-endian hosts none of this is
+// ever called; see OMRX_NEEDS_SWAP().)  The vector kernels handle as many
+// whole vectors as they can, and leave the remainder to the scalar loops.
+//
+// Vector kernels are only built for big-endian targets which have them: NEON
+// (AArch64 or ARM in big-endian mode) and VSX (big-endian POWER).  Other
+// platforms with vector units (x86 in particular) are only ever little-endian,
+// so would never get here.
+
+#if OMRX_HOST_BIG_ENDIAN && defined(__ARM_NEON)
+  #define OMRX_SWAP_NEON 1
+  #include <arm_neon.h>
+#elif OMRX_HOST_BIG_ENDIAN && defined(__VSX__)
+  #define OMRX_SWAP_VSX 1
+  #include <altivec.h>
+#endif
+
+static size_t bswap16_scalar(uint8_t *dest, const uint8_t *src, size_t count) {
+    uint16_t v;
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        memcpy(&v, src + i * 2, 2);
+        v = omrx_bswap16(v);
+        memcpy(dest + i * 2, &v, 2);
+    }
+    return count;
+}
+
+static size_t bswap32_scalar(uint8_t *dest, const uint8_t *src, size_t count) {
+    uint32_t v;
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        memcpy(&v, src + i * 4, 4);
+        v = omrx_bswap32(v);
+        memcpy(dest + i * 4, &v, 4);
+    }
+    return count;
+}
+
+static size_t bswap64_scalar(uint8_t *dest, const uint8_t *src, size_t count) {
+    uint64_t v;
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        memcpy(&v, src + i * 8, 8);
+        v = omrx_bswap64(v);
+        memcpy(dest + i * 8, &v, 8);
+    }
+    return count;
+}
+
+#ifdef OMRX_SWAP_NEON
+
+static size_t bswap_vector(uint8_t *dest, const uint8_t *src, size_t len, int shift) {
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        uint8x16_t a = vld1q_u8(src + i);
+        switch (shift) {
+            case 1:
+                a = vrev16q_u8(a);
+                break;
+            case 2:
+                a = vrev32q_u8(a);
+                break;
+            default:
+                a = vrev64q_u8(a);
+                break;
+        }
+        vst1q_u8(dest + i, a);
+    }
+    return i;
+}
+
+#elif defined(OMRX_SWAP_VSX)
+
+// Byte permutations reversing each 2/4/8-byte element of a vector (indexed by
+// log2 of the element width).  POWER9 has vec_revb() for this, but vec_perm()
+// does the same job on every VSX machine, in one instruction.
+static const __vector unsigned char swap_perms[4] = {
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+    {1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14},
+    {3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12},
+    {7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8},
+};
+
+static size_t bswap_vector(uint8_t *dest, const uint8_t *src, size_t len, int shift) {
+    __vector unsigned char perm = swap_perms[shift];
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __vector unsigned char a = vec_xl(0, src + i);
+        vec_xst(vec_perm(a, a, perm), 0, dest + i);
+    }
+    return i;
+}
+
+#else
+
+static size_t bswap_vector(uint8_t *dest, const uint8_t *src, size_t len, int shift) {
+    // No vector kernels for this platform; the scalar loops do everything.
+    (void)dest;
+    (void)src;
+    (void)len;
+    (void)shift;
+    return 0;
+}
+
+#endif
+
+// Byte-swap `count` elements of `width` (1, 2, 4 or 8) bytes each from src
+// into dest.  dest and src may be the same buffer (for in-place conversion),
+// but must not otherwise overlap.  Neither needs to be aligned.
+void omrx_bswap_array(void *dest, const void *src, size_t width, size_t count) {
+    uint8_t *d = dest;
+    const uint8_t *s = src;
+    size_t done;
+
+    switch (width) {
+        case 2:
+            done = bswap_vector(d, s, count * 2, 1) / 2;
+            bswap16_scalar(d + done * 2, s + done * 2, count - done);
+            break;
+        case 4:
+            done = bswap_vector(d, s, count * 4, 2) / 4;
+            bswap32_scalar(d + done * 4, s + done * 4, count - done);
+            break;
+        case 8:
+            done = bswap_vector(d, s, count * 8, 3) / 8;
+            bswap64_scalar(d + done * 8, s + done * 8, count - done);
+            break;
+        default:
+            // Single bytes (or unknown element types) don't get swapped.
+            if (dest != src) {
+                memcpy(dest, src, width * count);
+            }
+            break;
+    }
+}
+
+/** @endcond */
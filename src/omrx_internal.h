@@ -1,6 +1,9 @@
 #ifndef _OMRX_INTERNAL_H
 #define _OMRX_INTERNAL_H
 
+#include <stddef.h>
+#include <pthread.h>
+
 #include "omrx.h"
 
 /** @cond internal
@@ -8,29 +11,388 @@
 
 #define OMRX_ERRMSG_BUFSIZE 4096
 
+// Size of the read buffer used when scanning file headers
+#define OMRX_SCAN_BUFSIZE (1024 * 1024)
+// Scan buffer sizes used instead when the file is being read sequentially or
+// randomly (see omrx_advise())
+#define OMRX_SCAN_BUFSIZE_SEQUENTIAL (4 * 1024 * 1024)
+#define OMRX_SCAN_BUFSIZE_RANDOM (64 * 1024)
+// How much the scanner reads at first after skipping past its buffer (this
+// doubles, up to the buffer size, while reads keep following on)
+#define OMRX_SCAN_FILL_MIN (16 * 1024)
+// Attribute data ranges closer together than this are combined into one when
+// passing advice for a chunk on to the kernel (see omrx_advise_chunk())
+#define OMRX_ADVISE_MERGE_GAP (64 * 1024)
+// How far the kernel may have read ahead past the end of one read (the usual
+// Linux default), which OMRX_ADVICE_DONTNEED drops along with the next one
+// (see drop_behind())
+#define OMRX_READAHEAD_WINDOW (128 * 1024)
+
+// Size of the buffer used by the streaming writer to collect a chunk's
+// attributes before its header (and thus attribute count) is written
+#define OMRX_STREAM_BUFSIZE 65536
+
+// Default byte budget for the attribute data cache (see omrx_set_cache_limit());
+// caching is opt-in, since it costs a second copy of everything read
+#define OMRX_CACHE_DEFAULT_LIMIT 0
+
+// Size of the temporary buffer used to byte-swap data on its way to the file
+// (only used on big-endian hosts)
+#define OMRX_SWAP_BUFSIZE 4096
+
+// Default target size of the (decoded) blocks which large encoded array
+// attributes are split into (see omrx_set_block_size())
+#define OMRX_BLOCK_DEFAULT_SIZE (1024 * 1024)
+
+// The first file version (see OMRX_VERSION) in which encoded array data starts
+// with a block directory (see read_block_dir()).  In older files, it is always
+// a single block with no directory.
+#define OMRX_VERSION_BLOCKS 0x00000002
+
+// Upper limit on the number of threads used for parallel work (see
+// omrx_set_threads())
+#define OMRX_MAX_THREADS 64
+
+// Amount of attribute data the parallel writer prepares (loads, encodes and
+// writes out) at a time, and the most items (headers, attributes, etc) it
+// handles at once
+#define OMRX_WRITE_BATCH_SIZE (64 * 1024 * 1024)
+#define OMRX_WRITE_BATCH_ITEMS 4096
+
+// Items smaller than this are gathered together into runs of up to this size
+// by the parallel writer, so they can be written with a single call
+#define OMRX_WRITE_RUN_SIZE (1024 * 1024)
+
+// Size of the staging buffer which omrx_write() collects headers and other
+// small pieces of output in, and the size of data which is written straight
+// from where it is instead (see omrx_output.c)
+#define OMRX_OUTPUT_BUFSIZE (256 * 1024)
+#define OMRX_OUTPUT_COPY_MAX 16384
+
+// Size and alignment of the output buffer for OMRX_WRITE_DIRECT (the
+// alignment must suit O_DIRECT on any likely file system)
+#define OMRX_OUTPUT_DIRECT_BUFSIZE (4 * 1024 * 1024)
+#define OMRX_OUTPUT_DIRECT_ALIGN 4096
+
+// Number of background threads used for asynchronous fetches, and the most
+// reads which can be outstanding in the io_uring at once (see omrx_async.c)
+#define OMRX_ASYNC_THREADS 4
+#define OMRX_ASYNC_RING_ENTRIES 256
+
+// Approximate size of each slab allocated for chunk/attribute nodes
+#define OMRX_SLAB_SIZE 65536
+
+// Chunks with at least this many children get an index of them by tag (see
+// struct omrx_tag_index), built the first time they are searched by tag
+#define OMRX_TAG_INDEX_MIN 32
+// Initial number of slots in a tag index (a power of two)
+#define OMRX_TAG_INDEX_SIZE 16
+
+// Most steps a query can have (the steps a chunk may match are kept as a
+// 64-bit mask), and the initial depth of the stack used to run one
+#define OMRX_QUERY_MAX_STEPS 64
+#define OMRX_QUERY_STACK_SIZE 64
+
 typedef struct omrx_attr *omrx_attr_t;
+typedef struct omrx_pool *omrx_pool_t;
+typedef struct omrx_workers *omrx_workers_t;
+typedef struct omrx_output *omrx_output_t;
+typedef struct omrx_async *omrx_async_t;
+typedef void (*omrx_task_func_t)(void *arg, size_t index);
 
-//FIXME: make this a hashtable or something
+// A slot in the chunk ID index (an open-addressed hashtable using linear
+// probing).  A slot with a NULL chunk is empty; a slot with a chunk but a NULL
+// id is a tombstone left behind by a deleted entry.
 struct idmap_st {
     const char *id;
+    uint32_t hash;
     omrx_chunk_t chunk;
 };
 
+// A slot in a chunk's tag index: the first and last children with a
+// particular tag.  Slots stay in use (with NULL first/last) when all the
+// children with their tag have been deleted, so there are no tombstones.
+struct tag_slot {
+    bool used;
+    uint32_t tagint;
+    omrx_chunk_t first;
+    omrx_chunk_t last;
+};
+
+// An index of a chunk's children by tag (an open-addressed hashtable using
+// linear probing), so that omrx_get_child() doesn't have to go through every
+// child.  Children with the same tag are linked together through their
+// next_same_tag pointers, so omrx_get_next_chunk() doesn't either.
+struct omrx_tag_index {
+    size_t size;
+    size_t count;
+    struct tag_slot slots[];
+};
+
+// Comparisons a query step can make with a chunk's ID (see omrx_query.c)
+enum {
+    QUERY_ID_ANY = 0,
+    QUERY_ID_EQ,
+    QUERY_ID_PREFIX,
+    QUERY_ID_SUFFIX,
+    QUERY_ID_CONTAINS,
+};
+
+// One step of a compiled query: chunks with tag `tagint` (or any tag), whose
+// IDs compare with `id` (if id_op isn't QUERY_ID_ANY), which are children of
+// a chunk matched by the previous step (or any descendants, if `descendant`).
+struct query_step {
+    bool descendant;
+    bool any_tag;
+    uint32_t tagint;
+    int id_op;
+    const char *id;
+    size_t id_len;
+};
+
+// A compiled query (see omrx_query_compile()).  The steps' IDs point into
+// `text`.
+struct omrx_query {
+    omrx_t omrx;
+    char *text;
+    size_t count;
+    struct query_step steps[];
+};
+
+// A slab of fixed-size nodes.  Nodes are handed out from the slab in order,
+// and are never returned to the underlying allocator individually.
+struct omrx_slab {
+    struct omrx_slab *next;
+    size_t used;
+    max_align_t data[];
+};
+
+// A pool of same-sized nodes (chunks or attributes), allocated out of slabs.
+// Freed nodes go onto free_list (linked through their first word) for reuse.
+// All slabs are released at once when the OMRX instance is freed.
+struct omrx_pool {
+    size_t node_size;
+    size_t nodes_per_slab;
+    struct omrx_slab *slabs;
+    void *free_list;
+};
+
+// Buffered reader used by omrx_scan() to parse chunk/attribute headers.  A
+// large block of the file is read into buf at a time, and headers are parsed
+// directly out of it.  The current file position (pos) is tracked here rather
+// than via the FILE, and skipping over data just moves pos forward; the
+// buffer is only refilled when something outside of it is actually needed.
+// (If the file is mapped, buf just points at the whole mapping.)
+struct omrx_scanner {
+    uint8_t *buf;
+    size_t buf_size;
+    bool own_buf;
+    off_t buf_pos;
+    size_t buf_len;
+    size_t fill_size;
+    off_t pos;
+    // Size of the file being scanned, or -1 if it isn't known
+    off_t file_size;
+};
+
+// A chunk which is currently open in the streaming writer.  The chunk header
+// is not written until the chunk's attributes are (probably) all known, so
+// that it doesn't usually need to be patched afterwards.  Until then (while
+// `started` is false), attributes are collected in the stream's pending
+// buffer.  If attributes are added after the header has been written,
+// written_count will no longer match attr_count and the header gets patched
+// when the chunk is finished.
+struct omrx_stream_level {
+    char tag[4];
+    uint32_t tagint;
+    bool started;
+    bool has_children;
+    off_t hdr_pos;
+    uint16_t attr_count;
+    uint16_t written_count;
+};
+
+// State for the streaming writer (omrx_stream_open(), etc).  `levels` is the
+// stack of currently open chunks, with the root chunk at the bottom.  When
+// appending to an existing file, the file is truncated at the end of what we
+// wrote when it's closed (in case there was a TOC after the old end tag).  The
+// old end of the file (`tail_len` bytes from `tail_pos`, which are about to be
+// overwritten) is kept in `tail`, so that it can be put back if anything goes
+// wrong.
+struct omrx_stream {
+    FILE *fp;
+    bool appending;
+    uint8_t *tail;
+    size_t tail_len;
+    off_t tail_pos;
+    struct omrx_stream_level *levels;
+    size_t depth;
+    size_t max_depth;
+    uint8_t *pending;
+    size_t pending_len;
+    bool in_array;
+    off_t array_hdr_pos;
+    uint16_t array_cols;
+    uint32_t array_elem_size;
+    uint64_t array_size;
+};
+
+// Output staging for omrx_write() (see omrx_output.c).  `buf` is NULL when
+// nothing is using it.  `pos` is the file position the staged data (`len`
+// bytes at `buf`) goes at.
+struct omrx_output {
+    omrx_t omrx;
+    int fd;
+    bool direct;
+    void *mem;
+    uint8_t *buf;
+    size_t buf_size;
+    size_t len;
+    off_t pos;
+};
+
+// An operation for omrx_async_run()/omrx_async_read() (see omrx_async.c).
+// This is embedded in a larger structure saying what func is to do; the read
+// fields are filled in by omrx_async_read().
+struct omrx_async_op {
+    struct omrx_async_op *next;
+    void (*func)(struct omrx_async_op *op);
+    int fd;
+    uint8_t *buf;
+    size_t size;
+    size_t done;
+    off_t pos;
+    int err;
+};
+
+// Cache of attribute data loaded from the file.  Cached attributes are kept
+// on a doubly-linked list (through their cache_prev/cache_next fields), with
+// the most recently used at the head.  When the total size goes over `limit`,
+// data is discarded from the tail until it fits again.  Pinned entries (data
+// which has been handed out to the application as a borrowed pointer) are
+// counted in `size`, but are never evicted; they stay until they are
+// explicitly released with omrx_release_attr_data().  Shared buffers (see
+// omrx_get_attr_buffer()) are counted too, but can only be evicted once the
+// attribute's own reference is the only one left.
+struct omrx_cache {
+    struct omrx_attr *head;
+    struct omrx_attr *tail;
+    size_t limit;
+    size_t size;
+    size_t entries;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+};
+
+// A reference-counted, immutable copy of an attribute's data, which can be
+// shared between any number of readers (see omrx_get_attr_buffer()).  The
+// attribute itself holds a reference while it's using the buffer as its
+// data.  Buffers can outlive the instance they came from; they keep a
+// reference to its memory (but nothing else) so they can be freed with its
+// free function.
+struct omrx_buffer {
+    unsigned int refcount;
+    size_t size;
+    omrx_t omrx;
+    max_align_t data[];
+};
+
+// A batch of asynchronous attribute reads (see omrx_fetch_submit()).  `ops`
+// has one entry per request, of which `pending` are still running.  `status`
+// and `message` record the first error.  The fields below `ops` are protected
+// by the instance's fetch_lock.  `done` is set once everything (including the
+// callback) has finished; if omrx_fetch_free() is called from the callback
+// itself, freeing is left to the thread running the callback (free_pending).
+struct omrx_fetch {
+    omrx_t omrx;
+    struct omrx_fetch_request *requests;
+    size_t count;
+    omrx_fetch_func_t callback;
+    void *user_data;
+    struct fetch_op *ops;
+    size_t pending;
+    bool done;
+    omrx_status_t status;
+    char *message;
+    bool in_callback;
+    pthread_t callback_thread;
+    bool free_pending;
+};
+
+// Error/warning state reported by omrx_status(), omrx_last_result() and
+// omrx_last_message().  Normally each instance has just one of these, but in
+// concurrent mode (OMRX_OPEN_CONCURRENT) each thread using the instance gets
+// its own (see get_errstate()), so threads don't clobber each other's
+// results.  Per-thread states are chained together both on prev/next (all of
+// an instance's states, which are freed along with it) and on
+// thread_prev/thread_next (all of a thread's states, headed by `thread_list`,
+// which are freed when it exits).
+struct omrx_errstate {
+    omrx_t omrx;
+    struct omrx_errstate *prev;
+    struct omrx_errstate *next;
+    struct omrx_errstate **thread_list;
+    struct omrx_errstate *thread_prev;
+    struct omrx_errstate *thread_next;
+    omrx_status_t status;
+    omrx_status_t last_result;
+    char *message;
+};
+
 struct omrx {
     FILE *fp;
     char *filename;
     bool close_file;
-    char *message;
+    unsigned int open_flags;
+    uint8_t *map;
+    size_t map_size;
+    struct omrx_errstate err;
+    // Unique number for each instance ever created, so that a thread's
+    // cached error state (see get_errstate()) can't be mistaken for one
+    // belonging to a new instance which happens to have the same address
+    uint64_t serial;
+    struct omrx_errstate *thread_errstates;
+    pthread_mutex_t attr_lock;
     omrx_log_func_t log_error;
     omrx_log_func_t log_warning;
     omrx_alloc_func_t alloc;
     omrx_free_func_t free;
+    // References to the instance's memory: one for the instance itself
+    // (dropped by omrx_free()), and one for each shared attribute buffer,
+    // which may outlive it (see struct omrx_buffer).  The instance is only
+    // actually freed once they have all gone.
+    unsigned int refcount;
+    struct omrx_pool chunk_pool;
+    struct omrx_pool attr_pool;
+    struct omrx_scanner scan;
+    // Versions of the file opened (which determines how encoded data read
+    // from it is laid out) and of the file being written (which determines
+    // how encoded data is written; see OMRX_VERSION_BLOCKS)
+    uint32_t file_version;
+    uint32_t out_version;
+    off_t write_pos;
+    bool write_checksums;
+    uint32_t write_crc;
+    struct omrx_output out;
+    struct omrx_stream stream;
+    struct omrx_cache cache;
+    uint32_t block_size;
+    omrx_advice_t advice;
+    off_t drop_pos;
+    unsigned int threads;
+    omrx_workers_t workers;
+    pthread_mutex_t workers_lock;
+    omrx_async_t async;
+    pthread_mutex_t fetch_lock;
+    pthread_cond_t fetch_cond;
     struct omrx_chunk *root_chunk;
     struct omrx_chunk *context;
+    size_t unloaded_count;
     struct idmap_st *chunk_id_map;
     size_t chunk_id_map_size;
-    omrx_status_t status;
-    omrx_status_t last_result;
+    size_t chunk_id_map_count;
+    size_t chunk_id_map_used;
     void *user_data;
 };
 
@@ -39,13 +401,24 @@ struct omrx_chunk {
     struct omrx_chunk *parent;
     struct omrx_chunk *first_child;
     struct omrx_chunk *last_child;
+    // The index of this chunk's children by tag (if it has been built), and
+    // the next sibling with the same tag (only valid while the parent's
+    // index exists)
+    struct omrx_tag_index *tag_index;
+    struct omrx_chunk *next_same_tag;
+    uint32_t child_count;
     struct omrx *omrx;
     uint8_t tag[5];
     uint32_t tagint;
     uint16_t attr_count;
     struct omrx_attr *attrs;
     char *id;
+    uint32_t id_hash;
     off_t file_position;
+    off_t out_pos;
+    uint32_t toc_index;
+    off_t children_pos;
+    bool unloaded;
 };
 
 struct omrx_attr {
@@ -55,7 +428,28 @@ struct omrx_attr {
     uint16_t datatype;
     uint32_t size;
     off_t file_pos;
+    off_t out_pos;
+    // Encoding to use when writing, the encoding of the data in the file
+    // (and its encoded size there), and the encoding used for the last write
+    uint16_t encoding;
+    uint16_t file_encoding;
+    uint32_t file_size;
+    uint16_t out_encoding;
+    uint32_t out_size;
+    // CRC-32C of the data in the file (if it had one, see
+    // OMRX_WRITE_CHECKSUMS), whether it has been checked, and the CRC of the
+    // data as last written
+    uint32_t crc;
+    bool has_crc;
+    bool crc_ok;
+    uint32_t out_crc;
     void *data;
+    bool own_data;
+    struct omrx_buffer *shared;
+    bool cached;
+    bool pinned;
+    struct omrx_attr *cache_prev;
+    struct omrx_attr *cache_next;
     uint16_t cols;
 };
 
@@ -66,16 +460,127 @@ struct omrx_attr {
 #define COPYABLE_CHUNK_FLAG  0x00200000
 #define END_CHUNK_FLAG       0x00000020
 
-// FIXME: make this correct based on detected machine endianness
-#define UINT16_FTOH(value) (value)
-#define UINT32_FTOH(value) (value)
-#define UINT16_HTOF(value) (value)
-#define UINT32_HTOF(value) (value)
+// Table-of-contents chunk written (optionally) at the end of the OMRX chunk,
+// and the attributes it contains.  Each TOC attribute is an array with one
+// entry (row) per chunk or per attribute, in depth-first order.
+#define TOC_CHUNK_TAG "tOCx"
+#define TOC_ATTR_CHUNK_TAGS    0x0010 // U8_ARRAY, cols=4: chunk tags
+#define TOC_ATTR_CHUNK_PARENTS 0x0011 // U32_ARRAY: index of parent chunk
+#define TOC_ATTR_CHUNK_POS     0x0012 // U64_ARRAY: chunk file_position
+#define TOC_ATTR_CHUNK_NATTRS  0x0013 // U16_ARRAY: attribute count
+#define TOC_ATTR_ATTR_TYPES    0x0020 // U16_ARRAY, cols=3: id, datatype, cols
+#define TOC_ATTR_ATTR_SIZES    0x0021 // U32_ARRAY: attribute data size
+#define TOC_ATTR_ATTR_POS      0x0022 // U64_ARRAY: attribute file_pos
+#define TOC_ATTR_ATTR_RAWSIZES 0x0023 // U32_ARRAY: decoded size (if any are encoded)
+#define TOC_ATTR_ATTR_CRCS     0x0024 // U32_ARRAY: data checksum (if written)
+#define TOC_ATTR_IDS           0x0030 // RAW: NUL-terminated chunk id strings
+
+#define TOC_NO_PARENT 0xffffffff
+
+// The TOC trailer comes immediately after the end tag of the OMRX chunk (and
+// is thus ignored by anything which doesn't know to look for it).
+#define TOC_TRAILER_MAGIC "oTOC"
+#define TOC_TRAILER_VERSION 1
+
+// Byte order.  OMRX files are always little-endian; all data held in memory
+// (including attribute data) is in host order.  OMRX_HOST_BIG_ENDIAN can be
+// defined on the command line if it can't be detected automatically.
+#ifndef OMRX_HOST_BIG_ENDIAN
+  #if defined(__BYTE_ORDER__) && defined(__ORDER_BIG_ENDIAN__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    #define OMRX_HOST_BIG_ENDIAN 1
+  #elif defined(__BIG_ENDIAN__) || defined(_BIG_ENDIAN)
+    #define OMRX_HOST_BIG_ENDIAN 1
+  #else
+    #define OMRX_HOST_BIG_ENDIAN 0
+  #endif
+#endif
+
+#if defined(__GNUC__)
+  #define omrx_bswap16(x) __builtin_bswap16(x)
+  #define omrx_bswap32(x) __builtin_bswap32(x)
+  #define omrx_bswap64(x) __builtin_bswap64(x)
+#else
+static inline uint16_t omrx_bswap16(uint16_t x) {
+    return (uint16_t)((x >> 8) | (x << 8));
+}
+static inline uint32_t omrx_bswap32(uint32_t x) {
+    return ((x >> 24) & 0xff) | ((x >> 8) & 0xff00) | ((x << 8) & 0xff0000) | (x << 24);
+}
+static inline uint64_t omrx_bswap64(uint64_t x) {
+    return ((uint64_t)omrx_bswap32((uint32_t)x) << 32) | omrx_bswap32((uint32_t)(x >> 32));
+}
+#endif
+
+#if OMRX_HOST_BIG_ENDIAN
+  #define UINT16_FTOH(value) omrx_bswap16(value)
+  #define UINT32_FTOH(value) omrx_bswap32(value)
+  #define UINT64_FTOH(value) omrx_bswap64(value)
+#else
+  #define UINT16_FTOH(value) (value)
+  #define UINT32_FTOH(value) (value)
+  #define UINT64_FTOH(value) (value)
+#endif
+#define UINT16_HTOF(value) UINT16_FTOH(value)
+#define UINT32_HTOF(value) UINT32_FTOH(value)
+#define UINT64_HTOF(value) UINT64_FTOH(value)
+
+// True if elements of the given width need to be byte-swapped between file
+// and host order.  This is a constant 0 on little-endian hosts, so any code
+// guarded by it compiles away entirely.
+#define OMRX_NEEDS_SWAP(width) (OMRX_HOST_BIG_ENDIAN && (width) > 1)
+
+// Bulk byte-swapping of array data (omrx_endian.c)
+void omrx_bswap_array(void *dest, const void *src, size_t width, size_t count);
+
+// Conversion of numeric data to float (omrx_convert.c)
+bool omrx_convert_supported(uint16_t type);
+void omrx_convert_to_float32(float *dest, const void *src, uint16_t type, size_t count);
+void omrx_convert_to_float64(double *dest, const void *src, uint16_t type, size_t count);
+
+// Attribute data codecs (omrx_codec.c)
+bool omrx_codec_supported(uint16_t codec);
+uint16_t omrx_codec_best(void);
+size_t omrx_codec_bound(uint16_t codec, size_t size);
+uint64_t omrx_codec_max_output(uint16_t codec, uint64_t size);
+size_t omrx_compress(uint16_t codec, void *dest, size_t dest_size, const void *src, size_t size);
+bool omrx_decompress(uint16_t codec, void *dest, size_t size, const void *src, size_t src_size);
+void omrx_shuffle(void *dest, const void *src, size_t width, size_t count);
+void omrx_unshuffle(void *dest, const void *src, size_t width, size_t count);
+
+// CRC-32C checksums (omrx_crc.c)
+uint32_t omrx_crc32c(uint32_t crc, const void *data, size_t size);
+
+// Worker thread pool (omrx_workers.c)
+unsigned int omrx_default_threads(void);
+omrx_workers_t omrx_workers_new(omrx_t omrx, unsigned int nthreads);
+void omrx_workers_free(omrx_workers_t workers);
+void omrx_workers_run(omrx_workers_t workers, size_t count, omrx_task_func_t func, void *arg);
+
+// Output staging and positioned writes (omrx_output.c)
+struct iovec;
+int omrx_output_init(omrx_t omrx, omrx_output_t out, int fd, bool direct);
+void omrx_output_free(omrx_output_t out);
+int omrx_output_write(omrx_output_t out, const void *src, size_t size);
+int omrx_output_flush(omrx_output_t out);
+int omrx_pwrite_all(int fd, const void *src, size_t size, off_t pos);
+int omrx_pwritev_all(int fd, struct iovec *iov, int count, off_t pos);
+
+// Background threads for asynchronous operations (omrx_async.c)
+omrx_async_t omrx_async_new(omrx_t omrx, unsigned int nthreads);
+void omrx_async_free(omrx_async_t async);
+void omrx_async_drain(omrx_async_t async);
+void omrx_async_run(omrx_async_t async, struct omrx_async_op *op);
+void omrx_async_read(omrx_async_t async, struct omrx_async_op *op, int fd, void *buf, size_t size, off_t pos);
+void omrx_async_submit(omrx_async_t async);
+
+// Chunk query parsing and matching (omrx_query.c)
+int omrx_query_parse(omrx_t omrx, const char *path, omrx_query_t *result, size_t *error_pos, const char **error_msg);
+bool omrx_query_step_matches(const struct query_step *step, uint32_t tagint, const char *id);
 
 #define CHECK_ALLOC(omrx, x) if ((x) == NULL) { return omrx_os_error((omrx), OMRX_ERR_ALLOC, "Memory allocation failed"); }
 #define CHECK_ERR(x) do { omrx_status_t __x = (x); if (__x < 0) return __x; } while (0);
 #define CHECK_OK(x) do { omrx_status_t __x = (x); if (__x != OMRX_STATUS_OK) return __x; } while (0);
-#define API_RESULT(omrx, x) (omrx->last_result = (x))
+#define API_RESULT(omrx, x) (get_errstate(omrx)->last_result = (x))
 
 /** @endcond */
 
@@ -0,0 +1,210 @@
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE // (for O_DIRECT)
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "omrx.h"
+#include "omrx_internal.h"
+
+/** @cond internal
+  */
+
+// Output staging for omrx_write().  Rather than going through stdio, which
+// means a library call (and a lock) for every 6-byte chunk header, 8-byte
+// attribute header, etc, the writer appends everything to an omrx_output.
+// Headers and other small pieces of data are just copied into its staging
+// buffer.  Anything larger is written straight from where it is, in a single
+// pwritev() call along with whatever has been staged in front of it, so the
+// data is never copied.  Everything is written with positioned writes, so the
+// file offset of the descriptor doesn't matter.
+//
+// In direct mode (OMRX_WRITE_DIRECT), the descriptor has O_DIRECT set so the
+// data doesn't go through (and push everything else out of) the page cache.
+// That requires the buffer, file position and length of every write to be
+// suitably aligned, so then everything is copied into a larger, aligned
+// buffer, which is only written out when it is full.  The unaligned tail at
+// the end of the file is written after switching O_DIRECT off again.
+
+// Set up `out` to write to `fd`, starting at the beginning of the file.  If
+// `direct` is true, try to bypass the page cache (if the file system doesn't
+// support that, the file is just written normally).  Returns 0 or an errno
+// value.
+int omrx_output_init(omrx_t omrx, omrx_output_t out, int fd, bool direct) {
+    size_t buf_size = OMRX_OUTPUT_BUFSIZE;
+    size_t align = 1;
+
+    memset(out, 0, sizeof(struct omrx_output));
+#ifdef O_DIRECT
+    if (direct) {
+        int fl = fcntl(fd, F_GETFL);
+
+        if (fl >= 0 && fcntl(fd, F_SETFL, fl | O_DIRECT) >= 0) {
+            out->direct = true;
+            buf_size = OMRX_OUTPUT_DIRECT_BUFSIZE;
+            align = OMRX_OUTPUT_DIRECT_ALIGN;
+        }
+    }
+#endif
+    out->mem = omrx->alloc(omrx, buf_size + align - 1);
+    if (!out->mem) {
+        return ENOMEM;
+    }
+    out->buf = (uint8_t *)(((uintptr_t)out->mem + align - 1) & ~(uintptr_t)(align - 1));
+    out->buf_size = buf_size;
+    out->omrx = omrx;
+    out->fd = fd;
+
+    return 0;
+}
+
+// Free the staging buffer (without writing anything still in it; call
+// omrx_output_flush() first for that).
+void omrx_output_free(omrx_output_t out) {
+    if (out->mem) {
+        out->omrx->free(out->omrx, out->mem);
+    }
+    memset(out, 0, sizeof(struct omrx_output));
+}
+
+// Append `size` bytes to the output.  Returns 0 or an errno value.
+int omrx_output_write(omrx_output_t out, const void *src, size_t size) {
+    const uint8_t *p = src;
+    struct iovec iov[2];
+    size_t len;
+    int err;
+
+    if (out->direct) {
+        while (size) {
+            len = out->buf_size - out->len;
+            if (len > size) len = size;
+            memcpy(out->buf + out->len, p, len);
+            out->len += len;
+            p += len;
+            size -= len;
+            if (out->len == out->buf_size) {
+                err = omrx_pwrite_all(out->fd, out->buf, out->len, out->pos);
+                if (err) return err;
+                out->pos += out->len;
+                out->len = 0;
+            }
+        }
+        return 0;
+    }
+
+    if (size < OMRX_OUTPUT_COPY_MAX) {
+        if (out->len + size > out->buf_size) {
+            err = omrx_output_flush(out);
+            if (err) return err;
+        }
+        memcpy(out->buf + out->len, src, size);
+        out->len += size;
+        return 0;
+    }
+    iov[0].iov_base = out->buf;
+    iov[0].iov_len = out->len;
+    iov[1].iov_base = (void *)src;
+    iov[1].iov_len = size;
+    if (out->len) {
+        err = omrx_pwritev_all(out->fd, iov, 2, out->pos);
+    } else {
+        err = omrx_pwritev_all(out->fd, iov + 1, 1, out->pos);
+    }
+    if (err) return err;
+    out->pos += out->len + size;
+    out->len = 0;
+
+    return 0;
+}
+
+// Write out everything which has been staged.  In direct mode this can only
+// be done once everything has been written, since the last write is probably
+// not aligned.  Returns 0 or an errno value.
+int omrx_output_flush(omrx_output_t out) {
+    size_t len = out->len;
+    int err;
+
+    if (out->direct) {
+        len &= ~(size_t)(OMRX_OUTPUT_DIRECT_ALIGN - 1);
+        if (len) {
+            err = omrx_pwrite_all(out->fd, out->buf, len, out->pos);
+            if (err) return err;
+        }
+#ifdef O_DIRECT
+        if (len < out->len) {
+            int fl = fcntl(out->fd, F_GETFL);
+
+            if (fl < 0 || fcntl(out->fd, F_SETFL, fl & ~O_DIRECT) < 0) {
+                return errno;
+            }
+        }
+#endif
+        out->direct = false;
+        err = omrx_pwrite_all(out->fd, out->buf + len, out->len - len, out->pos + len);
+    } else {
+        err = omrx_pwrite_all(out->fd, out->buf, len, out->pos);
+    }
+    if (err) return err;
+    out->pos += out->len;
+    out->len = 0;
+
+    return 0;
+}
+
+// Write all of `size` bytes at `pos`, returning 0 or an errno value.  (This
+// and omrx_pwritev_all() are also used from worker threads, so they can't
+// report errors themselves.)
+int omrx_pwrite_all(int fd, const void *src, size_t size, off_t pos) {
+    const uint8_t *ptr = src;
+    ssize_t count;
+
+    while (size > 0) {
+        count = pwrite(fd, ptr, size, pos);
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            return errno;
+        }
+        ptr += count;
+        pos += count;
+        size -= count;
+    }
+
+    return 0;
+}
+
+// Write the contents of `count` buffers one after another at `pos`, with as
+// few calls as possible.  The iovec array is modified.
+int omrx_pwritev_all(int fd, struct iovec *iov, int count, off_t pos) {
+    ssize_t written;
+
+    while (count && !iov->iov_len) {
+        iov++;
+        count--;
+    }
+    while (count) {
+        written = pwritev(fd, iov, count, pos);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return errno;
+        }
+        pos += written;
+        while (count && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count) {
+            iov->iov_base = (uint8_t *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+
+    return 0;
+}
+
+/** @endcond */
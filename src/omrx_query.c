@@ -0,0 +1,188 @@
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+
+#include "omrx.h"
+#include "omrx_internal.h"
+
+/** @cond internal
+  */
+
+// Parsing and matching of chunk queries (see omrx_query_compile()).  A query
+// is a path of steps separated by "/" (the next step matches children of the
+// chunks matched so far) or "//" (it matches any of their descendants).  Each
+// step is a four-character tag or "*", optionally followed by a predicate on
+// the chunk's ID: [id=VALUE], [id^=VALUE] (starts with), [id$=VALUE] (ends
+// with) or [id*=VALUE] (contains).  The value may be quoted with "" or ''
+// (and must be, if it contains "]").  A leading "/" is allowed and makes no
+// difference; a leading "//" makes the first step match descendants of the
+// starting chunk, rather than just its children.
+//
+// Everything here just works on the parsed steps; running a query over the
+// tree is done by omrx_query_run().
+
+// Parse `path` into a new query.  Returns 0, ENOMEM, or EINVAL if the query
+// is invalid, in which case *error_pos is set to the offset in `path` where
+// the problem was found and *error_msg says what it was.
+int omrx_query_parse(omrx_t omrx, const char *path, omrx_query_t *result, size_t *error_pos, const char **error_msg) {
+    omrx_query_t query;
+    struct query_step *step;
+    size_t len = strlen(path);
+    size_t max_steps = 1;
+    size_t i;
+    char *p;
+    char quote;
+
+    // Every step after the first starts with a "/", so this is enough.
+    for (i = 0; i < len; i++) {
+        if (path[i] == '/') max_steps++;
+    }
+    if (max_steps > OMRX_QUERY_MAX_STEPS) {
+        max_steps = OMRX_QUERY_MAX_STEPS;
+    }
+    query = omrx->alloc(omrx, sizeof(struct omrx_query) + sizeof(struct query_step) * max_steps);
+    if (!query) {
+        return ENOMEM;
+    }
+    memset(query, 0, sizeof(struct omrx_query) + sizeof(struct query_step) * max_steps);
+    query->omrx = omrx;
+    // ID values point into this copy of the query (terminated in place).
+    query->text = omrx->alloc(omrx, len + 1);
+    if (!query->text) {
+        omrx->free(omrx, query);
+        return ENOMEM;
+    }
+    memcpy(query->text, path, len + 1);
+
+    p = query->text;
+    if (*p == '/' && p[1] != '/') {
+        p++;
+    }
+    for (;;) {
+        if (query->count == max_steps) {
+            *error_msg = "too many steps";
+            break;
+        }
+        step = &query->steps[query->count];
+        step->id_op = QUERY_ID_ANY;
+        if (*p == '/') {
+            if (p[1] != '/') {
+                *error_msg = "expected a step";
+                break;
+            }
+            step->descendant = true;
+            p += 2;
+        }
+        if (*p == '*') {
+            step->any_tag = true;
+            p++;
+        } else {
+            for (i = 0; i < 4; i++) {
+                if (!p[i] || strchr("/[]*", p[i])) break;
+            }
+            if (i < 4) {
+                *error_msg = "expected a four-character tag or '*'";
+                break;
+            }
+            step->tagint = TAG_TO_TAGINT(p);
+            p += 4;
+        }
+        if (*p == '[') {
+            p++;
+            if (strncmp(p, "id", 2)) {
+                *error_msg = "expected 'id'";
+                break;
+            }
+            p += 2;
+            if (*p == '=') {
+                step->id_op = QUERY_ID_EQ;
+            } else if (p[1] == '=' && *p == '^') {
+                step->id_op = QUERY_ID_PREFIX;
+            } else if (p[1] == '=' && *p == '$') {
+                step->id_op = QUERY_ID_SUFFIX;
+            } else if (p[1] == '=' && *p == '*') {
+                step->id_op = QUERY_ID_CONTAINS;
+            } else {
+                *error_msg = "expected '=', '^=', '$=' or '*='";
+                break;
+            }
+            p += (*p == '=') ? 1 : 2;
+            if (*p == '"' || *p == '\'') {
+                quote = *p++;
+                step->id = p;
+                while (*p && *p != quote) p++;
+                if (!*p) {
+                    *error_msg = "unterminated string";
+                    break;
+                }
+                step->id_len = p - step->id;
+                *p++ = 0;
+                if (*p != ']') {
+                    *error_msg = "expected ']'";
+                    break;
+                }
+            } else {
+                step->id = p;
+                while (*p && *p != ']') p++;
+                if (!*p) {
+                    *error_msg = "expected ']'";
+                    break;
+                }
+                step->id_len = p - step->id;
+            }
+            *p++ = 0;
+        }
+        query->count++;
+        if (!*p) {
+            *result = query;
+            return 0;
+        }
+        if (*p != '/') {
+            *error_msg = "expected '/' or '['";
+            break;
+        }
+        // A single "/" just separates steps; "//" belongs to the next one.
+        if (p[1] != '/') {
+            p++;
+        }
+    }
+
+    *error_pos = p - query->text;
+    omrx->free(omrx, query->text);
+    omrx->free(omrx, query);
+    return EINVAL;
+}
+
+// Return whether a chunk with the given tag and ID (which may be NULL) is
+// matched by a query step (ignoring where the chunk is in the tree).
+bool omrx_query_step_matches(const struct query_step *step, uint32_t tagint, const char *id) {
+    size_t len;
+
+    if (!step->any_tag && step->tagint != tagint) {
+        return false;
+    }
+    if (step->id_op == QUERY_ID_ANY) {
+        return true;
+    }
+    if (!id) {
+        return false;
+    }
+    switch (step->id_op) {
+        case QUERY_ID_EQ:
+            return !strcmp(id, step->id);
+        case QUERY_ID_PREFIX:
+            return !strncmp(id, step->id, step->id_len);
+        case QUERY_ID_SUFFIX:
+            len = strlen(id);
+            return len >= step->id_len && !memcmp(id + len - step->id_len, step->id, step->id_len);
+        case QUERY_ID_CONTAINS:
+            return strstr(id, step->id) != NULL;
+    }
+
+    return false;
+}
+
+/** @endcond */
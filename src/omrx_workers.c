@@ -0,0 +1,161 @@
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "omrx.h"
+#include "omrx_internal.h"
+
+/** @cond internal
+  */
+
+// A simple pool of worker threads for running independent tasks in parallel
+// (decoding the blocks of an attribute, etc).  Only one job (a batch of
+// `count` tasks) runs at a time: omrx_workers_run() posts it, the workers
+// and the calling thread all take task indexes from it until they run out,
+// and the caller then waits for any still in progress before returning.  If
+// the pool is already busy (e.g. another thread in concurrent mode, or a task
+// which itself wants to run a job), the tasks are just run in the calling
+// thread instead, so this never deadlocks.
+
+struct omrx_workers {
+    omrx_t omrx;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    pthread_mutex_t run_lock;
+    pthread_t *threads;
+    unsigned int nthreads;
+    bool shutdown;
+    omrx_task_func_t func;
+    void *arg;
+    size_t count;
+    size_t next;
+    size_t pending;
+};
+
+static void *worker_main(void *arg) {
+    omrx_workers_t workers = arg;
+    size_t index;
+
+    pthread_mutex_lock(&workers->lock);
+    for (;;) {
+        while (!workers->shutdown && workers->next >= workers->count) {
+            pthread_cond_wait(&workers->work_cond, &workers->lock);
+        }
+        if (workers->shutdown) break;
+        index = workers->next++;
+        pthread_mutex_unlock(&workers->lock);
+        workers->func(workers->arg, index);
+        pthread_mutex_lock(&workers->lock);
+        if (--workers->pending == 0) {
+            pthread_cond_signal(&workers->done_cond);
+        }
+    }
+    pthread_mutex_unlock(&workers->lock);
+
+    return NULL;
+}
+
+// The number of threads to use by default (one per online CPU)
+unsigned int omrx_default_threads(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (n < 1) return 1;
+    if (n > OMRX_MAX_THREADS) return OMRX_MAX_THREADS;
+    return n;
+}
+
+// Create a pool with `nthreads` worker threads.  (Tasks are also run by the
+// thread which submits them, so a pool for N-way parallelism needs N-1
+// workers.)  Returns NULL if the pool or its threads couldn't be created.
+omrx_workers_t omrx_workers_new(omrx_t omrx, unsigned int nthreads) {
+    omrx_workers_t workers;
+    unsigned int i;
+
+    workers = omrx->alloc(omrx, sizeof(struct omrx_workers));
+    if (!workers) return NULL;
+    memset(workers, 0, sizeof(struct omrx_workers));
+    workers->omrx = omrx;
+    workers->threads = omrx->alloc(omrx, nthreads * sizeof(pthread_t));
+    if (!workers->threads) {
+        omrx->free(omrx, workers);
+        return NULL;
+    }
+    pthread_mutex_init(&workers->lock, NULL);
+    pthread_cond_init(&workers->work_cond, NULL);
+    pthread_cond_init(&workers->done_cond, NULL);
+    pthread_mutex_init(&workers->run_lock, NULL);
+    for (i = 0; i < nthreads; i++) {
+        if (pthread_create(&workers->threads[i], NULL, worker_main, workers)) {
+            break;
+        }
+    }
+    workers->nthreads = i;
+    if (!i) {
+        omrx_workers_free(workers);
+        return NULL;
+    }
+
+    return workers;
+}
+
+// Shut down all the worker threads and free the pool.  No job may be running.
+void omrx_workers_free(omrx_workers_t workers) {
+    unsigned int i;
+
+    pthread_mutex_lock(&workers->lock);
+    workers->shutdown = true;
+    pthread_cond_broadcast(&workers->work_cond);
+    pthread_mutex_unlock(&workers->lock);
+    for (i = 0; i < workers->nthreads; i++) {
+        pthread_join(workers->threads[i], NULL);
+    }
+    pthread_mutex_destroy(&workers->lock);
+    pthread_cond_destroy(&workers->work_cond);
+    pthread_cond_destroy(&workers->done_cond);
+    pthread_mutex_destroy(&workers->run_lock);
+    workers->omrx->free(workers->omrx, workers->threads);
+    workers->omrx->free(workers->omrx, workers);
+}
+
+// Call func(arg, i) for each i from 0 to count-1, spread across the pool (and
+// the calling thread), and return once they have all finished.  Tasks may run
+// in any order.  `workers` may be NULL, in which case they are all just run in
+// the calling thread.
+void omrx_workers_run(omrx_workers_t workers, size_t count, omrx_task_func_t func, void *arg) {
+    size_t index;
+
+    if (!workers || count < 2 || pthread_mutex_trylock(&workers->run_lock)) {
+        for (index = 0; index < count; index++) {
+            func(arg, index);
+        }
+        return;
+    }
+    pthread_mutex_lock(&workers->lock);
+    workers->func = func;
+    workers->arg = arg;
+    workers->count = count;
+    workers->next = 0;
+    workers->pending = count;
+    pthread_cond_broadcast(&workers->work_cond);
+    while (workers->next < workers->count) {
+        index = workers->next++;
+        pthread_mutex_unlock(&workers->lock);
+        func(arg, index);
+        pthread_mutex_lock(&workers->lock);
+        workers->pending--;
+    }
+    while (workers->pending) {
+        pthread_cond_wait(&workers->done_cond, &workers->lock);
+    }
+    workers->count = 0;
+    workers->next = 0;
+    pthread_mutex_unlock(&workers->lock);
+    pthread_mutex_unlock(&workers->run_lock);
+}
+
+/** @endcond */